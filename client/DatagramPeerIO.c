@@ -46,13 +46,23 @@ static void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int
 void init_io (DatagramPeerIO *o)
 {
     // init dgram recv interface
-    BDatagram_RecvAsync_Init(&o->dgram, o->effective_socket_mtu);
+    BDatagram_RecvAsync_InitBatch(&o->dgram, o->effective_socket_mtu, DATAGRAMPEERIO_BATCH_SIZE);
+    
+    // enable receive offload if requested
+    if (o->offload && !BDatagram_RecvAsync_EnableGRO(&o->dgram)) {
+        PeerLog(o, BLOG_INFO, "UDP receive offload not available");
+    }
     
     // connect source
     PacketRecvConnector_ConnectInput(&o->recv_connector, BDatagram_RecvAsync_GetIf(&o->dgram));
     
     // init dgram send interface
-    BDatagram_SendAsync_Init(&o->dgram, o->effective_socket_mtu);
+    BDatagram_SendAsync_InitBatch(&o->dgram, o->effective_socket_mtu, DATAGRAMPEERIO_BATCH_SIZE);
+    
+    // enable segmentation offload if requested
+    if (o->offload && !BDatagram_SendAsync_EnableGSO(&o->dgram)) {
+        PeerLog(o, BLOG_INFO, "UDP segmentation offload not available");
+    }
     
     // connect sink
     PacketPassConnector_ConnectOutput(&o->send_connector, BDatagram_SendAsync_GetIf(&o->dgram));
@@ -167,6 +177,9 @@ int DatagramPeerIO_Init (
     o->logfunc = logfunc;
     o->handler_error = handler_error;
     
+    // set no offload
+    o->offload = 0;
+    
     // check num frames (for FragmentProtoAssembler)
     if (num_frames >= FPA_MAX_TIME) {
         PeerLog(o, BLOG_ERROR, "num_frames is too big");
@@ -291,6 +304,13 @@ PacketPassInterface * DatagramPeerIO_GetSendInput (DatagramPeerIO *o)
     return FragmentProtoDisassembler_GetInput(&o->send_disassembler);
 }
 
+void DatagramPeerIO_EnableOffload (DatagramPeerIO *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    o->offload = 1;
+}
+
 int DatagramPeerIO_Connect (DatagramPeerIO *o, BAddr addr)
 {
     DebugObject_Access(&o->d_obj);
@@ -366,7 +386,7 @@ fail0:
 
 void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // set sending key
@@ -378,7 +398,7 @@ void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key
 
 void DatagramPeerIO_RemoveEncryptionKey (DatagramPeerIO *o)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // remove sending key
@@ -55,6 +55,9 @@
 #include <client/SPProtoEncoder.h>
 #include <client/SPProtoDecoder.h>
 
+// number of datagrams to receive and send per system call
+#define DATAGRAMPEERIO_BATCH_SIZE 8
+
 /**
  * Callback function invoked when an error occurs with the peer connection.
  * The object has entered default state.
@@ -106,6 +109,7 @@ typedef struct {
     DatagramPeerIO_handler_error handler_error;
     int spproto_payload_mtu;
     int effective_socket_mtu;
+    int offload;
     
     // sending base
     FragmentProtoDisassembler send_disassembler;
@@ -190,6 +194,15 @@ void DatagramPeerIO_Free (DatagramPeerIO *o);
  */
 PacketPassInterface * DatagramPeerIO_GetSendInput (DatagramPeerIO *o);
 
+/**
+ * Requests UDP segmentation and receive offload (GSO/GRO) for sockets created
+ * from now on, see {@link BDatagram_SendAsync_EnableGSO} and
+ * {@link BDatagram_RecvAsync_EnableGRO}. Offload is not used where unsupported.
+ *
+ * @param o the object
+ */
+void DatagramPeerIO_EnableOffload (DatagramPeerIO *o);
+
 /**
  * Attempts to establish connection to the peer which has bound to an address.
  * On success, the interface enters connecting mode.
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
 #include <misc/byteorder.h>
 #include <security/BHash.h>
 
@@ -39,21 +40,46 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static void decode_work_func (SPProtoDecoder *o)
+static struct SPProtoDecoder_slot * get_slot (SPProtoDecoder *o, unsigned int pos)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->in_len <= o->input_mtu)
+    return &o->slots[pos % o->num_slots];
+}
+
+static void decode_slot (SPProtoDecoder *o, struct SPProtoDecoder_slot *s, struct SPProtoDecoder_slot *cs)
+{
+    ASSERT(s->in_len >= 0)
+    ASSERT(s->in_len <= o->input_mtu)
     
-    uint8_t *in = o->in;
-    int in_len = o->in_len;
+    uint8_t *in = s->in;
+    int in_len = s->in_len;
     
-    o->tw_out_len = -1;
+    s->out_len = -1;
     
     uint8_t *plaintext;
     int plaintext_len;
     
     // decrypt if needed
-    if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // input must have a nonce and a tag
+        if (in_len < SPPROTO_AEAD_OVERHEAD) {
+            PeerLog(o, BLOG_WARNING, "packet does not have a nonce and a tag");
+            return;
+        }
+        
+        // check if we have encryption key
+        if (!o->have_encryption_key) {
+            PeerLog(o, BLOG_WARNING, "have no encryption key");
+            return;
+        }
+        
+        // decrypt in place, between the nonce and the tag
+        plaintext = in + BAEAD_NONCE_SIZE;
+        plaintext_len = in_len - SPPROTO_AEAD_OVERHEAD;
+        if (!BAead_Decrypt(&cs->aead, in, plaintext, plaintext, plaintext_len, plaintext + plaintext_len)) {
+            PeerLog(o, BLOG_WARNING, "packet failed authentication");
+            return;
+        }
+    } else if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         plaintext = in;
         plaintext_len = in_len;
     } else {
@@ -82,8 +108,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // decrypt
         uint8_t *ciphertext = in + o->enc_block_size;
         int ciphertext_len = in_len - o->enc_block_size;
-        plaintext = o->buf;
-        BEncryption_Decrypt(&o->encryptor, ciphertext, plaintext, ciphertext_len, iv);
+        plaintext = s->plaintext;
+        BEncryption_Decrypt(&cs->encryptor, ciphertext, plaintext, ciphertext_len, iv);
         
         // read padding
         if (ciphertext_len < o->enc_block_size) {
@@ -125,8 +151,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // remember seed and OTP (can't check from here)
         struct spproto_otpdata header_otpd;
         memcpy(&header_otpd, header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), sizeof(header_otpd));
-        o->tw_out_seed_id = ltoh16(header_otpd.seed_id);
-        o->tw_out_otp = header_otpd.otp;
+        s->out_seed_id = ltoh16(header_otpd.seed_id);
+        s->out_otp = header_otpd.otp;
     }
     
     // check hash
@@ -150,35 +176,100 @@ static void decode_work_func (SPProtoDecoder *o)
     }
     
     // return packet
-    o->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
-    o->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+    s->out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
+    s->out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+}
+
+static void maybe_unblock_input (SPProtoDecoder *o)
+{
+    if (o->in_blocked && o->fill_pos - o->deliver_pos < o->num_slots) {
+        // finish input packet
+        o->in_blocked = 0;
+        PacketPassInterface_Done(&o->input);
+    }
+}
+    
+static void maybe_deliver (SPProtoDecoder *o)
+{
+    while (!o->out_busy && o->deliver_pos != o->decode_pos) {
+        struct SPProtoDecoder_slot *s = get_slot(o, o->deliver_pos);
+        if (!s->decoded) {
+            return;
+        }
+        
+        // check OTP
+        if (SPPROTO_HAVE_OTP(o->sp_params) && s->out_len >= 0) {
+            if (!OTPChecker_CheckOTP(&o->otpchecker, s->out_seed_id, s->out_otp)) {
+                PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
+                s->out_len = -1;
+            }
+        }
+        
+        if (s->out_len >= 0) {
+            // submit decoded packet to output
+            o->out_busy = 1;
+            PacketPassInterface_Sender_Send(o->output, s->out, s->out_len);
+            return;
+        }
+        
+        // cannot decode, drop packet
+        o->deliver_pos++;
+        maybe_unblock_input(o);
+    }
 }
 
-static void decode_work_handler (SPProtoDecoder *o)
+static void decode_work_func (struct SPProtoDecoder_slot *first)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->tw_have)
+    SPProtoDecoder *o = first->o;
+    ASSERT(first->batch_count > 0)
+    
+    unsigned int pos = first - o->slots;
+    
+    // the batch uses the cipher contexts of its first slot
+    for (int i = 0; i < first->batch_count; i++) {
+        decode_slot(o, get_slot(o, pos + i), first);
+    }
+}
+
+static void decode_work_handler (struct SPProtoDecoder_slot *first)
+{
+    SPProtoDecoder *o = first->o;
+    ASSERT(first->batch_count > 0)
     DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&first->tw);
     
-    // check OTP
-    if (SPPROTO_HAVE_OTP(o->sp_params) && o->tw_out_len >= 0) {
-        if (!OTPChecker_CheckOTP(&o->otpchecker, o->tw_out_seed_id, o->tw_out_otp)) {
-            PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
-            o->tw_out_len = -1;
-        }
+    // mark packets decoded
+    unsigned int pos = first - o->slots;
+    for (int i = 0; i < first->batch_count; i++) {
+        get_slot(o, pos + i)->decoded = 1;
     }
+    first->batch_count = 0;
     
-    if (o->tw_out_len < 0) {
-        // cannot decode, finish input packet
-        PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
-    } else {
-        // submit decoded packet to output
-        PacketPassInterface_Sender_Send(o->output, o->tw_out, o->tw_out_len);
+    // output packets which are next in order
+    maybe_deliver(o);
+}
+
+static void maybe_decode (SPProtoDecoder *o)
+{
+    while (o->decode_pos != o->fill_pos) {
+        struct SPProtoDecoder_slot *first = get_slot(o, o->decode_pos);
+        int count = 0;
+        
+        // collect packets for a batch
+        do {
+            struct SPProtoDecoder_slot *s = get_slot(o, o->decode_pos);
+            ASSERT(s->batch_count == 0)
+            
+            s->decoded = 0;
+            o->decode_pos++;
+            count++;
+        } while (count < SPPROTODECODER_BATCH_SIZE && o->decode_pos != o->fill_pos);
+        
+        // start work
+        first->batch_count = count;
+        BThreadWork_Init(&first->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, first, (BThreadWork_work_func)decode_work_func, first);
     }
 }
 
@@ -186,42 +277,129 @@ static void input_handler_send (SPProtoDecoder *o, uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(!o->tw_have)
+    ASSERT(!o->in_blocked)
     DebugObject_Access(&o->d_obj);
     
-    // remember input
-    o->in = data;
-    o->in_len = data_len;
+    struct SPProtoDecoder_slot *s = get_slot(o, o->fill_pos);
+    
+    // Without pipelining, decode in the input packet, which is held until
+    // the packet is output, otherwise copy it to a slot.
+    if (!o->pipelined) {
+        s->in = data;
+        if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+            s->plaintext = data;
+        }
+    } else {
+        memcpy(s->in, data, data_len);
+    }
+    s->in_len = data_len;
+    o->fill_pos++;
+    
+    // accept next input packet if there is a free slot
+    o->in_blocked = 1;
+    maybe_unblock_input(o);
     
-    // start decoding
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, o, (BThreadWork_work_func)decode_work_func, o);
-    o->tw_have = 1;
+    if (!o->pipelined) {
+        // start decoding
+        maybe_decode(o);
+        return;
+    }
+    
+    // Decode from a job, so that packets which the sender has ready
+    // right away end up in the same batch.
+    BPending_Set(&o->decode_job);
 }
 
 static void output_handler_done (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(!o->tw_have)
+    ASSERT(o->out_busy)
     DebugObject_Access(&o->d_obj);
     
-    // finish input packet
-    PacketPassInterface_Done(&o->input);
-    o->in_len = -1;
+    // packet is out
+    o->out_busy = 0;
+    o->deliver_pos++;
+    
+    // a slot is free
+    maybe_unblock_input(o);
+    
+    // output next packet
+    maybe_deliver(o);
+}
+
+static void decode_job_handler (SPProtoDecoder *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    maybe_decode(o);
+}
+
+static void stop_work (SPProtoDecoder *o)
+{
+    for (unsigned int pos = o->deliver_pos; pos != o->decode_pos; pos++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, pos);
+        if (s->batch_count > 0) {
+            // free work
+            BThreadWork_Free(&s->tw);
+            
+            // ignore its packets
+            for (int i = 0; i < s->batch_count; i++) {
+                struct SPProtoDecoder_slot *bs = get_slot(o, pos + i);
+                bs->decoded = 1;
+                bs->out_len = -1;
+            }
+            s->batch_count = 0;
+        }
+    }
 }
 
 static void maybe_stop_work_and_ignore (SPProtoDecoder *o)
 {
-    ASSERT(!(o->tw_have) || o->in_len >= 0)
+    // stop works, ignoring packets being decoded
+    stop_work(o);
     
-    if (o->tw_have) {
-        // free work
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
-        
-        // ignore packet, receive next one
-        PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
+    // drop them and continue
+    maybe_deliver(o);
+}
+
+static int init_ciphers (SPProtoDecoder *o, uint8_t *encryption_key)
+{
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
+    
+    // Each slot has cipher contexts, for batches starting there, since
+    // contexts cannot be used by concurrent works.
+    for (int i = 0; i < o->num_slots; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            if (!BAead_Init(&s->aead, BAEAD_MODE_DECRYPT, o->sp_params.aead_mode, encryption_key)) {
+                while (i-- > 0) {
+                    BAead_Free(&o->slots[i].aead);
+                }
+                return 0;
+            }
+        } else {
+            if (!BEncryption_Init(&s->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key)) {
+                while (i-- > 0) {
+                    BEncryption_Free(&o->slots[i].encryptor);
+                }
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+static void free_ciphers (SPProtoDecoder *o)
+{
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
+    
+    for (int i = 0; i < o->num_slots; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BAead_Free(&s->aead);
+        } else {
+            BEncryption_Free(&s->encryptor);
+        }
     }
 }
 
@@ -258,44 +436,71 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // calculate input MTU
     o->input_mtu = spproto_carrier_mtu_for_payload_mtu(o->sp_params, o->output_mtu);
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail0;
-        }
+    // pipeline packets only if they can be decoded in parallel
+    o->pipelined = BThreadWorkDispatcher_UsingThreads(o->twd);
+    o->num_slots = (o->pipelined ? SPPROTODECODER_PIPELINE_DEPTH : 1);
+    
+    // allocate slots
+    if (!(o->slots = BAllocArray(o->num_slots, sizeof(o->slots[0])))) {
+        goto fail0;
+    }
+    
+    // Allocate slot buffers. With encryption, each slot has a plaintext buffer,
+    // otherwise the packet is decoded in place (with AEAD encryption, after
+    // the nonce). When pipelining, each slot also has an input buffer,
+    // otherwise packets are decoded in the input packet.
+    int plaintext_size = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size) : 0);
+    int in_size = (o->pipelined ? o->input_mtu : 0);
+    int slot_size = in_size + plaintext_size;
+    if (!(o->slots_buf = BAllocArray(o->num_slots, slot_size))) {
+        goto fail1;
     }
     
+    // init slots; without pipelining, buffers in the input packet are set
+    // when it arrives
+    for (int i = 0; i < o->num_slots; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        uint8_t *buf = o->slots_buf + (size_t)i * slot_size;
+        s->o = o;
+        s->in = (in_size > 0 ? buf : NULL);
+        s->plaintext = (plaintext_size > 0 ? buf + in_size : s->in);
+        s->batch_count = 0;
+    }
+    o->deliver_pos = 0;
+    o->decode_pos = 0;
+    o->fill_pos = 0;
+    
     // init input
     PacketPassInterface_Init(&o->input, o->input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
     
     // init OTP checker
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         if (!OTPChecker_Init(&o->otpchecker, o->sp_params.otp_num, o->sp_params.otp_mode, num_otp_seeds, o->twd)) {
-            goto fail1;
+            goto fail2;
         }
     }
     
     // have no encryption key
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) { 
+    if (SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params)) { 
         o->have_encryption_key = 0;
     }
     
-    // have no input packet
-    o->in_len = -1;
+    // input not blocked, output not busy
+    o->in_blocked = 0;
+    o->out_busy = 0;
     
-    // have no work
-    o->tw_have = 0;
+    // init decode job
+    BPending_Init(&o->decode_job, pg, (BPending_handler)decode_job_handler, o);
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
-fail1:
+fail2:
     PacketPassInterface_Free(&o->input);
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
-    }
+    BFree(o->slots_buf);
+fail1:
+    BFree(o->slots);
 fail0:
     return 0;
 }
@@ -304,14 +509,15 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-    }
+    // free works
+    stop_work(o);
+    
+    // free decode job
+    BPending_Free(&o->decode_job);
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+    // free cipher contexts
+    if (SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params) && o->have_encryption_key) {
+        free_ciphers(o);
     }
     
     // free OTP checker
@@ -322,10 +528,9 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     // free input
     PacketPassInterface_Free(&o->input);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
-    }
+    // free slots
+    BFree(o->slots_buf);
+    BFree(o->slots);
 }
 
 PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
@@ -337,35 +542,33 @@ PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
 
 void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
-    // stop existing work
-    maybe_stop_work_and_ignore(o);
+    // stop existing work and free the old key
+    SPProtoDecoder_RemoveEncryptionKey(o);
     
-    // free encryptor
-    if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+    // init cipher contexts
+    if (!init_ciphers(o, encryption_key)) {
+        PeerLog(o, BLOG_ERROR, "failed to initialize cipher");
+        return;
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
-    
     // have encryption key
     o->have_encryption_key = 1;
 }
 
 void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
     maybe_stop_work_and_ignore(o);
     
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
+        // free cipher contexts
+        free_ciphers(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
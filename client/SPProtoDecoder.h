@@ -41,6 +41,7 @@
 #include <base/BLog.h>
 #include <protocol/spproto.h>
 #include <security/BEncryption.h>
+#include <security/BAead.h>
 #include <security/OTPChecker.h>
 #include <flow/PacketPassInterface.h>
 
@@ -51,12 +52,43 @@
  */
 typedef void (*SPProtoDecoder_otp_handler) (void *user);
 
+// number of packets which may be in the decoder at once when threads are used;
+// must be a power of two
+#define SPPROTODECODER_PIPELINE_DEPTH 16
+
+// maximum number of packets decoded by a single thread work
+#define SPPROTODECODER_BATCH_SIZE 4
+
+struct SPProtoDecoder_s;
+
+struct SPProtoDecoder_slot {
+    struct SPProtoDecoder_s *o;
+    uint8_t *in;
+    uint8_t *plaintext;
+    int in_len;
+    uint16_t out_seed_id;
+    otp_t out_otp;
+    uint8_t *out;
+    int out_len;
+    int decoded;
+    int batch_count;
+    BThreadWork tw;
+    BEncryption encryptor;
+    BAead aead;
+};
+
 /**
  * Object which decodes packets according to SPProto.
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
+ * 
+ * When the thread work dispatcher uses threads, up to {@link SPPROTODECODER_PIPELINE_DEPTH}
+ * input packets are accepted ahead of output, and decoded in parallel in batches of up to
+ * {@link SPPROTODECODER_BATCH_SIZE} packets. Packets are always output in input order.
+ * Otherwise, a packet is decoded in the input packet, which is held until the decoded
+ * packet has been output.
  */
-typedef struct {
+typedef struct SPProtoDecoder_s {
     PacketPassInterface *output;
     struct spproto_security_params sp_params;
     BThreadWorkDispatcher *twd;
@@ -67,19 +99,19 @@ typedef struct {
     int enc_block_size;
     int enc_key_size;
     int input_mtu;
-    uint8_t *buf;
     PacketPassInterface input;
     OTPChecker otpchecker;
     int have_encryption_key;
-    BEncryption encryptor;
-    uint8_t *in;
-    int in_len;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_out_seed_id;
-    otp_t tw_out_otp;
-    uint8_t *tw_out;
-    int tw_out_len;
+    int pipelined;
+    int num_slots;
+    struct SPProtoDecoder_slot *slots;
+    uint8_t *slots_buf;
+    unsigned int deliver_pos;
+    unsigned int decode_pos;
+    unsigned int fill_pos;
+    int in_blocked;
+    int out_busy;
+    BPending decode_job;
     DebugObject d_obj;
 } SPProtoDecoder;
 
@@ -122,7 +154,7 @@ PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o);
 
 /**
  * Sets an encryption key for decrypting packets.
- * Encryption must be enabled.
+ * Encryption or AEAD encryption must be enabled.
  *
  * @param o the object
  * @param encryption_key key to use
@@ -131,7 +163,7 @@ void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key
 
 /**
  * Removes an encryption key if one is configured.
- * Encryption must be enabled.
+ * Encryption or AEAD encryption must be enabled.
  *
  * @param o the object
  */
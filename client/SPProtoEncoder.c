@@ -31,81 +31,80 @@
 #include <stdlib.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <security/BRandom.h>
 #include <security/BHash.h>
+#include <base/BLog.h>
 
 #include "SPProtoEncoder.h"
 
+#include <generated/blog_channel_SPProtoEncoder.h>
+
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, unsigned int pos);
 static int can_encode (SPProtoEncoder *o);
-static void encode_packet (SPProtoEncoder *o);
-static void encode_work_func (SPProtoEncoder *o);
-static void encode_work_handler (SPProtoEncoder *o);
+static void make_nonce (SPProtoEncoder *o, uint8_t *nonce);
+static void encode_slot (SPProtoEncoder *o, struct SPProtoEncoder_slot *s, struct SPProtoEncoder_slot *cs);
+static void encode_work_func (struct SPProtoEncoder_slot *first);
+static void encode_work_handler (struct SPProtoEncoder_slot *first);
 static void maybe_encode (SPProtoEncoder *o);
+static void maybe_deliver (SPProtoEncoder *o);
+static void maybe_receive (SPProtoEncoder *o);
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data);
 static void input_handler_done (SPProtoEncoder *o, int data_len);
+static void encode_job_handler (SPProtoEncoder *o);
 static void handler_job_hander (SPProtoEncoder *o);
 static void otpgenerator_handler (SPProtoEncoder *o);
 static void maybe_stop_work (SPProtoEncoder *o);
+static int init_ciphers (SPProtoEncoder *o, uint8_t *encryption_key);
+static void free_ciphers (SPProtoEncoder *o);
 
-static int can_encode (SPProtoEncoder *o)
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, unsigned int pos)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    return &o->slots[pos % o->num_slots];
+}
     
+static int can_encode (SPProtoEncoder *o)
+{
     return (
         (!SPPROTO_HAVE_OTP(o->sp_params) || OTPGenerator_GetPosition(&o->otpgen) < o->sp_params.otp_num) &&
-        (!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
+        (!SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params) || o->have_encryption_key)
     );
 }
 
-static void encode_packet (SPProtoEncoder *o)
+static void make_nonce (SPProtoEncoder *o, uint8_t *nonce)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
-    ASSERT(can_encode(o))
-    
-    // generate OTP, remember seed ID
-    if (SPPROTO_HAVE_OTP(o->sp_params)) {
-        o->tw_seed_id = o->otpgen_seed_id;
-        o->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
-    }
-    
-    // start work
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, o, (BThreadWork_work_func)encode_work_func, o);
-    o->tw_have = 1;
-    
-    // schedule OTP warning handler
-    if (SPPROTO_HAVE_OTP(o->sp_params) && OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
-        BPending_Set(&o->handler_job);
+    ASSERT(SPPROTO_HAVE_AEAD(o->sp_params))
+    ASSERT(o->have_encryption_key)
+    
+    // Like in TLS 1.3, the nonce is the salt with the packet counter
+    // XOR-ed into its last bytes, so it never repeats for a key.
+    uint64_t counter = o->aead_nonce_counter++;
+    memcpy(nonce, o->aead_nonce_salt, BAEAD_NONCE_SIZE);
+    for (int i = 0; i < 8; i++) {
+        nonce[BAEAD_NONCE_SIZE - 1 - i] ^= (uint8_t)(counter >> (8 * i));
     }
 }
 
-static void encode_work_func (SPProtoEncoder *o)
+static void encode_slot (SPProtoEncoder *o, struct SPProtoEncoder_slot *s, struct SPProtoEncoder_slot *cs)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
-    
-    ASSERT(o->in_len <= o->input_mtu)
-    
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    ASSERT(s->in_len >= 0)
+    ASSERT(s->in_len <= o->input_mtu)
+    ASSERT(!SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params) || o->have_encryption_key)
     
     // plaintext begins with header
+    uint8_t *plaintext = s->plaintext;
     uint8_t *header = plaintext;
     
     // plaintext is header + payload
-    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + o->in_len;
+    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + s->in_len;
     
     // write OTP
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         struct spproto_otpdata header_otpd;
-        header_otpd.seed_id = htol16(o->tw_seed_id);
-        header_otpd.otp = o->tw_otp;
+        header_otpd.seed_id = htol16(s->seed_id);
+        header_otpd.otp = s->otp;
         memcpy(header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), &header_otpd, sizeof(header_otpd));
     }
     
@@ -123,7 +122,12 @@ static void encode_work_func (SPProtoEncoder *o)
     
     int out_len;
     
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // encrypt after the nonce (written already), and append the tag
+        uint8_t *ciphertext = s->out + BAEAD_NONCE_SIZE;
+        BAead_Encrypt(&cs->aead, s->out, plaintext, ciphertext, plaintext_len, ciphertext + plaintext_len);
+        out_len = SPPROTO_AEAD_OVERHEAD + plaintext_len;
+    } else if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         // encrypting pad(header + payload)
         int cyphertext_len = balign_up((plaintext_len + 1), o->enc_block_size);
         
@@ -134,80 +138,192 @@ static void encode_work_func (SPProtoEncoder *o)
         }
         
         // generate IV
-        BRandom_randomize(o->out, o->enc_block_size);
+        BRandom_randomize(s->out, o->enc_block_size);
         
         // copy IV because BEncryption_Encrypt changes the IV
         uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-        memcpy(iv, o->out, o->enc_block_size);
+        memcpy(iv, s->out, o->enc_block_size);
         
         // encrypt
-        BEncryption_Encrypt(&o->encryptor, plaintext, o->out + o->enc_block_size, cyphertext_len, iv);
+        BEncryption_Encrypt(&cs->encryptor, plaintext, s->out + o->enc_block_size, cyphertext_len, iv);
         out_len = o->enc_block_size + cyphertext_len;
     } else {
         out_len = plaintext_len;
     }
     
     // remember length
-    o->tw_out_len = out_len;
+    s->out_len = out_len;
 }
 
-static void encode_work_handler (SPProtoEncoder *o)
+static void encode_work_func (struct SPProtoEncoder_slot *first)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(o->tw_have)
+    SPProtoEncoder *o = first->o;
+    ASSERT(first->batch_count > 0)
+    
+    unsigned int pos = first - o->slots;
+    
+    // the batch uses the cipher contexts of its first slot
+    for (int i = 0; i < first->batch_count; i++) {
+        encode_slot(o, get_slot(o, pos + i), first);
+    }
+}
+
+static void encode_work_handler (struct SPProtoEncoder_slot *first)
+{
+    SPProtoEncoder *o = first->o;
+    ASSERT(first->batch_count > 0)
+    DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&first->tw);
     
-    // finish packet
-    o->in_len = -1;
-    o->out_have = 0;
-    PacketRecvInterface_Done(&o->output, o->tw_out_len);
+    // mark packets encoded
+    unsigned int pos = first - o->slots;
+    for (int i = 0; i < first->batch_count; i++) {
+        get_slot(o, pos + i)->encoded = 1;
+    }
+    first->batch_count = 0;
+    
+    // output packets which are next in order
+    maybe_deliver(o);
 }
 
 static void maybe_encode (SPProtoEncoder *o)
 {
-    if (o->in_len >= 0 && o->out_have && !o->tw_have && can_encode(o)) {
-        encode_packet(o);
+    while (o->encode_pos != o->fill_pos && can_encode(o)) {
+        struct SPProtoEncoder_slot *first = get_slot(o, o->encode_pos);
+        int count = 0;
+        
+        // collect packets for a batch
+        do {
+            struct SPProtoEncoder_slot *s = get_slot(o, o->encode_pos);
+            ASSERT(s->in_len >= 0)
+            ASSERT(s->batch_count == 0)
+            
+            // generate OTP, remember seed ID
+            if (SPPROTO_HAVE_OTP(o->sp_params)) {
+                s->seed_id = o->otpgen_seed_id;
+                s->otp = OTPGenerator_GetOTP(&o->otpgen);
+                
+                // schedule OTP warning handler
+                if (OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
+                    BPending_Set(&o->handler_job);
+                }
+            }
+            
+            // generate nonce, in front of the plaintext
+            if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+                make_nonce(o, s->out);
+            }
+            
+            s->encoded = 0;
+            o->encode_pos++;
+            count++;
+        } while (count < SPPROTOENCODER_BATCH_SIZE && o->encode_pos != o->fill_pos && can_encode(o));
+        
+        // start work
+        first->batch_count = count;
+        BThreadWork_Init(&first->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, first, (BThreadWork_work_func)encode_work_func, first);
     }
 }
 
+static void maybe_deliver (SPProtoEncoder *o)
+{
+    if (!o->out_have || o->deliver_pos == o->encode_pos) {
+        return;
+    }
+    
+    struct SPProtoEncoder_slot *s = get_slot(o, o->deliver_pos);
+    if (!s->encoded) {
+        return;
+    }
+    
+    // copy packet to output, unless it was encoded there
+    if (o->pipelined) {
+        memcpy(o->out, s->out, s->out_len);
+    }
+    o->deliver_pos++;
+    
+    // finish output packet
+    o->out_have = 0;
+    PacketRecvInterface_Done(&o->output, s->out_len);
+    
+    // a slot is free, receive more input
+    maybe_receive(o);
+}
+
+static void maybe_receive (SPProtoEncoder *o)
+{
+    if (o->in_receiving || o->fill_pos - o->deliver_pos == o->num_slots) {
+        return;
+    }
+    
+    struct SPProtoEncoder_slot *s = get_slot(o, o->fill_pos);
+    
+    // Without pipelining, receive only when output wants a packet,
+    // and encode into the output buffer.
+    if (!o->pipelined) {
+        if (!o->out_have) {
+            return;
+        }
+        s->out = o->out;
+        if (!SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params)) {
+            s->plaintext = o->out;
+        }
+    }
+    
+    // schedule receive
+    o->in_receiving = 1;
+    PacketRecvInterface_Receiver_Recv(o->input, s->plaintext + SPPROTO_HEADER_LEN(o->sp_params));
+}
+
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data)
 {
-    ASSERT(o->in_len == -1)
     ASSERT(!o->out_have)
-    ASSERT(!o->tw_have)
     DebugObject_Access(&o->d_obj);
     
     // remember output packet
     o->out_have = 1;
     o->out = data;
     
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    // output a packet if one is ready
+    maybe_deliver(o);
     
-    // schedule receive
-    PacketRecvInterface_Receiver_Recv(o->input, plaintext + SPPROTO_HEADER_LEN(o->sp_params));
+    // without pipelining, this is when input is received
+    maybe_receive(o);
 }
 
 static void input_handler_done (SPProtoEncoder *o, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->in_receiving)
     DebugObject_Access(&o->d_obj);
     
     // remember input packet
-    o->in_len = data_len;
+    get_slot(o, o->fill_pos)->in_len = data_len;
+    o->fill_pos++;
+    o->in_receiving = 0;
     
-    // encode if possible
-    if (can_encode(o)) {
-        encode_packet(o);
+    if (!o->pipelined) {
+        // encode if possible
+        maybe_encode(o);
+        return;
     }
+    
+    // Encode from a job, so that packets which the input has ready
+    // right away end up in the same batch.
+    BPending_Set(&o->encode_job);
+    
+    // receive more input
+    maybe_receive(o);
+}
+
+static void encode_job_handler (SPProtoEncoder *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    maybe_encode(o);
 }
 
 static void handler_job_hander (SPProtoEncoder *o)
@@ -235,10 +351,64 @@ static void otpgenerator_handler (SPProtoEncoder *o)
 
 static void maybe_stop_work (SPProtoEncoder *o)
 {
-    // stop existing work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+    // stop existing works
+    for (unsigned int pos = o->deliver_pos; pos != o->encode_pos; pos++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, pos);
+        if (s->batch_count > 0) {
+            BThreadWork_Free(&s->tw);
+            s->batch_count = 0;
+        }
+    }
+    
+    // packets not yet output will be encoded again
+    o->encode_pos = o->deliver_pos;
+}
+
+static int init_ciphers (SPProtoEncoder *o, uint8_t *encryption_key)
+{
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
+    
+    // Each slot has cipher contexts, for batches starting there, since
+    // contexts cannot be used by concurrent works.
+    for (int i = 0; i < o->num_slots; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            if (!BAead_Init(&s->aead, BAEAD_MODE_ENCRYPT, o->sp_params.aead_mode, encryption_key)) {
+                while (i-- > 0) {
+                    BAead_Free(&o->slots[i].aead);
+                }
+                return 0;
+            }
+        } else {
+            if (!BEncryption_Init(&s->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key)) {
+                while (i-- > 0) {
+                    BEncryption_Free(&o->slots[i].encryptor);
+                }
+                return 0;
+            }
+        }
+    }
+    
+    // new salt and counter for nonces
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        BRandom_randomize(o->aead_nonce_salt, BAEAD_NONCE_SIZE);
+        o->aead_nonce_counter = 0;
+    }
+    
+    return 1;
+}
+
+static void free_ciphers (SPProtoEncoder *o)
+{
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
+    
+    for (int i = 0; i < o->num_slots; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BAead_Free(&s->aead);
+        } else {
+            BEncryption_Free(&s->encryptor);
+        }
     }
 }
 
@@ -279,7 +449,7 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     }
     
     // have no encryption key
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) { 
+    if (SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params)) { 
         o->have_encryption_key = 0;
     }
     
@@ -289,11 +459,49 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // calculate output MTU
     o->output_mtu = spproto_carrier_mtu_for_payload_mtu(o->sp_params, o->input_mtu);
     
+    // pipeline packets only if they can be encoded in parallel
+    o->pipelined = BThreadWorkDispatcher_UsingThreads(o->twd);
+    o->num_slots = (o->pipelined ? SPPROTOENCODER_PIPELINE_DEPTH : 1);
+    
+    // allocate slots
+    if (!(o->slots = BAllocArray(o->num_slots, sizeof(o->slots[0])))) {
+        goto fail1;
+    }
+    
+    // Allocate slot buffers. With encryption, each slot has a plaintext buffer,
+    // otherwise the packet is encoded in place. The plaintext must be kept,
+    // since packets may have to be encoded again. When pipelining, each slot
+    // also has an output buffer, otherwise packets are encoded directly into
+    // the output packet.
+    int plaintext_size = 0;
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+        plaintext_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
+    } else if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        plaintext_size = SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu;
+    }
+    int out_size = (o->pipelined ? o->output_mtu : 0);
+    int slot_size = plaintext_size + out_size;
+    if (!(o->slots_buf = BAllocArray(o->num_slots, slot_size))) {
+        goto fail2;
+    }
+    
+    // init slots; without pipelining, buffers in the output packet are set
+    // when receiving
+    for (int i = 0; i < o->num_slots; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        uint8_t *buf = o->slots_buf + (size_t)i * slot_size;
+        s->o = o;
+        s->out = (out_size > 0 ? buf : NULL);
+        s->plaintext = (plaintext_size > 0 ? buf + out_size : s->out);
+        s->batch_count = 0;
+    }
+    o->deliver_pos = 0;
+    o->encode_pos = 0;
+    o->fill_pos = 0;
+    
     // init input
     PacketRecvInterface_Receiver_Init(o->input, (PacketRecvInterface_handler_done)input_handler_done, o);
-    
-    // have no input in buffer
-    o->in_len = -1;
+    o->in_receiving = 0;
     
     // init output
     PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, pg);
@@ -301,26 +509,22 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // have no output available
     o->out_have = 0;
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail1;
-        }
-    }
+    // init encode job
+    BPending_Init(&o->encode_job, pg, (BPending_handler)encode_job_handler, o);
     
     // init handler job
     BPending_Init(&o->handler_job, pg, (BPending_handler)handler_job_hander, o);
     
-    // have no work
-    o->tw_have = 0;
+    // start receiving ahead of output if pipelining
+    maybe_receive(o);
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
+fail2:
+    BFree(o->slots);
 fail1:
-    PacketRecvInterface_Free(&o->output);
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         OTPGenerator_Free(&o->otpgen);
     }
@@ -332,25 +536,25 @@ void SPProtoEncoder_Free (SPProtoEncoder *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-    }
+    // free works
+    maybe_stop_work(o);
     
     // free handler job
     BPending_Free(&o->handler_job);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
-    }
+    // free encode job
+    BPending_Free(&o->encode_job);
     
     // free output
     PacketRecvInterface_Free(&o->output);
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+    // free slots
+    BFree(o->slots_buf);
+    BFree(o->slots);
+    
+    // free cipher contexts
+    if (SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params) && o->have_encryption_key) {
+        free_ciphers(o);
     }
     
     // free otp generator
@@ -358,7 +562,6 @@ void SPProtoEncoder_Free (SPProtoEncoder *o)
         OTPGenerator_Free(&o->otpgen);
     }
 }
-
 PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -368,20 +571,18 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o)
 
 void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
-    // stop existing work
-    maybe_stop_work(o);
+    // stop existing works and free the old key
+    SPProtoEncoder_RemoveEncryptionKey(o);
     
-    // free encryptor
-    if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+    // init cipher contexts
+    if (!init_ciphers(o, encryption_key)) {
+        BLog(BLOG_ERROR, "failed to initialize cipher");
+        return;
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
-    
     // have encryption key
     o->have_encryption_key = 1;
     
@@ -391,15 +592,15 @@ void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key
 
 void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_ENCRYPTION_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
-    // stop existing work
+    // stop existing works
     maybe_stop_work(o);
     
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
+        // free cipher contexts
+        free_ciphers(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
@@ -40,6 +40,7 @@
 #include <protocol/spproto.h>
 #include <base/DebugObject.h>
 #include <security/BEncryption.h>
+#include <security/BAead.h>
 #include <security/OTPGenerator.h>
 #include <flow/PacketRecvInterface.h>
 #include <threadwork/BThreadWork.h>
@@ -52,13 +53,43 @@
  */
 typedef void (*SPProtoEncoder_handler) (void *user);
 
+// number of packets which may be in the encoder at once when threads are used;
+// must be a power of two
+#define SPPROTOENCODER_PIPELINE_DEPTH 16
+
+// maximum number of packets encoded by a single thread work
+#define SPPROTOENCODER_BATCH_SIZE 4
+
+struct SPProtoEncoder_s;
+
+struct SPProtoEncoder_slot {
+    struct SPProtoEncoder_s *o;
+    uint8_t *plaintext;
+    uint8_t *out;
+    int in_len;
+    uint16_t seed_id;
+    otp_t otp;
+    int out_len;
+    int encoded;
+    int batch_count;
+    BThreadWork tw;
+    BEncryption encryptor;
+    BAead aead;
+};
+
 /**
  * Object which encodes packets according to SPProto.
  *
  * Input is with {@link PacketRecvInterface}.
  * Output is with {@link PacketRecvInterface}.
+ * 
+ * When the thread work dispatcher uses threads, up to {@link SPPROTOENCODER_PIPELINE_DEPTH}
+ * packets are read from input ahead of output, and encoded in parallel in batches of up to
+ * {@link SPPROTOENCODER_BATCH_SIZE} packets. Packets are always output in input order.
+ * Otherwise, a packet is read from input only when output wants one, and encoded directly
+ * into the output packet.
  */
-typedef struct {
+typedef struct SPProtoEncoder_s {
     PacketRecvInterface *input;
     struct spproto_security_params sp_params;
     int otp_warning_count;
@@ -72,20 +103,23 @@ typedef struct {
     uint16_t otpgen_seed_id;
     uint16_t otpgen_pending_seed_id;
     int have_encryption_key;
-    BEncryption encryptor;
+    uint8_t aead_nonce_salt[BAEAD_NONCE_SIZE];
+    uint64_t aead_nonce_counter;
     int input_mtu;
     int output_mtu;
-    int in_len;
     PacketRecvInterface output;
     int out_have;
     uint8_t *out;
-    uint8_t *buf;
+    int pipelined;
+    int num_slots;
+    struct SPProtoEncoder_slot *slots;
+    uint8_t *slots_buf;
+    unsigned int deliver_pos;
+    unsigned int encode_pos;
+    unsigned int fill_pos;
+    int in_receiving;
+    BPending encode_job;
     BPending handler_job;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_seed_id;
-    otp_t tw_otp;
-    int tw_out_len;
     DebugObject d_obj;
 } SPProtoEncoder;
 
@@ -126,7 +160,7 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o);
 
 /**
  * Sets an encryption key to use.
- * Encryption must be enabled.
+ * Encryption or AEAD encryption must be enabled.
  *
  * @param o the object
  * @param encryption_key key to use
@@ -135,7 +169,7 @@ void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key
 
 /**
  * Removes an encryption key if one is configured.
- * Encryption must be enabled.
+ * Encryption or AEAD encryption must be enabled.
  *
  * @param o the object
  */
@@ -94,6 +94,7 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
+    int threads_cpu_affinity;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
     int ssl;
@@ -108,11 +109,13 @@ struct {
     struct bind_addr_option bind_addrs[MAX_BIND_ADDRS];
     int transport_mode;
     int encryption_mode;
+    int aead_mode;
     int hash_mode;
     int otp_mode;
     int otp_num;
     int otp_num_warn;
     int fragmentation_latency;
+    int peer_udp_offload;
     int peer_ssl;
     int peer_tcp_socket_sndbuf;
     int send_buffer_size;
@@ -488,7 +491,7 @@ int main (int argc, char *argv[])
     }
     
     // init thread work dispatcher
-    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
+    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads, options.threads_cpu_affinity)) {
         BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
         goto fail3;
     }
@@ -668,6 +671,7 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--threads <integer>]\n"
+        "        [--threads-cpu-affinity]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
         "        [--ssl --nssdb <string> --client-cert-name <string>]\n"
@@ -682,10 +686,11 @@ void print_help (const char *name)
         "        ] ...\n"
         "        --transport-mode <udp/tcp>\n"
         "        (transport-mode=udp?\n"
-        "            --encryption-mode <blowfish/aes/none>\n"
+        "            --encryption-mode <blowfish/aes/aes-gcm/chacha20-poly1305/none>\n"
         "            --hash-mode <md5/sha1/none>\n"
         "            [--otp <blowfish/aes> <num> <num-warn>]\n"
         "            [--fragmentation-latency <milliseconds>]\n"
+        "            [--peer-udp-offload]\n"
         "        )\n"
         "        (transport-mode=tcp?\n"
         "            (ssl? [--peer-ssl])\n"
@@ -727,6 +732,7 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.threads = 0;
+    options.threads_cpu_affinity = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
     options.ssl = 0;
@@ -739,9 +745,11 @@ int parse_arguments (int argc, char *argv[])
     options.num_bind_addrs = 0;
     options.transport_mode = -1;
     options.encryption_mode = -1;
+    options.aead_mode = SPPROTO_AEAD_MODE_NONE;
     options.hash_mode = -1;
     options.otp_mode = SPPROTO_OTP_MODE_NONE;
     options.fragmentation_latency = PEER_DEFAULT_UDP_FRAGMENTATION_LATENCY;
+    options.peer_udp_offload = 0;
     options.peer_ssl = 0;
     options.peer_tcp_socket_sndbuf = -1;
     options.send_buffer_size = PEER_DEFAULT_SEND_BUFFER_SIZE;
@@ -839,6 +847,9 @@ int parse_arguments (int argc, char *argv[])
             options.threads = atoi(argv[i + 1]);
             i++;
         }
+        else if (!strcmp(arg, "--threads-cpu-affinity")) {
+            options.threads_cpu_affinity = 1;
+        }
         else if (!strcmp(arg, "--use-threads-for-ssl-handshake")) {
             options.use_threads_for_ssl_handshake = 1;
         }
@@ -986,6 +997,14 @@ int parse_arguments (int argc, char *argv[])
             else if (!strcmp(arg2, "aes")) {
                 options.encryption_mode = BENCRYPTION_CIPHER_AES;
             }
+            else if (!strcmp(arg2, "aes-gcm")) {
+                options.encryption_mode = SPPROTO_ENCRYPTION_MODE_NONE;
+                options.aead_mode = BAEAD_CIPHER_AES_128_GCM;
+            }
+            else if (!strcmp(arg2, "chacha20-poly1305")) {
+                options.encryption_mode = SPPROTO_ENCRYPTION_MODE_NONE;
+                options.aead_mode = BAEAD_CIPHER_CHACHA20_POLY1305;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -1051,6 +1070,9 @@ int parse_arguments (int argc, char *argv[])
             have_fragmentation_latency = 1;
             i++;
         }
+        else if (!strcmp(arg, "--peer-udp-offload")) {
+            options.peer_udp_offload = 1;
+        }
         else if (!strcmp(arg, "--peer-ssl")) {
             options.peer_ssl = 1;
         }
@@ -1185,6 +1207,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!(options.aead_mode != SPPROTO_AEAD_MODE_NONE) || (options.hash_mode == SPPROTO_HASH_MODE_NONE))) {
+        fprintf(stderr, "False: --encryption-mode aes-gcm/chacha20-poly1305 => --hash-mode none\n");
+        return 0;
+    }
+    
     if (!(!(options.otp_mode != SPPROTO_OTP_MODE_NONE) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
         fprintf(stderr, "False: --otp => UDP\n");
         return 0;
@@ -1195,6 +1222,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!options.peer_udp_offload || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --peer-udp-offload => UDP\n");
+        return 0;
+    }
+    
     if (!(!options.peer_ssl || (options.ssl && options.transport_mode == TRANSPORT_MODE_TCP))) {
         fprintf(stderr, "False: --peer-ssl => (--ssl && TCP)\n");
         return 0;
@@ -1292,6 +1324,7 @@ int process_arguments (void)
     // initialize SPProto parameters
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
         sp_params.encryption_mode = options.encryption_mode;
+        sp_params.aead_mode = options.aead_mode;
         sp_params.hash_mode = options.hash_mode;
         sp_params.otp_mode = options.otp_mode;
         if (options.otp_mode > 0) {
@@ -1632,6 +1665,10 @@ int peer_init_link (struct peer_data *peer)
             goto fail1;
         }
         
+        if (options.peer_udp_offload) {
+            DatagramPeerIO_EnableOffload(&peer->pio.udp.pio);
+        }
+        
         if (SPPROTO_HAVE_OTP(sp_params)) {
             // init send seed state
             peer->pio.udp.sendseed_nextid = 0;
@@ -2056,13 +2093,13 @@ void peer_msg_youconnect (struct peer_data *peer, uint8_t *data, int data_len)
     
     // read additonal parameters
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
-        if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+        if (SPPROTO_HAVE_ENCRYPTION_KEY(sp_params)) {
             int key_len;
             if (!msg_youconnectParser_Getkey(&parser, &key, &key_len)) {
                 peer_log(peer, BLOG_WARNING, "msg_youconnect: no key");
                 return;
             }
-            if (key_len != BEncryption_cipher_key_size(sp_params.encryption_mode)) {
+            if (key_len != SPPROTO_ENCRYPTION_KEY_SIZE(sp_params)) {
                 peer_log(peer, BLOG_WARNING, "msg_youconnect: wrong key size");
                 return;
             }
@@ -2373,11 +2410,11 @@ void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont)
             return;
         }
         
-        uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+        uint8_t key[SPPROTO_MAX_ENCRYPTION_KEY_SIZE];
         
         // generate and set encryption key
-        if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
-            BRandom_randomize(key, BEncryption_cipher_key_size(sp_params.encryption_mode));
+        if (SPPROTO_HAVE_ENCRYPTION_KEY(sp_params)) {
+            BRandom_randomize(key, SPPROTO_ENCRYPTION_KEY_SIZE(sp_params));
             DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, key);
         }
         
@@ -2421,7 +2458,7 @@ void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key,
         }
         
         // set encryption key
-        if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+        if (SPPROTO_HAVE_ENCRYPTION_KEY(sp_params)) {
             DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, encryption_key);
         }
         
@@ -2517,8 +2554,8 @@ void peer_send_conectinfo (struct peer_data *peer, int addr_index, int port_adju
     
     // remember encryption key size
     int key_size = 0; // to remove warning
-    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION(sp_params)) {
-        key_size = BEncryption_cipher_key_size(sp_params.encryption_mode);
+    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION_KEY(sp_params)) {
+        key_size = SPPROTO_ENCRYPTION_KEY_SIZE(sp_params);
     }
     
     // calculate message length ..
@@ -2533,7 +2570,7 @@ void peer_send_conectinfo (struct peer_data *peer, int addr_index, int port_adju
     }
     
     // encryption key
-    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION_KEY(sp_params)) {
         msg_len += msg_youconnect_SIZEkey(key_size);
     }
     
@@ -2588,7 +2625,7 @@ void peer_send_conectinfo (struct peer_data *peer, int addr_index, int port_adju
     }
     
     // write encryption key
-    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION_KEY(sp_params)) {
         uint8_t *key_dst = msg_youconnectWriter_Addkey(&writer, key_size);
         memcpy(key_dst, enckey, key_size);
     }
@@ -60,6 +60,7 @@ system/BConnection_unix.c
 system/BConnection_common.c
 system/BTime.c
 system/BUnixSignal.c
+system/BWorkerProcesses.c
 system/BNetwork.c
 system/BDatagram_common.c
 system/BDatagram_unix.c
@@ -53,6 +53,7 @@ system/BConnection_common.c
 system/BDatagram_unix.c
 system/BTime.c
 system/BUnixSignal.c
+system/BWorkerProcesses.c
 system/BNetwork.c
 flow/StreamRecvInterface.c
 flow/PacketRecvInterface.c
@@ -25,6 +25,12 @@
  * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Benchmark of packet encryption and hashing, as done by SPProto for each
+ * combination of --encryption-mode and --hash-mode, over a range of packet
+ * sizes, both on the calling thread and with work dispatched to threads.
  */
 
 #include <stdio.h>
@@ -32,114 +38,468 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
 
+#include <misc/debug.h>
+#include <misc/balign.h>
 #include <misc/balloc.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <security/BSecurity.h>
 #include <security/BRandom.h>
 #include <security/BEncryption.h>
-#include <base/DebugObject.h>
+#include <security/BAead.h>
+#include <security/BHash.h>
+#include <threadwork/BThreadWork.h>
+
+#define MAX_PACKET_SIZE 65536
+
+// packets encoded by one work, like SPProtoEncoder batches
+#define WORK_BATCH 4
+
+// works in flight per thread
+#define WORKS_PER_THREAD 2
+
+#define MAX_WORKS 256
+
+struct encryption_mode {
+    const char *name;
+    int cipher;
+    int aead;
+};
+
+struct hash_mode {
+    const char *name;
+    int type;
+};
+
+static const struct encryption_mode encryption_modes[] = {
+    {"none", 0, 0},
+    {"blowfish", BENCRYPTION_CIPHER_BLOWFISH, 0},
+    {"aes", BENCRYPTION_CIPHER_AES, 0},
+    {"aes-gcm", BAEAD_CIPHER_AES_128_GCM, 1},
+    {"chacha20-poly1305", BAEAD_CIPHER_CHACHA20_POLY1305, 1}
+};
+
+static const struct hash_mode hash_modes[] = {
+    {"none", 0},
+    {"md5", BHASH_TYPE_MD5},
+    {"sha1", BHASH_TYPE_SHA1}
+};
+
+static const int packet_sizes[] = {64, 256, 1024, 1500, 4096, 16384, 65536};
+
+#define NUM_ELEMS(_a) ((int)(sizeof(_a) / sizeof((_a)[0])))
+
+struct coder {
+    const struct encryption_mode *enc;
+    const struct hash_mode *hash;
+    int size;
+    BEncryption encryptor;
+    BAead aead;
+    uint8_t nonce_salt[BAEAD_NONCE_SIZE];
+    uint64_t nonce_counter;
+    uint8_t *plaintext;
+    uint8_t *out;
+    BThreadWork tw;
+};
+
+static int opt_threads = -1;
+static int opt_time = 300;
+static const char *opt_encryption_mode = NULL;
+static const char *opt_hash_mode = NULL;
+static int opt_size = 0;
+
+struct combination {
+    const struct encryption_mode *enc;
+    const struct hash_mode *hash;
+    int size;
+};
+
+static int num_threads;
+
+static struct combination combinations[NUM_ELEMS(encryption_modes) * NUM_ELEMS(hash_modes) * NUM_ELEMS(packet_sizes)];
+static int num_combinations;
+static int cur_combination;
+
+static BReactor reactor;
+static BThreadWorkDispatcher twd;
+static BPending next_job;
+static struct coder works[MAX_WORKS];
+static int num_works;
+static int num_works_running;
+static btime_t start_time;
+static btime_t end_time;
+static uint64_t num_packets;
 
 static void usage (char *name)
 {
     printf(
-        "Usage: %s <enc/dec> <ciper> <num_blocks> <num_ops>\n"
-        "    <cipher> is one of (blowfish, aes).\n",
+        "Usage: %s [--threads <num>] [--time <ms>] [--encryption-mode <mode>] [--hash-mode <mode>] [--size <bytes>]\n"
+        "    Encodes packets the way SPProto does for every combination of encryption mode\n"
+        "    (none, blowfish, aes, aes-gcm, chacha20-poly1305), hash mode (none, md5, sha1)\n"
+        "    and packet size (64 to 65536 bytes). Each combination runs for <ms> milliseconds\n"
+        "    (default 300) on the calling thread, then with work dispatched to <num> threads\n"
+        "    (default: the number of CPUs). The options restrict the matrix.\n",
         name
     );
     
     exit(1);
 }
 
-int main (int argc, char **argv)
+static int coder_init (struct coder *c, const struct encryption_mode *enc, const struct hash_mode *hash, int size)
 {
-    if (argc <= 0) {
-        return 1;
+    c->enc = enc;
+    c->hash = hash;
+    c->size = size;
+    
+    // buffers as in SPProtoEncoder: header and payload, then the encoded packet
+    int header_len = (hash->type ? BHash_size(hash->type) : 0);
+    if (!(c->plaintext = (uint8_t *)BAlloc(header_len + size + BENCRYPTION_MAX_BLOCK_SIZE))) {
+        goto fail0;
     }
+    if (!(c->out = (uint8_t *)BAlloc(BAEAD_NONCE_SIZE + header_len + size + 2 * BENCRYPTION_MAX_BLOCK_SIZE + BAEAD_TAG_SIZE))) {
+        goto fail1;
+    }
+    BRandom_randomize(c->plaintext + header_len, size);
     
-    if (argc != 5) {
-        usage(argv[0]);
+    uint8_t key[BAEAD_MAX_KEY_SIZE > BENCRYPTION_MAX_KEY_SIZE ? BAEAD_MAX_KEY_SIZE : BENCRYPTION_MAX_KEY_SIZE];
+    BRandom_randomize(key, sizeof(key));
+    
+    if (enc->aead) {
+        if (!BAead_Init(&c->aead, BAEAD_MODE_ENCRYPT, enc->cipher, key)) {
+            goto fail2;
+        }
+        BRandom_randomize(c->nonce_salt, sizeof(c->nonce_salt));
+        c->nonce_counter = 0;
+    }
+    else if (enc->cipher) {
+        if (!BEncryption_Init(&c->encryptor, BENCRYPTION_MODE_ENCRYPT, enc->cipher, key)) {
+            goto fail2;
+        }
     }
     
-    char *mode_str = argv[1];
-    char *cipher_str = argv[2];
+    return 1;
     
-    int mode;
-    int cipher = 0; // silence warning
-    int num_blocks = atoi(argv[3]);
-    int num_ops = atoi(argv[4]);
+fail2:
+    BFree(c->out);
+fail1:
+    BFree(c->plaintext);
+fail0:
+    return 0;
+}
+
+static void coder_free (struct coder *c)
+{
+    if (c->enc->aead) {
+        BAead_Free(&c->aead);
+    }
+    else if (c->enc->cipher) {
+        BEncryption_Free(&c->encryptor);
+    }
     
-    if (!strcmp(mode_str, "enc")) {
-        mode = BENCRYPTION_MODE_ENCRYPT;
+    BFree(c->out);
+    BFree(c->plaintext);
+}
+
+static void coder_encode (struct coder *c)
+{
+    uint8_t *plaintext = c->plaintext;
+    int plaintext_len = c->size;
+    
+    // hash header and payload
+    if (c->hash->type) {
+        int hash_size = BHash_size(c->hash->type);
+        plaintext_len += hash_size;
+        memset(plaintext, 0, hash_size);
+        uint8_t hash[BHASH_MAX_SIZE];
+        BHash_calculate(c->hash->type, plaintext, plaintext_len, hash);
+        memcpy(plaintext, hash, hash_size);
     }
-    else if (!strcmp(mode_str, "dec")) {
-        mode = BENCRYPTION_MODE_DECRYPT;
+    
+    if (c->enc->aead) {
+        // counter nonce, encrypt and append tag
+        memcpy(c->out, c->nonce_salt, BAEAD_NONCE_SIZE);
+        uint64_t counter = c->nonce_counter++;
+        for (int i = 0; i < 8; i++) {
+            c->out[BAEAD_NONCE_SIZE - 1 - i] ^= (uint8_t)(counter >> (8 * i));
+        }
+        uint8_t *ciphertext = c->out + BAEAD_NONCE_SIZE;
+        BAead_Encrypt(&c->aead, c->out, plaintext, ciphertext, plaintext_len, ciphertext + plaintext_len);
     }
-    else {
-        usage(argv[0]);
+    else if (c->enc->cipher) {
+        // pad, generate IV and encrypt
+        int block_size = BEncryption_cipher_block_size(c->enc->cipher);
+        int cyphertext_len = balign_up((plaintext_len + 1), block_size);
+        plaintext[plaintext_len] = 1;
+        memset(plaintext + plaintext_len + 1, 0, cyphertext_len - (plaintext_len + 1));
+        BRandom_randomize(c->out, block_size);
+        uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+        memcpy(iv, c->out, block_size);
+        BEncryption_Encrypt(&c->encryptor, plaintext, c->out + block_size, cyphertext_len, iv);
     }
+}
+
+static void print_result (struct combination *cb, const char *dispatch, uint64_t packets, btime_t time)
+{
+    double secs = (time > 0 ? time : 1) / 1000.0;
+    double mbps = (double)packets * cb->size / secs / 1000000.0;
+    printf("%-18s %-5s %6d %-9s %10.1f %12.0f\n", cb->enc->name, cb->hash->name, cb->size, dispatch, mbps, packets / secs);
+    fflush(stdout);
+}
+
+static void print_failed (struct combination *cb)
+{
+    printf("%-18s %-5s %6d failed to initialize\n", cb->enc->name, cb->hash->name, cb->size);
+    fflush(stdout);
+}
+
+static void finish_threaded (void)
+{
+    struct combination *cb = &combinations[cur_combination];
     
-    if (!strcmp(cipher_str, "blowfish")) {
-        cipher = BENCRYPTION_CIPHER_BLOWFISH;
+    char dispatch[32];
+    snprintf(dispatch, sizeof(dispatch), "%d-thread", num_threads);
+    print_result(cb, dispatch, num_packets, btime_gettime() - start_time);
+    
+    for (int i = 0; i < num_works; i++) {
+        coder_free(&works[i]);
     }
-    else if (!strcmp(cipher_str, "aes")) {
-        cipher = BENCRYPTION_CIPHER_AES;
+    
+    cur_combination++;
+    BPending_Set(&next_job);
+}
+
+static void work_func (struct coder *c)
+{
+    for (int i = 0; i < WORK_BATCH; i++) {
+        coder_encode(c);
     }
-    else {
-        usage(argv[0]);
+}
+
+static void work_handler (struct coder *c)
+{
+    BThreadWork_Free(&c->tw);
+    num_packets += WORK_BATCH;
+    
+    // keep going until the time is up, then wait for the other works
+    if (btime_gettime() < end_time) {
+        BThreadWork_Init(&c->tw, &twd, (BThreadWork_handler_done)work_handler, c, (BThreadWork_work_func)work_func, c);
+        return;
     }
     
-    if (num_blocks < 0 || num_ops < 0) {
-        usage(argv[0]);
+    if (--num_works_running == 0) {
+        finish_threaded();
+    }
+}
+
+static int run_single (struct combination *cb)
+{
+    struct coder *c = &works[0];
+    if (!coder_init(c, cb->enc, cb->hash, cb->size)) {
+        return 0;
     }
     
-    int key_size = BEncryption_cipher_key_size(cipher);
-    int block_size = BEncryption_cipher_block_size(cipher);
+    start_time = btime_gettime();
+    end_time = start_time + opt_time;
+    uint64_t packets = 0;
     
-    uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
-    BRandom_randomize(key, key_size);
+    btime_t now;
+    do {
+        for (int i = 0; i < WORK_BATCH; i++) {
+            coder_encode(c);
+        }
+        packets += WORK_BATCH;
+    } while ((now = btime_gettime()) < end_time);
     
-    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-    BRandom_randomize(iv, block_size);
+    coder_free(c);
     
-    if (num_blocks > INT_MAX / block_size) {
-        printf("too much");
-        goto fail0;
+    print_result(cb, "single", packets, now - start_time);
+    return 1;
+}
+
+static int start_threaded (struct combination *cb)
+{
+    num_works = WORKS_PER_THREAD * num_threads;
+    if (num_works > MAX_WORKS) {
+        num_works = MAX_WORKS;
     }
-    int unit_size = num_blocks * block_size;
     
-    printf("unit size %d\n", unit_size);
+    // each work has its own contexts, as they cannot be shared between threads
+    for (int i = 0; i < num_works; i++) {
+        if (!coder_init(&works[i], cb->enc, cb->hash, cb->size)) {
+            while (i-- > 0) {
+                coder_free(&works[i]);
+            }
+            return 0;
+        }
+    }
     
-    uint8_t *buf1 = (uint8_t *)BAlloc(unit_size);
-    if (!buf1) {
-        printf("BAlloc failed");
-        goto fail0;
+    start_time = btime_gettime();
+    end_time = start_time + opt_time;
+    num_packets = 0;
+    
+    for (int i = 0; i < num_works; i++) {
+        BThreadWork_Init(&works[i].tw, &twd, (BThreadWork_handler_done)work_handler, &works[i], (BThreadWork_work_func)work_func, &works[i]);
     }
+    num_works_running = num_works;
     
-    uint8_t *buf2 = (uint8_t *)BAlloc(unit_size);
-    if (!buf2) {
-        printf("BAlloc failed");
-        goto fail1;
+    return 1;
+}
+
+static void next_job_handler (void *unused)
+{
+    if (cur_combination == num_combinations) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    struct combination *cb = &combinations[cur_combination];
+    
+    // the single-threaded run blocks the event loop, which has nothing else to do
+    if (!run_single(cb)) {
+        print_failed(cb);
+        goto next;
     }
     
-    BEncryption enc;
-    BEncryption_Init(&enc, mode, cipher, key);
+    if (BThreadWorkDispatcher_UsingThreads(&twd)) {
+        if (!start_threaded(cb)) {
+            print_failed(cb);
+            goto next;
+        }
+        return;
+    }
     
-    uint8_t *in = buf1;
-    uint8_t *out = buf2;
-    BRandom_randomize(in, unit_size);
+next:
+    cur_combination++;
+    BPending_Set(&next_job);
+}
+
+static void add_combination (const struct encryption_mode *enc, const struct hash_mode *hash, int size)
+{
+    ASSERT(num_combinations < NUM_ELEMS(combinations))
     
-    for (int i = 0; i < num_ops; i++) {
-        BEncryption_Encrypt(&enc, in, out, unit_size, iv);
+    struct combination *cb = &combinations[num_combinations++];
+    cb->enc = enc;
+    cb->hash = hash;
+    cb->size = size;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        char *val = argv[++i];
         
-        uint8_t *t = in;
-        in = out;
-        out = t;
+        if (!strcmp(arg, "--threads")) {
+            opt_threads = atoi(val);
+        }
+        else if (!strcmp(arg, "--time")) {
+            if ((opt_time = atoi(val)) <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (!strcmp(arg, "--encryption-mode")) {
+            opt_encryption_mode = val;
+        }
+        else if (!strcmp(arg, "--hash-mode")) {
+            opt_hash_mode = val;
+        }
+        else if (!strcmp(arg, "--size")) {
+            if ((opt_size = atoi(val)) <= 0 || opt_size > MAX_PACKET_SIZE) {
+                usage(argv[0]);
+            }
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    
+    // build the matrix
+    for (int e = 0; e < NUM_ELEMS(encryption_modes); e++) {
+        const struct encryption_mode *enc = &encryption_modes[e];
+        if (opt_encryption_mode && strcmp(opt_encryption_mode, enc->name)) {
+            continue;
+        }
+        
+        for (int h = 0; h < NUM_ELEMS(hash_modes); h++) {
+            const struct hash_mode *hash = &hash_modes[h];
+            if (opt_hash_mode && strcmp(opt_hash_mode, hash->name)) {
+                continue;
+            }
+            
+            // AEAD modes authenticate packets themselves
+            if (enc->aead && hash->type) {
+                continue;
+            }
+            
+            if (opt_size) {
+                add_combination(enc, hash, opt_size);
+                continue;
+            }
+            
+            for (int s = 0; s < NUM_ELEMS(packet_sizes); s++) {
+                add_combination(enc, hash, packet_sizes[s]);
+            }
+        }
+    }
+    
+    if (num_combinations == 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStderr();
+    BTime_Init();
+    
+    if (!BSecurity_GlobalInitThreadSafe()) {
+        fprintf(stderr, "BSecurity_GlobalInitThreadSafe failed\n");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail1;
+    }
+    
+    // one thread per CPU unless told otherwise
+    num_threads = opt_threads;
+    if (num_threads < 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (ncpu > 0 ? ncpu : 1);
+    }
+    if (num_threads > BTHREADWORK_MAX_THREADS) {
+        num_threads = BTHREADWORK_MAX_THREADS;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, num_threads, 0)) {
+        fprintf(stderr, "BThreadWorkDispatcher_Init failed\n");
+        goto fail2;
     }
     
-    BEncryption_Free(&enc);
-    BFree(buf2);
+    printf("%-18s %-5s %6s %-9s %10s %12s\n", "encryption", "hash", "size", "dispatch", "MB/s", "packets/s");
+    
+    BPending_Init(&next_job, BReactor_PendingGroup(&reactor), next_job_handler, NULL);
+    BPending_Set(&next_job);
+    
+    BReactor_Exec(&reactor);
+    
+    BPending_Free(&next_job);
+    BThreadWorkDispatcher_Free(&twd);
+fail2:
+    BReactor_Free(&reactor);
 fail1:
-    BFree(buf1);
+    BSecurity_GlobalFreeThreadSafe();
 fail0:
+    BLog_Free();
     DebugObjectGlobal_Finish();
     
     return 0;
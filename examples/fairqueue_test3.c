@@ -0,0 +1,291 @@
+/**
+ * @file fairqueue_test3.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Benchmark of {@link PacketPassFairQueue} against {@link PacketPassDRRQueue}
+ * with many flows which always have a packet queued.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/array_length.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketPassFairQueue.h>
+#include <flow/PacketPassDRRQueue.h>
+
+#define MTU 1500
+#define MIN_PACKET_SIZE 64
+#define PACKET_WEIGHT 1
+
+#define QUEUE_FAIR 1
+#define QUEUE_DRR 2
+
+struct source {
+    PacketPassInterface *output;
+    int len;
+    uint64_t num_sent;
+};
+
+static const int default_num_flows[] = {10, 1000, 10000};
+
+static int opt_num_flows;
+static int opt_num_packets = 2000000;
+
+static uint8_t packet_data[MTU];
+
+static BReactor reactor;
+static PacketPassInterface sink;
+static BTimer start_timer;
+static int running;
+static uint64_t sink_count;
+static btime_t start_time;
+static btime_t end_time;
+
+static PacketPassFairQueue fq;
+static PacketPassDRRQueue drr;
+static PacketPassFairQueueFlow *fq_flows;
+static PacketPassDRRQueueFlow *drr_flows;
+static struct source *sources;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s [--flows <num>] [--packets <num>]\n"
+        "    Passes <num> packets (default 2000000) through PacketPassFairQueue and\n"
+        "    PacketPassDRRQueue, from 10, 1000 and 10000 flows, or <num> flows. Every\n"
+        "    flow has a packet queued all the time, with sizes varying between flows.\n"
+        "    Fairness is the least over the most amount of data a flow got through.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void source_handler_done (struct source *s)
+{
+    s->num_sent++;
+    
+    // queue the next packet right away
+    PacketPassInterface_Sender_Send(s->output, packet_data, s->len);
+}
+
+static void start_timer_handler (void *unused)
+{
+    // all flows have queued their first packet, start counting
+    running = 1;
+    start_time = btime_gettime();
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void sink_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    // Keep the first packet until all sources have sent theirs. Pending jobs
+    // run last in first out, so if we finished it now, the first flow would
+    // keep sending before the others got to queue anything.
+    if (!running) {
+        BReactor_SetTimer(&reactor, &start_timer);
+        return;
+    }
+    
+    if (++sink_count == opt_num_packets) {
+        end_time = btime_gettime();
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static int run (int queue, int num_flows)
+{
+    int res = 0;
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    BPendingGroup *pg = BReactor_PendingGroup(&reactor);
+    
+    PacketPassInterface_Init(&sink, MTU, sink_handler_send, NULL, pg);
+    BTimer_Init(&start_timer, 0, start_timer_handler, NULL);
+    running = 0;
+    sink_count = 0;
+    
+    if (!(sources = (struct source *)BAllocArray(num_flows, sizeof(sources[0])))) {
+        DEBUG("BAllocArray failed");
+        goto fail1;
+    }
+    
+    if (queue == QUEUE_FAIR) {
+        if (!(fq_flows = (PacketPassFairQueueFlow *)BAllocArray(num_flows, sizeof(fq_flows[0])))) {
+            DEBUG("BAllocArray failed");
+            goto fail2;
+        }
+        if (!PacketPassFairQueue_Init(&fq, &sink, pg, 0, PACKET_WEIGHT)) {
+            DEBUG("PacketPassFairQueue_Init failed");
+            BFree(fq_flows);
+            goto fail2;
+        }
+    } else {
+        if (!(drr_flows = (PacketPassDRRQueueFlow *)BAllocArray(num_flows, sizeof(drr_flows[0])))) {
+            DEBUG("BAllocArray failed");
+            goto fail2;
+        }
+        if (!PacketPassDRRQueue_Init(&drr, &sink, pg, 0, PACKET_WEIGHT)) {
+            DEBUG("PacketPassDRRQueue_Init failed");
+            BFree(drr_flows);
+            goto fail2;
+        }
+    }
+    
+    for (int i = 0; i < num_flows; i++) {
+        struct source *s = &sources[i];
+        
+        if (queue == QUEUE_FAIR) {
+            PacketPassFairQueueFlow_Init(&fq_flows[i], &fq);
+            s->output = PacketPassFairQueueFlow_GetInput(&fq_flows[i]);
+        } else {
+            PacketPassDRRQueueFlow_Init(&drr_flows[i], &drr);
+            s->output = PacketPassDRRQueueFlow_GetInput(&drr_flows[i]);
+        }
+        
+        s->len = MIN_PACKET_SIZE + (int)(((uint64_t)i * 7919) % (MTU - MIN_PACKET_SIZE + 1));
+        s->num_sent = 0;
+        
+        PacketPassInterface_Sender_Init(s->output, (PacketPassInterface_handler_done)source_handler_done, s);
+        PacketPassInterface_Sender_Send(s->output, packet_data, s->len);
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    // the amount of data each flow got through, counting packet weights
+    uint64_t min_amount = UINT64_MAX;
+    uint64_t max_amount = 0;
+    for (int i = 0; i < num_flows; i++) {
+        uint64_t amount = sources[i].num_sent * (sources[i].len + PACKET_WEIGHT);
+        if (amount < min_amount) {
+            min_amount = amount;
+        }
+        if (amount > max_amount) {
+            max_amount = amount;
+        }
+    }
+    
+    double secs = (end_time > start_time ? end_time - start_time : 1) / 1000.0;
+    printf("%-20s %6d %12.0f %10.3f\n", (queue == QUEUE_FAIR ? "PacketPassFairQueue" : "PacketPassDRRQueue"), num_flows, opt_num_packets / secs, (max_amount > 0 ? (double)min_amount / max_amount : 0.0));
+    fflush(stdout);
+    
+    // the sink didn't finish the last packet, so flows must be freed as part of freeing the queue
+    if (queue == QUEUE_FAIR) {
+        PacketPassFairQueue_PrepareFree(&fq);
+        for (int i = 0; i < num_flows; i++) {
+            PacketPassFairQueueFlow_Free(&fq_flows[i]);
+        }
+        PacketPassFairQueue_Free(&fq);
+        BFree(fq_flows);
+    } else {
+        PacketPassDRRQueue_PrepareFree(&drr);
+        for (int i = 0; i < num_flows; i++) {
+            PacketPassDRRQueueFlow_Free(&drr_flows[i]);
+        }
+        PacketPassDRRQueue_Free(&drr);
+        BFree(drr_flows);
+    }
+    
+    res = 1;
+    
+fail2:
+    BFree(sources);
+fail1:
+    BReactor_RemoveTimer(&reactor, &start_timer);
+    PacketPassInterface_Free(&sink);
+    BReactor_Free(&reactor);
+fail0:
+    return res;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        char *val = argv[++i];
+        
+        if (!strcmp(arg, "--flows")) {
+            if ((opt_num_flows = atoi(val)) <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (!strcmp(arg, "--packets")) {
+            if ((opt_num_packets = atoi(val)) <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    
+    BLog_InitStderr();
+    BTime_Init();
+    
+    printf("%-20s %6s %12s %10s\n", "queue", "flows", "packets/s", "fairness");
+    
+    for (int i = 0; i < (int)B_ARRAY_LENGTH(default_num_flows); i++) {
+        int num_flows = (opt_num_flows ? opt_num_flows : default_num_flows[i]);
+        
+        if (!run(QUEUE_FAIR, num_flows) || !run(QUEUE_DRR, num_flows)) {
+            BLog_Free();
+            return 1;
+        }
+        
+        if (opt_num_flows) {
+            break;
+        }
+    }
+    
+    BLog_Free();
+    return 0;
+}
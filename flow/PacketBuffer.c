@@ -36,6 +36,95 @@
 
 static void input_handler_done (PacketBuffer *buf, int in_len);
 static void output_handler_done (PacketBuffer *buf);
+static void send_output (PacketBuffer *buf);
+
+#ifdef BADVPN_PACKETBUFFER_RING
+
+static int buffer_init (PacketBuffer *buf, int num_packets)
+{
+    return PacketRing_Init(&buf->ring, buf->input_mtu, num_packets, 0);
+}
+
+static void buffer_free (PacketBuffer *buf)
+{
+    PacketRing_Free(&buf->ring);
+}
+
+static uint8_t * buffer_input_dest (PacketBuffer *buf)
+{
+    return PacketRing_WriteDest(&buf->ring);
+}
+
+static void buffer_submit (PacketBuffer *buf, int len)
+{
+    PacketRing_SubmitPacket(&buf->ring, len);
+}
+
+static int buffer_is_empty (PacketBuffer *buf)
+{
+    return (PacketRing_ReadAvail(&buf->ring) == 0);
+}
+
+static int buffer_peek (PacketBuffer *buf, int max, uint8_t **data, int *len)
+{
+    return PacketRing_PeekPackets(&buf->ring, max, data, len);
+}
+
+static void buffer_consume (PacketBuffer *buf, int num)
+{
+    PacketRing_ConsumePackets(&buf->ring, num);
+}
+
+#else
+
+static int buffer_init (PacketBuffer *buf, int num_packets)
+{
+    int num_blocks = ChunkBuffer2_calc_blocks(buf->input_mtu, num_packets);
+    if (num_blocks < 0) {
+        return 0;
+    }
+    if (!(buf->buf_data = (struct ChunkBuffer2_block *)BAllocArray(num_blocks, sizeof(buf->buf_data[0])))) {
+        return 0;
+    }
+    
+    ChunkBuffer2_Init(&buf->buf, buf->buf_data, num_blocks, buf->input_mtu);
+    
+    return 1;
+}
+
+static void buffer_free (PacketBuffer *buf)
+{
+    BFree(buf->buf_data);
+}
+
+static uint8_t * buffer_input_dest (PacketBuffer *buf)
+{
+    return (buf->buf.input_avail >= buf->input_mtu ? buf->buf.input_dest : NULL);
+}
+
+static void buffer_submit (PacketBuffer *buf, int len)
+{
+    ChunkBuffer2_SubmitPacket(&buf->buf, len);
+}
+
+static int buffer_is_empty (PacketBuffer *buf)
+{
+    return (buf->buf.output_avail < 0);
+}
+
+static int buffer_peek (PacketBuffer *buf, int max, uint8_t **data, int *len)
+{
+    return ChunkBuffer2_PeekPackets(&buf->buf, max, data, len);
+}
+
+static void buffer_consume (PacketBuffer *buf, int num)
+{
+    for (int i = 0; i < num; i++) {
+        ChunkBuffer2_ConsumePacket(&buf->buf);
+    }
+}
+
+#endif
 
 void input_handler_done (PacketBuffer *buf, int in_len)
 {
@@ -44,19 +133,20 @@ void input_handler_done (PacketBuffer *buf, int in_len)
     DebugObject_Access(&buf->d_obj);
     
     // remember if buffer is empty
-    int was_empty = (buf->buf.output_avail < 0);
+    int was_empty = buffer_is_empty(buf);
     
     // submit packet to buffer
-    ChunkBuffer2_SubmitPacket(&buf->buf, in_len);
+    buffer_submit(buf, in_len);
     
     // if there is space, schedule receive
-    if (buf->buf.input_avail >= buf->input_mtu) {
-        PacketRecvInterface_Receiver_Recv(buf->input, buf->buf.input_dest);
+    uint8_t *dest = buffer_input_dest(buf);
+    if (dest) {
+        PacketRecvInterface_Receiver_Recv(buf->input, dest);
     }
     
     // if buffer was empty, schedule send
     if (was_empty) {
-        PacketPassInterface_Sender_Send(buf->output, buf->buf.output_dest, buf->buf.output_avail);
+        send_output(buf);
     }
 }
 
@@ -65,20 +155,46 @@ void output_handler_done (PacketBuffer *buf)
     DebugObject_Access(&buf->d_obj);
     
     // remember if buffer is full
-    int was_full = (buf->buf.input_avail < buf->input_mtu);
+    int was_full = !buffer_input_dest(buf);
     
-    // remove packet from buffer
-    ChunkBuffer2_ConsumePacket(&buf->buf);
+    // remove sent packets from buffer
+    buffer_consume(buf, PacketPassInterface_Sender_GetNumDone(buf->output));
     
     // if buffer was full and there is space, schedule receive
-    if (was_full && buf->buf.input_avail >= buf->input_mtu) {
-        PacketRecvInterface_Receiver_Recv(buf->input, buf->buf.input_dest);
+    if (was_full) {
+        uint8_t *dest = buffer_input_dest(buf);
+        if (dest) {
+            PacketRecvInterface_Receiver_Recv(buf->input, dest);
+        }
     }
     
     // if there is more data, schedule send
-    if (buf->buf.output_avail >= 0) {
-        PacketPassInterface_Sender_Send(buf->output, buf->buf.output_dest, buf->buf.output_avail);
+    if (!buffer_is_empty(buf)) {
+        send_output(buf);
+    }
+}
+
+void send_output (PacketBuffer *buf)
+{
+    ASSERT(!buffer_is_empty(buf))
+    
+    // get buffered packets, up to the batch limit
+    uint8_t *data[PACKETPASS_MAX_BATCH];
+    int len[PACKETPASS_MAX_BATCH];
+    int num = buffer_peek(buf, buf->max_batch, data, len);
+    ASSERT(num > 0)
+    
+    if (buf->max_batch == 1) {
+        PacketPassInterface_Sender_Send(buf->output, data[0], len[0]);
+        return;
     }
+    
+    for (int i = 0; i < num; i++) {
+        buf->out_packets[i].data = data[i];
+        buf->out_packets[i].len = len[i];
+    }
+    
+    PacketPassInterface_Sender_SendBatch(buf->output, buf->out_packets, num);
 }
 
 int PacketBuffer_Init (PacketBuffer *buf, PacketRecvInterface *input, PacketPassInterface *output, int num_packets, BPendingGroup *pg)
@@ -99,20 +215,16 @@ int PacketBuffer_Init (PacketBuffer *buf, PacketRecvInterface *input, PacketPass
     // init output
     PacketPassInterface_Sender_Init(buf->output, (PacketPassInterface_handler_done)output_handler_done, buf);
     
-    // allocate buffer
-    int num_blocks = ChunkBuffer2_calc_blocks(buf->input_mtu, num_packets);
-    if (num_blocks < 0) {
-        goto fail0;
-    }
-    if (!(buf->buf_data = (struct ChunkBuffer2_block *)BAllocArray(num_blocks, sizeof(buf->buf_data[0])))) {
-        goto fail0;
-    }
+    // pass buffered packets in batches if the output accepts them
+    buf->max_batch = (PacketPassInterface_HasBatch(buf->output) ? PACKETPASS_MAX_BATCH : 1);
     
     // init buffer
-    ChunkBuffer2_Init(&buf->buf, buf->buf_data, num_blocks, buf->input_mtu);
+    if (!buffer_init(buf, num_packets)) {
+        goto fail0;
+    }
     
     // schedule receive
-    PacketRecvInterface_Receiver_Recv(buf->input, buf->buf.input_dest);
+    PacketRecvInterface_Receiver_Recv(buf->input, buffer_input_dest(buf));
     
     DebugObject_Init(&buf->d_obj);
     
@@ -127,5 +239,5 @@ void PacketBuffer_Free (PacketBuffer *buf)
     DebugObject_Free(&buf->d_obj);
     
     // free buffer
-    BFree(buf->buf_data);
+    buffer_free(buf);
 }
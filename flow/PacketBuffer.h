@@ -38,20 +38,35 @@
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
+#ifdef BADVPN_PACKETBUFFER_RING
+#include <structure/PacketRing.h>
+#else
 #include <structure/ChunkBuffer2.h>
+#endif
 #include <flow/PacketRecvInterface.h>
 #include <flow/PacketPassInterface.h>
 
 /**
  * Packet buffer with {@link PacketRecvInterface} input and {@link PacketPassInterface} output.
+ * If the output accepts batches, buffered packets are passed to it in batches.
+ * 
+ * Packets are kept in a {@link ChunkBuffer2}, or, when built with the
+ * WITH_PACKET_RING option, in a {@link PacketRing}, where every packet takes
+ * a cache-line aligned slot of the input MTU.
  */
 typedef struct {
     DebugObject d_obj;
     PacketRecvInterface *input;
     int input_mtu;
     PacketPassInterface *output;
+#ifdef BADVPN_PACKETBUFFER_RING
+    PacketRing ring;
+#else
     struct ChunkBuffer2_block *buf_data;
     ChunkBuffer2 buf;
+#endif
+    int max_batch;
+    struct PacketPassInterface_packet out_packets[PACKETPASS_MAX_BATCH];
 } PacketBuffer;
 
 /**
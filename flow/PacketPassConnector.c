@@ -37,30 +37,48 @@ static void input_handler_send (PacketPassConnector *o, uint8_t *data, int data_
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
+    ASSERT(o->in_num_packets == 0)
     DebugObject_Access(&o->d_obj);
     
     // remember input packet
-    o->in_len = data_len;
-    o->in = data;
+    o->in_single.data = data;
+    o->in_single.len = data_len;
+    o->in_packets = &o->in_single;
+    o->in_num_packets = 1;
     
     if (o->output) {
         // schedule send
-        PacketPassInterface_Sender_Send(o->output, o->in, o->in_len);
+        PacketPassInterface_Sender_Send(o->output, data, data_len);
+    }
+}
+
+static void input_handler_send_batch (PacketPassConnector *o, struct PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    ASSERT(o->in_num_packets == 0)
+    DebugObject_Access(&o->d_obj);
+    
+    // remember input packets
+    o->in_packets = packets;
+    o->in_num_packets = num_packets;
+    
+    if (o->output) {
+        // schedule send
+        PacketPassInterface_Sender_SendBatch(o->output, o->in_packets, o->in_num_packets);
     }
 }
 
 static void output_handler_done (PacketPassConnector *o)
 {
-    ASSERT(o->in_len >= 0)
+    ASSERT(o->in_num_packets > 0)
     ASSERT(o->output)
     DebugObject_Access(&o->d_obj);
     
-    // have no input packet
-    o->in_len = -1;
+    // have no input packets
+    o->in_num_packets = 0;
     
     // allow input to send more packets
-    PacketPassInterface_Done(&o->input);
+    PacketPassInterface_DoneBatch(&o->input, PacketPassInterface_Sender_GetNumDone(o->output));
 }
 
 void PacketPassConnector_Init (PacketPassConnector *o, int mtu, BPendingGroup *pg)
@@ -72,9 +90,10 @@ void PacketPassConnector_Init (PacketPassConnector *o, int mtu, BPendingGroup *p
     
     // init input
     PacketPassInterface_Init(&o->input, o->input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    PacketPassInterface_EnableBatch(&o->input, (PacketPassInterface_handler_send_batch)input_handler_send_batch);
     
-    // have no input packet
-    o->in_len = -1;
+    // have no input packets
+    o->in_num_packets = 0;
     
     // have no output
     o->output = NULL;
@@ -109,9 +128,9 @@ void PacketPassConnector_ConnectOutput (PacketPassConnector *o, PacketPassInterf
     // init output
     PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
     
-    // if we have an input packet, schedule send
-    if (o->in_len >= 0) {
-        PacketPassInterface_Sender_Send(o->output, o->in, o->in_len);
+    // if we have input packets, schedule send
+    if (o->in_num_packets > 0) {
+        PacketPassInterface_Sender_SendBatch(o->output, o->in_packets, o->in_num_packets);
     }
 }
 
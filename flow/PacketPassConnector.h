@@ -43,12 +43,15 @@
 /**
  * A {@link PacketPassInterface} layer which allows the output to be
  * connected and disconnected on the fly.
+ * The input accepts batches of packets, which are passed on to the output;
+ * if the output doesn't accept batches, packets are passed on one by one.
  */
 typedef struct {
     PacketPassInterface input;
     int input_mtu;
-    int in_len;
-    uint8_t *in;
+    struct PacketPassInterface_packet in_single;
+    struct PacketPassInterface_packet *in_packets;
+    int in_num_packets;
     PacketPassInterface *output;
     DebugObject d_obj;
 } PacketPassConnector;
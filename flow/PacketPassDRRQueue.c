@@ -0,0 +1,374 @@
+/**
+ * @file PacketPassDRRQueue.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+
+#include <flow/PacketPassDRRQueue.h>
+
+static void end_previous_flow (PacketPassDRRQueue *m)
+{
+    ASSERT(m->previous_flow)
+    ASSERT(!m->previous_flow->is_queued)
+    
+    PacketPassDRRQueueFlow *flow = m->previous_flow;
+    
+    // the flow went idle, it loses its turn and its remaining deficit
+    flow->deficit = 0;
+    flow->in_turn = 0;
+    
+    m->previous_flow = NULL;
+}
+
+static void schedule (PacketPassDRRQueue *m)
+{
+    ASSERT(!m->sending_flow)
+    ASSERT(!m->previous_flow)
+    ASSERT(!m->freeing)
+    ASSERT(!LinkedList1_IsEmpty(&m->active_list))
+    
+    PacketPassDRRQueueFlow *flow;
+    uint64_t cost;
+    
+    // Find the first flow which can afford its packet. A flow which starts its
+    // turn gets at least a quantum, which covers any packet, so this takes at
+    // most two steps.
+    while (1) {
+        flow = UPPER_OBJECT(LinkedList1_GetFirst(&m->active_list), PacketPassDRRQueueFlow, queued.active_list_node);
+        ASSERT(flow->is_queued)
+        
+        // start turn
+        if (!flow->in_turn) {
+            flow->deficit += m->quantum * flow->weight;
+            flow->in_turn = 1;
+        }
+        
+        cost = (uint64_t)m->packet_weight + flow->queued.data_len;
+        if (cost <= flow->deficit) {
+            break;
+        }
+        
+        // end turn, keeping the deficit for the next one
+        flow->in_turn = 0;
+        LinkedList1_Remove(&m->active_list, &flow->queued.active_list_node);
+        LinkedList1_Append(&m->active_list, &flow->queued.active_list_node);
+    }
+    
+    // remove flow from active list
+    LinkedList1_Remove(&m->active_list, &flow->queued.active_list_node);
+    flow->is_queued = 0;
+    
+    // set sending flow
+    m->sending_flow = flow;
+    m->sending_cost = cost;
+    
+    // schedule send
+    PacketPassInterface_Sender_Send(m->output, flow->queued.data, flow->queued.data_len);
+}
+
+static void schedule_job_handler (PacketPassDRRQueue *m)
+{
+    ASSERT(!m->sending_flow)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&m->d_obj);
+    
+    // remove previous flow if it didn't send again
+    if (m->previous_flow) {
+        end_previous_flow(m);
+    }
+    
+    if (!LinkedList1_IsEmpty(&m->active_list)) {
+        schedule(m);
+    }
+}
+
+static void input_handler_send (PacketPassDRRQueueFlow *flow, uint8_t *data, int data_len)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(flow != m->sending_flow)
+    ASSERT(!flow->is_queued)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    // remember packet
+    flow->queued.data = data;
+    flow->queued.data_len = data_len;
+    
+    if (flow == m->previous_flow) {
+        // remove from previous flow
+        m->previous_flow = NULL;
+        
+        // continue its turn
+        LinkedList1_Prepend(&m->active_list, &flow->queued.active_list_node);
+    } else {
+        // a newly active flow waits for its turn at the end
+        ASSERT(flow->deficit == 0)
+        ASSERT(!flow->in_turn)
+        LinkedList1_Append(&m->active_list, &flow->queued.active_list_node);
+    }
+    flow->is_queued = 1;
+    
+    if (!m->sending_flow && !BPending_IsSet(&m->schedule_job)) {
+        schedule(m);
+    }
+}
+
+static void output_handler_done (PacketPassDRRQueue *m)
+{
+    ASSERT(m->sending_flow)
+    ASSERT(!m->previous_flow)
+    ASSERT(!BPending_IsSet(&m->schedule_job))
+    ASSERT(!m->freeing)
+    ASSERT(!m->sending_flow->is_queued)
+    ASSERT(m->sending_flow->deficit >= m->sending_cost)
+    
+    PacketPassDRRQueueFlow *flow = m->sending_flow;
+    
+    // sending finished
+    m->sending_flow = NULL;
+    
+    // charge the packet to the flow
+    flow->deficit -= m->sending_cost;
+    
+    // remember this flow so the schedule job can end its turn if it didn't send
+    m->previous_flow = flow;
+    
+    // schedule schedule
+    BPending_Set(&m->schedule_job);
+    
+    // finish flow packet
+    PacketPassInterface_Done(&flow->input);
+    
+    // call busy handler if set
+    if (flow->handler_busy) {
+        // handler is one-shot, unset it before calling
+        PacketPassDRRQueue_handler_busy handler = flow->handler_busy;
+        flow->handler_busy = NULL;
+        
+        // call handler
+        handler(flow->user);
+    }
+}
+
+int PacketPassDRRQueue_Init (PacketPassDRRQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight)
+{
+    ASSERT(packet_weight > 0)
+    ASSERT(use_cancel == 0 || use_cancel == 1)
+    ASSERT(!use_cancel || PacketPassInterface_HasCancel(output))
+    
+    // init arguments
+    m->output = output;
+    m->pg = pg;
+    m->use_cancel = use_cancel;
+    m->packet_weight = packet_weight;
+    
+    // a quantum covers the largest packet
+    m->quantum = (uint64_t)PacketPassInterface_GetMTU(output) + packet_weight;
+    
+    // init output
+    PacketPassInterface_Sender_Init(m->output, (PacketPassInterface_handler_done)output_handler_done, m);
+    
+    // not sending
+    m->sending_flow = NULL;
+    
+    // no previous flow
+    m->previous_flow = NULL;
+    
+    // init active list
+    LinkedList1_Init(&m->active_list);
+    
+    // init flows list
+    LinkedList1_Init(&m->flows_list);
+    
+    // not freeing
+    m->freeing = 0;
+    
+    // init schedule job
+    BPending_Init(&m->schedule_job, m->pg, (BPending_handler)schedule_job_handler, m);
+    
+    DebugObject_Init(&m->d_obj);
+    DebugCounter_Init(&m->d_ctr);
+    return 1;
+}
+
+void PacketPassDRRQueue_Free (PacketPassDRRQueue *m)
+{
+    ASSERT(LinkedList1_IsEmpty(&m->flows_list))
+    ASSERT(LinkedList1_IsEmpty(&m->active_list))
+    ASSERT(!m->previous_flow)
+    ASSERT(!m->sending_flow)
+    DebugCounter_Free(&m->d_ctr);
+    DebugObject_Free(&m->d_obj);
+    
+    // free schedule job
+    BPending_Free(&m->schedule_job);
+}
+
+void PacketPassDRRQueue_PrepareFree (PacketPassDRRQueue *m)
+{
+    DebugObject_Access(&m->d_obj);
+    
+    // set freeing
+    m->freeing = 1;
+}
+
+int PacketPassDRRQueue_GetMTU (PacketPassDRRQueue *m)
+{
+    DebugObject_Access(&m->d_obj);
+    
+    return PacketPassInterface_GetMTU(m->output);
+}
+
+void PacketPassDRRQueueFlow_Init (PacketPassDRRQueueFlow *flow, PacketPassDRRQueue *m)
+{
+    ASSERT(!m->freeing)
+    DebugObject_Access(&m->d_obj);
+    
+    // init arguments
+    flow->m = m;
+    
+    // have no canfree handler
+    flow->handler_busy = NULL;
+    
+    // init input
+    PacketPassInterface_Init(&flow->input, PacketPassInterface_GetMTU(flow->m->output), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
+    
+    // set default weight
+    flow->weight = 1;
+    
+    // has no deficit and is not in its turn
+    flow->deficit = 0;
+    flow->in_turn = 0;
+    
+    // add to flows list
+    LinkedList1_Append(&m->flows_list, &flow->list_node);
+    
+    // is not queued
+    flow->is_queued = 0;
+    
+    DebugObject_Init(&flow->d_obj);
+    DebugCounter_Increment(&m->d_ctr);
+}
+
+void PacketPassDRRQueueFlow_Free (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(m->freeing || flow != m->sending_flow)
+    DebugCounter_Decrement(&m->d_ctr);
+    DebugObject_Free(&flow->d_obj);
+    
+    // remove from sending flow
+    if (flow == m->sending_flow) {
+        m->sending_flow = NULL;
+    }
+    
+    // remove from previous flow
+    if (flow == m->previous_flow) {
+        m->previous_flow = NULL;
+    }
+    
+    // remove from active list
+    if (flow->is_queued) {
+        LinkedList1_Remove(&m->active_list, &flow->queued.active_list_node);
+    }
+    
+    // remove from flows list
+    LinkedList1_Remove(&m->flows_list, &flow->list_node);
+    
+    // free input
+    PacketPassInterface_Free(&flow->input);
+}
+
+void PacketPassDRRQueueFlow_AssertFree (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    B_USE(m)
+    
+    ASSERT(m->freeing || flow != m->sending_flow)
+    DebugObject_Access(&flow->d_obj);
+}
+
+int PacketPassDRRQueueFlow_IsBusy (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    return (flow == m->sending_flow);
+}
+
+void PacketPassDRRQueueFlow_RequestCancel (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(flow == m->sending_flow)
+    ASSERT(m->use_cancel)
+    ASSERT(!m->freeing)
+    ASSERT(!BPending_IsSet(&m->schedule_job))
+    DebugObject_Access(&flow->d_obj);
+    
+    // request cancel
+    PacketPassInterface_Sender_RequestCancel(m->output);
+}
+
+void PacketPassDRRQueueFlow_SetBusyHandler (PacketPassDRRQueueFlow *flow, PacketPassDRRQueue_handler_busy handler, void *user)
+{
+    PacketPassDRRQueue *m = flow->m;
+    B_USE(m)
+    
+    ASSERT(flow == m->sending_flow)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    // set handler
+    flow->handler_busy = handler;
+    flow->user = user;
+}
+
+void PacketPassDRRQueueFlow_SetWeight (PacketPassDRRQueueFlow *flow, int weight)
+{
+    ASSERT(weight >= 1)
+    ASSERT(weight <= PACKETPASSDRRQUEUE_MAX_WEIGHT)
+    DebugObject_Access(&flow->d_obj);
+    
+    // set weight
+    flow->weight = weight;
+}
+
+PacketPassInterface * PacketPassDRRQueueFlow_GetInput (PacketPassDRRQueueFlow *flow)
+{
+    DebugObject_Access(&flow->d_obj);
+    
+    return &flow->input;
+}
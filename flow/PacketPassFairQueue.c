@@ -51,8 +51,8 @@ static int compare_flows (PacketPassFairQueueFlow *f1, PacketPassFairQueueFlow *
 
 static uint64_t get_current_time (PacketPassFairQueue *m)
 {
-    if (m->sending_flow) {
-        return m->sending_flow->time;
+    if (m->sending_count > 0) {
+        return m->sending_flows[m->sending_finished]->time;
     }
     
     uint64_t time = 0; // to remove warning
@@ -82,7 +82,7 @@ static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
     
     ASSERT(amount <= FAIRQUEUE_MAX_TIME)
     ASSERT(!flow->is_queued)
-    ASSERT(!m->sending_flow)
+    ASSERT(!flow->is_sending)
     
     // does time overflow?
     if (amount > FAIRQUEUE_MAX_TIME - flow->time) {
@@ -96,6 +96,11 @@ static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
             subtract = first_flow->time;
         }
         
+        // flows of the batch still being finished may be behind the queued ones
+        if (m->sending_count > 0) {
+            subtract = bmin_uint64(subtract, m->sending_flows[m->sending_finished]->time);
+        }
+        
         // subtract time from all flows
         for (LinkedList1Node *list_node = LinkedList1_GetFirst(&m->flows_list); list_node; list_node = LinkedList1Node_Next(list_node)) {
             PacketPassFairQueueFlow *someflow = UPPER_OBJECT(list_node, PacketPassFairQueueFlow, list_node);
@@ -117,31 +122,90 @@ static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
 
 static void schedule (PacketPassFairQueue *m)
 {
-    ASSERT(!m->sending_flow)
+    ASSERT(m->sending_count == 0)
     ASSERT(!m->previous_flow)
     ASSERT(!m->freeing)
     ASSERT(!PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree))
     
-    // get first queued flow
-    PacketPassFairQueueFlow *qflow = PacketPassFairQueue__Tree_GetFirst(&m->queued_tree, 0);
-    ASSERT(qflow->is_queued)
+    int num = 0;
+    
+    do {
+        // get first queued flow
+        PacketPassFairQueueFlow *qflow = PacketPassFairQueue__Tree_GetFirst(&m->queued_tree, 0);
+        ASSERT(qflow->is_queued)
+        
+        // remove flow from queue
+        PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, qflow);
+        qflow->is_queued = 0;
+        
+        // add to batch
+        qflow->is_sending = 1;
+        m->sending_flows[num] = qflow;
+        m->sending_packets[num].data = qflow->queued.data;
+        m->sending_packets[num].len = qflow->queued.data_len;
+        num++;
+    } while (num < m->batch_limit && !PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree));
     
-    // remove flow from queue
-    PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, qflow);
-    qflow->is_queued = 0;
+    m->sending_count = num;
+    m->sending_finished = 0;
     
     // schedule send
-    PacketPassInterface_Sender_Send(m->output, qflow->queued.data, qflow->queued.data_len);
-    m->sending_flow = qflow;
-    m->sending_len = qflow->queued.data_len;
+    PacketPassInterface_Sender_SendBatch(m->output, m->sending_packets, num);
+}
+
+static void finish_sent (PacketPassFairQueue *m)
+{
+    ASSERT(m->sending_count > 0)
+    ASSERT(m->sending_finished < m->sending_count)
+    ASSERT(BPending_IsSet(&m->schedule_job))
+    ASSERT(!m->freeing)
+    
+    do {
+        PacketPassFairQueueFlow *flow = m->sending_flows[m->sending_finished];
+        int len = m->sending_packets[m->sending_finished].len;
+        ASSERT(flow->is_sending)
+        ASSERT(!flow->is_queued)
+        
+        // sending finished
+        flow->is_sending = 0;
+        if (++m->sending_finished == m->sending_count) {
+            m->sending_count = 0;
+        }
+        
+        // remember this flow so the schedule job can remove its time if it didn's send
+        m->previous_flow = flow;
+        
+        // update flow time by packet size
+        increment_sent_flow(flow, (uint64_t)m->packet_weight + len);
+        
+        // finish flow packet
+        PacketPassInterface_Done(&flow->input);
+        
+        // call busy handler if set
+        if (flow->handler_busy) {
+            // handler is one-shot, unset it before calling
+            PacketPassFairQueue_handler_busy handler = flow->handler_busy;
+            flow->handler_busy = NULL;
+            
+            // call handler; the rest of the batch is finished from the schedule job
+            handler(flow->user);
+            return;
+        }
+    } while (m->sending_count > 0);
 }
 
 static void schedule_job_handler (PacketPassFairQueue *m)
 {
-    ASSERT(!m->sending_flow)
     ASSERT(!m->freeing)
     DebugObject_Access(&m->d_obj);
     
+    // finish the rest of the batch
+    if (m->sending_count > 0) {
+        BPending_Set(&m->schedule_job);
+        finish_sent(m);
+        return;
+    }
+    
     // remove previous flow
     m->previous_flow = NULL;
     
@@ -154,7 +218,7 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
 {
     PacketPassFairQueue *m = flow->m;
     
-    ASSERT(flow != m->sending_flow)
+    ASSERT(!flow->is_sending)
     ASSERT(!flow->is_queued)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
@@ -174,46 +238,43 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
     ASSERT_EXECUTE(res)
     flow->is_queued = 1;
     
-    if (!m->sending_flow && !BPending_IsSet(&m->schedule_job)) {
+    if (m->sending_count == 0 && !BPending_IsSet(&m->schedule_job)) {
         schedule(m);
     }
 }
 
 static void output_handler_done (PacketPassFairQueue *m)
 {
-    ASSERT(m->sending_flow)
+    ASSERT(m->sending_count > 0)
+    ASSERT(m->sending_finished == 0)
     ASSERT(!m->previous_flow)
     ASSERT(!BPending_IsSet(&m->schedule_job))
     ASSERT(!m->freeing)
-    ASSERT(!m->sending_flow->is_queued)
-    
-    PacketPassFairQueueFlow *flow = m->sending_flow;
     
-    // sending finished
-    m->sending_flow = NULL;
+    int num_done = PacketPassInterface_Sender_GetNumDone(m->output);
     
-    // remember this flow so the schedule job can remove its time if it didn's send
-    m->previous_flow = flow;
+    // adjust batch size to what the output takes
+    if (num_done < m->sending_count) {
+        m->batch_limit = num_done;
+    } else if (m->use_batch) {
+        m->batch_limit = bmin_int(2 * m->batch_limit, PACKETPASS_MAX_BATCH);
+    }
     
-    // update flow time by packet size
-    increment_sent_flow(flow, (uint64_t)m->packet_weight + m->sending_len);
+    // queue again the flows whose packets the output didn't take
+    while (m->sending_count > num_done) {
+        PacketPassFairQueueFlow *flow = m->sending_flows[--m->sending_count];
+        ASSERT(flow->is_sending)
+        flow->is_sending = 0;
+        int res = PacketPassFairQueue__Tree_Insert(&m->queued_tree, 0, flow, NULL);
+        ASSERT_EXECUTE(res)
+        flow->is_queued = 1;
+    }
     
     // schedule schedule
     BPending_Set(&m->schedule_job);
     
-    // finish flow packet
-    PacketPassInterface_Done(&flow->input);
-    
-    // call busy handler if set
-    if (flow->handler_busy) {
-        // handler is one-shot, unset it before calling
-        PacketPassFairQueue_handler_busy handler = flow->handler_busy;
-        flow->handler_busy = NULL;
-        
-        // call handler
-        handler(flow->user);
-        return;
-    }
+    // finish flows whose packets were sent
+    finish_sent(m);
 }
 
 int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight)
@@ -239,8 +300,13 @@ int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *outpu
     // init output
     PacketPassInterface_Sender_Init(m->output, (PacketPassInterface_handler_done)output_handler_done, m);
     
+    // pass packets in batches if the output accepts them; batches can't be cancelled
+    m->use_batch = (!m->use_cancel && PacketPassInterface_HasBatch(m->output));
+    m->batch_limit = (m->use_batch ? PACKETPASS_MAX_BATCH : 1);
+    
     // not sending
-    m->sending_flow = NULL;
+    m->sending_count = 0;
+    m->sending_finished = 0;
     
     // no previous flow
     m->previous_flow = NULL;
@@ -270,7 +336,7 @@ void PacketPassFairQueue_Free (PacketPassFairQueue *m)
     ASSERT(LinkedList1_IsEmpty(&m->flows_list))
     ASSERT(PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree))
     ASSERT(!m->previous_flow)
-    ASSERT(!m->sending_flow)
+    ASSERT(m->sending_count == 0)
     DebugCounter_Free(&m->d_ctr);
     DebugObject_Free(&m->d_obj);
     
@@ -316,6 +382,9 @@ void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFair
     // is not queued
     flow->is_queued = 0;
     
+    // is not sending
+    flow->is_sending = 0;
+    
     DebugObject_Init(&flow->d_obj);
     DebugCounter_Increment(&m->d_ctr);
 }
@@ -324,13 +393,17 @@ void PacketPassFairQueueFlow_Free (PacketPassFairQueueFlow *flow)
 {
     PacketPassFairQueue *m = flow->m;
     
-    ASSERT(m->freeing || flow != m->sending_flow)
+    ASSERT(m->freeing || !flow->is_sending)
     DebugCounter_Decrement(&m->d_ctr);
     DebugObject_Free(&flow->d_obj);
     
-    // remove from current flow
-    if (flow == m->sending_flow) {
-        m->sending_flow = NULL;
+    // abandon the batch being sent; the output won't finish it while freeing
+    if (flow->is_sending) {
+        for (int i = m->sending_finished; i < m->sending_count; i++) {
+            m->sending_flows[i]->is_sending = 0;
+        }
+        m->sending_count = 0;
+        m->sending_finished = 0;
     }
     
     // remove from previous flow
@@ -355,26 +428,28 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow)
     PacketPassFairQueue *m = flow->m;
     B_USE(m)
     
-    ASSERT(m->freeing || flow != m->sending_flow)
+    ASSERT(m->freeing || !flow->is_sending)
     DebugObject_Access(&flow->d_obj);
 }
 
 int PacketPassFairQueueFlow_IsBusy (PacketPassFairQueueFlow *flow)
 {
     PacketPassFairQueue *m = flow->m;
+    B_USE(m)
     
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
-    return (flow == m->sending_flow);
+    return flow->is_sending;
 }
 
 void PacketPassFairQueueFlow_RequestCancel (PacketPassFairQueueFlow *flow)
 {
     PacketPassFairQueue *m = flow->m;
     
-    ASSERT(flow == m->sending_flow)
+    ASSERT(flow->is_sending)
     ASSERT(m->use_cancel)
+    ASSERT(!m->use_batch)
     ASSERT(!m->freeing)
     ASSERT(!BPending_IsSet(&m->schedule_job))
     DebugObject_Access(&flow->d_obj);
@@ -388,7 +463,7 @@ void PacketPassFairQueueFlow_SetBusyHandler (PacketPassFairQueueFlow *flow, Pack
     PacketPassFairQueue *m = flow->m;
     B_USE(m)
     
-    ASSERT(flow == m->sending_flow)
+    ASSERT(flow->is_sending)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
@@ -62,6 +62,7 @@ typedef struct PacketPassFairQueueFlow_s {
     uint64_t time;
     LinkedList1Node list_node;
     int is_queued;
+    int is_sending;
     struct {
         PacketPassFairQueue__TreeNode tree_node;
         uint8_t *data;
@@ -72,14 +73,24 @@ typedef struct PacketPassFairQueueFlow_s {
 
 /**
  * Fair queue using {@link PacketPassInterface}.
+ * 
+ * If the output accepts batches and cancel functionality is not used, the queued
+ * packets of up to PACKETPASS_MAX_BATCH flows are passed to the output at once,
+ * in the order in which they would otherwise be sent one by one. If the output
+ * takes fewer packets than offered, smaller batches are offered until it takes
+ * all of them again, so that flows aren't needlessly taken off the queue.
  */
 typedef struct PacketPassFairQueue_s {
     PacketPassInterface *output;
     BPendingGroup *pg;
     int use_cancel;
     int packet_weight;
-    struct PacketPassFairQueueFlow_s *sending_flow;
-    int sending_len;
+    int use_batch;
+    int batch_limit;
+    struct PacketPassFairQueueFlow_s *sending_flows[PACKETPASS_MAX_BATCH];
+    struct PacketPassInterface_packet sending_packets[PACKETPASS_MAX_BATCH];
+    int sending_count;
+    int sending_finished;
     struct PacketPassFairQueueFlow_s *previous_flow;
     PacketPassFairQueue__Tree queued_tree;
     LinkedList1 flows_list;
@@ -160,7 +171,9 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow);
 
 /**
  * Determines if the flow is busy. If the flow is considered busy, it must not
- * be freed. At any given time, at most one flow will be indicated as busy.
+ * be freed. At any given time, at most one flow will be indicated as busy,
+ * unless packets are passed to the output in batches, in which case all flows
+ * in the batch are busy.
  * Queue must not be in freeing state.
  * Must not be called from queue calls to output.
  *
@@ -183,6 +196,8 @@ void PacketPassFairQueueFlow_RequestCancel (PacketPassFairQueueFlow *flow);
  * Sets up a callback to be called when the flow is no longer busy.
  * The handler will be called as soon as the flow is no longer busy, i.e. it is not
  * possible that this flow is no longer busy before the handler is called.
+ * When a batch is finished, the handlers of different flows are called from
+ * separate jobs.
  * The flow must be busy as indicated by {@link PacketPassFairQueueFlow_IsBusy}.
  * Queue must not be in freeing state.
  * Must not be called from queue calls to output.
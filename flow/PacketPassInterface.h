@@ -29,6 +29,12 @@
  * @section DESCRIPTION
  * 
  * Interface allowing a packet sender to pass data packets to a packet receiver.
+ * 
+ * A receiver may additionally accept batches of packets, see
+ * {@link PacketPassInterface_EnableBatch}. A sender can then offer several
+ * packets with a single operation, and the receiver tells how many of them
+ * it consumed, saving the jobs which would otherwise be dispatched for each
+ * packet.
  */
 
 #ifndef BADVPN_FLOW_PACKETPASSINTERFACE_H
@@ -46,8 +52,18 @@
 #define PPI_STATE_BUSY 3
 #define PPI_STATE_DONE_PENDING 4
 
+// maximum number of packets in a batch
+#define PACKETPASS_MAX_BATCH 32
+
+struct PacketPassInterface_packet {
+    uint8_t *data;
+    int len;
+};
+
 typedef void (*PacketPassInterface_handler_send) (void *user, uint8_t *data, int data_len);
 
+typedef void (*PacketPassInterface_handler_send_batch) (void *user, struct PacketPassInterface_packet *packets, int num_packets);
+
 typedef void (*PacketPassInterface_handler_requestcancel) (void *user);
 
 typedef void (*PacketPassInterface_handler_done) (void *user);
@@ -56,6 +72,7 @@ typedef struct {
     // provider data
     int mtu;
     PacketPassInterface_handler_send handler_operation;
+    PacketPassInterface_handler_send_batch handler_operation_batch;
     PacketPassInterface_handler_requestcancel handler_requestcancel;
     void *user_provider;
     
@@ -67,6 +84,8 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    struct PacketPassInterface_packet *job_operation_packets;
+    int job_operation_num_packets;
     
     // requestcancel job
     BPending job_requestcancel;
@@ -77,6 +96,7 @@ typedef struct {
     // state
     int state;
     int cancel_requested;
+    int num_done;
     
     DebugObject d_obj;
 } PacketPassInterface;
@@ -87,18 +107,66 @@ static void PacketPassInterface_Free (PacketPassInterface *i);
 
 static void PacketPassInterface_EnableCancel (PacketPassInterface *i, PacketPassInterface_handler_requestcancel handler_requestcancel);
 
+/**
+ * Enables receiving batches of packets. Must be called before the sender is initialized.
+ * When the sender sends more than one packet with {@link PacketPassInterface_Sender_SendBatch},
+ * they are passed to handler_operation_batch instead of the regular send handler, and
+ * the receiver finishes the operation with {@link PacketPassInterface_DoneBatch}.
+ * A single packet is always passed to the regular send handler.
+ * Batch operations cannot be cancelled.
+ * 
+ * @param i the object
+ * @param handler_operation_batch handler called when the sender sends a batch of packets
+ */
+static void PacketPassInterface_EnableBatch (PacketPassInterface *i, PacketPassInterface_handler_send_batch handler_operation_batch);
+
 static void PacketPassInterface_Done (PacketPassInterface *i);
 
+/**
+ * Finishes an operation, reporting how many of the packets were consumed.
+ * The packets consumed are always the first num_done packets; the sender
+ * is expected to send any others again.
+ * 
+ * @param i the object
+ * @param num_done number of packets consumed. Must be >0 and <= the number of
+ *                 packets in the operation.
+ */
+static void PacketPassInterface_DoneBatch (PacketPassInterface *i, int num_done);
+
 static int PacketPassInterface_GetMTU (PacketPassInterface *i);
 
 static void PacketPassInterface_Sender_Init (PacketPassInterface *i, PacketPassInterface_handler_done handler_done, void *user);
 
 static void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int data_len);
 
+/**
+ * Sends a batch of packets. If the receiver does not accept batches, or there
+ * is only one packet, only the first packet is sent, as with
+ * {@link PacketPassInterface_Sender_Send}. The number of packets consumed can be
+ * obtained in the done handler with {@link PacketPassInterface_Sender_GetNumDone}.
+ * The packet descriptors and data must remain valid until the operation is done.
+ * 
+ * @param i the object
+ * @param packets packets to send. Each length must be >=0 and <=MTU.
+ * @param num_packets number of packets. Must be >0 and <=PACKETPASS_MAX_BATCH.
+ */
+static void PacketPassInterface_Sender_SendBatch (PacketPassInterface *i, struct PacketPassInterface_packet *packets, int num_packets);
+
+/**
+ * Returns the number of packets consumed in the last operation.
+ * Must be called after the done handler was called, and before sending again.
+ * 
+ * @param i the object
+ * @return number of packets consumed, >0
+ */
+static int PacketPassInterface_Sender_GetNumDone (PacketPassInterface *i);
+
 static void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i);
 
 static int PacketPassInterface_HasCancel (PacketPassInterface *i);
 
+static int PacketPassInterface_HasBatch (PacketPassInterface *i);
+
 void _PacketPassInterface_job_operation (PacketPassInterface *i);
 void _PacketPassInterface_job_requestcancel (PacketPassInterface *i);
 void _PacketPassInterface_job_done (PacketPassInterface *i);
@@ -110,6 +178,7 @@ void PacketPassInterface_Init (PacketPassInterface *i, int mtu, PacketPassInterf
     // init arguments
     i->mtu = mtu;
     i->handler_operation = handler_operation;
+    i->handler_operation_batch = NULL;
     i->handler_requestcancel = NULL;
     i->user_provider = user;
     
@@ -146,11 +215,30 @@ void PacketPassInterface_EnableCancel (PacketPassInterface *i, PacketPassInterfa
     i->handler_requestcancel = handler_requestcancel;
 }
 
+void PacketPassInterface_EnableBatch (PacketPassInterface *i, PacketPassInterface_handler_send_batch handler_operation_batch)
+{
+    ASSERT(!i->handler_operation_batch)
+    ASSERT(!i->handler_done)
+    ASSERT(handler_operation_batch)
+    
+    i->handler_operation_batch = handler_operation_batch;
+}
+
 void PacketPassInterface_Done (PacketPassInterface *i)
 {
     ASSERT(i->state == PPI_STATE_BUSY)
     DebugObject_Access(&i->d_obj);
     
+    PacketPassInterface_DoneBatch(i, 1);
+}
+
+void PacketPassInterface_DoneBatch (PacketPassInterface *i, int num_done)
+{
+    ASSERT(i->state == PPI_STATE_BUSY)
+    ASSERT(num_done > 0)
+    ASSERT(num_done <= i->job_operation_num_packets)
+    DebugObject_Access(&i->d_obj);
+    
     // unset requestcancel job
     BPending_Unset(&i->job_requestcancel);
     
@@ -159,6 +247,7 @@ void PacketPassInterface_Done (PacketPassInterface *i)
     
     // set state
     i->state = PPI_STATE_DONE_PENDING;
+    i->num_done = num_done;
 }
 
 int PacketPassInterface_GetMTU (PacketPassInterface *i)
@@ -190,6 +279,7 @@ void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_num_packets = 1;
     BPending_Set(&i->job_operation);
     
     // set state
@@ -197,10 +287,52 @@ void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int
     i->cancel_requested = 0;
 }
 
+void PacketPassInterface_Sender_SendBatch (PacketPassInterface *i, struct PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    ASSERT(num_packets <= PACKETPASS_MAX_BATCH)
+    ASSERT(packets)
+    ASSERT(i->state == PPI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    // send just the first packet if the receiver can't take more
+    if (num_packets == 1 || !i->handler_operation_batch) {
+        PacketPassInterface_Sender_Send(i, packets[0].data, packets[0].len);
+        return;
+    }
+    
+#ifndef NDEBUG
+    for (int j = 0; j < num_packets; j++) {
+        ASSERT(packets[j].len >= 0)
+        ASSERT(packets[j].len <= i->mtu)
+        ASSERT(!(packets[j].len > 0) || packets[j].data)
+    }
+#endif
+    
+    // schedule operation
+    i->job_operation_packets = packets;
+    i->job_operation_num_packets = num_packets;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = PPI_STATE_OPERATION_PENDING;
+    i->cancel_requested = 0;
+}
+
+int PacketPassInterface_Sender_GetNumDone (PacketPassInterface *i)
+{
+    ASSERT(i->state == PPI_STATE_NONE)
+    DebugObject_Access(&i->d_obj);
+    
+    return i->num_done;
+}
+
 void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i)
 {
     ASSERT(i->state == PPI_STATE_OPERATION_PENDING || i->state == PPI_STATE_BUSY || i->state == PPI_STATE_DONE_PENDING)
     ASSERT(i->handler_requestcancel)
+    ASSERT(i->job_operation_num_packets == 1)
     DebugObject_Access(&i->d_obj);
     
     // ignore multiple cancel requests
@@ -220,6 +352,7 @@ void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i)
         
         // set state
         i->state = PPI_STATE_DONE_PENDING;
+        i->num_done = 1;
     } else if (i->state == PPI_STATE_BUSY) {
         // set requestcancel job
         BPending_Set(&i->job_requestcancel);
@@ -233,4 +366,11 @@ int PacketPassInterface_HasCancel (PacketPassInterface *i)
     return !!i->handler_requestcancel;
 }
 
+int PacketPassInterface_HasBatch (PacketPassInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return !!i->handler_operation_batch;
+}
+
 #endif
@@ -0,0 +1,100 @@
+/**
+ * @file PacketPassVecGatherer.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <misc/balloc.h>
+
+#include <flow/PacketPassVecGatherer.h>
+
+static void input_handler_send (PacketPassVecGatherer *o, PacketVecSeg *segs, int num_segs)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // a single segment can be passed as it is
+    if (num_segs == 1) {
+        PacketPassInterface_Sender_Send(o->output, segs[0].data, segs[0].len);
+        return;
+    }
+    
+    // join segments
+    int len = PacketVecSeg_TotalLen(segs, num_segs);
+    PacketVecSeg_CopyOut(segs, num_segs, o->buf);
+    
+    PacketPassInterface_Sender_Send(o->output, o->buf, len);
+}
+
+static void output_handler_done (PacketPassVecGatherer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    PacketPassVecInterface_Done(&o->input);
+}
+
+int PacketPassVecGatherer_Init (PacketPassVecGatherer *o, int max_segs, PacketPassInterface *output, BPendingGroup *pg)
+{
+    ASSERT(max_segs > 0)
+    ASSERT(max_segs <= PACKETVEC_MAX_SEGS)
+    
+    // init arguments
+    o->output = output;
+    
+    // allocate buffer
+    if (!(o->buf = (uint8_t *)BAlloc(PacketPassInterface_GetMTU(o->output)))) {
+        goto fail0;
+    }
+    
+    // init input
+    PacketPassVecInterface_Init(&o->input, PacketPassInterface_GetMTU(o->output), max_segs, (PacketPassVecInterface_handler_send)input_handler_send, o, pg);
+    
+    // init output
+    PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void PacketPassVecGatherer_Free (PacketPassVecGatherer *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free input
+    PacketPassVecInterface_Free(&o->input);
+    
+    // free buffer
+    BFree(o->buf);
+}
+
+PacketPassVecInterface * PacketPassVecGatherer_GetInput (PacketPassVecGatherer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->input;
+}
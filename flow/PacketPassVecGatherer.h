@@ -0,0 +1,90 @@
+/**
+ * @file PacketPassVecGatherer.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object which passes packets from a {@link PacketPassVecInterface} to a
+ * {@link PacketPassInterface}, joining their segments.
+ */
+
+#ifndef BADVPN_FLOW_PACKETPASSVECGATHERER_H
+#define BADVPN_FLOW_PACKETPASSVECGATHERER_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketPassVecInterface.h>
+
+/**
+ * Object which passes packets from a {@link PacketPassVecInterface} to a
+ * {@link PacketPassInterface}, joining their segments.
+ * Packets of more than one segment are copied into a buffer; packets of a
+ * single segment are passed on as they are.
+ * 
+ * Input is with {@link PacketPassVecInterface}.
+ * Output is with {@link PacketPassInterface}.
+ */
+typedef struct {
+    PacketPassVecInterface input;
+    PacketPassInterface *output;
+    uint8_t *buf;
+    DebugObject d_obj;
+} PacketPassVecGatherer;
+
+/**
+ * Initializes the object.
+ * 
+ * @param o the object
+ * @param max_segs maximum number of segments in a packet. Must be >0 and
+ *                 <=PACKETVEC_MAX_SEGS.
+ * @param output output interface
+ * @param pg pending group
+ * @return 1 on success, 0 on failure
+ */
+int PacketPassVecGatherer_Init (PacketPassVecGatherer *o, int max_segs, PacketPassInterface *output, BPendingGroup *pg) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void PacketPassVecGatherer_Free (PacketPassVecGatherer *o);
+
+/**
+ * Returns the input interface.
+ * The MTU of the interface will be the same as of the output interface.
+ * The maximum number of segments will be as in {@link PacketPassVecGatherer_Init}.
+ * 
+ * @param o the object
+ * @return input interface
+ */
+PacketPassVecInterface * PacketPassVecGatherer_GetInput (PacketPassVecGatherer *o);
+
+#endif
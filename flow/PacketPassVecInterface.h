@@ -0,0 +1,293 @@
+/**
+ * @file PacketPassVecInterface.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Interface allowing a packet sender to pass data packets to a packet receiver,
+ * where a packet is given as a sequence of segments which may lie in different
+ * buffers. This allows a header to be put in front of a packet without copying
+ * the packet, and the receiver to write out the segments with a single
+ * vectored write. The interface works like {@link PacketPassInterface}, except
+ * that cancellation is not supported.
+ */
+
+#ifndef BADVPN_FLOW_PACKETPASSVECINTERFACE_H
+#define BADVPN_FLOW_PACKETPASSVECINTERFACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+
+// maximum number of segments in a packet
+#define PACKETVEC_MAX_SEGS 8
+
+#define PPVI_STATE_NONE 1
+#define PPVI_STATE_OPERATION_PENDING 2
+#define PPVI_STATE_BUSY 3
+#define PPVI_STATE_DONE_PENDING 4
+
+/**
+ * A contiguous part of a packet.
+ */
+typedef struct {
+    uint8_t *data;
+    int len;
+} PacketVecSeg;
+
+typedef void (*PacketPassVecInterface_handler_send) (void *user, PacketVecSeg *segs, int num_segs);
+
+typedef void (*PacketPassVecInterface_handler_done) (void *user);
+
+typedef struct {
+    // provider data
+    int mtu;
+    int max_segs;
+    PacketPassVecInterface_handler_send handler_operation;
+    void *user_provider;
+    
+    // user data
+    PacketPassVecInterface_handler_done handler_done;
+    void *user_user;
+    
+    // operation job
+    BPending job_operation;
+    PacketVecSeg *job_operation_segs;
+    int job_operation_num_segs;
+    
+    // done job
+    BPending job_done;
+    
+    // state
+    int state;
+    
+    DebugObject d_obj;
+} PacketPassVecInterface;
+
+/**
+ * Returns the total length of segments.
+ * 
+ * @param segs segments
+ * @param num_segs number of segments. Must be >=0.
+ * @return total length
+ */
+static int PacketVecSeg_TotalLen (const PacketVecSeg *segs, int num_segs);
+
+/**
+ * Copies segments into a contiguous buffer.
+ * 
+ * @param segs segments
+ * @param num_segs number of segments. Must be >=0.
+ * @param out buffer to copy to. Must have space for the total length of the segments.
+ */
+static void PacketVecSeg_CopyOut (const PacketVecSeg *segs, int num_segs, uint8_t *out);
+
+/**
+ * Initializes the interface. The user of the interface is the provider.
+ * 
+ * @param i the object
+ * @param mtu maximum total length of a packet. Must be >=0.
+ * @param max_segs maximum number of segments in a packet. Must be >0 and
+ *                 <=PACKETVEC_MAX_SEGS.
+ * @param handler_operation handler called when the user sends a packet
+ * @param user value passed to the handler
+ * @param pg pending group
+ */
+static void PacketPassVecInterface_Init (PacketPassVecInterface *i, int mtu, int max_segs, PacketPassVecInterface_handler_send handler_operation, void *user, BPendingGroup *pg);
+
+/**
+ * Frees the interface.
+ * 
+ * @param i the object
+ */
+static void PacketPassVecInterface_Free (PacketPassVecInterface *i);
+
+/**
+ * Notifies the user that the provider is done with the packet it was given.
+ * The interface must be busy.
+ * 
+ * @param i the object
+ */
+static void PacketPassVecInterface_Done (PacketPassVecInterface *i);
+
+/**
+ * Returns the maximum total length of a packet.
+ * 
+ * @param i the object
+ * @return MTU
+ */
+static int PacketPassVecInterface_GetMTU (PacketPassVecInterface *i);
+
+/**
+ * Returns the maximum number of segments in a packet.
+ * 
+ * @param i the object
+ * @return maximum number of segments
+ */
+static int PacketPassVecInterface_GetMaxSegs (PacketPassVecInterface *i);
+
+/**
+ * Initializes the user side of the interface.
+ * 
+ * @param i the object
+ * @param handler_done handler called when the provider is done with a packet
+ * @param user value passed to the handler
+ */
+static void PacketPassVecInterface_Sender_Init (PacketPassVecInterface *i, PacketPassVecInterface_handler_done handler_done, void *user);
+
+/**
+ * Sends a packet. The interface must not be busy.
+ * The segment descriptors and the data they point to must remain valid
+ * until the provider is done with the packet.
+ * 
+ * @param i the object
+ * @param segs segments of the packet. Their total length must be <=MTU.
+ * @param num_segs number of segments. Must be >=0 and <= the maximum number of segments.
+ */
+static void PacketPassVecInterface_Sender_Send (PacketPassVecInterface *i, PacketVecSeg *segs, int num_segs);
+
+void _PacketPassVecInterface_job_operation (PacketPassVecInterface *i);
+void _PacketPassVecInterface_job_done (PacketPassVecInterface *i);
+
+int PacketVecSeg_TotalLen (const PacketVecSeg *segs, int num_segs)
+{
+    ASSERT(num_segs >= 0)
+    
+    int len = 0;
+    for (int j = 0; j < num_segs; j++) {
+        ASSERT(segs[j].len >= 0)
+        ASSERT(!(segs[j].len > 0) || segs[j].data)
+        len += segs[j].len;
+    }
+    
+    return len;
+}
+
+void PacketVecSeg_CopyOut (const PacketVecSeg *segs, int num_segs, uint8_t *out)
+{
+    ASSERT(num_segs >= 0)
+    
+    for (int j = 0; j < num_segs; j++) {
+        memcpy(out, segs[j].data, segs[j].len);
+        out += segs[j].len;
+    }
+}
+
+void PacketPassVecInterface_Init (PacketPassVecInterface *i, int mtu, int max_segs, PacketPassVecInterface_handler_send handler_operation, void *user, BPendingGroup *pg)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(max_segs > 0)
+    ASSERT(max_segs <= PACKETVEC_MAX_SEGS)
+    
+    // init arguments
+    i->mtu = mtu;
+    i->max_segs = max_segs;
+    i->handler_operation = handler_operation;
+    i->user_provider = user;
+    
+    // set no user
+    i->handler_done = NULL;
+    
+    // init jobs
+    BPending_Init(&i->job_operation, pg, (BPending_handler)_PacketPassVecInterface_job_operation, i);
+    BPending_Init(&i->job_done, pg, (BPending_handler)_PacketPassVecInterface_job_done, i);
+    
+    // set state
+    i->state = PPVI_STATE_NONE;
+    
+    DebugObject_Init(&i->d_obj);
+}
+
+void PacketPassVecInterface_Free (PacketPassVecInterface *i)
+{
+    DebugObject_Free(&i->d_obj);
+    
+    // free jobs
+    BPending_Free(&i->job_done);
+    BPending_Free(&i->job_operation);
+}
+
+void PacketPassVecInterface_Done (PacketPassVecInterface *i)
+{
+    ASSERT(i->state == PPVI_STATE_BUSY)
+    DebugObject_Access(&i->d_obj);
+    
+    // schedule done
+    BPending_Set(&i->job_done);
+    
+    // set state
+    i->state = PPVI_STATE_DONE_PENDING;
+}
+
+int PacketPassVecInterface_GetMTU (PacketPassVecInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return i->mtu;
+}
+
+int PacketPassVecInterface_GetMaxSegs (PacketPassVecInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return i->max_segs;
+}
+
+void PacketPassVecInterface_Sender_Init (PacketPassVecInterface *i, PacketPassVecInterface_handler_done handler_done, void *user)
+{
+    ASSERT(handler_done)
+    ASSERT(!i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    i->handler_done = handler_done;
+    i->user_user = user;
+}
+
+void PacketPassVecInterface_Sender_Send (PacketPassVecInterface *i, PacketVecSeg *segs, int num_segs)
+{
+    ASSERT(num_segs >= 0)
+    ASSERT(num_segs <= i->max_segs)
+    ASSERT(!(num_segs > 0) || segs)
+    ASSERT(PacketVecSeg_TotalLen(segs, num_segs) <= i->mtu)
+    ASSERT(i->state == PPVI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    // schedule operation
+    i->job_operation_segs = segs;
+    i->job_operation_num_segs = num_segs;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = PPVI_STATE_OPERATION_PENDING;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file PacketPassVecWrapper.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object which passes packets from a {@link PacketPassInterface} to a
+ * {@link PacketPassVecInterface}, as packets of a single segment.
+ */
+
+#ifndef BADVPN_FLOW_PACKETPASSVECWRAPPER_H
+#define BADVPN_FLOW_PACKETPASSVECWRAPPER_H
+
+#include <base/DebugObject.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketPassVecInterface.h>
+
+/**
+ * Object which passes packets from a {@link PacketPassInterface} to a
+ * {@link PacketPassVecInterface}, as packets of a single segment.
+ * The data is not copied.
+ * 
+ * Input is with {@link PacketPassInterface}.
+ * Output is with {@link PacketPassVecInterface}.
+ */
+typedef struct {
+    PacketPassInterface input;
+    PacketPassVecInterface *output;
+    PacketVecSeg seg;
+    DebugObject d_obj;
+} PacketPassVecWrapper;
+
+/**
+ * Initializes the object.
+ * 
+ * @param o the object
+ * @param output output interface
+ * @param pg pending group
+ */
+void PacketPassVecWrapper_Init (PacketPassVecWrapper *o, PacketPassVecInterface *output, BPendingGroup *pg);
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void PacketPassVecWrapper_Free (PacketPassVecWrapper *o);
+
+/**
+ * Returns the input interface.
+ * The MTU of the interface will be the same as of the output interface.
+ * 
+ * @param o the object
+ * @return input interface
+ */
+PacketPassInterface * PacketPassVecWrapper_GetInput (PacketPassVecWrapper *o);
+
+#endif
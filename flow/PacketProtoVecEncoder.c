@@ -0,0 +1,92 @@
+/**
+ * @file PacketProtoVecEncoder.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/minmax.h>
+
+#include <flow/PacketProtoVecEncoder.h>
+
+static void input_handler_send (PacketProtoVecEncoder *o, PacketVecSeg *segs, int num_segs)
+{
+    ASSERT(num_segs < PacketPassVecInterface_GetMaxSegs(o->output))
+    DebugObject_Access(&o->d_obj);
+    
+    // write header
+    o->header.len = htol16(PacketVecSeg_TotalLen(segs, num_segs));
+    o->segs[0].data = (uint8_t *)&o->header;
+    o->segs[0].len = sizeof(o->header);
+    
+    // pass the packet behind it
+    memcpy(o->segs + 1, segs, num_segs * sizeof(segs[0]));
+    
+    PacketPassVecInterface_Sender_Send(o->output, o->segs, 1 + num_segs);
+}
+
+static void output_handler_done (PacketProtoVecEncoder *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    PacketPassVecInterface_Done(&o->input);
+}
+
+void PacketProtoVecEncoder_Init (PacketProtoVecEncoder *o, PacketPassVecInterface *output, BPendingGroup *pg)
+{
+    ASSERT(PacketPassVecInterface_GetMTU(output) >= sizeof(struct packetproto_header))
+    ASSERT(PacketPassVecInterface_GetMaxSegs(output) >= 2)
+    
+    // init arguments
+    o->output = output;
+    
+    // init input
+    int mtu = bmin_int(PacketPassVecInterface_GetMTU(o->output) - sizeof(struct packetproto_header), PACKETPROTO_MAXPAYLOAD);
+    PacketPassVecInterface_Init(&o->input, mtu, PacketPassVecInterface_GetMaxSegs(o->output) - 1, (PacketPassVecInterface_handler_send)input_handler_send, o, pg);
+    
+    // init output
+    PacketPassVecInterface_Sender_Init(o->output, (PacketPassVecInterface_handler_done)output_handler_done, o);
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void PacketProtoVecEncoder_Free (PacketProtoVecEncoder *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free input
+    PacketPassVecInterface_Free(&o->input);
+}
+
+PacketPassVecInterface * PacketProtoVecEncoder_GetInput (PacketProtoVecEncoder *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->input;
+}
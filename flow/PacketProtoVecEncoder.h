@@ -0,0 +1,87 @@
+/**
+ * @file PacketProtoVecEncoder.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object which encodes packets according to PacketProto, passing the header
+ * as a separate segment in front of the packet.
+ */
+
+#ifndef BADVPN_FLOW_PACKETPROTOVECENCODER_H
+#define BADVPN_FLOW_PACKETPROTOVECENCODER_H
+
+#include <stdint.h>
+
+#include <protocol/packetproto.h>
+#include <base/DebugObject.h>
+#include <flow/PacketPassVecInterface.h>
+
+/**
+ * Object which encodes packets according to PacketProto, passing the header
+ * as a separate segment in front of the packet. The packet is not copied.
+ * 
+ * Input is with {@link PacketPassVecInterface}.
+ * Output is with {@link PacketPassVecInterface}.
+ */
+typedef struct {
+    PacketPassVecInterface input;
+    PacketPassVecInterface *output;
+    struct packetproto_header header;
+    PacketVecSeg segs[PACKETVEC_MAX_SEGS];
+    DebugObject d_obj;
+} PacketProtoVecEncoder;
+
+/**
+ * Initializes the object.
+ * 
+ * @param o the object
+ * @param output output interface. Its MTU must be >=sizeof(struct packetproto_header),
+ *               and its maximum number of segments must be >=2.
+ * @param pg pending group
+ */
+void PacketProtoVecEncoder_Init (PacketProtoVecEncoder *o, PacketPassVecInterface *output, BPendingGroup *pg);
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void PacketProtoVecEncoder_Free (PacketProtoVecEncoder *o);
+
+/**
+ * Returns the input interface.
+ * The MTU of the interface will be the MTU of the output interface minus
+ * sizeof(struct packetproto_header), but no more than PACKETPROTO_MAXPAYLOAD.
+ * The maximum number of segments will be one less than that of the output interface.
+ * 
+ * @param o the object
+ * @return input interface
+ */
+PacketPassVecInterface * PacketProtoVecEncoder_GetInput (PacketProtoVecEncoder *o);
+
+#endif
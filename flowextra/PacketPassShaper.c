@@ -0,0 +1,215 @@
+/**
+ * @file PacketPassShaper.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <misc/debug.h>
+
+#include "PacketPassShaper.h"
+
+// tokens are counted in thousandths of a byte, which is what a rate
+// in bytes per second gives in a millisecond
+#define TOKENS_PER_BYTE 1000
+
+static void refill (PacketPassShaper *o)
+{
+    ASSERT(o->rate > 0)
+    
+    btime_t now = btime_gettime();
+    
+    if (now > o->last_time) {
+        uint64_t max_tokens = (uint64_t)o->burst * TOKENS_PER_BYTE;
+        uint64_t missing = max_tokens - o->tokens;
+        uint64_t elapsed = now - o->last_time;
+        
+        // don't multiply if the bucket fills anyway, it could overflow
+        if (elapsed > missing / o->rate) {
+            o->tokens = max_tokens;
+        } else {
+            o->tokens += elapsed * o->rate;
+        }
+    }
+    
+    o->last_time = now;
+}
+
+static void try_send (PacketPassShaper *o)
+{
+    ASSERT(o->holding)
+    ASSERT(!BTimer_IsRunning(&o->timer))
+    
+    if (o->rate > 0) {
+        uint64_t cost = (uint64_t)o->held_len * TOKENS_PER_BYTE;
+        
+        refill(o);
+        
+        // wait until the bucket has enough for the packet
+        if (o->tokens < cost) {
+            BReactor_SetTimerAfter(o->reactor, &o->timer, (cost - o->tokens + o->rate - 1) / o->rate);
+            return;
+        }
+        
+        o->tokens -= cost;
+    }
+    
+    // no longer holding
+    o->holding = 0;
+    
+    // schedule send
+    PacketPassInterface_Sender_Send(o->output, o->held_data, o->held_len);
+}
+
+static void input_handler_send (PacketPassShaper *o, uint8_t *data, int data_len)
+{
+    ASSERT(!o->holding)
+    DebugObject_Access(&o->d_obj);
+    
+    // hold packet
+    o->holding = 1;
+    o->held_data = data;
+    o->held_len = data_len;
+    
+    // send if the bucket allows
+    try_send(o);
+}
+
+static void input_handler_requestcancel (PacketPassShaper *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // a held packet is ours to drop
+    if (o->holding) {
+        BReactor_RemoveTimer(o->reactor, &o->timer);
+        o->holding = 0;
+        PacketPassInterface_Done(&o->input);
+        return;
+    }
+    
+    // request cancel
+    PacketPassInterface_Sender_RequestCancel(o->output);
+}
+
+static void output_handler_done (PacketPassShaper *o)
+{
+    ASSERT(!o->holding)
+    DebugObject_Access(&o->d_obj);
+    
+    // call done
+    PacketPassInterface_Done(&o->input);
+}
+
+static void timer_handler (PacketPassShaper *o)
+{
+    ASSERT(o->holding)
+    DebugObject_Access(&o->d_obj);
+    
+    // bucket should have filled enough by now
+    try_send(o);
+}
+
+void PacketPassShaper_Init (PacketPassShaper *o, PacketPassInterface *output, BReactor *reactor, uint64_t rate, int burst)
+{
+    ASSERT(rate <= PACKETPASSSHAPER_MAX_RATE)
+    ASSERT(rate == 0 || burst >= PacketPassInterface_GetMTU(output))
+    
+    // init arguments
+    o->output = output;
+    o->reactor = reactor;
+    o->rate = rate;
+    o->burst = burst;
+    
+    // start with a full bucket
+    o->tokens = (rate > 0 ? (uint64_t)burst * TOKENS_PER_BYTE : 0);
+    o->last_time = btime_gettime();
+    
+    // not holding
+    o->holding = 0;
+    
+    // init input
+    PacketPassInterface_Init(&o->input, PacketPassInterface_GetMTU(o->output), (PacketPassInterface_handler_send)input_handler_send, o, BReactor_PendingGroup(o->reactor));
+    if (PacketPassInterface_HasCancel(o->output)) {
+        PacketPassInterface_EnableCancel(&o->input, (PacketPassInterface_handler_requestcancel)input_handler_requestcancel);
+    }
+    
+    // init output
+    PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
+    
+    // init timer
+    BTimer_Init(&o->timer, 0, (BTimer_handler)timer_handler, o);
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void PacketPassShaper_Free (PacketPassShaper *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free timer
+    BReactor_RemoveTimer(o->reactor, &o->timer);
+    
+    // free input
+    PacketPassInterface_Free(&o->input);
+}
+
+PacketPassInterface * PacketPassShaper_GetInput (PacketPassShaper *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->input;
+}
+
+void PacketPassShaper_SetRate (PacketPassShaper *o, uint64_t rate, int burst)
+{
+    ASSERT(rate <= PACKETPASSSHAPER_MAX_RATE)
+    ASSERT(rate == 0 || burst >= PacketPassInterface_GetMTU(o->output))
+    DebugObject_Access(&o->d_obj);
+    
+    // account for the time with the old rate
+    if (o->rate > 0) {
+        refill(o);
+    } else {
+        o->tokens = (uint64_t)burst * TOKENS_PER_BYTE;
+        o->last_time = btime_gettime();
+    }
+    
+    // set new rate
+    o->rate = rate;
+    o->burst = burst;
+    
+    if (rate > 0) {
+        uint64_t max_tokens = (uint64_t)burst * TOKENS_PER_BYTE;
+        if (o->tokens > max_tokens) {
+            o->tokens = max_tokens;
+        }
+    }
+    
+    // reconsider a held packet with the new rate
+    if (o->holding) {
+        BReactor_RemoveTimer(o->reactor, &o->timer);
+        try_send(o);
+    }
+}
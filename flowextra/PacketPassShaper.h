@@ -0,0 +1,116 @@
+/**
+ * @file PacketPassShaper.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * A {@link PacketPassInterface} layer which limits the data rate with a token bucket.
+ */
+
+#ifndef BADVPN_PACKETPASSSHAPER_H
+#define BADVPN_PACKETPASSSHAPER_H
+
+#include <stdint.h>
+
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+
+#define PACKETPASSSHAPER_MAX_RATE 1000000000000ULL
+
+/**
+ * A {@link PacketPassInterface} layer which limits the data rate with a token bucket.
+ * 
+ * The bucket fills with rate bytes per second, up to burst bytes. A packet is
+ * passed to the output when the bucket holds at least as many bytes as the packet
+ * is long, and that many bytes are taken from the bucket; until then, the packet
+ * is held. This can be put in front of a flow of a queue, e.g.
+ * {@link PacketPassDRRQueue}, to limit the rate of that flow. A held packet does
+ * not make the queue flow busy.
+ */
+typedef struct {
+    PacketPassInterface *output;
+    BReactor *reactor;
+    uint64_t rate;
+    int burst;
+    uint64_t tokens;
+    btime_t last_time;
+    int holding;
+    uint8_t *held_data;
+    int held_len;
+    PacketPassInterface input;
+    BTimer timer;
+    DebugObject d_obj;
+} PacketPassShaper;
+
+/**
+ * Initializes the object.
+ * The bucket starts full.
+ *
+ * @param o the object
+ * @param output output interface
+ * @param reactor reactor we live in
+ * @param rate rate limit in bytes per second, or 0 for no limit.
+ *             Must be <=PACKETPASSSHAPER_MAX_RATE.
+ * @param burst capacity of the bucket in bytes. If rate is not 0, must be at
+ *              least the MTU of the output, so that any packet can pass.
+ */
+void PacketPassShaper_Init (PacketPassShaper *o, PacketPassInterface *output, BReactor *reactor, uint64_t rate, int burst);
+
+/**
+ * Frees the object.
+ * A held packet is dropped.
+ *
+ * @param o the object
+ */
+void PacketPassShaper_Free (PacketPassShaper *o);
+
+/**
+ * Returns the input interface.
+ * The MTU of the interface will be the same as of the output interface.
+ * The interface supports cancel functionality if the output interface supports it.
+ *
+ * @param o the object
+ * @return input interface
+ */
+PacketPassInterface * PacketPassShaper_GetInput (PacketPassShaper *o);
+
+/**
+ * Changes the rate limit.
+ * The bucket keeps its bytes, up to the new capacity. If there was no
+ * limit before, the bucket starts full.
+ *
+ * @param o the object
+ * @param rate rate limit in bytes per second, or 0 for no limit.
+ *             Must be <=PACKETPASSSHAPER_MAX_RATE.
+ * @param burst capacity of the bucket in bytes. If rate is not 0, must be at
+ *              least the MTU of the output.
+ */
+void PacketPassShaper_SetRate (PacketPassShaper *o, uint64_t rate, int burst);
+
+#endif
@@ -146,4 +146,8 @@
 #define BLOG_CHANNEL_ncd_load_module 145
 #define BLOG_CHANNEL_ncd_basic_functions 146
 #define BLOG_CHANNEL_ncd_objref 147
-#define BLOG_NUM_CHANNELS 148
+#define BLOG_CHANNEL_BReactorMailbox 148
+#define BLOG_CHANNEL_BReactorGroup 149
+#define BLOG_CHANNEL_SPProtoEncoder 150
+#define BLOG_CHANNEL_BWorkerProcesses 151
+#define BLOG_NUM_CHANNELS 152
@@ -146,3 +146,7 @@
 {"ncd_load_module", 4},
 {"ncd_basic_functions", 4},
 {"ncd_objref", 4},
+{"BReactorMailbox", 4},
+{"BReactorGroup", 4},
+{"SPProtoEncoder", 4},
+{"BWorkerProcesses", 4},
@@ -52,6 +52,11 @@
  *     bytes as needed to align to block size,
  *   - the padded plaintext is encrypted, and
  *   - the initialization vector (IV) is prepended.
+ * 
+ * If AEAD encryption is used instead, hashes are not used, and:
+ *   - the plaintext is encrypted with no padding,
+ *   - the nonce is prepended, and
+ *   - the authentication tag is appended.
  */
 
 #ifndef BADVPN_PROTOCOL_SPPROTO_H
@@ -65,11 +70,13 @@
 #include <misc/packed.h>
 #include <security/BHash.h>
 #include <security/BEncryption.h>
+#include <security/BAead.h>
 #include <security/OTPCalculator.h>
 
 #define SPPROTO_HASH_MODE_NONE 0
 #define SPPROTO_ENCRYPTION_MODE_NONE 0
 #define SPPROTO_OTP_MODE_NONE 0
+#define SPPROTO_AEAD_MODE_NONE 0
 
 /**
  * Stores security parameters for SPProto.
@@ -101,6 +108,15 @@ struct spproto_security_params {
      * OTPs generated from a single seed.
      */
     int otp_num;
+    
+    /**
+     * AEAD encryption mode.
+     * Either SPPROTO_AEAD_MODE_NONE for no AEAD encryption, or a valid
+     * {@link BAead} cipher. If not SPPROTO_AEAD_MODE_NONE, hash_mode and
+     * encryption_mode must be none, as the AEAD cipher both encrypts
+     * and authenticates packets.
+     */
+    int aead_mode;
 };
 
 #define SPPROTO_HAVE_HASH(_params) ((_params).hash_mode != SPPROTO_HASH_MODE_NONE)
@@ -114,6 +130,20 @@ struct spproto_security_params {
 
 #define SPPROTO_HAVE_OTP(_params) ((_params).otp_mode != SPPROTO_OTP_MODE_NONE)
 
+#define SPPROTO_HAVE_AEAD(_params) ((_params).aead_mode != SPPROTO_AEAD_MODE_NONE)
+
+// whether a key needs to be agreed on, either for encryption or AEAD encryption
+#define SPPROTO_HAVE_ENCRYPTION_KEY(_params) (SPPROTO_HAVE_ENCRYPTION(_params) || SPPROTO_HAVE_AEAD(_params))
+#define SPPROTO_ENCRYPTION_KEY_SIZE(_params) ( \
+    SPPROTO_HAVE_AEAD(_params) ? \
+    BAead_cipher_key_size((_params).aead_mode) : \
+    BEncryption_cipher_key_size((_params).encryption_mode) \
+)
+#define SPPROTO_MAX_ENCRYPTION_KEY_SIZE \
+    (BENCRYPTION_MAX_KEY_SIZE > BAEAD_MAX_KEY_SIZE ? BENCRYPTION_MAX_KEY_SIZE : BAEAD_MAX_KEY_SIZE)
+
+#define SPPROTO_AEAD_OVERHEAD (BAEAD_NONCE_SIZE + BAEAD_TAG_SIZE)
+
 B_START_PACKED
 struct spproto_otpdata {
     uint16_t seed_id;
@@ -138,6 +168,9 @@ static void spproto_assert_security_params (struct spproto_security_params param
     ASSERT(params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE || BEncryption_cipher_valid(params.encryption_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || BEncryption_cipher_valid(params.otp_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || params.otp_num > 0)
+    ASSERT(params.aead_mode == SPPROTO_AEAD_MODE_NONE || BAead_cipher_valid(params.aead_mode))
+    ASSERT(params.aead_mode == SPPROTO_AEAD_MODE_NONE || params.hash_mode == SPPROTO_HASH_MODE_NONE)
+    ASSERT(params.aead_mode == SPPROTO_AEAD_MODE_NONE || params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE)
 }
 
 /**
@@ -154,6 +187,10 @@ static int spproto_payload_mtu_for_carrier_mtu (struct spproto_security_params p
     spproto_assert_security_params(params);
     ASSERT(carrier_mtu >= 0)
     
+    if (SPPROTO_HAVE_AEAD(params)) {
+        return (carrier_mtu - SPPROTO_AEAD_OVERHEAD - SPPROTO_HEADER_LEN(params));
+    }
+    
     if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         return (carrier_mtu - SPPROTO_HEADER_LEN(params));
     } else {
@@ -175,6 +212,14 @@ static int spproto_carrier_mtu_for_payload_mtu (struct spproto_security_params p
     spproto_assert_security_params(params);
     ASSERT(payload_mtu >= 0)
     
+    if (SPPROTO_HAVE_AEAD(params)) {
+        if (payload_mtu > INT_MAX - (SPPROTO_AEAD_OVERHEAD + SPPROTO_HEADER_LEN(params))) {
+            return -1;
+        }
+        
+        return (SPPROTO_AEAD_OVERHEAD + SPPROTO_HEADER_LEN(params) + payload_mtu);
+    }
+    
     if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         if (payload_mtu > INT_MAX - SPPROTO_HEADER_LEN(params)) {
             return -1;
@@ -0,0 +1,139 @@
+/**
+ * @file BHash.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Authenticated encryption (AEAD) abstraction.
+ */
+
+#ifndef BADVPN_SECURITY_BAEAD_H
+#define BADVPN_SECURITY_BAEAD_H
+
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+
+#define BAEAD_MODE_ENCRYPT 1
+#define BAEAD_MODE_DECRYPT 2
+
+#define BAEAD_NONCE_SIZE 12
+#define BAEAD_TAG_SIZE 16
+
+#define BAEAD_MAX_KEY_SIZE 32
+
+#define BAEAD_CIPHER_AES_128_GCM 1
+#define BAEAD_CIPHER_AES_128_GCM_KEY_SIZE 16
+
+#define BAEAD_CIPHER_CHACHA20_POLY1305 2
+#define BAEAD_CIPHER_CHACHA20_POLY1305_KEY_SIZE 32
+
+// NOTE: update the maximum above when adding a cipher!
+
+/**
+ * Authenticated encryption (AEAD) abstraction.
+ * 
+ * The key is expanded once on initialization; each operation only
+ * supplies a new nonce. The object keeps per-operation state, so it must
+ * not be used from more than one thread at the same time.
+ */
+typedef struct {
+    int mode;
+    int cipher;
+    EVP_CIPHER_CTX *ctx;
+    DebugObject d_obj;
+} BAead;
+
+/**
+ * Checks if the given cipher number is valid.
+ * 
+ * @param cipher cipher number
+ * @return 1 if valid, 0 if not
+ */
+int BAead_cipher_valid (int cipher);
+
+/**
+ * Returns the key size of a cipher.
+ * 
+ * @param cipher cipher number. Must be valid.
+ * @return key size in bytes
+ */
+int BAead_cipher_key_size (int cipher);
+
+/**
+ * Initializes the object.
+ * {@link BSecurity_GlobalInitThreadSafe} must have been done if this object
+ * will be used from a non-main thread.
+ * 
+ * @param o the object
+ * @param mode whether encryption or decryption is to be done.
+ *             Must be either BAEAD_MODE_ENCRYPT or BAEAD_MODE_DECRYPT.
+ * @param cipher cipher number. Must be valid.
+ * @param key encryption key
+ * @return 1 on success, 0 on failure
+ */
+int BAead_Init (BAead *o, int mode, int cipher, uint8_t *key) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void BAead_Free (BAead *o);
+
+/**
+ * Encrypts and authenticates data.
+ * The object must have been initialized with BAEAD_MODE_ENCRYPT.
+ * 
+ * @param o the object
+ * @param nonce nonce, BAEAD_NONCE_SIZE bytes. Must never be repeated with the same key.
+ * @param in data to encrypt
+ * @param out ciphertext output, of the same length as the input. May be equal to in.
+ * @param len number of bytes to encrypt. Must be >=0.
+ * @param tag authentication tag output, BAEAD_TAG_SIZE bytes
+ */
+void BAead_Encrypt (BAead *o, const uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag);
+
+/**
+ * Verifies and decrypts data.
+ * The object must have been initialized with BAEAD_MODE_DECRYPT.
+ * 
+ * @param o the object
+ * @param nonce nonce, BAEAD_NONCE_SIZE bytes
+ * @param in data to decrypt
+ * @param out plaintext output, of the same length as the input. May be equal to in.
+ *            If verification fails, its contents are undefined.
+ * @param len number of bytes to decrypt. Must be >=0.
+ * @param tag authentication tag, BAEAD_TAG_SIZE bytes
+ * @return 1 if the data is authentic, 0 if not
+ */
+int BAead_Decrypt (BAead *o, const uint8_t *nonce, uint8_t *in, uint8_t *out, int len, const uint8_t *tag) WARN_UNUSED;
+
+#endif
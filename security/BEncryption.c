@@ -33,6 +33,96 @@
 
 #include <generated/blog_channel_BEncryption.h>
 
+static EVP_CIPHER_CTX * new_evp_ctx (const EVP_CIPHER *evp_cipher, uint8_t *key, int encrypt)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        goto fail0;
+    }
+    
+    // set cipher and key; the IV is given with each operation
+    if (!EVP_CipherInit_ex(ctx, evp_cipher, NULL, key, NULL, encrypt)) {
+        goto fail1;
+    }
+    
+    // lengths are always a multiple of block size
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    
+    return ctx;
+    
+fail1:
+    EVP_CIPHER_CTX_free(ctx);
+fail0:
+    return NULL;
+}
+
+static int init_evp (BEncryption *enc, const EVP_CIPHER *evp_cipher, uint8_t *key)
+{
+    enc->evp.encrypt = NULL;
+    enc->evp.decrypt = NULL;
+    
+    if (enc->mode&BENCRYPTION_MODE_ENCRYPT) {
+        if (!(enc->evp.encrypt = new_evp_ctx(evp_cipher, key, 1))) {
+            goto fail0;
+        }
+    }
+    
+    if (enc->mode&BENCRYPTION_MODE_DECRYPT) {
+        if (!(enc->evp.decrypt = new_evp_ctx(evp_cipher, key, 0))) {
+            goto fail1;
+        }
+    }
+    
+    return 1;
+    
+fail1:
+    if (enc->evp.encrypt) {
+        EVP_CIPHER_CTX_free(enc->evp.encrypt);
+    }
+fail0:
+    return 0;
+}
+
+static void free_evp (BEncryption *enc)
+{
+    if (enc->evp.decrypt) {
+        EVP_CIPHER_CTX_free(enc->evp.decrypt);
+    }
+    if (enc->evp.encrypt) {
+        EVP_CIPHER_CTX_free(enc->evp.encrypt);
+    }
+}
+
+static void set_evp_key (EVP_CIPHER_CTX *ctx, uint8_t *key)
+{
+    if (ctx) {
+        ASSERT_FORCE(EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, -1))
+    }
+}
+
+static void evp_crypt (BEncryption *enc, EVP_CIPHER_CTX *ctx, int encrypt, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
+{
+    if (len == 0) {
+        return;
+    }
+    
+    int block_size = BEncryption_cipher_block_size(enc->cipher);
+    
+    // With CBC, the next IV is the last ciphertext block. When decrypting,
+    // save it before it may be overwritten.
+    uint8_t next_iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    if (!encrypt) {
+        memcpy(next_iv, in + len - block_size, block_size);
+    }
+    
+    int out_len;
+    ASSERT_FORCE(EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+    ASSERT_FORCE(EVP_CipherUpdate(ctx, out, &out_len, in, len))
+    ASSERT(out_len == len)
+    
+    memcpy(iv, (encrypt ? out + len - block_size : next_iv), block_size);
+}
+
 int BEncryption_cipher_valid (int cipher)
 {
     switch (cipher) {
@@ -70,7 +160,7 @@ int BEncryption_cipher_key_size (int cipher)
     }
 }
 
-void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
+int BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
 {
     ASSERT(!(mode&~(BENCRYPTION_MODE_ENCRYPT|BENCRYPTION_MODE_DECRYPT)))
     ASSERT((mode&BENCRYPTION_MODE_ENCRYPT) || (mode&BENCRYPTION_MODE_DECRYPT))
@@ -111,7 +201,8 @@ void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
     enc->cryptodev.ses = sess.ses;
     enc->use_cryptodev = 1;
     
-    goto success;
+    DebugObject_Init(&enc->d_obj);
+    return 1;
     
 fail3:
     ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
@@ -123,20 +214,16 @@ fail1:
     
     #endif
     
-    int res;
-    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
+            // Blowfish gains nothing from EVP, and newer OpenSSL versions
+            // only provide it there with the legacy provider loaded
             BF_set_key(&enc->blowfish, BENCRYPTION_CIPHER_BLOWFISH_KEY_SIZE, key);
             break;
         case BENCRYPTION_CIPHER_AES:
-            if (enc->mode&BENCRYPTION_MODE_ENCRYPT) {
-                res = AES_set_encrypt_key(key, 128, &enc->aes.encrypt);
-                ASSERT_EXECUTE(res >= 0)
-            }
-            if (enc->mode&BENCRYPTION_MODE_DECRYPT) {
-                res = AES_set_decrypt_key(key, 128, &enc->aes.decrypt);
-                ASSERT_EXECUTE(res >= 0)
+            if (!init_evp(enc, EVP_aes_128_cbc(), key)) {
+                BLog(BLOG_ERROR, "failed to initialize EVP cipher contexts");
+                return 0;
             }
             break;
         default:
@@ -144,11 +231,10 @@ fail1:
             ;
     }
     
-    #ifdef BADVPN_USE_CRYPTODEV
-success:
-    #endif
     // init debug object
     DebugObject_Init(&enc->d_obj);
+    
+    return 1;
 }
 
 void BEncryption_Free (BEncryption *enc)
@@ -162,9 +248,49 @@ void BEncryption_Free (BEncryption *enc)
         ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
         ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
         ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+        return;
     }
     
     #endif
+    
+    if (enc->cipher == BENCRYPTION_CIPHER_AES) {
+        free_evp(enc);
+    }
+}
+
+void BEncryption_SetKey (BEncryption *enc, uint8_t *key)
+{
+    DebugObject_Access(&enc->d_obj);
+    
+    #ifdef BADVPN_USE_CRYPTODEV
+    
+    if (enc->use_cryptodev) {
+        ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
+        
+        struct session_op sess;
+        memset(&sess, 0, sizeof(sess));
+        sess.cipher = enc->cryptodev.cipher;
+        sess.keylen = BEncryption_cipher_key_size(enc->cipher);
+        sess.key = key;
+        ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCGSESSION, &sess) == 0)
+        
+        enc->cryptodev.ses = sess.ses;
+        return;
+    }
+    
+    #endif
+    
+    switch (enc->cipher) {
+        case BENCRYPTION_CIPHER_BLOWFISH:
+            BF_set_key(&enc->blowfish, BENCRYPTION_CIPHER_BLOWFISH_KEY_SIZE, key);
+            break;
+        case BENCRYPTION_CIPHER_AES:
+            set_evp_key(enc->evp.encrypt, key);
+            set_evp_key(enc->evp.decrypt, key);
+            break;
+        default:
+            ASSERT(0);
+    }
 }
 
 void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
@@ -196,7 +322,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_ENCRYPT);
             break;
         case BENCRYPTION_CIPHER_AES:
-            AES_cbc_encrypt(in, out, len, &enc->aes.encrypt, iv, AES_ENCRYPT);
+            evp_crypt(enc, enc->evp.encrypt, 1, in, out, len, iv);
             break;
         default:
             ASSERT(0);
@@ -232,7 +358,7 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_DECRYPT);
             break;
         case BENCRYPTION_CIPHER_AES:
-            AES_cbc_encrypt(in, out, len, &enc->aes.decrypt, iv, AES_DECRYPT);
+            evp_crypt(enc, enc->evp.decrypt, 0, in, out, len, iv);
             break;
         default:
             ASSERT(0);
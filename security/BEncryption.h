@@ -49,7 +49,7 @@
 #endif
 
 #include <openssl/blowfish.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -72,6 +72,12 @@
 
 /**
  * Block cipher encryption abstraction.
+ * 
+ * AES goes through OpenSSL EVP contexts, which are keyed on initialization
+ * and use hardware acceleration where available. Blowfish uses the low-level
+ * cipher functions.
+ * The EVP contexts keep per-operation state, so the object must not be
+ * used from more than one thread at the same time.
  */
 typedef struct {
     DebugObject d_obj;
@@ -83,9 +89,9 @@ typedef struct {
     union {
         BF_KEY blowfish;
         struct {
-            AES_KEY encrypt;
-            AES_KEY decrypt;
-        } aes;
+            EVP_CIPHER_CTX *encrypt;
+            EVP_CIPHER_CTX *decrypt;
+        } evp;
         #ifdef BADVPN_USE_CRYPTODEV
         struct {
             int fd;
@@ -132,8 +138,9 @@ int BEncryption_cipher_key_size (int cipher);
  *             and BENCRYPTION_MODE_DECRYPT.
  * @param cipher cipher number. Must be valid.
  * @param key encryption key
+ * @return 1 on success, 0 on failure
  */
-void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key);
+int BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -142,6 +149,15 @@ void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key);
  */
 void BEncryption_Free (BEncryption *enc);
 
+/**
+ * Changes the encryption key.
+ * Unlike initializing a new object, this does not allocate anything.
+ * 
+ * @param enc the object
+ * @param key new encryption key
+ */
+void BEncryption_SetKey (BEncryption *enc, uint8_t *key);
+
 /**
  * Encrypts data.
  * The object must have been initialized with mode including
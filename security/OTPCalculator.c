@@ -51,16 +51,34 @@ int OTPCalculator_Init (OTPCalculator *calc, int num_otps, int cipher)
     }
     calc->num_blocks = bdivide_up(calc->num_otps * sizeof(otp_t), calc->block_size);
     
+    // blocks are encrypted in one call
+    if (calc->num_blocks > INT_MAX / calc->block_size) {
+        goto fail0;
+    }
+    
     // allocate buffer
     if (!(calc->data = (otp_t *)BAllocArray(calc->num_blocks, calc->block_size))) {
         goto fail0;
     }
     
+    // init encryptor; it is given the key of each generation when it starts,
+    // so that generating cannot fail
+    uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+    memset(key, 0, sizeof(key));
+    if (!BEncryption_Init(&calc->gen_encryptor, BENCRYPTION_MODE_ENCRYPT, calc->cipher, key)) {
+        goto fail1;
+    }
+    
+    // not generating
+    calc->gen_have = 0;
+    
     // init debug object
     DebugObject_Init(&calc->d_obj);
     
     return 1;
     
+fail1:
+    BFree(calc->data);
 fail0:
     return 0;
 }
@@ -70,6 +88,9 @@ void OTPCalculator_Free (OTPCalculator *calc)
     // free debug object
     DebugObject_Free(&calc->d_obj);
     
+    // free encryptor
+    BEncryption_Free(&calc->gen_encryptor);
+    
     // free buffer
     BFree(calc->data);
 }
@@ -77,27 +98,14 @@ void OTPCalculator_Free (OTPCalculator *calc)
 otp_t * OTPCalculator_Generate (OTPCalculator *calc, uint8_t *key, uint8_t *iv, int shuffle)
 {
     ASSERT(shuffle == 0 || shuffle == 1)
+    DebugObject_Access(&calc->d_obj);
     
-    // copy IV so it can be updated
-    uint8_t iv_work[BENCRYPTION_MAX_BLOCK_SIZE];
-    memcpy(iv_work, iv, calc->block_size);
-    
-    // create zero block
-    uint8_t zero[BENCRYPTION_MAX_BLOCK_SIZE];
-    memset(zero, 0, calc->block_size);
-    
-    // init encryptor
-    BEncryption encryptor;
-    BEncryption_Init(&encryptor, BENCRYPTION_MODE_ENCRYPT, calc->cipher, key);
-    
-    // encrypt zero blocks
-    for (size_t i = 0; i < calc->num_blocks; i++) {
-        BEncryption_Encrypt(&encryptor, zero, (uint8_t *)calc->data + i * calc->block_size, calc->block_size, iv_work);
+    // generate all OTPs in one pass
+    OTPCalculator_Start(calc, key, iv);
+    if (calc->num_otps > 0) {
+        OTPCalculator_Continue(calc, calc->num_otps);
     }
     
-    // free encryptor
-    BEncryption_Free(&encryptor);
-    
     // shuffle if requested
     if (shuffle) {
         int i = 0;
@@ -116,3 +124,55 @@ otp_t * OTPCalculator_Generate (OTPCalculator *calc, uint8_t *key, uint8_t *iv,
     
     return calc->data;
 }
+
+void OTPCalculator_Start (OTPCalculator *calc, uint8_t *key, uint8_t *iv)
+{
+    DebugObject_Access(&calc->d_obj);
+    
+    // copy IV so it can be updated
+    memcpy(calc->gen_iv, iv, calc->block_size);
+    
+    // set key, abandoning any previous generation
+    BEncryption_SetKey(&calc->gen_encryptor, key);
+    
+    calc->gen_have = 1;
+    calc->gen_blocks = 0;
+}
+
+int OTPCalculator_Continue (OTPCalculator *calc, int max_otps)
+{
+    ASSERT(calc->gen_have)
+    ASSERT(calc->gen_blocks < calc->num_blocks)
+    ASSERT(max_otps > 0)
+    DebugObject_Access(&calc->d_obj);
+    
+    int otps_per_block = calc->block_size / sizeof(otp_t);
+    
+    // calculate blocks to generate
+    size_t blocks = bdivide_up(max_otps, otps_per_block);
+    if (blocks > calc->num_blocks - calc->gen_blocks) {
+        blocks = calc->num_blocks - calc->gen_blocks;
+    }
+    
+    // encrypt zero blocks in place; the IV is updated so that the
+    // next call continues the chain
+    uint8_t *data = (uint8_t *)calc->data + calc->gen_blocks * calc->block_size;
+    memset(data, 0, blocks * calc->block_size);
+    BEncryption_Encrypt(&calc->gen_encryptor, data, data, blocks * calc->block_size, calc->gen_iv);
+    calc->gen_blocks += blocks;
+    
+    // finished
+    if (calc->gen_blocks == calc->num_blocks) {
+        calc->gen_have = 0;
+        return calc->num_otps;
+    }
+    
+    return calc->gen_blocks * otps_per_block;
+}
+
+otp_t * OTPCalculator_Data (OTPCalculator *calc)
+{
+    DebugObject_Access(&calc->d_obj);
+    
+    return calc->data;
+}
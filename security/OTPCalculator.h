@@ -58,6 +58,10 @@ typedef struct {
     int block_size;
     size_t num_blocks;
     otp_t *data;
+    int gen_have;
+    size_t gen_blocks;
+    BEncryption gen_encryptor;
+    uint8_t gen_iv[BENCRYPTION_MAX_BLOCK_SIZE];
 } OTPCalculator;
 
 /**
@@ -93,4 +97,37 @@ void OTPCalculator_Free (OTPCalculator *calc);
  */
 otp_t * OTPCalculator_Generate (OTPCalculator *calc, uint8_t *key, uint8_t *iv, int shuffle);
 
+/**
+ * Starts generating OTPs from the given key and IV in parts, using
+ * {@link OTPCalculator_Continue}. The OTPs are the same as
+ * {@link OTPCalculator_Generate} gives without shuffling.
+ * Any generation in progress is abandoned.
+ *
+ * @param calc the object
+ * @param key encryption key
+ * @param iv initialization vector
+ */
+void OTPCalculator_Start (OTPCalculator *calc, uint8_t *key, uint8_t *iv);
+
+/**
+ * Generates more OTPs after {@link OTPCalculator_Start}.
+ * There must be a generation in progress, i.e. not all OTPs may have
+ * been generated since the last {@link OTPCalculator_Start}.
+ *
+ * @param calc the object
+ * @param max_otps maximum number of OTPs to generate. Must be >0.
+ * @return number of OTPs generated so far, at the start of the array
+ *         returned by {@link OTPCalculator_Data}. When this reaches the number
+ *         specified in {@link OTPCalculator_Init}, the generation is finished.
+ */
+int OTPCalculator_Continue (OTPCalculator *calc, int max_otps);
+
+/**
+ * Returns the array OTPs are generated into.
+ *
+ * @param calc the object
+ * @return pointer to an array of 32-bit OTPs
+ */
+otp_t * OTPCalculator_Data (OTPCalculator *calc);
+
 #endif
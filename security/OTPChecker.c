@@ -28,6 +28,8 @@
  */
 
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include <misc/balloc.h>
 
@@ -35,104 +37,139 @@
 
 static void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t);
 static void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp);
-static void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPCalculator *calc, uint8_t *key, uint8_t *iv);
 static int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp);
 
+static void bucket_compare (struct OTPChecker_bucket *b, otp_t otp, unsigned int *out_match, unsigned int *out_empty)
+{
+    // compare all entries without branching, so that the compiler can use
+    // vector compares and the time taken doesn't depend on where the OTP is
+    unsigned int match = 0;
+    unsigned int empty = 0;
+    for (int i = 0; i < OTPCHECKER_BUCKET_ENTRIES; i++) {
+        unsigned int used = (b->avail[i] >= 0);
+        match |= ((unsigned int)(b->otps[i] == otp) & used) << i;
+        empty |= (used ^ 1) << i;
+    }
+    
+    *out_match = match;
+    *out_empty = empty;
+}
+
 void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t)
 {
-    for (int i = 0; i < mc->num_entries; i++) {
-        t->entries[i].avail = -1;
+    for (int i = 0; i < mc->num_buckets; i++) {
+        for (int j = 0; j < OTPCHECKER_BUCKET_ENTRIES; j++) {
+            t->buckets[i].otps[j] = 0;
+            t->buckets[i].avail[j] = -1;
+        }
     }
 }
 
 void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    // calculate starting bucket
+    int start_index = otp % mc->num_buckets;
     
-    // try indexes starting with the base position
-    for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
-        struct OTPChecker_entry *entry = &t->entries[index];
+    // try buckets starting with the base position
+    for (int i = 0; i < mc->num_buckets; i++) {
+        struct OTPChecker_bucket *b = &t->buckets[bmodadd_int(start_index, i, mc->num_buckets)];
+        
+        unsigned int match;
+        unsigned int empty;
+        bucket_compare(b, otp, &match, &empty);
         
-        // if we find a free index, use it
-        if (entry->avail < 0) {
-            entry->otp = otp;
-            entry->avail = 1;
+        // if we find a used entry with the same OTP,
+        // use it by incrementing its count
+        if (match) {
+            b->avail[__builtin_ctz(match)]++;
             return;
         }
         
-        // if we find a used index with the same mac,
-        // use it by incrementing its count
-        if (entry->otp == otp) {
-            entry->avail++;
+        // if we find a free entry, use it; entries in a bucket
+        // are used in order, so the OTP is in no later bucket
+        if (empty) {
+            int j = __builtin_ctz(empty);
+            b->otps[j] = otp;
+            b->avail[j] = 1;
             return;
         }
     }
     
-    // will never add more macs than we can hold
+    // will never add more OTPs than we can hold
     ASSERT(0)
 }
 
-void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPCalculator *calc, uint8_t *key, uint8_t *iv)
-{
-    // calculate values
-    otp_t *otps = OTPCalculator_Generate(calc, key, iv, 0);
-    
-    // empty table
-    OTPChecker_Table_Empty(mc ,t);
-    
-    // add calculated values to table
-    for (int i = 0; i < mc->num_otps; i++) {
-        OTPChecker_Table_AddOTP(mc, t, otps[i]);
-    }
-}
-
 int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    // calculate starting bucket
+    int start_index = otp % mc->num_buckets;
     
-    // try indexes starting with the base position
-    for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
-        struct OTPChecker_entry *entry = &t->entries[index];
+    // try buckets starting with the base position
+    for (int i = 0; i < mc->num_buckets; i++) {
+        struct OTPChecker_bucket *b = &t->buckets[bmodadd_int(start_index, i, mc->num_buckets)];
         
-        // if we find an empty entry, there is no such mac
-        if (entry->avail < 0) {
-            return 0;
-        }
+        unsigned int match;
+        unsigned int empty;
+        bucket_compare(b, otp, &match, &empty);
         
         // if we find a matching entry, check its count
-        if (entry->otp == otp) {
-            if (entry->avail > 0) {
-                entry->avail--;
+        if (match) {
+            int j = __builtin_ctz(match);
+            if (b->avail[j] > 0) {
+                b->avail[j]--;
                 return 1;
             }
             return 0;
         }
+        
+        // if the bucket has a free entry, there is no such OTP
+        if (empty) {
+            return 0;
+        }
     }
     
-    // there are always empty slots
+    // there are always free entries
     ASSERT(0)
     return 0;
 }
 
 static void work_func (OTPChecker *mc)
 {
-    struct OTPChecker_table *table = &mc->tables[mc->next_table];
-    OTPChecker_Table_Generate(mc, table, &mc->calc, mc->tw_key, mc->tw_iv);
+    // the table being generated is not checked until the first chunk is added
+    if (mc->tw_num_added == 0) {
+        OTPChecker_Table_Empty(mc, &mc->tables[mc->next_table]);
+        OTPCalculator_Start(&mc->calc, mc->tw_key, mc->tw_iv);
+    }
+    
+    // generate a chunk of OTPs
+    mc->tw_num_generated = OTPCalculator_Continue(&mc->calc, OTPCHECKER_GENERATE_CHUNK);
 }
 
 static void work_done_handler (OTPChecker *mc)
 {
     ASSERT(mc->tw_have)
+    ASSERT(mc->tw_num_generated > mc->tw_num_added)
     DebugObject_Access(&mc->d_obj);
     
     // free work
     BThreadWork_Free(&mc->tw);
     mc->tw_have = 0;
     
+    // add generated OTPs to the table, making them recognized
+    struct OTPChecker_table *table = &mc->tables[mc->next_table];
+    otp_t *otps = OTPCalculator_Data(&mc->calc);
+    for (int i = mc->tw_num_added; i < mc->tw_num_generated; i++) {
+        OTPChecker_Table_AddOTP(mc, table, otps[i]);
+    }
+    mc->tw_num_added = mc->tw_num_generated;
+    
+    // generate the next chunk
+    if (mc->tw_num_added < mc->num_otps) {
+        BThreadWork_Init(&mc->tw, mc->twd, (BThreadWork_handler_done)work_done_handler, mc, (BThreadWork_work_func)work_func, mc);
+        mc->tw_have = 1;
+        return;
+    }
+    
     // update next table number
     mc->next_table = bmodadd_int(mc->next_table, 1, mc->num_tables);
     
@@ -163,11 +200,11 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
     // set no handlers
     mc->handler = NULL;
     
-    // set number of entries
+    // set number of buckets, keeping tables at most half full
     if (mc->num_otps > INT_MAX / 2) {
         goto fail0;
     }
-    mc->num_entries = 2 * mc->num_otps;
+    mc->num_buckets = bdivide_up(2 * mc->num_otps, OTPCHECKER_BUCKET_ENTRIES);
     
     // set no tables used
     mc->tables_used = 0;
@@ -183,15 +220,19 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
         goto fail1;
     }
     
-    // allocate entries
-    if (!(mc->entries = (struct OTPChecker_entry *)BAllocArray2(mc->num_tables, mc->num_entries, sizeof(mc->entries[0])))) {
+    // allocate buckets, with one more so they can be aligned to cache lines
+    if (mc->num_tables > INT_MAX / mc->num_buckets) {
         goto fail2;
     }
+    if (!(mc->buckets_mem = BAllocArray(mc->num_tables * mc->num_buckets + 1, sizeof(struct OTPChecker_bucket)))) {
+        goto fail2;
+    }
+    struct OTPChecker_bucket *buckets = (struct OTPChecker_bucket *)balign_up((uintptr_t)mc->buckets_mem, sizeof(struct OTPChecker_bucket));
     
     // initialize tables
     for (int i = 0; i < mc->num_tables; i++) {
         struct OTPChecker_table *table = &mc->tables[i];
-        table->entries = mc->entries + (size_t)i * mc->num_entries;
+        table->buckets = buckets + (size_t)i * mc->num_buckets;
         OTPChecker_Table_Empty(mc, table);
     }
     
@@ -218,8 +259,8 @@ void OTPChecker_Free (OTPChecker *mc)
         BThreadWork_Free(&mc->tw);
     }
     
-    // free entries
-    BFree(mc->entries);
+    // free buckets
+    BFree(mc->buckets_mem);
     
     // free tables
     BFree(mc->tables);
@@ -246,7 +287,8 @@ void OTPChecker_AddSeed (OTPChecker *mc, uint16_t seed_id, uint8_t *key, uint8_t
     memcpy(mc->tw_key, key, BEncryption_cipher_key_size(mc->cipher));
     memcpy(mc->tw_iv, iv, BEncryption_cipher_block_size(mc->cipher));
     
-    // start work
+    // start work for the first chunk
+    mc->tw_num_added = 0;
     BThreadWork_Init(&mc->tw, mc->twd, (BThreadWork_handler_done)work_done_handler, mc, (BThreadWork_work_func)work_func, mc);
     
     // set have work
@@ -271,6 +313,14 @@ int OTPChecker_CheckOTP (OTPChecker *mc, uint16_t seed_id, otp_t otp)
 {
     DebugObject_Access(&mc->d_obj);
     
+    // try the table being generated, which is the newest, if it has OTPs yet
+    if (mc->tw_have && mc->tw_num_added > 0) {
+        struct OTPChecker_table *table = &mc->tables[mc->next_table];
+        if (table->id == seed_id) {
+            return OTPChecker_Table_CheckOTP(mc, table, otp);
+        }
+    }
+    
     // try tables in reverse order
     for (int i = 1; i <= mc->tables_used; i++) {
         int table_index = bmodadd_int(mc->next_table, mc->num_tables - i, mc->num_tables);
@@ -43,14 +43,26 @@
 #include <base/DebugObject.h>
 #include <threadwork/BThreadWork.h>
 
-struct OTPChecker_entry {
-    otp_t otp;
-    int avail;
+/**
+ * Number of entries in a bucket of an OTP table. A bucket fills one
+ * 64-byte cache line.
+ */
+#define OTPCHECKER_BUCKET_ENTRIES 8
+
+/**
+ * Number of OTPs generated by one work. The OTPs generated so far are
+ * recognized while the rest are being generated.
+ */
+#define OTPCHECKER_GENERATE_CHUNK 1024
+
+struct OTPChecker_bucket {
+    otp_t otps[OTPCHECKER_BUCKET_ENTRIES];
+    int32_t avail[OTPCHECKER_BUCKET_ENTRIES];
 };
 
 struct OTPChecker_table {
     uint16_t id;
-    struct OTPChecker_entry *entries;
+    struct OTPChecker_bucket *buckets;
 };
 
 /**
@@ -70,17 +82,19 @@ typedef struct {
     void *user;
     int num_otps;
     int cipher;
-    int num_entries;
+    int num_buckets;
     int num_tables;
     int tables_used;
     int next_table;
     OTPCalculator calc;
     struct OTPChecker_table *tables;
-    struct OTPChecker_entry *entries;
+    void *buckets_mem;
     int tw_have;
     BThreadWork tw;
     uint8_t tw_key[BENCRYPTION_MAX_KEY_SIZE];
     uint8_t tw_iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    int tw_num_added;
+    int tw_num_generated;
     DebugObject d_obj;
 } OTPChecker;
 
@@ -108,7 +122,9 @@ void OTPChecker_Free (OTPChecker *mc);
 
 /**
  * Starts generating OTPs to recognize for a seed.
- * OTPs for this seed will not be recognized until the {@link OTPChecker_handler} handler is called.
+ * OTPs are generated in chunks of {@link OTPCHECKER_GENERATE_CHUNK}, and each chunk
+ * is recognized as soon as it is generated. The {@link OTPChecker_handler} handler is
+ * called when all OTPs for this seed have been generated.
  * If OTPs are still being generated for a previous seed, it will be forgotten.
  *
  * @param mc the object
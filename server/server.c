@@ -55,6 +55,7 @@
 #include <misc/open_standard_streams.h>
 #include <misc/compare.h>
 #include <misc/bsize.h>
+#include <misc/minmax.h>
 #include <predicate/BPredicate.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
@@ -67,6 +68,7 @@
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <system/BReactorGroup.h>
 #endif
 
 #include <server/server.h>
@@ -88,8 +90,10 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
+    int threads_cpu_affinity;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
+    int workers;
     int ssl;
     char *nssdb;
     char *server_cert_name;
@@ -99,6 +103,8 @@ struct {
     char *relay_predicate;
     int client_socket_sndbuf;
     int max_clients;
+    int peer_rate_limit;
+    int peer_rate_burst;
 } options;
 
 // listen addresses
@@ -141,6 +147,22 @@ BReactor ss;
 // thread work dispatcher
 BThreadWorkDispatcher twd;
 
+#ifndef BADVPN_USE_WINAPI
+
+// worker threads for client connections, if using workers
+BReactorGroup workers;
+
+// mailbox of the main thread, if using workers
+BReactorMailbox main_mailbox;
+
+// number of connections of each worker
+int workers_num_cons[BREACTORGROUP_MAX_THREADS];
+
+// connections passed to workers and not yet confirmed stopped
+LinkedList1 worker_cons;
+
+#endif
+
 // server certificate if using SSL
 CERTCertificate *server_cert;
 
@@ -181,6 +203,14 @@ static int process_arguments (void);
 
 static int ssl_flags (void);
 
+// creates a server SSL file descriptor on top of a client's bottom file descriptor,
+// which it takes ownership of
+static PRFileDesc * client_ssl_import (PRFileDesc *bottom_prfd, BLog_logfunc logfunc, void *log_arg);
+
+// reads the certificate and common name of a client after the SSL handshake
+static int client_read_cert (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_arg, uint8_t *out_cert, int *out_cert_len,
+                             uint8_t *out_cert_old, int *out_cert_old_len, char **out_common_name);
+
 // handler for program termination request
 static void signal_handler (void *unused);
 
@@ -222,6 +252,60 @@ static void client_sslcon_handler (struct client_data *client, int event);
 // decoder handler
 static void client_decoder_handler_error (struct client_data *client);
 
+#ifndef BADVPN_USE_WINAPI
+
+// passes the connection of a new client to a worker
+static int client_start_worker (struct client_data *client);
+
+// frees the main thread ends of the pipes and asks the worker to free the connection
+static void client_stop_worker (struct client_data *client);
+
+// handler for the worker completing the SSL handshake
+static void client_worker_up_handler (BReactorMailboxMsg *msg);
+
+// handler for the connection failing in the worker
+static void client_worker_error_handler (BReactorMailboxMsg *msg);
+
+// handler for the worker having freed the connection
+static void client_worker_stopped_handler (BReactorMailboxMsg *msg);
+
+// frees a worker connection structure
+static void worker_con_dealloc (struct client_worker_con *wcon);
+
+// the following run in the worker thread
+
+// adopts the connection in the worker
+static void worker_con_start_handler (BReactorMailboxMsg *msg);
+
+// frees the connection in the worker and confirms it
+static void worker_con_stop_handler (BReactorMailboxMsg *msg);
+
+// initializes the decoder and sender of the connection
+static int worker_con_init_io (struct client_worker_con *wcon);
+
+// frees the connection
+static void worker_con_free (struct client_worker_con *wcon);
+
+// frees the connection and reports the failure
+static void worker_con_fail (struct client_worker_con *wcon);
+
+// appends worker connection log prefix
+static void worker_con_logfunc (struct client_worker_con *wcon);
+
+// passes a message to the logger, prepending about the connection
+static void worker_con_log (struct client_worker_con *wcon, int level, const char *fmt, ...);
+
+// BConnection handler
+static void worker_con_connection_handler (struct client_worker_con *wcon, int event);
+
+// BSSLConnection handler
+static void worker_con_sslcon_handler (struct client_worker_con *wcon, int event);
+
+// decoder handler
+static void worker_con_decoder_handler_error (struct client_worker_con *wcon);
+
+#endif
+
 // provides a buffer for sending a control packet to the client
 static int client_start_control_packet (struct client_data *client, void **data, int len);
 
@@ -490,11 +574,30 @@ int main (int argc, char *argv[])
     }
     
     // init thread work dispatcher
-    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
+    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads, options.threads_cpu_affinity)) {
         BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
         goto fail3a;
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    if (options.workers > 0) {
+        // init main thread mailbox
+        if (!BReactorMailbox_Init(&main_mailbox, &ss)) {
+            BLog(BLOG_ERROR, "BReactorMailbox_Init failed");
+            goto fail3b;
+        }
+        
+        // init worker connections list
+        LinkedList1_Init(&worker_cons);
+        
+        // start workers
+        if (!BReactorGroup_Init(&workers, options.workers, options.threads_cpu_affinity, NULL, NULL, NULL)) {
+            BLog(BLOG_ERROR, "BReactorGroup_Init failed");
+            goto fail3c;
+        }
+    }
+    #endif
+    
     // setup signal handler
     if (!BSignal_Init(&ss, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
@@ -570,6 +673,22 @@ fail10:
     
     BSignal_Finish();
 fail4:
+    #ifndef BADVPN_USE_WINAPI
+    if (options.workers > 0) {
+        // stop workers, after they have freed the connections of the clients
+        BReactorGroup_Free(&workers);
+        
+        // free worker connections whose stop confirmation was not handled
+        LinkedList1Node *wcon_node;
+        while (wcon_node = LinkedList1_GetFirst(&worker_cons)) {
+            struct client_worker_con *wcon = UPPER_OBJECT(wcon_node, struct client_worker_con, list_node);
+            worker_con_dealloc(wcon);
+        }
+fail3c:
+        BReactorMailbox_Free(&main_mailbox);
+    }
+fail3b:
+    #endif
     BThreadWorkDispatcher_Free(&twd);
 fail3a:
     BReactor_Free(&ss);
@@ -629,14 +748,20 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--threads <integer>]\n"
+        "        [--threads-cpu-affinity]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--workers <integer>]\n"
+        #endif
         "        [--listen-addr <addr>] ...\n"
         "        [--ssl --nssdb <string> --server-cert-name <string>]\n"
         "        [--comm-predicate <string>]\n"
         "        [--relay-predicate <string>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--max-clients <number>]\n"
+        "        [--peer-rate-limit <bytes per second / 0>]\n"
+        "        [--peer-rate-burst <bytes>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -661,8 +786,10 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.threads = 0;
+    options.threads_cpu_affinity = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
+    options.workers = 0;
     options.ssl = 0;
     options.nssdb = NULL;
     options.server_cert_name = NULL;
@@ -671,6 +798,8 @@ int parse_arguments (int argc, char *argv[])
     options.relay_predicate = NULL;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SNDBUF;
     options.max_clients = DEFAULT_MAX_CLIENTS;
+    options.peer_rate_limit = 0;
+    options.peer_rate_burst = CLIENT_PEER_FLOW_DEFAULT_RATE_BURST;
     
     for (int i = 1; i < argc; i++) {
         char *arg = argv[i];
@@ -755,12 +884,28 @@ int parse_arguments (int argc, char *argv[])
             options.threads = atoi(argv[i + 1]);
             i++;
         }
+        else if (!strcmp(arg, "--threads-cpu-affinity")) {
+            options.threads_cpu_affinity = 1;
+        }
         else if (!strcmp(arg, "--use-threads-for-ssl-handshake")) {
             options.use_threads_for_ssl_handshake = 1;
         }
         else if (!strcmp(arg, "--use-threads-for-ssl-data")) {
             options.use_threads_for_ssl_data = 1;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--workers")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.workers = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else if (!strcmp(arg, "--ssl")) {
             options.ssl = 1;
         }
@@ -831,6 +976,28 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--peer-rate-limit")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.peer_rate_limit = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--peer-rate-burst")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.peer_rate_burst = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else {
             fprintf(stderr, "%s: unknown option\n", arg);
             return 0;
@@ -851,6 +1018,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (options.workers > 0 && (options.use_threads_for_ssl_handshake || options.use_threads_for_ssl_data)) {
+        fprintf(stderr, "--workers cannot be used with --use-threads-for-ssl-handshake or --use-threads-for-ssl-data\n");
+        return 0;
+    }
+    
     return 1;
 }
 
@@ -881,6 +1053,99 @@ int ssl_flags (void)
     return flags;
 }
 
+PRFileDesc * client_ssl_import (PRFileDesc *bottom_prfd, BLog_logfunc logfunc, void *log_arg)
+{
+    // create SSL file descriptor from the bottom NSPR file descriptor
+    PRFileDesc *ssl_prfd = SSL_ImportFD(model_prfd, bottom_prfd);
+    if (!ssl_prfd) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_ImportFD failed");
+        ASSERT_FORCE(PR_Close(bottom_prfd) == PR_SUCCESS)
+        goto fail0;
+    }
+    
+    // set server mode
+    if (SSL_ResetHandshake(ssl_prfd, PR_TRUE) != SECSuccess) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_ResetHandshake failed");
+        goto fail1;
+    }
+    
+    // set require client certificate
+    if (SSL_OptionSet(ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+        goto fail1;
+    }
+    if (SSL_OptionSet(ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+        goto fail1;
+    }
+    
+    return ssl_prfd;
+    
+fail1:
+    ASSERT_FORCE(PR_Close(ssl_prfd) == PR_SUCCESS)
+fail0:
+    return NULL;
+}
+
+int client_read_cert (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_arg, uint8_t *out_cert, int *out_cert_len,
+                      uint8_t *out_cert_old, int *out_cert_old_len, char **out_common_name)
+{
+    // get client certificate
+    CERTCertificate *cert = SSL_PeerCertificate(ssl_prfd);
+    if (!cert) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_PeerCertificate failed");
+        goto fail0;
+    }
+    
+    // remember common name
+    if (!(*out_common_name = CERT_GetCommonName(&cert->subject))) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "CERT_GetCommonName failed");
+        goto fail1;
+    }
+    
+    // store certificate
+    SECItem der = cert->derCert;
+    if (der.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "client certificate too big");
+        goto fail1;
+    }
+    memcpy(out_cert, der.data, der.len);
+    *out_cert_len = der.len;
+    
+    PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+    if (!arena) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "PORT_NewArena failed");
+        goto fail1;
+    }
+    
+    // encode certificate
+    memset(&der, 0, sizeof(der));
+    if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
+        goto fail2;
+    }
+    
+    // store re-encoded certificate (for compatibility with old clients)
+    if (der.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        BLog_LogViaFunc(logfunc, log_arg, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "client certificate too big");
+        goto fail2;
+    }
+    memcpy(out_cert_old, der.data, der.len);
+    *out_cert_old_len = der.len;
+    
+    PORT_FreeArena(arena, PR_FALSE);
+    CERT_DestroyCertificate(cert);
+    
+    return 1;
+    
+fail2:
+    PORT_FreeArena(arena, PR_FALSE);
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    return 0;
+}
+
 void signal_handler (void *unused)
 {
     BLog(BLOG_NOTICE, "termination requested");
@@ -922,48 +1187,49 @@ void listener_handler (BListener *listener)
     // set no common name
     client->common_name = NULL;
     
-    // now client_log() works
+    // set no worker
+    client->wcon = NULL;
     
-    // init connection interfaces
-    BConnection_SendAsync_Init(&client->con);
-    BConnection_RecvAsync_Init(&client->con);
+    // now client_log() works
     
-    if (options.ssl) {
-        // create bottom NSPR file descriptor
-        if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
-            client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
-            goto fail2;
-        }
-        
-        // create SSL file descriptor from the bottom NSPR file descriptor
-        if (!(client->ssl_prfd = SSL_ImportFD(model_prfd, &client->bottom_prfd))) {
-            client_log(client, BLOG_ERROR, "SSL_ImportFD failed");
-            ASSERT_FORCE(PR_Close(&client->bottom_prfd) == PR_SUCCESS)
-            goto fail2;
-        }
-        
-        // set server mode
-        if (SSL_ResetHandshake(client->ssl_prfd, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_ResetHandshake failed");
-            goto fail3;
+    if (options.workers > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        // pass the connection to a worker
+        if (!client_start_worker(client)) {
+            BConnection_Free(&client->con);
+            goto fail1;
         }
         
-        // set require client certificate
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
-            goto fail3;
-        }
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
-            goto fail3;
+        // with SSL, I/O is initialized when the worker completes the handshake
+        if (!options.ssl && !client_init_io(client)) {
+            client_stop_worker(client);
+            goto fail1;
         }
-        
-        // init SSL connection
-        BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(&ss), client, (BSSLConnection_handler)client_sslcon_handler);
+        #endif
     } else {
-        // initialize I/O
-        if (!client_init_io(client)) {
-            goto fail2;
+        // init connection interfaces
+        BConnection_SendAsync_Init(&client->con);
+        BConnection_RecvAsync_Init(&client->con);
+        
+        if (options.ssl) {
+            // create bottom NSPR file descriptor
+            if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
+                client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+                goto fail2;
+            }
+            
+            // create SSL file descriptor
+            if (!(client->ssl_prfd = client_ssl_import(&client->bottom_prfd, (BLog_logfunc)client_logfunc, client))) {
+                goto fail2;
+            }
+            
+            // init SSL connection
+            BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(&ss), client, (BSSLConnection_handler)client_sslcon_handler);
+        } else {
+            // initialize I/O
+            if (!client_init_io(client)) {
+                goto fail2;
+            }
         }
     }
     
@@ -995,10 +1261,6 @@ void listener_handler (BListener *listener)
     
     return;
     
-    if (options.ssl) {
-fail3:
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
 fail2:
     BConnection_RecvAsync_Free(&client->con);
     BConnection_SendAsync_Free(&client->con);
@@ -1031,10 +1293,26 @@ void client_dealloc (struct client_data *client)
     // stop disconnect timer
     BReactor_RemoveTimer(&ss, &client->disconnect_timer);
     
-    // free SSL
-    if (options.ssl) {
-        BSSLConnection_Free(&client->sslcon);
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+    if (options.workers > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        // stop the worker, unless client_dealloc_io did
+        if (client->wcon) {
+            client_stop_worker(client);
+        }
+        #endif
+    } else {
+        // free SSL
+        if (options.ssl) {
+            BSSLConnection_Free(&client->sslcon);
+            ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+        }
+        
+        // free connection interfaces
+        BConnection_RecvAsync_Free(&client->con);
+        BConnection_SendAsync_Free(&client->con);
+        
+        // free connection
+        BConnection_Free(&client->con);
     }
     
     // free common name
@@ -1042,13 +1320,6 @@ void client_dealloc (struct client_data *client)
         PORT_Free(client->common_name);
     }
     
-    // free connection interfaces
-    BConnection_RecvAsync_Free(&client->con);
-    BConnection_SendAsync_Free(&client->con);
-    
-    // free connection
-    BConnection_Free(&client->con);
-    
     // free memory
     free(client);
 }
@@ -1066,29 +1337,43 @@ int client_compute_buffer_size (struct client_data *client)
 
 int client_init_io (struct client_data *client)
 {
-    StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
-    StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
+    PacketPassInterface *output;
     
     // init input
     
     // init interface
     PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, client, BReactor_PendingGroup(&ss));
     
-    // init decoder
-    if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
-        (PacketProtoDecoder_handler_error)client_decoder_handler_error
-    )) {
-        client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
-        goto fail1;
+    if (client->wcon) {
+        #ifndef BADVPN_USE_WINAPI
+        // receive packets decoded by the worker
+        BPacketPipe_InitOutput(client->wcon->input_pipe, &client->input_interface);
+        
+        // send packets through the worker
+        BPacketPipe_InitInput(client->wcon->output_pipe, BReactor_PendingGroup(&ss));
+        output = BPacketPipe_GetInput(client->wcon->output_pipe);
+        #endif
+    } else {
+        StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
+        StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
+        
+        // init decoder
+        if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
+            (PacketProtoDecoder_handler_error)client_decoder_handler_error
+        )) {
+            client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+            goto fail1;
+        }
+        
+        // init sender
+        PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+        output = PacketStreamSender_GetInput(&client->output_sender);
     }
     
     // init output common
     
-    // init sender
-    PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
-    
     // init queue
-    PacketPassPriorityQueue_Init(&client->output_priorityqueue, PacketStreamSender_GetInput(&client->output_sender), BReactor_PendingGroup(&ss), 0);
+    PacketPassPriorityQueue_Init(&client->output_priorityqueue, output, BReactor_PendingGroup(&ss), 0);
     
     // init output control flow
     
@@ -1130,9 +1415,11 @@ fail2:
     PacketPassPriorityQueueFlow_Free(&client->output_control_qflow);
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
-    // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
+    if (!client->wcon) {
+        PacketStreamSender_Free(&client->output_sender);
+        // free input
+        PacketProtoDecoder_Free(&client->input_decoder);
+    }
 fail1:
     PacketPassInterface_Free(&client->input_interface);
     return 0;
@@ -1141,7 +1428,7 @@ fail1:
 void client_dealloc_io (struct client_data *client)
 {
     // stop using any buffers before they get freed
-    if (options.ssl) {
+    if (options.ssl && !client->wcon) {
         BSSLConnection_ReleaseBuffers(&client->sslcon);
     }
     
@@ -1169,11 +1456,22 @@ void client_dealloc_io (struct client_data *client)
     
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
+    if (!client->wcon) {
+        PacketStreamSender_Free(&client->output_sender);
+    }
     
     // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
+    if (!client->wcon) {
+        PacketProtoDecoder_Free(&client->input_decoder);
+    }
     PacketPassInterface_Free(&client->input_interface);
+    
+    #ifndef BADVPN_USE_WINAPI
+    // stop the worker, which also frees our ends of the pipes
+    if (client->wcon) {
+        client_stop_worker(client);
+    }
+    #endif
 }
 
 void client_remove (struct client_data *client)
@@ -1292,84 +1590,415 @@ void client_sslcon_handler (struct client_data *client, int event)
         return;
     }
     
-    // get client certificate
-    CERTCertificate *cert = SSL_PeerCertificate(client->ssl_prfd);
-    if (!cert) {
-        client_log(client, BLOG_ERROR, "SSL_PeerCertificate failed");
+    // read client certificate
+    if (!client_read_cert(client->ssl_prfd, (BLog_logfunc)client_logfunc, client, client->cert, &client->cert_len,
+                          client->cert_old, &client->cert_old_len, &client->common_name)) {
         goto fail0;
     }
     
-    // remember common name
-    if (!(client->common_name = CERT_GetCommonName(&cert->subject))) {
-        client_log(client, BLOG_NOTICE, "CERT_GetCommonName failed");
-        goto fail1;
+    // init I/O chains
+    if (!client_init_io(client)) {
+        goto fail0;
     }
     
-    // store certificate
-    SECItem der = cert->derCert;
-    if (der.len > sizeof(client->cert)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail1;
+    // set client state
+    client->initstatus = INITSTATUS_WAITHELLO;
+    
+    client_log(client, BLOG_INFO, "handshake complete");
+    
+    return;
+    
+    // handle errors
+fail0:
+    client_remove(client);
+}
+
+void client_decoder_handler_error (struct client_data *client)
+{
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    ASSERT(!client->dying)
+    
+    client_log(client, BLOG_ERROR, "decoder error");
+    
+    client_remove(client);
+    return;
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+int client_start_worker (struct client_data *client)
+{
+    ASSERT(options.workers > 0)
+    ASSERT(!client->wcon)
+    
+    // choose the worker with the fewest connections
+    int index = 0;
+    for (int i = 1; i < BReactorGroup_NumThreads(&workers); i++) {
+        if (workers_num_cons[i] < workers_num_cons[index]) {
+            index = i;
+        }
     }
-    memcpy(client->cert, der.data, der.len);
-    client->cert_len = der.len;
     
-    PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
-    if (!arena) {
-        client_log(client, BLOG_ERROR, "PORT_NewArena failed");
+    // allocate structure
+    struct client_worker_con *wcon = (struct client_worker_con *)malloc(sizeof(*wcon));
+    if (!wcon) {
+        client_log(client, BLOG_ERROR, "failed to allocate worker connection");
+        goto fail0;
+    }
+    
+    // init arguments
+    wcon->client = client;
+    wcon->index = index;
+    wcon->reactor = BReactorGroup_Reactor(&workers, index);
+    wcon->id = client->id;
+    wcon->addr = client->addr;
+    
+    // create pipe for received packets
+    if (!(wcon->input_pipe = BPacketPipe_New(SC_MAX_ENC, CLIENT_WORKER_PIPE_SLOTS, BReactorGroup_Mailbox(&workers, index), &main_mailbox))) {
+        client_log(client, BLOG_ERROR, "BPacketPipe_New failed");
         goto fail1;
     }
     
-    // encode certificate
-    memset(&der, 0, sizeof(der));
-    if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
-        client_log(client, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
+    // create pipe for packets to send
+    if (!(wcon->output_pipe = BPacketPipe_New(PACKETPROTO_ENCLEN(SC_MAX_ENC), CLIENT_WORKER_PIPE_SLOTS, &main_mailbox, BReactorGroup_Mailbox(&workers, index)))) {
+        client_log(client, BLOG_ERROR, "BPacketPipe_New failed");
         goto fail2;
     }
     
-    // store re-encoded certificate (for compatibility with old clients)
-    if (der.len > sizeof(client->cert_old)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail2;
+    // set no common name
+    wcon->common_name = NULL;
+    
+    // take the socket from the connection
+    wcon->fd = BConnection_Release(&client->con);
+    
+    // link in
+    LinkedList1_Append(&worker_cons, &wcon->list_node);
+    workers_num_cons[index]++;
+    client->wcon = wcon;
+    
+    // pass the connection to the worker
+    BReactorMailbox_Thread_Send(BReactorGroup_Mailbox(&workers, index), &wcon->start_msg, worker_con_start_handler);
+    
+    client_log(client, BLOG_DEBUG, "passed to worker %d", index);
+    
+    return 1;
+    
+fail2:
+    BPacketPipe_FreeInput(wcon->input_pipe);
+    BPacketPipe_FreeOutput(wcon->input_pipe);
+fail1:
+    free(wcon);
+fail0:
+    return 0;
+}
+
+void client_stop_worker (struct client_data *client)
+{
+    struct client_worker_con *wcon = client->wcon;
+    ASSERT(wcon)
+    ASSERT(wcon->client == client)
+    
+    // free our ends of the pipes
+    BPacketPipe_FreeOutput(wcon->input_pipe);
+    BPacketPipe_FreeInput(wcon->output_pipe);
+    
+    // detach; messages from the worker are ignored from now on
+    wcon->client = NULL;
+    client->wcon = NULL;
+    
+    // ask the worker to free the connection
+    BReactorMailbox_Thread_Send(BReactorGroup_Mailbox(&workers, wcon->index), &wcon->stop_msg, worker_con_stop_handler);
+}
+
+void client_worker_up_handler (BReactorMailboxMsg *msg)
+{
+    struct client_worker_con *wcon = UPPER_OBJECT(msg, struct client_worker_con, up_msg);
+    struct client_data *client = wcon->client;
+    ASSERT(options.ssl)
+    
+    // ignore if the client is gone or going
+    if (!client || client->dying) {
+        return;
     }
-    memcpy(client->cert_old, der.data, der.len);
-    client->cert_old_len = der.len;
+    
+    ASSERT(client->initstatus == INITSTATUS_HANDSHAKE)
+    
+    // take client data from the worker
+    client->common_name = wcon->common_name;
+    wcon->common_name = NULL;
+    memcpy(client->cert, wcon->cert, wcon->cert_len);
+    client->cert_len = wcon->cert_len;
+    memcpy(client->cert_old, wcon->cert_old, wcon->cert_old_len);
+    client->cert_old_len = wcon->cert_old_len;
     
     // init I/O chains
     if (!client_init_io(client)) {
-        goto fail2;
+        client_stop_worker(client);
+        client_remove(client);
+        return;
     }
     
-    PORT_FreeArena(arena, PR_FALSE);
-    CERT_DestroyCertificate(cert);
-    
     // set client state
     client->initstatus = INITSTATUS_WAITHELLO;
     
     client_log(client, BLOG_INFO, "handshake complete");
+}
+
+void client_worker_error_handler (BReactorMailboxMsg *msg)
+{
+    struct client_worker_con *wcon = UPPER_OBJECT(msg, struct client_worker_con, error_msg);
+    struct client_data *client = wcon->client;
+    
+    // ignore if the client is gone or going
+    if (!client || client->dying) {
+        return;
+    }
+    
+    client_remove(client);
+    return;
+}
+
+void client_worker_stopped_handler (BReactorMailboxMsg *msg)
+{
+    struct client_worker_con *wcon = UPPER_OBJECT(msg, struct client_worker_con, stopped_msg);
+    ASSERT(!wcon->client)
+    
+    worker_con_dealloc(wcon);
+}
+
+void worker_con_dealloc (struct client_worker_con *wcon)
+{
+    // link out
+    workers_num_cons[wcon->index]--;
+    LinkedList1_Remove(&worker_cons, &wcon->list_node);
+    
+    // free common name if not taken by the client
+    if (wcon->common_name) {
+        PORT_Free(wcon->common_name);
+    }
+    
+    // free memory
+    free(wcon);
+}
+
+void worker_con_start_handler (BReactorMailboxMsg *msg)
+{
+    struct client_worker_con *wcon = UPPER_OBJECT(msg, struct client_worker_con, start_msg);
+    
+    wcon->running = 0;
+    wcon->have_io = 0;
+    
+    // adopt the socket
+    if (!BConnection_Init(&wcon->con, BConnection_source_pipe(wcon->fd, 1), wcon->reactor, wcon, (BConnection_handler)worker_con_connection_handler)) {
+        worker_con_log(wcon, BLOG_ERROR, "BConnection_Init failed");
+        goto fail0;
+    }
+    
+    // init connection interfaces
+    BConnection_SendAsync_Init(&wcon->con);
+    BConnection_RecvAsync_Init(&wcon->con);
+    
+    if (options.ssl) {
+        // create bottom NSPR file descriptor
+        if (!BSSLConnection_MakeBackend(&wcon->bottom_prfd, BConnection_SendAsync_GetIf(&wcon->con), BConnection_RecvAsync_GetIf(&wcon->con), NULL, 0)) {
+            worker_con_log(wcon, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+            goto fail1;
+        }
+        
+        // create SSL file descriptor
+        if (!(wcon->ssl_prfd = client_ssl_import(&wcon->bottom_prfd, (BLog_logfunc)worker_con_logfunc, wcon))) {
+            goto fail1;
+        }
+        
+        // init SSL connection
+        BSSLConnection_Init(&wcon->sslcon, wcon->ssl_prfd, 1, BReactor_PendingGroup(wcon->reactor), wcon, (BSSLConnection_handler)worker_con_sslcon_handler);
+    } else {
+        // initialize I/O
+        if (!worker_con_init_io(wcon)) {
+            goto fail1;
+        }
+    }
+    
+    wcon->running = 1;
     
     return;
     
-    // handle errors
-fail2:
-    PORT_FreeArena(arena, PR_FALSE);
 fail1:
-    CERT_DestroyCertificate(cert);
+    BConnection_RecvAsync_Free(&wcon->con);
+    BConnection_SendAsync_Free(&wcon->con);
+    BConnection_Free(&wcon->con);
 fail0:
-    client_remove(client);
+    BPacketPipe_FreeInput(wcon->input_pipe);
+    BPacketPipe_FreeOutput(wcon->output_pipe);
+    BReactorMailbox_Thread_Send(&main_mailbox, &wcon->error_msg, client_worker_error_handler);
 }
 
-void client_decoder_handler_error (struct client_data *client)
+void worker_con_stop_handler (BReactorMailboxMsg *msg)
 {
-    ASSERT(INITSTATUS_HASLINK(client->initstatus))
-    ASSERT(!client->dying)
+    struct client_worker_con *wcon = UPPER_OBJECT(msg, struct client_worker_con, stop_msg);
     
-    client_log(client, BLOG_ERROR, "decoder error");
+    // free connection, unless it failed already
+    if (wcon->running) {
+        worker_con_free(wcon);
+    }
     
-    client_remove(client);
+    // confirm; the structure must not be accessed after this
+    BReactorMailbox_Thread_Send(&main_mailbox, &wcon->stopped_msg, client_worker_stopped_handler);
+}
+
+int worker_con_init_io (struct client_worker_con *wcon)
+{
+    ASSERT(!wcon->have_io)
+    
+    StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&wcon->sslcon) : BConnection_SendAsync_GetIf(&wcon->con));
+    StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&wcon->sslcon) : BConnection_RecvAsync_GetIf(&wcon->con));
+    
+    // init input
+    BPacketPipe_InitInput(wcon->input_pipe, BReactor_PendingGroup(wcon->reactor));
+    
+    // init decoder
+    if (!PacketProtoDecoder_Init(&wcon->input_decoder, recv_if, BPacketPipe_GetInput(wcon->input_pipe), BReactor_PendingGroup(wcon->reactor), wcon,
+        (PacketProtoDecoder_handler_error)worker_con_decoder_handler_error
+    )) {
+        worker_con_log(wcon, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        return 0;
+    }
+    
+    // init sender
+    PacketStreamSender_Init(&wcon->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(wcon->reactor));
+    
+    // init output
+    BPacketPipe_InitOutput(wcon->output_pipe, PacketStreamSender_GetInput(&wcon->output_sender));
+    
+    wcon->have_io = 1;
+    
+    return 1;
+}
+
+void worker_con_free (struct client_worker_con *wcon)
+{
+    ASSERT(wcon->running)
+    
+    if (wcon->have_io) {
+        // stop using any buffers before they get freed
+        if (options.ssl) {
+            BSSLConnection_ReleaseBuffers(&wcon->sslcon);
+        }
+        
+        // free decoder
+        PacketProtoDecoder_Free(&wcon->input_decoder);
+    }
+    
+    // free our ends of the pipes
+    BPacketPipe_FreeInput(wcon->input_pipe);
+    BPacketPipe_FreeOutput(wcon->output_pipe);
+    
+    // free sender
+    if (wcon->have_io) {
+        PacketStreamSender_Free(&wcon->output_sender);
+    }
+    
+    // free SSL
+    if (options.ssl) {
+        BSSLConnection_Free(&wcon->sslcon);
+        ASSERT_FORCE(PR_Close(wcon->ssl_prfd) == PR_SUCCESS)
+    }
+    
+    // free connection interfaces
+    BConnection_RecvAsync_Free(&wcon->con);
+    BConnection_SendAsync_Free(&wcon->con);
+    
+    // free connection
+    BConnection_Free(&wcon->con);
+    
+    wcon->running = 0;
+}
+
+void worker_con_fail (struct client_worker_con *wcon)
+{
+    ASSERT(wcon->running)
+    
+    worker_con_free(wcon);
+    
+    // have the main thread remove the client
+    BReactorMailbox_Thread_Send(&main_mailbox, &wcon->error_msg, client_worker_error_handler);
+}
+
+void worker_con_logfunc (struct client_worker_con *wcon)
+{
+    char addr[BADDR_MAX_PRINT_LEN];
+    BAddr_Print(&wcon->addr, addr);
+    
+    BLog_Append("client %d (%s) in worker %d: ", (int)wcon->id, addr, wcon->index);
+}
+
+void worker_con_log (struct client_worker_con *wcon, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)worker_con_logfunc, wcon, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+void worker_con_connection_handler (struct client_worker_con *wcon, int event)
+{
+    ASSERT(wcon->running)
+    
+    if (event == BCONNECTION_EVENT_RECVCLOSED) {
+        worker_con_log(wcon, BLOG_INFO, "connection closed");
+    } else {
+        worker_con_log(wcon, BLOG_INFO, "connection error");
+    }
+    
+    worker_con_fail(wcon);
     return;
 }
 
+void worker_con_sslcon_handler (struct client_worker_con *wcon, int event)
+{
+    ASSERT(options.ssl)
+    ASSERT(wcon->running)
+    ASSERT(event == BSSLCONNECTION_EVENT_UP || event == BSSLCONNECTION_EVENT_ERROR)
+    ASSERT(!(event == BSSLCONNECTION_EVENT_UP) || !wcon->have_io)
+    
+    if (event == BSSLCONNECTION_EVENT_ERROR) {
+        worker_con_log(wcon, BLOG_ERROR, "SSL error");
+        goto fail0;
+    }
+    
+    // read client certificate
+    if (!client_read_cert(wcon->ssl_prfd, (BLog_logfunc)worker_con_logfunc, wcon, wcon->cert, &wcon->cert_len,
+                          wcon->cert_old, &wcon->cert_old_len, &wcon->common_name)) {
+        goto fail0;
+    }
+    
+    // init I/O chains
+    if (!worker_con_init_io(wcon)) {
+        goto fail0;
+    }
+    
+    // have the main thread start using the pipes
+    BReactorMailbox_Thread_Send(&main_mailbox, &wcon->up_msg, client_worker_up_handler);
+    
+    return;
+    
+fail0:
+    worker_con_fail(wcon);
+}
+
+void worker_con_decoder_handler_error (struct client_worker_con *wcon)
+{
+    ASSERT(wcon->running)
+    ASSERT(wcon->have_io)
+    
+    worker_con_log(wcon, BLOG_ERROR, "decoder error");
+    
+    worker_con_fail(wcon);
+    return;
+}
+
+#endif
+
 int client_start_control_packet (struct client_data *client, void **data, int len)
 {
     ASSERT(len >= 0)
@@ -1851,10 +2480,15 @@ int peer_flow_init_io (struct peer_flow *flow)
     // init queue flow
     PacketPassFairQueueFlow_Init(&flow->qflow, &flow->dest_client->output_peers_fairqueue);
     
+    // init shaper; the bucket must hold at least a packet
+    PacketPassInterface *qflow_input = PacketPassFairQueueFlow_GetInput(&flow->qflow);
+    int burst = bmax_int(options.peer_rate_burst, PacketPassInterface_GetMTU(qflow_input));
+    PacketPassShaper_Init(&flow->shaper, qflow_input, &ss, options.peer_rate_limit, burst);
+    
     // init PacketProtoFlow
     if (!PacketProtoFlow_Init(
         &flow->oflow, SC_MAX_ENC, CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS,
-        PacketPassFairQueueFlow_GetInput(&flow->qflow), BReactor_PendingGroup(&ss)
+        PacketPassShaper_GetInput(&flow->shaper), BReactor_PendingGroup(&ss)
     )) {
         BLog(BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
@@ -1870,6 +2504,7 @@ int peer_flow_init_io (struct peer_flow *flow)
     return 1;
     
 fail1:
+    PacketPassShaper_Free(&flow->shaper);
     PacketPassFairQueueFlow_Free(&flow->qflow);
     return 0;
 }
@@ -1882,6 +2517,9 @@ void peer_flow_free_io (struct peer_flow *flow)
     // free PacketProtoFlow
     PacketProtoFlow_Free(&flow->oflow);
     
+    // free shaper
+    PacketPassShaper_Free(&flow->shaper);
+    
     // free queue flow
     PacketPassFairQueueFlow_Free(&flow->qflow);
     
@@ -37,10 +37,16 @@
 #include <flow/PacketPassPriorityQueue.h>
 #include <flow/PacketPassFairQueue.h>
 #include <flow/PacketProtoFlow.h>
+#include <flowextra/PacketPassShaper.h>
 #include <system/BReactor.h>
 #include <system/BConnection.h>
 #include <nspr_support/BSSLConnection.h>
 
+#ifndef BADVPN_USE_WINAPI
+#include <system/BReactorMailbox.h>
+#include <system/BPacketPipe.h>
+#endif
+
 // name of the program
 #define PROGRAM_NAME "server"
 
@@ -52,6 +58,8 @@
 #define CLIENT_CONTROL_BUFFER_MIN_PACKETS (1 + 2*(MAX_CLIENTS - 1))
 // size of client-to-client buffers in packets
 #define CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS 10
+// default burst of the rate limit of client-to-client flows, in bytes
+#define CLIENT_PEER_FLOW_DEFAULT_RATE_BURST 16384
 // after how long of not hearing anything from the client we disconnect it
 #define CLIENT_NO_DATA_TIME_LIMIT 30000
 // SO_SNDBFUF socket option for clients
@@ -61,6 +69,8 @@
 
 // maxiumum listen addresses
 #define MAX_LISTEN_ADDRS 16
+// packets in flight between a worker and the main thread, per client and direction
+#define CLIENT_WORKER_PIPE_SLOTS 4
 
 //#define SIMULATE_OUT_OF_CONTROL_BUFFER 20
 //#define SIMULATE_OUT_OF_FLOW_BUFFER 100
@@ -78,6 +88,51 @@
 struct client_data;
 struct peer_know;
 
+#ifndef BADVPN_USE_WINAPI
+
+// connection of a client handled by a worker thread
+struct client_worker_con {
+    // client, or NULL if it has been freed (main thread)
+    struct client_data *client;
+    // node in worker connections list (main thread)
+    LinkedList1Node list_node;
+    // worker index and reactor
+    int index;
+    BReactor *reactor;
+    // client ID and address for logging
+    peerid_t id;
+    BAddr addr;
+    // socket, until the worker adopts it
+    int fd;
+    // decoded packets from the worker
+    BPacketPipe *input_pipe;
+    // packets to send from the main thread
+    BPacketPipe *output_pipe;
+    // messages
+    BReactorMailboxMsg start_msg;
+    BReactorMailboxMsg stop_msg;
+    BReactorMailboxMsg up_msg;
+    BReactorMailboxMsg error_msg;
+    BReactorMailboxMsg stopped_msg;
+    // worker side
+    int running;
+    int have_io;
+    BConnection con;
+    PRFileDesc bottom_prfd;
+    PRFileDesc *ssl_prfd;
+    BSSLConnection sslcon;
+    PacketProtoDecoder input_decoder;
+    PacketStreamSender output_sender;
+    // client data if using SSL, passed to the main thread with up_msg
+    uint8_t cert[SCID_NEWCLIENT_MAX_CERT_LEN];
+    int cert_len;
+    uint8_t cert_old[SCID_NEWCLIENT_MAX_CERT_LEN];
+    int cert_old_len;
+    char *common_name;
+};
+
+#endif
+
 struct peer_flow {
     // source client
     struct client_data *src_client;
@@ -93,6 +148,7 @@ struct peer_flow {
     // output chain
     int have_io;
     PacketPassFairQueueFlow qflow;
+    PacketPassShaper shaper;
     PacketProtoFlow oflow;
     BufferWriter *input;
     int packet_len;
@@ -123,6 +179,9 @@ struct client_data {
     BConnection con;
     BAddr addr;
     
+    // connection in a worker thread, if using workers
+    struct client_worker_con *wcon;
+    
     // SSL connection, if using SSL
     PRFileDesc bottom_prfd;
     PRFileDesc *ssl_prfd;
@@ -0,0 +1,157 @@
+/**
+ * @file BlockPool.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Pool of equally sized memory blocks. Released blocks are kept on a free
+ * list for reuse, up to a limit, so that objects which come and go often
+ * (connections, I/O buffers) don't go through malloc each time, while memory
+ * is still returned when usage drops.
+ */
+
+#ifndef BADVPN_STRUCTURE_BLOCKPOOL_H
+#define BADVPN_STRUCTURE_BLOCKPOOL_H
+
+#include <stddef.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <base/DebugObject.h>
+
+struct BlockPool_block {
+    struct BlockPool_block *next;
+};
+
+/**
+ * Pool of equally sized memory blocks.
+ */
+typedef struct {
+    size_t block_size;
+    int max_free;
+    struct BlockPool_block *free_first;
+    int num_free;
+    DebugObject d_obj;
+} BlockPool;
+
+/**
+ * Initializes the pool.
+ * 
+ * @param o the object
+ * @param block_size size of blocks. Must be >0.
+ * @param max_free maximum number of released blocks to keep for reuse. Must be >=0.
+ */
+static void BlockPool_Init (BlockPool *o, size_t block_size, int max_free);
+
+/**
+ * Frees the pool, including any blocks kept for reuse.
+ * Blocks which have not been released are not affected; they may
+ * only be freed with {@link BFree} after this.
+ * 
+ * @param o the object
+ */
+static void BlockPool_Free (BlockPool *o);
+
+/**
+ * Obtains a block, either one kept for reuse or a newly allocated one.
+ * The block is suitably aligned for any type.
+ * 
+ * @param o the object
+ * @return the block, or NULL if out of memory
+ */
+static void * BlockPool_Get (BlockPool *o);
+
+/**
+ * Releases a block obtained with {@link BlockPool_Get}.
+ * 
+ * @param o the object
+ * @param block the block
+ */
+static void BlockPool_Put (BlockPool *o, void *block);
+
+void BlockPool_Init (BlockPool *o, size_t block_size, int max_free)
+{
+    ASSERT(block_size > 0)
+    ASSERT(max_free >= 0)
+    
+    // blocks on the free list hold the link
+    if (block_size < sizeof(struct BlockPool_block)) {
+        block_size = sizeof(struct BlockPool_block);
+    }
+    
+    o->block_size = block_size;
+    o->max_free = max_free;
+    o->free_first = NULL;
+    o->num_free = 0;
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void BlockPool_Free (BlockPool *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    while (o->free_first) {
+        struct BlockPool_block *b = o->free_first;
+        o->free_first = b->next;
+        BFree(b);
+    }
+}
+
+void * BlockPool_Get (BlockPool *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (o->free_first) {
+        ASSERT(o->num_free > 0)
+        
+        struct BlockPool_block *b = o->free_first;
+        o->free_first = b->next;
+        o->num_free--;
+        return b;
+    }
+    
+    return BAlloc(o->block_size);
+}
+
+void BlockPool_Put (BlockPool *o, void *block)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(block)
+    
+    if (o->num_free >= o->max_free) {
+        BFree(block);
+        return;
+    }
+    
+    struct BlockPool_block *b = (struct BlockPool_block *)block;
+    b->next = o->free_first;
+    o->free_first = b;
+    o->num_free++;
+}
+
+#endif
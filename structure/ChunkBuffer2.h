@@ -78,6 +78,9 @@ static void ChunkBuffer2_SubmitPacket (ChunkBuffer2 *buf, int len);
 // remove the first packet
 static void ChunkBuffer2_ConsumePacket (ChunkBuffer2 *buf);
 
+// get up to 'max' packets from the start of the buffer, without removing them
+static int ChunkBuffer2_PeekPackets (ChunkBuffer2 *buf, int max, uint8_t **out_data, int *out_len);
+
 static int _ChunkBuffer2_end (ChunkBuffer2 *buf)
 {
     if (buf->used >= buf->wrap - buf->start) {
@@ -314,4 +317,33 @@ void ChunkBuffer2_ConsumePacket (ChunkBuffer2 *buf)
     CHUNKBUFFER2_ASSERT_IO(buf)
 }
 
+int ChunkBuffer2_PeekPackets (ChunkBuffer2 *buf, int max, uint8_t **out_data, int *out_len)
+{
+    ASSERT(max >= 0)
+    
+    CHUNKBUFFER2_ASSERT_BUFFER(buf)
+    
+    int pos = buf->start;
+    int left = buf->used;
+    int num = 0;
+    
+    while (num < max && left > 0) {
+        int blocklen = bdivide_up(buf->buffer[pos].len, sizeof(struct ChunkBuffer2_block));
+        ASSERT(blocklen <= left - 1)
+        ASSERT(blocklen <= buf->wrap - pos - 1)
+        
+        out_data[num] = (uint8_t *)&buf->buffer[pos + 1];
+        out_len[num] = buf->buffer[pos].len;
+        num++;
+        
+        pos += 1 + blocklen;
+        left -= 1 + blocklen;
+        if (pos == buf->wrap) {
+            pos = 0;
+        }
+    }
+    
+    return num;
+}
+
 #endif
@@ -0,0 +1,340 @@
+/**
+ * @file PacketRing.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Circular packet buffer with cache-line aligned packets.
+ */
+
+#ifndef BADVPN_STRUCTURE_PACKETRING_H
+#define BADVPN_STRUCTURE_PACKETRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include <misc/debug.h>
+#include <misc/balign.h>
+#include <misc/balloc.h>
+#include <misc/bsize.h>
+
+#define PACKETRING_CACHE_LINE 64
+
+#ifdef __GNUC__
+#define PACKETRING_PREFETCH(_addr, _rw) __builtin_prefetch((_addr), (_rw));
+#else
+#define PACKETRING_PREFETCH(_addr, _rw)
+#endif
+
+struct PacketRing_desc {
+    int start;
+    int len;
+};
+
+/**
+ * Circular packet buffer with cache-line aligned packets.
+ * 
+ * Every packet starts on a cache line and takes as many whole cache lines as
+ * it needs, so packets never share a cache line. Packets are found through a
+ * ring of descriptors (position and length), whose size is a power of two.
+ * The producer writes a packet directly into the buffer, and may write many
+ * packets before submitting them together. The consumer looks at submitted
+ * packets in place, as many at once as it wants, and consumes them together.
+ * 
+ * In shared mode, there may be one producer thread and one consumer thread
+ * using the buffer at the same time without locking. Each side only writes its
+ * own position, which is kept on a cache line apart from the other one, and
+ * reads the other side's position with acquire semantics only when its own
+ * copy of it doesn't show enough packets or space.
+ */
+typedef struct {
+    uint8_t *mem;
+    uint8_t *lines;
+    struct PacketRing_desc *descs;
+    int num_lines;
+    unsigned int desc_mask;
+    int mtu;
+    int mtu_lines;
+    int shared;
+    uint8_t pad0[PACKETRING_CACHE_LINE];
+    // producer side
+    unsigned int tail;
+    unsigned int write_desc;
+    int write_off;
+    int write_start;
+    unsigned int head_cache;
+    uint8_t pad1[PACKETRING_CACHE_LINE];
+    // consumer side
+    unsigned int head;
+    unsigned int tail_cache;
+    uint8_t pad2[PACKETRING_CACHE_LINE];
+} PacketRing;
+
+// initialize to hold at least 'num_packets' packets up to 'mtu' long
+static int PacketRing_Init (PacketRing *o, int mtu, int num_packets, int shared) WARN_UNUSED;
+
+// free
+static void PacketRing_Free (PacketRing *o);
+
+// (producer) get where the next packet, up to MTU long, is to be written, or NULL if there's no space.
+// Once found, the location stays the same until the packet is written.
+static uint8_t * PacketRing_WriteDest (PacketRing *o);
+
+// (producer) finish writing a packet to the location from the last WriteDest; it is not visible until submitted
+static void PacketRing_Write (PacketRing *o, int len);
+
+// (producer) make written packets visible to the consumer
+static void PacketRing_Submit (PacketRing *o);
+
+// (producer) write and submit a packet
+static void PacketRing_SubmitPacket (PacketRing *o, int len);
+
+// (consumer) get the number of submitted packets; may be less than there are in shared mode
+static int PacketRing_ReadAvail (PacketRing *o);
+
+// (consumer) get up to 'max' packets from the start of the buffer, without removing them
+static int PacketRing_PeekPackets (PacketRing *o, int max, uint8_t **out_data, int *out_len);
+
+// (consumer) remove the first 'num' packets, which must have been seen with ReadAvail or PeekPackets
+static void PacketRing_ConsumePackets (PacketRing *o, int num);
+
+static unsigned int _PacketRing_load (PacketRing *o, unsigned int *ptr)
+{
+    if (o->shared) {
+        return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    }
+    return *ptr;
+}
+
+static void _PacketRing_store (PacketRing *o, unsigned int *ptr, unsigned int val)
+{
+    if (o->shared) {
+        __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+        return;
+    }
+    *ptr = val;
+}
+
+static int _PacketRing_packet_lines (int len)
+{
+    return (len > 0 ? bdivide_up(len, PACKETRING_CACHE_LINE) : 1);
+}
+
+// finds where an MTU long packet can be written, given the consumer's position
+static int _PacketRing_find_start (PacketRing *o, unsigned int head)
+{
+    ASSERT(o->write_desc - head <= o->desc_mask + 1)
+    
+    // no descriptors left
+    if (o->write_desc - head == o->desc_mask + 1) {
+        return -1;
+    }
+    
+    // nothing is in use, start over
+    if (head == o->write_desc) {
+        return 0;
+    }
+    
+    int head_off = o->descs[head & o->desc_mask].start;
+    
+    if (o->write_off > head_off) {
+        // used space doesn't wrap; use the end, or else the beginning
+        if (o->num_lines - o->write_off >= o->mtu_lines) {
+            return o->write_off;
+        }
+        if (head_off >= o->mtu_lines) {
+            return 0;
+        }
+        return -1;
+    }
+    
+    // used space wraps, or the buffer is full
+    if (head_off - o->write_off >= o->mtu_lines) {
+        return o->write_off;
+    }
+    return -1;
+}
+
+int PacketRing_Init (PacketRing *o, int mtu, int num_packets, int shared)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(num_packets > 0)
+    ASSERT(shared == 0 || shared == 1)
+    
+    // lines for num_packets packets and what may be left unused at the end
+    int mtu_lines = _PacketRing_packet_lines(mtu);
+    int num_lines;
+    if (!bsize_toint(bsize_mul(bsize_fromint(mtu_lines), bsize_add(bsize_fromint(num_packets), bsize_fromint(1))), &num_lines)) {
+        return 0;
+    }
+    
+    // a packet takes at least one line, so that many descriptors are enough
+    unsigned int num_descs = 1;
+    while (num_descs < (unsigned int)num_lines) {
+        if (num_descs > UINT_MAX / 2) {
+            return 0;
+        }
+        num_descs <<= 1;
+    }
+    
+    // allocate lines and descriptors, with room to align the lines
+    bsize_t size = bsize_mul(bsize_fromint(num_lines), bsize_fromsize(PACKETRING_CACHE_LINE));
+    size = bsize_add(size, bsize_mul(bsize_fromsize(num_descs), bsize_fromsize(sizeof(struct PacketRing_desc))));
+    size = bsize_add(size, bsize_fromsize(PACKETRING_CACHE_LINE - 1));
+    if (!(o->mem = (uint8_t *)BAllocSize(size))) {
+        return 0;
+    }
+    
+    o->lines = (uint8_t *)balign_up((uintptr_t)o->mem, PACKETRING_CACHE_LINE);
+    o->descs = (struct PacketRing_desc *)(o->lines + (size_t)num_lines * PACKETRING_CACHE_LINE);
+    o->num_lines = num_lines;
+    o->desc_mask = num_descs - 1;
+    o->mtu = mtu;
+    o->mtu_lines = mtu_lines;
+    o->shared = shared;
+    o->tail = 0;
+    o->write_desc = 0;
+    o->write_off = 0;
+    o->write_start = -1;
+    o->head_cache = 0;
+    o->head = 0;
+    o->tail_cache = 0;
+    
+    return 1;
+}
+
+void PacketRing_Free (PacketRing *o)
+{
+    BFree(o->mem);
+}
+
+uint8_t * PacketRing_WriteDest (PacketRing *o)
+{
+    // space only grows until the packet is written, so keep the location
+    if (o->write_start >= 0) {
+        return o->lines + (size_t)o->write_start * PACKETRING_CACHE_LINE;
+    }
+    
+    int start = _PacketRing_find_start(o, o->head_cache);
+    
+    // in shared mode, look at the consumer's position only if we seem to be out of space
+    if (!o->shared || start < 0) {
+        o->head_cache = _PacketRing_load(o, &o->head);
+        start = _PacketRing_find_start(o, o->head_cache);
+    }
+    
+    o->write_start = start;
+    
+    return (start >= 0 ? o->lines + (size_t)start * PACKETRING_CACHE_LINE : NULL);
+}
+
+void PacketRing_Write (PacketRing *o, int len)
+{
+    ASSERT(o->write_start >= 0)
+    ASSERT(len >= 0)
+    ASSERT(len <= o->mtu)
+    
+    struct PacketRing_desc *desc = &o->descs[o->write_desc & o->desc_mask];
+    desc->start = o->write_start;
+    desc->len = len;
+    
+    o->write_off = o->write_start + _PacketRing_packet_lines(len);
+    o->write_desc++;
+    o->write_start = -1;
+    
+    // the next packet is likely to be written here
+    if (o->write_off < o->num_lines) {
+        PACKETRING_PREFETCH(o->lines + (size_t)o->write_off * PACKETRING_CACHE_LINE, 1)
+    }
+}
+
+void PacketRing_Submit (PacketRing *o)
+{
+    // publish the written packets and their descriptors
+    _PacketRing_store(o, &o->tail, o->write_desc);
+}
+
+void PacketRing_SubmitPacket (PacketRing *o, int len)
+{
+    PacketRing_Write(o, len);
+    PacketRing_Submit(o);
+}
+
+int PacketRing_ReadAvail (PacketRing *o)
+{
+    unsigned int avail = o->tail_cache - o->head;
+    
+    // in shared mode, look at the producer's position only if we seem to be empty
+    if (!o->shared || avail == 0) {
+        o->tail_cache = _PacketRing_load(o, &o->tail);
+        avail = o->tail_cache - o->head;
+    }
+    ASSERT(avail <= o->desc_mask + 1)
+    
+    return avail;
+}
+
+int PacketRing_PeekPackets (PacketRing *o, int max, uint8_t **out_data, int *out_len)
+{
+    ASSERT(max >= 0)
+    
+    unsigned int avail = o->tail_cache - o->head;
+    
+    // in shared mode, look at the producer's position only if we seem to have fewer packets than wanted
+    if (!o->shared || avail < (unsigned int)max) {
+        o->tail_cache = _PacketRing_load(o, &o->tail);
+        avail = o->tail_cache - o->head;
+    }
+    ASSERT(avail <= o->desc_mask + 1)
+    
+    int num = (avail < (unsigned int)max ? (int)avail : max);
+    
+    for (int i = 0; i < num; i++) {
+        struct PacketRing_desc *desc = &o->descs[(o->head + i) & o->desc_mask];
+        out_data[i] = o->lines + (size_t)desc->start * PACKETRING_CACHE_LINE;
+        out_len[i] = desc->len;
+        
+        // packets after the first are likely to be read soon
+        if (i > 0) {
+            PACKETRING_PREFETCH(out_data[i], 0)
+        }
+    }
+    
+    return num;
+}
+
+void PacketRing_ConsumePackets (PacketRing *o, int num)
+{
+    ASSERT(num >= 0)
+    ASSERT((unsigned int)num <= o->tail_cache - o->head)
+    
+    // release the packets to the producer
+    _PacketRing_store(o, &o->head, o->head + num);
+}
+
+#endif
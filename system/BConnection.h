@@ -32,6 +32,7 @@
 
 #include <misc/debug.h>
 #include <flow/StreamPassInterface.h>
+#include <flow/PacketPassVecInterface.h>
 #include <flow/StreamRecvInterface.h>
 #include <system/BAddr.h>
 #include <system/BReactor.h>
@@ -57,6 +58,7 @@ struct BLisCon_from {
     union {
         struct {
             BAddr addr;
+            int reuse_port;
         } from_addr;
 #ifndef BADVPN_USE_WINAPI
         struct {
@@ -71,6 +73,22 @@ static struct BLisCon_from BLisCon_from_addr (BAddr addr)
     struct BLisCon_from res;
     res.type = BLISCON_FROM_ADDR;
     res.u.from_addr.addr = addr;
+    res.u.from_addr.reuse_port = 0;
+    return res;
+}
+
+/**
+ * Like {@link BLisCon_from_addr}, but a {@link BListener} will set SO_REUSEPORT
+ * on its socket, so that multiple processes can listen on the same address and
+ * have the kernel distribute connections among them. Not supported on Windows.
+ * Connectors ignore this.
+ */
+static struct BLisCon_from BLisCon_from_addr_reuse_port (BAddr addr)
+{
+    struct BLisCon_from res;
+    res.type = BLISCON_FROM_ADDR;
+    res.u.from_addr.addr = addr;
+    res.u.from_addr.reuse_port = 1;
     return res;
 }
 
@@ -338,6 +356,24 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
  */
 void BConnection_Free (BConnection *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Frees the object, but keeps the underlying socket open and returns it.
+ * The send and receive interfaces must not be initialized.
+ * 
+ * This is used to move a connection to another reactor, possibly running in another
+ * thread: pass the returned file descriptor there and create a new connection from it
+ * using a BCONNECTION_SOURCE_PIPE 'source' argument. Data not yet received stays queued
+ * in the socket. The caller becomes responsible for closing the file descriptor if the
+ * connection was responsible for it.
+ * Available on Unix-like systems only.
+ * 
+ * @param o the object
+ * @return file descriptor of the socket
+ */
+int BConnection_Release (BConnection *o);
+#endif
+
 /**
  * Updates the handler function.
  * 
@@ -392,13 +428,47 @@ void BConnection_SendAsync_Free (BConnection *o);
 
 /**
  * Returns the send interface.
- * The send interface must be initialized.
+ * The send interface must be initialized, and not in packet mode.
  * 
  * @param o the object
  * @return send interface
  */
 StreamPassInterface * BConnection_SendAsync_GetIf (BConnection *o);
 
+#ifndef BADVPN_USE_WINAPI
+
+/**
+ * Initializes the send interface for the connection in packet mode.
+ * The send interface must not be initialized.
+ * 
+ * In packet mode, data is sent via a {@link PacketPassVecInterface}. The segments
+ * of each packet are written to the connection with writev(), and the packet is
+ * only done when all of it has been written. This allows e.g. a framing header
+ * to be sent together with the payload without copying them into one buffer.
+ * The send interface is obtained with {@link BConnection_SendAsync_GetVecIf} instead
+ * of {@link BConnection_SendAsync_GetIf}, and is freed with {@link BConnection_SendAsync_Free}.
+ * Packet mode is not supported on Windows.
+ * 
+ * @param o the object
+ * @param mtu maximum total length of a packet. Must be >=0.
+ * @param max_segs maximum number of segments in a packet. Must be >0 and
+ *                 <=PACKETVEC_MAX_SEGS.
+ */
+void BConnection_SendAsync_InitVec (BConnection *o, int mtu, int max_segs);
+
+/**
+ * Returns the send interface in packet mode.
+ * The send interface must be initialized with {@link BConnection_SendAsync_InitVec}.
+ * The MTU and maximum number of segments of the interface will be as in
+ * {@link BConnection_SendAsync_InitVec}.
+ * 
+ * @param o the object
+ * @return send interface
+ */
+PacketPassVecInterface * BConnection_SendAsync_GetVecIf (BConnection *o);
+
+#endif
+
 /**
  * Initializes the receive interface for the connection.
  * The receive interface must not be initialized.
@@ -426,6 +496,61 @@ void BConnection_RecvAsync_Free (BConnection *o);
  */
 StreamRecvInterface * BConnection_RecvAsync_GetIf (BConnection *o);
 
+#ifdef BADVPN_LINUX
+
+/**
+ * Object which forwards everything received on one {@link BConnection} to another one,
+ * using splice() through a pipe, so that the data does not pass through user space.
+ * This is only available on Linux.
+ */
+typedef struct BConnectionRelay_s BConnectionRelay;
+
+#define BCONNECTIONRELAY_EVENT_ERROR 1
+#define BCONNECTIONRELAY_EVENT_RECVCLOSED 2
+
+/**
+ * Handler called when the relay stops.
+ * - If event is BCONNECTIONRELAY_EVENT_ERROR, receiving from the source or sending
+ *   to the destination failed. The relay must be freed, and the connections are no
+ *   longer usable and must be freed as well.
+ * - If event is BCONNECTIONRELAY_EVENT_RECVCLOSED, the receive end of the source
+ *   connection was closed by the remote peer and all data has been sent to the
+ *   destination. The relay must be freed, after which no further receive I/O or
+ *   receive interface initialization must occur on the source.
+ * 
+ * @param user as in {@link BConnectionRelay_Init}
+ * @param event what happened - BCONNECTIONRELAY_EVENT_ERROR or BCONNECTIONRELAY_EVENT_RECVCLOSED
+ */
+typedef void (*BConnectionRelay_handler) (void *user, int event);
+
+/**
+ * Initializes the relay.
+ * The relay takes the place of the receive interface of the source connection and
+ * the send interface of the destination connection, which must not be initialized,
+ * and must not be initialized while the relay exists.
+ * The two connections must be different objects and must live in the same reactor.
+ * 
+ * @param o the object
+ * @param src connection to receive data from
+ * @param dst connection to send data to
+ * @param user argument to handler
+ * @param handler handler called when the relay stops
+ * @return 1 on success, 0 on failure
+ */
+int BConnectionRelay_Init (BConnectionRelay *o, BConnection *src, BConnection *dst, void *user,
+                           BConnectionRelay_handler handler) WARN_UNUSED;
+
+/**
+ * Frees the relay.
+ * Any data already received from the source but not yet sent to the destination
+ * is lost.
+ * 
+ * @param o the object
+ */
+void BConnectionRelay_Free (BConnectionRelay *o);
+
+#endif
+
 
 
 #ifdef BADVPN_USE_WINAPI
@@ -27,16 +27,25 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef BADVPN_LINUX
+#include <fcntl.h>
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 
 #include <misc/nonblocking.h>
 #include <misc/strdup.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include "BConnection.h"
@@ -48,12 +57,14 @@
 #define SEND_STATE_NOT_INITED 0
 #define SEND_STATE_READY 1
 #define SEND_STATE_BUSY 2
+#define SEND_STATE_RELAY 3
 
 #define RECV_STATE_NOT_INITED 0
 #define RECV_STATE_READY 1
 #define RECV_STATE_BUSY 2
 #define RECV_STATE_INITED_CLOSED 3
 #define RECV_STATE_NOT_INITED_CLOSED 4
+#define RECV_STATE_RELAY 5
 
 struct sys_addr {
     socklen_t len;
@@ -72,21 +83,65 @@ struct unix_addr {
     } u;
 };
 
+#ifdef BCONNECTION_USE_URING
+// accepting by the reactor: a multishot accept reports connections, and each
+// is kept here until a BConnection takes it or the default job closes it
+struct BListener__uring {
+    BReactorIO io;
+    int accepted_fd; // -1 if none
+};
+
+// sends and receives performed by the reactor, straight from and into the
+// buffers of the interfaces; the kernel may access the buffers until the
+// operations complete or are cancelled
+struct BConnection__uring {
+    BReactorIO send_io;
+    BReactorIO recv_io;
+    int send_busy;
+    int recv_busy;
+    struct iovec send_iov[PACKETVEC_MAX_SEGS];
+    size_t send_left;
+};
+#endif
+
 static int build_unix_address (struct unix_addr *out, const char *socket_path);
 static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
+static int listener_uses_uring (BListener *o);
+static int listener_accept (BListener *o, struct sys_addr *sysaddr);
 static void listener_fd_handler (BListener *o, int events);
 static void listener_default_job_handler (BListener *o);
+#ifdef BCONNECTION_USE_URING
+static void listener_accept_handler (BListener *o, int res, int buf, int more);
+static struct BConnection__uring * connection_uring_alloc (BConnection *o);
+static void connection_uring_free (BConnection *o);
+#endif
 static void connector_fd_handler (BConnector *o, int events);
 static void connector_job_handler (BConnector *o);
 static void connection_report_error (BConnection *o);
+static int connection_send_in_reactor (BConnection *o);
+static int connection_recv_in_reactor (BConnection *o);
+static void connection_send_done (BConnection *o, int bytes);
 static void connection_send (BConnection *o);
+static void connection_send_vec_done (BConnection *o, size_t bytes, size_t left);
+static void connection_send_vec (BConnection *o);
+static void connection_recv_done (BConnection *o, int bytes);
 static void connection_recv (BConnection *o);
 static void connection_fd_handler (BConnection *o, int events);
 static void connection_send_job_handler (BConnection *o);
 static void connection_recv_job_handler (BConnection *o);
+#ifdef BCONNECTION_USE_URING
+static void connection_send_uring_handler (BConnection *o, int res, int buf, int more);
+static void connection_recv_uring_handler (BConnection *o, int res, int buf, int more);
+#endif
 static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int data_len);
+static void connection_send_vec_if_handler_send (BConnection *o, PacketVecSeg *segs, int num_segs);
 static void connection_recv_if_handler_recv (BConnection *o, uint8_t *data, int data_len);
+#ifdef BADVPN_LINUX
+static void relay_report (BConnectionRelay *o, int event);
+static void relay_wait (BConnection *c, int event);
+static void relay_job_handler (BConnectionRelay *o);
+#endif
 
 static int build_unix_address (struct unix_addr *out, const char *socket_path)
 {
@@ -147,6 +202,48 @@ static void addr_sys_to_socket (BAddr *out, struct sys_addr addr)
     }
 }
 
+static int listener_uses_uring (BListener *o)
+{
+#ifdef BCONNECTION_USE_URING
+    return !!o->uring;
+#else
+    return 0;
+#endif
+}
+
+static int listener_accept (BListener *o, struct sys_addr *sysaddr)
+{
+#ifdef BCONNECTION_USE_URING
+    // take the connection which the reactor accepted
+    if (o->uring) {
+        ASSERT(o->uring->accepted_fd >= 0)
+        
+        int fd = o->uring->accepted_fd;
+        o->uring->accepted_fd = -1;
+        
+        // get address, which the reactor does not return
+        if (getpeername(fd, &sysaddr->addr.generic, &sysaddr->len) < 0) {
+            BLog(BLOG_ERROR, "getpeername failed");
+            if (close(fd) < 0) {
+                BLog(BLOG_ERROR, "close failed");
+            }
+            return -1;
+        }
+        
+        return fd;
+    }
+#endif
+    
+    // accept
+    int fd = accept(o->fd, &sysaddr->addr.generic, &sysaddr->len);
+    if (fd < 0) {
+        BLog(BLOG_ERROR, "accept failed");
+        return -1;
+    }
+    
+    return fd;
+}
+
 static void listener_fd_handler (BListener *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -166,9 +263,10 @@ static void listener_default_job_handler (BListener *o)
     BLog(BLOG_ERROR, "discarding connection");
     
     // accept
-    int newfd = accept(o->fd, NULL, NULL);
+    struct sys_addr sysaddr;
+    sysaddr.len = sizeof(sysaddr.addr);
+    int newfd = listener_accept(o, &sysaddr);
     if (newfd < 0) {
-        BLog(BLOG_ERROR, "accept failed");
         return;
     }
     
@@ -178,6 +276,77 @@ static void listener_default_job_handler (BListener *o)
     }
 }
 
+#ifdef BCONNECTION_USE_URING
+
+static void listener_accept_handler (BListener *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->uring->accepted_fd < 0)
+    ASSERT(!BPending_IsSet(&o->default_job))
+    
+    // keep accepting if the kernel stopped
+    if (!more) {
+        BReactor_SubmitAcceptMultishot(o->reactor, &o->uring->io, o->fd);
+    }
+    
+    if (res < 0) {
+        BLog(BLOG_ERROR, "accept failed");
+        return;
+    }
+    
+    // remember connection
+    o->uring->accepted_fd = res;
+    
+    // set default job
+    BPending_Set(&o->default_job);
+    
+    // call handler
+    o->handler(o->user);
+    return;
+}
+
+static struct BConnection__uring * connection_uring_alloc (BConnection *o)
+{
+    struct BConnection__uring *u = BAlloc(sizeof(*u));
+    if (!u) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    BReactorIO_Init(&u->send_io, (BReactorIO_handler)connection_send_uring_handler, o);
+    if (!BReactor_AddIO(o->reactor, &u->send_io)) {
+        BLog(BLOG_ERROR, "BReactor_AddIO failed");
+        goto fail1;
+    }
+    
+    BReactorIO_Init(&u->recv_io, (BReactorIO_handler)connection_recv_uring_handler, o);
+    if (!BReactor_AddIO(o->reactor, &u->recv_io)) {
+        BLog(BLOG_ERROR, "BReactor_AddIO failed");
+        goto fail2;
+    }
+    
+    u->send_busy = 0;
+    u->recv_busy = 0;
+    
+    return u;
+    
+fail2:
+    BReactor_RemoveIO(o->reactor, &u->send_io);
+fail1:
+    BFree(u);
+fail0:
+    return NULL;
+}
+
+static void connection_uring_free (BConnection *o)
+{
+    BReactor_RemoveIO(o->reactor, &o->uring->recv_io);
+    BReactor_RemoveIO(o->reactor, &o->uring->send_io);
+    BFree(o->uring);
+}
+
+#endif
+
 static void connector_fd_handler (BConnector *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -236,11 +405,51 @@ static void connection_report_error (BConnection *o)
     return;
 }
 
+static int connection_send_in_reactor (BConnection *o)
+{
+#ifdef BCONNECTION_USE_URING
+    return (o->uring && o->uring->send_busy);
+#else
+    return 0;
+#endif
+}
+
+static int connection_recv_in_reactor (BConnection *o)
+{
+#ifdef BCONNECTION_USE_URING
+    return (o->uring && o->uring->recv_busy);
+#else
+    return 0;
+#endif
+}
+
+static void connection_send_done (BConnection *o, int bytes)
+{
+    ASSERT(o->send.state == SEND_STATE_BUSY)
+    ASSERT(bytes > 0)
+    ASSERT(bytes <= o->send.busy_data_len)
+    
+    // set ready
+    o->send.state = SEND_STATE_READY;
+    
+    // done
+    StreamPassInterface_Done(&o->send.iface, bytes);
+}
+
 static void connection_send (BConnection *o)
 {
     DebugError_AssertNoError(&o->d_err);
     ASSERT(o->send.state == SEND_STATE_BUSY)
     
+#ifdef BCONNECTION_USE_URING
+    // let the reactor send; connection_send_uring_handler is called when done
+    if (o->uring) {
+        BReactor_SubmitWrite(o->reactor, &o->uring->send_io, o->fd, o->send.busy_data, o->send.busy_data_len);
+        o->uring->send_busy = 1;
+        return;
+    }
+#endif
+    
     // limit
     if (!o->is_hupd) {
         if (!BReactorLimit_Increment(&o->send.limit)) {
@@ -266,14 +475,134 @@ static void connection_send (BConnection *o)
         return;
     }
     
-    ASSERT(bytes > 0)
-    ASSERT(bytes <= o->send.busy_data_len)
+    connection_send_done(o, bytes);
+}
+
+static void connection_send_vec_done (BConnection *o, size_t bytes, size_t left)
+{
+    ASSERT(o->send.state == SEND_STATE_BUSY)
+    ASSERT(o->send.vec)
+    ASSERT(bytes <= left)
+    
+    if (bytes < left) {
+        // advance past what was written
+        while (bytes > 0) {
+            PacketVecSeg *seg = &o->send.busy_segs[o->send.busy_seg_pos];
+            int seg_left = seg->len - o->send.busy_seg_off;
+            if (bytes < seg_left) {
+                o->send.busy_seg_off += bytes;
+                break;
+            }
+            bytes -= seg_left;
+            o->send.busy_seg_pos++;
+            o->send.busy_seg_off = 0;
+        }
+        
+        // continue sending the rest
+        BPending_Set(&o->send.job);
+        return;
+    }
     
     // set ready
     o->send.state = SEND_STATE_READY;
     
     // done
-    StreamPassInterface_Done(&o->send.iface, bytes);
+    PacketPassVecInterface_Done(&o->send.vec_iface);
+}
+
+static void connection_send_vec (BConnection *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_BUSY)
+    ASSERT(o->send.vec)
+    
+    // collect what's left of the packet; the reactor needs it to stay around
+    struct iovec local_iov[PACKETVEC_MAX_SEGS];
+    struct iovec *iov = local_iov;
+#ifdef BCONNECTION_USE_URING
+    if (o->uring) {
+        iov = o->uring->send_iov;
+    }
+#endif
+    int iovlen = 0;
+    size_t left = 0;
+    for (int i = o->send.busy_seg_pos; i < o->send.busy_num_segs; i++) {
+        PacketVecSeg *seg = &o->send.busy_segs[i];
+        int off = (i == o->send.busy_seg_pos ? o->send.busy_seg_off : 0);
+        if (seg->len - off == 0) {
+            continue;
+        }
+        iov[iovlen].iov_base = seg->data + off;
+        iov[iovlen].iov_len = seg->len - off;
+        left += iov[iovlen].iov_len;
+        iovlen++;
+    }
+    
+    if (left > 0) {
+#ifdef BCONNECTION_USE_URING
+        // let the reactor send; connection_send_uring_handler is called when done
+        if (o->uring) {
+            BReactor_SubmitWritev(o->reactor, &o->uring->send_io, o->fd, iov, iovlen);
+            o->uring->send_busy = 1;
+            o->uring->send_left = left;
+            return;
+        }
+#endif
+        
+        // limit
+        if (!o->is_hupd) {
+            if (!BReactorLimit_Increment(&o->send.limit)) {
+                // wait for fd
+                o->wait_events |= BREACTOR_WRITE;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+                return;
+            }
+        }
+        
+        // send
+        ssize_t bytes = writev(o->fd, iov, iovlen);
+        if (bytes < 0) {
+            if (!o->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // wait for fd
+                o->wait_events |= BREACTOR_WRITE;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+                return;
+            }
+            
+            BLog(BLOG_ERROR, "send failed");
+            connection_report_error(o);
+            return;
+        }
+        
+        ASSERT(bytes > 0)
+        
+        connection_send_vec_done(o, bytes, left);
+        return;
+    }
+    
+    connection_send_vec_done(o, 0, 0);
+}
+
+static void connection_recv_done (BConnection *o, int bytes)
+{
+    ASSERT(o->recv.state == RECV_STATE_BUSY)
+    ASSERT(bytes >= 0)
+    ASSERT(bytes <= o->recv.busy_data_avail)
+    
+    if (bytes == 0) {
+        // set recv inited closed
+        o->recv.state = RECV_STATE_INITED_CLOSED;
+        
+        // report recv closed
+        o->handler(o->user, BCONNECTION_EVENT_RECVCLOSED);
+        return;
+    }
+    
+    // set not busy
+    o->recv.state = RECV_STATE_READY;
+    
+    // done
+    StreamRecvInterface_Done(&o->recv.iface, bytes);
 }
 
 static void connection_recv (BConnection *o)
@@ -281,6 +610,15 @@ static void connection_recv (BConnection *o)
     DebugError_AssertNoError(&o->d_err);
     ASSERT(o->recv.state == RECV_STATE_BUSY)
     
+#ifdef BCONNECTION_USE_URING
+    // let the reactor receive; connection_recv_uring_handler is called when done
+    if (o->uring) {
+        BReactor_SubmitRead(o->reactor, &o->uring->recv_io, o->fd, o->recv.busy_data, o->recv.busy_data_avail);
+        o->uring->recv_busy = 1;
+        return;
+    }
+#endif
+    
     // limit
     if (!o->is_hupd) {
         if (!BReactorLimit_Increment(&o->recv.limit)) {
@@ -306,23 +644,7 @@ static void connection_recv (BConnection *o)
         return;
     }
     
-    if (bytes == 0) {
-        // set recv inited closed
-        o->recv.state = RECV_STATE_INITED_CLOSED;
-        
-        // report recv closed
-        o->handler(o->user, BCONNECTION_EVENT_RECVCLOSED);
-        return;
-    }
-    
-    ASSERT(bytes > 0)
-    ASSERT(bytes <= o->recv.busy_data_avail)
-    
-    // set not busy
-    o->recv.state = RECV_STATE_READY;
-    
-    // done
-    StreamRecvInterface_Done(&o->recv.iface, bytes);
+    connection_recv_done(o, bytes);
 }
 
 static void connection_fd_handler (BConnection *o, int events)
@@ -337,6 +659,7 @@ static void connection_fd_handler (BConnection *o, int events)
     
     int have_send = 0;
     int have_recv = 0;
+    int have_relay = 0;
     
     // if we got a HUP event, stop monitoring the file descriptor
     if ((events & BREACTOR_HUP)) {
@@ -344,13 +667,32 @@ static void connection_fd_handler (BConnection *o, int events)
         o->is_hupd = 1;
     }
     
-    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.state == SEND_STATE_BUSY)) {
+    #ifdef BADVPN_LINUX
+    // pass events to relays; they will find out about errors when they splice
+    if (o->send.state == SEND_STATE_RELAY && (events & (BREACTOR_WRITE|BREACTOR_ERROR|BREACTOR_HUP))) {
+        BPending_Set(&o->send.relay->job);
+        events &= ~BREACTOR_WRITE;
+        have_relay = 1;
+    }
+    if (o->recv.state == RECV_STATE_RELAY && (events & (BREACTOR_READ|BREACTOR_ERROR|BREACTOR_HUP))) {
+        BPending_Set(&o->recv.relay->job);
+        events &= ~BREACTOR_READ;
+        have_relay = 1;
+    }
+    #endif
+    
+    // sends and receives performed by the reactor report their own errors
+    int in_reactor = (connection_send_in_reactor(o) || connection_recv_in_reactor(o));
+    
+    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.state == SEND_STATE_BUSY && !connection_send_in_reactor(o))) {
         ASSERT(o->send.state == SEND_STATE_BUSY)
+        ASSERT(!connection_send_in_reactor(o))
         have_send = 1;
     }
     
-    if ((events & BREACTOR_READ) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->recv.state == RECV_STATE_BUSY)) {
+    if ((events & BREACTOR_READ) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->recv.state == RECV_STATE_BUSY && !connection_recv_in_reactor(o))) {
         ASSERT(o->recv.state == RECV_STATE_BUSY)
+        ASSERT(!connection_recv_in_reactor(o))
         have_recv = 1;
     }
     
@@ -359,6 +701,11 @@ static void connection_fd_handler (BConnection *o, int events)
             BPending_Set(&o->recv.job);
         }
         
+        if (o->send.vec) {
+            connection_send_vec(o);
+            return;
+        }
+        
         connection_send(o);
         return;
     }
@@ -368,7 +715,7 @@ static void connection_fd_handler (BConnection *o, int events)
         return;
     }
     
-    if (!o->is_hupd) {
+    if (!o->is_hupd && !have_relay && !in_reactor) {
         BLog(BLOG_ERROR, "fd error event");
         connection_report_error(o);
         return;
@@ -381,6 +728,11 @@ static void connection_send_job_handler (BConnection *o)
     DebugError_AssertNoError(&o->d_err);
     ASSERT(o->send.state == SEND_STATE_BUSY)
     
+    if (o->send.vec) {
+        connection_send_vec(o);
+        return;
+    }
+    
     connection_send(o);
     return;
 }
@@ -395,6 +747,70 @@ static void connection_recv_job_handler (BConnection *o)
     return;
 }
 
+#ifdef BCONNECTION_USE_URING
+
+static void connection_send_uring_handler (BConnection *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_BUSY)
+    ASSERT(o->uring->send_busy)
+    ASSERT(!more)
+    
+    o->uring->send_busy = 0;
+    
+    if (res < 0) {
+        // older kernels do not wait with non-blocking file descriptors
+        if (!o->is_hupd && res == -EAGAIN) {
+            // wait for fd
+            o->wait_events |= BREACTOR_WRITE;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "send failed");
+        connection_report_error(o);
+        return;
+    }
+    
+    if (o->send.vec) {
+        ASSERT(res > 0)
+        connection_send_vec_done(o, res, o->uring->send_left);
+        return;
+    }
+    
+    connection_send_done(o, res);
+}
+
+static void connection_recv_uring_handler (BConnection *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.state == RECV_STATE_BUSY)
+    ASSERT(o->uring->recv_busy)
+    ASSERT(!more)
+    
+    o->uring->recv_busy = 0;
+    
+    if (res < 0) {
+        // older kernels do not wait with non-blocking file descriptors
+        if (!o->is_hupd && res == -EAGAIN) {
+            // wait for fd
+            o->wait_events |= BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "recv failed");
+        connection_report_error(o);
+        return;
+    }
+    
+    connection_recv_done(o, res);
+}
+
+#endif
+
 static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int data_len)
 {
     DebugObject_Access(&o->d_obj);
@@ -413,6 +829,27 @@ static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int
     return;
 }
 
+static void connection_send_vec_if_handler_send (BConnection *o, PacketVecSeg *segs, int num_segs)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_READY)
+    ASSERT(o->send.vec)
+    ASSERT(num_segs >= 0)
+    
+    // remember segments
+    o->send.busy_segs = segs;
+    o->send.busy_num_segs = num_segs;
+    o->send.busy_seg_pos = 0;
+    o->send.busy_seg_off = 0;
+    
+    // set busy
+    o->send.state = SEND_STATE_BUSY;
+    
+    connection_send_vec(o);
+    return;
+}
+
 static void connection_recv_if_handler_recv (BConnection *o, uint8_t *data, int data_avail)
 {
     DebugObject_Access(&o->d_obj);
@@ -519,6 +956,19 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
             BLog(BLOG_ERROR, "setsockopt(SO_REUSEADDR) failed");
         }
         
+        // set SO_REUSEPORT
+        if (from.u.from_addr.reuse_port) {
+#ifdef SO_REUSEPORT
+            if (setsockopt(o->fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+                BLog(BLOG_ERROR, "setsockopt(SO_REUSEPORT) failed");
+                goto fail2;
+            }
+#else
+            BLog(BLOG_ERROR, "SO_REUSEPORT is not supported");
+            goto fail2;
+#endif
+        }
+        
         // bind
         if (bind(o->fd, &sysaddr.addr.generic, sysaddr.len) < 0) {
             BLog(BLOG_ERROR, "bind failed");
@@ -538,7 +988,30 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
         BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
         goto fail3;
     }
-    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
+    
+#ifdef BCONNECTION_USE_URING
+    // let the reactor accept connections if it can
+    o->uring = NULL;
+    if (BReactor_IOSupported(o->reactor)) {
+        if (!(o->uring = BAlloc(sizeof(*o->uring)))) {
+            BLog(BLOG_ERROR, "BAlloc failed");
+            goto fail4;
+        }
+        BReactorIO_Init(&o->uring->io, (BReactorIO_handler)listener_accept_handler, o);
+        if (!BReactor_AddIO(o->reactor, &o->uring->io)) {
+            BLog(BLOG_ERROR, "BReactor_AddIO failed");
+            BFree(o->uring);
+            goto fail4;
+        }
+        o->uring->accepted_fd = -1;
+        BReactor_SubmitAcceptMultishot(o->reactor, &o->uring->io, o->fd);
+    }
+#endif
+    
+    // wait for connections, unless the reactor accepts them
+    if (!listener_uses_uring(o)) {
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
+    }
     
     // init default job
     BPending_Init(&o->default_job, BReactor_PendingGroup(o->reactor), (BPending_handler)listener_default_job_handler, o);
@@ -546,6 +1019,10 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
     DebugObject_Init(&o->d_obj);
     return 1;
     
+#ifdef BCONNECTION_USE_URING
+fail4:
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+#endif
 fail3:
     if (from.type == BLISCON_FROM_UNIX) {
         if (unlink(o->unix_socket_path) < 0) {
@@ -569,6 +1046,22 @@ void BListener_Free (BListener *o)
     // free default job
     BPending_Free(&o->default_job);
     
+#ifdef BCONNECTION_USE_URING
+    if (o->uring) {
+        // stop accepting
+        BReactor_RemoveIO(o->reactor, &o->uring->io);
+        
+        // close connection which was not taken
+        if (o->uring->accepted_fd >= 0) {
+            if (close(o->uring->accepted_fd) < 0) {
+                BLog(BLOG_ERROR, "close failed");
+            }
+        }
+        
+        BFree(o->uring);
+    }
+#endif
+    
     // free BFileDescriptor
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
     
@@ -756,8 +1249,7 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
             // accept
             struct sys_addr sysaddr;
             sysaddr.len = sizeof(sysaddr.addr);
-            if ((o->fd = accept(listener->fd, &sysaddr.addr.generic, &sysaddr.len)) < 0) {
-                BLog(BLOG_ERROR, "accept failed");
+            if ((o->fd = listener_accept(listener, &sysaddr)) < 0) {
                 goto fail0;
             }
             o->close_fd = 1;
@@ -806,6 +1298,14 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
         goto fail1;
     }
     
+#ifdef BCONNECTION_USE_URING
+    // let the reactor perform sends and receives if it can
+    o->uring = NULL;
+    if (BReactor_IOSupported(o->reactor) && !(o->uring = connection_uring_alloc(o))) {
+        goto fail2;
+    }
+#endif
+    
     // set no wait events
     o->wait_events = 0;
     
@@ -821,6 +1321,10 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
     DebugObject_Init(&o->d_obj);
     return 1;
     
+#ifdef BCONNECTION_USE_URING
+fail2:
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+#endif
 fail1:
     if (o->close_fd) {
         if (close(o->fd) < 0) {
@@ -842,6 +1346,13 @@ void BConnection_Free (BConnection *o)
     BReactorLimit_Free(&o->recv.limit);
     BReactorLimit_Free(&o->send.limit);
     
+#ifdef BCONNECTION_USE_URING
+    // free reactor operations
+    if (o->uring) {
+        connection_uring_free(o);
+    }
+#endif
+    
     // free BFileDescriptor
     if (!o->is_hupd) {
         BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
@@ -855,6 +1366,32 @@ void BConnection_Free (BConnection *o)
     }
 }
 
+int BConnection_Release (BConnection *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugError_Free(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_NOT_INITED)
+    ASSERT(o->recv.state == RECV_STATE_NOT_INITED || o->recv.state == RECV_STATE_NOT_INITED_CLOSED)
+    
+    // free limits
+    BReactorLimit_Free(&o->recv.limit);
+    BReactorLimit_Free(&o->send.limit);
+    
+#ifdef BCONNECTION_USE_URING
+    // free reactor operations
+    if (o->uring) {
+        connection_uring_free(o);
+    }
+#endif
+    
+    // free BFileDescriptor
+    if (!o->is_hupd) {
+        BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+    }
+    
+    return o->fd;
+}
+
 void BConnection_SetHandlers (BConnection *o, void *user, BConnection_handler handler)
 {
     DebugObject_Access(&o->d_obj);
@@ -909,6 +1446,9 @@ void BConnection_SendAsync_Init (BConnection *o)
     // init interface
     StreamPassInterface_Init(&o->send.iface, (StreamPassInterface_handler_send)connection_send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
     
+    // set not packet mode
+    o->send.vec = 0;
+    
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_send_job_handler, o);
     
@@ -927,11 +1467,23 @@ void BConnection_SendAsync_Free (BConnection *o)
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
     }
     
+#ifdef BCONNECTION_USE_URING
+    // cancel send in progress, so the kernel no longer reads the data
+    if (o->uring) {
+        BReactor_CancelIO(o->reactor, &o->uring->send_io);
+        o->uring->send_busy = 0;
+    }
+#endif
+    
     // free job
     BPending_Free(&o->send.job);
     
     // free interface
-    StreamPassInterface_Free(&o->send.iface);
+    if (o->send.vec) {
+        PacketPassVecInterface_Free(&o->send.vec_iface);
+    } else {
+        StreamPassInterface_Free(&o->send.iface);
+    }
     
     // set not inited
     o->send.state = SEND_STATE_NOT_INITED;
@@ -941,10 +1493,42 @@ StreamPassInterface * BConnection_SendAsync_GetIf (BConnection *o)
 {
     DebugObject_Access(&o->d_obj);
     ASSERT(o->send.state == SEND_STATE_READY || o->send.state == SEND_STATE_BUSY)
+    ASSERT(!o->send.vec)
     
     return &o->send.iface;
 }
 
+void BConnection_SendAsync_InitVec (BConnection *o, int mtu, int max_segs)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_NOT_INITED)
+    ASSERT(mtu >= 0)
+    ASSERT(max_segs > 0)
+    ASSERT(max_segs <= PACKETVEC_MAX_SEGS)
+    
+    // init interface
+    PacketPassVecInterface_Init(&o->send.vec_iface, mtu, max_segs, (PacketPassVecInterface_handler_send)connection_send_vec_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    
+    // set packet mode
+    o->send.vec = 1;
+    
+    // init job
+    BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_send_job_handler, o);
+    
+    // set ready
+    o->send.state = SEND_STATE_READY;
+}
+
+PacketPassVecInterface * BConnection_SendAsync_GetVecIf (BConnection *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->send.state == SEND_STATE_READY || o->send.state == SEND_STATE_BUSY)
+    ASSERT(o->send.vec)
+    
+    return &o->send.vec_iface;
+}
+
 void BConnection_RecvAsync_Init (BConnection *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -972,6 +1556,14 @@ void BConnection_RecvAsync_Free (BConnection *o)
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
     }
     
+#ifdef BCONNECTION_USE_URING
+    // cancel receive in progress, so the kernel no longer writes to the buffer
+    if (o->uring) {
+        BReactor_CancelIO(o->reactor, &o->uring->recv_io);
+        o->uring->recv_busy = 0;
+    }
+#endif
+    
     // free job
     BPending_Free(&o->recv.job);
     
@@ -989,3 +1581,173 @@ StreamRecvInterface * BConnection_RecvAsync_GetIf (BConnection *o)
     
     return &o->recv.iface;
 }
+
+#ifdef BADVPN_LINUX
+
+static void relay_report (BConnectionRelay *o, int event)
+{
+    DebugError_AssertNoError(&o->d_err);
+    
+    DEBUGERROR(&o->d_err, o->handler(o->user, event));
+    return;
+}
+
+static void relay_wait (BConnection *c, int event)
+{
+    ASSERT(!c->is_hupd)
+    
+    c->wait_events |= event;
+    BReactor_SetFileDescriptorEvents(c->reactor, &c->bfd, c->wait_events);
+}
+
+static void relay_job_handler (BConnectionRelay *o)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->pipe_used >= 0)
+    ASSERT(o->pipe_used <= o->pipe_size)
+    
+    for (int i = 0; i < BCONNECTIONRELAY_SPLICE_LIMIT; i++) {
+        if (o->pipe_used > 0) {
+            // move data from the pipe to the destination
+            ssize_t bytes = splice(o->pipe_fds[0], NULL, o->dst->fd, NULL, o->pipe_used, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if (bytes < 0) {
+                if (!o->dst->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    relay_wait(o->dst, BREACTOR_WRITE);
+                    return;
+                }
+                
+                BLog(BLOG_ERROR, "relay: splice to connection failed");
+                relay_report(o, BCONNECTIONRELAY_EVENT_ERROR);
+                return;
+            }
+            
+            ASSERT(bytes > 0)
+            ASSERT(bytes <= o->pipe_used)
+            
+            o->pipe_used -= bytes;
+            continue;
+        }
+        
+        // Move data from the source to the pipe. We only do this when the pipe
+        // is empty, so that EAGAIN can only mean that the source has no data.
+        ssize_t bytes = splice(o->src->fd, NULL, o->pipe_fds[1], NULL, o->pipe_size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (bytes < 0) {
+            if (!o->src->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                relay_wait(o->src, BREACTOR_READ);
+                return;
+            }
+            
+            BLog(BLOG_ERROR, "relay: splice from connection failed");
+            relay_report(o, BCONNECTIONRELAY_EVENT_ERROR);
+            return;
+        }
+        
+        if (bytes == 0) {
+            // everything received has been sent
+            relay_report(o, BCONNECTIONRELAY_EVENT_RECVCLOSED);
+            return;
+        }
+        
+        ASSERT(bytes <= o->pipe_size)
+        
+        o->pipe_used = bytes;
+    }
+    
+    // let others have a chance, continue later
+    BPending_Set(&o->job);
+}
+
+int BConnectionRelay_Init (BConnectionRelay *o, BConnection *src, BConnection *dst, void *user,
+                           BConnectionRelay_handler handler)
+{
+    DebugObject_Access(&src->d_obj);
+    DebugObject_Access(&dst->d_obj);
+    DebugError_AssertNoError(&src->d_err);
+    DebugError_AssertNoError(&dst->d_err);
+    ASSERT(src != dst)
+    ASSERT(src->reactor == dst->reactor)
+    ASSERT(src->recv.state == RECV_STATE_NOT_INITED)
+    ASSERT(dst->send.state == SEND_STATE_NOT_INITED)
+    ASSERT(handler)
+    
+    // init arguments
+    o->src = src;
+    o->dst = dst;
+    o->user = user;
+    o->handler = handler;
+    
+    // create pipe
+    if (pipe2(o->pipe_fds, O_NONBLOCK|O_CLOEXEC) < 0) {
+        BLog(BLOG_ERROR, "pipe2 failed");
+        goto fail0;
+    }
+    
+    // get pipe capacity
+    if ((o->pipe_size = fcntl(o->pipe_fds[1], F_GETPIPE_SZ)) <= 0) {
+        BLog(BLOG_ERROR, "fcntl(F_GETPIPE_SZ) failed");
+        goto fail1;
+    }
+    
+    // pipe is empty
+    o->pipe_used = 0;
+    
+    // init job and start
+    BPending_Init(&o->job, BReactor_PendingGroup(src->reactor), (BPending_handler)relay_job_handler, o);
+    BPending_Set(&o->job);
+    
+    // take over the receive side of the source and the send side of the destination
+    src->recv.state = RECV_STATE_RELAY;
+    src->recv.relay = o;
+    dst->send.state = SEND_STATE_RELAY;
+    dst->send.relay = o;
+    
+    DebugError_Init(&o->d_err, BReactor_PendingGroup(src->reactor));
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    if (close(o->pipe_fds[0]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+    if (close(o->pipe_fds[1]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+fail0:
+    return 0;
+}
+
+void BConnectionRelay_Free (BConnectionRelay *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugError_Free(&o->d_err);
+    ASSERT(o->src->recv.state == RECV_STATE_RELAY)
+    ASSERT(o->dst->send.state == SEND_STATE_RELAY)
+    
+    // stop waiting for events
+    if (!o->src->is_hupd) {
+        o->src->wait_events &= ~BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->src->reactor, &o->src->bfd, o->src->wait_events);
+    }
+    if (!o->dst->is_hupd) {
+        o->dst->wait_events &= ~BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->dst->reactor, &o->dst->bfd, o->dst->wait_events);
+    }
+    
+    // release the connections
+    o->src->recv.state = RECV_STATE_NOT_INITED;
+    o->dst->send.state = SEND_STATE_NOT_INITED;
+    
+    // free job
+    BPending_Free(&o->job);
+    
+    // close pipe
+    if (close(o->pipe_fds[0]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+    if (close(o->pipe_fds[1]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+}
+
+#endif
@@ -33,6 +33,15 @@
 #define BCONNECTION_SEND_LIMIT 2
 #define BCONNECTION_RECV_LIMIT 2
 #define BCONNECTION_LISTEN_BACKLOG 128
+#define BCONNECTIONRELAY_SPLICE_LIMIT 16
+
+// with the io_uring backend, the reactor performs accepts, sends and receives
+#if defined(BADVPN_BREACTOR_BADVPN) && defined(BADVPN_USE_IO_URING)
+#define BCONNECTION_USE_URING
+#endif
+
+struct BListener__uring;
+struct BConnection__uring;
 
 struct BListener_s {
     BReactor *reactor;
@@ -42,6 +51,9 @@ struct BListener_s {
     int fd;
     BFileDescriptor bfd;
     BPending default_job;
+#ifdef BCONNECTION_USE_URING
+    struct BListener__uring *uring;
+#endif
     DebugObject d_obj;
 };
 
@@ -66,13 +78,25 @@ struct BConnection_s {
     int is_hupd;
     BFileDescriptor bfd;
     int wait_events;
+#ifdef BCONNECTION_USE_URING
+    struct BConnection__uring *uring;
+#endif
     struct {
         BReactorLimit limit;
         StreamPassInterface iface;
+        int vec;
+        PacketPassVecInterface vec_iface;
         BPending job;
         const uint8_t *busy_data;
         int busy_data_len;
+        PacketVecSeg *busy_segs;
+        int busy_num_segs;
+        int busy_seg_pos;
+        int busy_seg_off;
         int state;
+        #ifdef BADVPN_LINUX
+        BConnectionRelay *relay;
+        #endif
     } send;
     struct {
         BReactorLimit limit;
@@ -81,7 +105,27 @@ struct BConnection_s {
         uint8_t *busy_data;
         int busy_data_avail;
         int state;
+        #ifdef BADVPN_LINUX
+        BConnectionRelay *relay;
+        #endif
     } recv;
     DebugError d_err;
     DebugObject d_obj;
 };
+
+#ifdef BADVPN_LINUX
+
+struct BConnectionRelay_s {
+    BConnection *src;
+    BConnection *dst;
+    void *user;
+    BConnectionRelay_handler handler;
+    int pipe_fds[2];
+    int pipe_size;
+    int pipe_used;
+    BPending job;
+    DebugError d_err;
+    DebugObject d_obj;
+};
+
+#endif
@@ -456,6 +456,12 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
         goto fail0;
     }
     
+    // check SO_REUSEPORT
+    if (from.u.from_addr.reuse_port) {
+        BLog(BLOG_ERROR, "SO_REUSEPORT is not supported");
+        goto fail0;
+    }
+    
     // convert address
     struct sys_addr sysaddr;
     addr_socket_to_sys(&sysaddr, from.u.from_addr.addr);
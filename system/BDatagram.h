@@ -32,6 +32,7 @@
 
 #include <misc/debug.h>
 #include <flow/PacketPassInterface.h>
+#include <flow/PacketPassVecInterface.h>
 #include <flow/PacketRecvInterface.h>
 #include <system/BAddr.h>
 #include <system/BReactor.h>
@@ -90,6 +91,42 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
  */
 void BDatagram_Free (BDatagram *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Initializes the object using an existing datagram socket.
+ * {@link BNetwork_GlobalInit} must have been done.
+ * This is the counterpart of {@link BDatagram_Release}, used to move a datagram object
+ * to another reactor, possibly running in another thread. The socket may already be bound,
+ * and receiving starts immediately. Send addresses are not carried over and need to be set
+ * again, as does UDP offload.
+ * Available on Unix-like systems only.
+ * 
+ * @param o the object
+ * @param fd socket file descriptor. Must be >=0. The object takes responsibility for closing it,
+ *           and it will be closed even if this function fails.
+ * @param family address family of the socket. Must be supported according to
+ *               {@link BDatagram_AddressFamilySupported}.
+ * @param reactor reactor we live in
+ * @param user argument to handler
+ * @param handler handler called when an error occurs
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_InitFromFd (BDatagram *o, int fd, int family, BReactor *reactor, void *user,
+                          BDatagram_handler handler) WARN_UNUSED;
+
+/**
+ * Frees the object, but keeps the underlying socket open and returns it.
+ * The send and receive interfaces must not be initialized.
+ * The caller becomes responsible for closing the file descriptor, usually by
+ * passing it to {@link BDatagram_InitFromFd}.
+ * Available on Unix-like systems only.
+ * 
+ * @param o the object
+ * @return file descriptor of the socket
+ */
+int BDatagram_Release (BDatagram *o);
+#endif
+
 /**
  * Binds to the given local address.
  * May initiate I/O.
@@ -175,6 +212,79 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse);
  */
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu);
 
+/**
+ * Initializes the send interface in batch mode.
+ * The send interface must not be initialized.
+ * 
+ * In batch mode, datagrams submitted to the send interface are copied into a queue
+ * of up to batch_size datagrams and the send operation completes immediately, as long
+ * as there is space in the queue. The queue is flushed from a job, with as few system
+ * calls as possible (sendmmsg() on Linux).
+ * The send interface accepts batches of datagrams (see {@link PacketPassInterface_EnableBatch}),
+ * and takes as many of them into the queue as there is space for.
+ * Each queued datagram is sent to the addresses which were set when it was submitted.
+ * When the send interface is freed, an attempt is made to send any datagrams still
+ * in the queue, without waiting.
+ * 
+ * If memory for the queue cannot be allocated, this behaves like
+ * {@link BDatagram_SendAsync_Init}. Batching is not supported on Windows.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch_size maximum number of queued datagrams. Must be >0.
+ */
+void BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size);
+
+/**
+ * Enables UDP segmentation offload (GSO) for the send interface.
+ * The send interface must be initialized.
+ * 
+ * With GSO, consecutive queued datagrams with the same addresses and the same size
+ * (except that the last one may be shorter) are passed to the kernel as a single
+ * datagram, which is split into the original datagrams as late as possible.
+ * If sending fails because the route does not support it, GSO is disabled again.
+ * 
+ * GSO requires batch mode; this fails if the send interface was not initialized with
+ * {@link BDatagram_SendAsync_InitBatch}, if batching could not be enabled, or if the
+ * system does not support GSO.
+ * 
+ * @param o the object
+ * @return 1 if GSO was enabled, 0 if not
+ */
+int BDatagram_SendAsync_EnableGSO (BDatagram *o);
+
+#ifndef BADVPN_USE_WINAPI
+
+/**
+ * Initializes the send interface in vectored mode.
+ * The send interface must not be initialized.
+ * 
+ * In vectored mode, datagrams are sent via a {@link PacketPassVecInterface}, and the
+ * segments of each datagram are passed to the system in a single sendmsg() call,
+ * without joining them first. The send interface is obtained with
+ * {@link BDatagram_SendAsync_GetVecIf} instead of {@link BDatagram_SendAsync_GetIf}.
+ * Vectored mode cannot be combined with batching. It is not supported on Windows.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param max_segs maximum number of segments in a datagram. Must be >0 and
+ *                 <=PACKETVEC_MAX_SEGS.
+ */
+void BDatagram_SendAsync_InitVec (BDatagram *o, int mtu, int max_segs);
+
+/**
+ * Returns the send interface in vectored mode.
+ * The send interface must be initialized with {@link BDatagram_SendAsync_InitVec}.
+ * The MTU and maximum number of segments of the interface will be as in
+ * {@link BDatagram_SendAsync_InitVec}.
+ * 
+ * @param o the object
+ * @return send interface
+ */
+PacketPassVecInterface * BDatagram_SendAsync_GetVecIf (BDatagram *o);
+
+#endif
+
 /**
  * Frees the send interface.
  * The send interface must be initialized.
@@ -187,7 +297,7 @@ void BDatagram_SendAsync_Free (BDatagram *o);
 
 /**
  * Returns the send interface.
- * The send interface must be initialized.
+ * The send interface must be initialized, and not in vectored mode.
  * The MTU of the interface will be as in {@link BDatagram_SendAsync_Init}.
  * 
  * @param o the object
@@ -204,6 +314,46 @@ PacketPassInterface * BDatagram_SendAsync_GetIf (BDatagram *o);
  */
 void BDatagram_RecvAsync_Init (BDatagram *o, int mtu);
 
+/**
+ * Initializes the receive interface in batch mode.
+ * The receive interface must not be initialized.
+ * 
+ * In batch mode, whenever the socket needs to be read, up to batch_size datagrams
+ * are received at once (recvmmsg() on Linux). The first one is received directly
+ * into the buffer provided to the receive interface, the others are stored along with
+ * their addresses and are used to complete subsequent receive operations.
+ * {@link BDatagram_GetLastReceiveAddrs} returns the addresses of the datagram which
+ * was last passed to the receive interface, as in non-batch mode.
+ * Stored datagrams are lost if the receive interface is freed.
+ * 
+ * If memory for storing datagrams cannot be allocated, this behaves like
+ * {@link BDatagram_RecvAsync_Init}. Batching is not supported on Windows.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch_size maximum number of datagrams received at once. Must be >0.
+ */
+void BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size);
+
+/**
+ * Enables UDP receive offload (GRO) for the receive interface.
+ * The receive interface must be initialized, and no datagrams must have been received
+ * through it yet.
+ * 
+ * With GRO, the kernel may coalesce datagrams of a flow into a single larger one.
+ * Since any received datagram may be coalesced, each datagram in a batch is received
+ * into a 64 KiB buffer. Coalesced datagrams are split back into the original datagrams,
+ * which are passed to the receive interface one by one.
+ * 
+ * GRO requires batch mode; this fails if the receive interface was not initialized with
+ * {@link BDatagram_RecvAsync_InitBatch}, if batching could not be enabled, or if the
+ * system does not support GRO.
+ * 
+ * @param o the object
+ * @return 1 if GRO was enabled, 0 if not
+ */
+int BDatagram_RecvAsync_EnableGRO (BDatagram *o);
+
 /**
  * Frees the receive interface.
  * The receive interface must be initialized.
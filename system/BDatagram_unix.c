@@ -40,13 +40,19 @@
 #ifdef BADVPN_LINUX
 #    include <netpacket/packet.h>
 #    include <net/ethernet.h>
+#    include <netinet/udp.h>
 #endif
 
 #include <misc/nonblocking.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include "BDatagram.h"
 
+#ifdef BDATAGRAM_USE_URING
+#    include <linux/io_uring.h>
+#endif
+
 #include <generated/blog_channel_BDatagram.h>
 
 struct sys_addr {
@@ -61,18 +67,145 @@ struct sys_addr {
     } addr;
 };
 
+// room for the local address and UDP offload information
+union cmsg_data {
+    struct cmsghdr align;
+#ifdef BADVPN_FREEBSD
+    char in[CMSG_SPACE(sizeof(struct in_addr)) + CMSG_SPACE(sizeof(int))];
+#else
+    char in[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(int))];
+#endif
+    char in6[CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(int))];
+};
+
+#ifdef BADVPN_LINUX
+typedef struct mmsghdr batch_msghdr;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} batch_msghdr;
+#endif
+
+struct batch_entry {
+    struct sys_addr sysaddr;
+    BIPAddr local_addr;
+    struct iovec iov;
+    union cmsg_data cdata;
+    int segment_size;
+};
+
+struct BDatagram__batch {
+    struct batch_entry *entries;
+    batch_msghdr *msgs;
+    struct iovec *iovs;
+    uint8_t *data;
+};
+
+#ifdef BDATAGRAM_USE_URING
+// a send or receive performed by the reactor; the kernel may access
+// everything here until the operation completes or is cancelled
+struct BDatagram__uring {
+    BReactorIO io;
+    struct msghdr msg;
+    struct iovec iov[PACKETVEC_MAX_SEGS];
+    struct sys_addr sysaddr;
+    union cmsg_data cdata;
+    int total_len;
+};
+
+// batch sending by the reactor: each message of a flush is sent by its own
+// operation, and the operations are linked so that they are performed in order
+struct BDatagram__uring_send_op {
+    BReactorIO io;
+    BDatagram *o;
+};
+
+struct BDatagram__uring_send_batch {
+    struct BDatagram__uring_send_op *ops;
+    int num_msgs; // number of messages being sent, 0 if none
+    int num_done; // number of them whose operations have completed
+    int num_sent; // number of them which were sent
+    int error; // first error, 0 if none
+};
+
+// batch receiving by the reactor: a multishot receive fills buffers from a
+// ring, which wait in a queue until their datagrams are delivered
+struct BDatagram__uring_recv_batch {
+    BReactorBufferRing ring;
+    struct msghdr msg;
+    int *queue;
+    int queue_start;
+    int queue_count;
+    int offset; // how much of the datagram at the front of the queue was delivered
+    int segment_size;
+    int armed; // whether the multishot receive is in progress
+};
+
+// layout of the buffers of a multishot receive: the header, the address,
+// the control messages and finally the data, all 8-byte aligned
+#define URING_RECV_NAMELEN ((sizeof(((struct sys_addr *)0)->addr) + 7) / 8 * 8)
+#define URING_RECV_HEADER (sizeof(struct io_uring_recvmsg_out) + URING_RECV_NAMELEN + sizeof(union cmsg_data))
+#endif
+
 static int family_socket_to_sys (int family);
 static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
 static void set_pktinfo (int fd, int family);
+static size_t build_send_control (union cmsg_data *cdata, BIPAddr local_addr);
+static void parse_recv_control (struct msghdr *msg, BIPAddr *local_addr);
+static size_t build_segment_control (union cmsg_data *cdata, size_t offset, int segment_size);
+static int parse_segment_control (struct msghdr *msg);
+static struct BDatagram__batch * batch_alloc (int batch_size, int num_bufs, int mtu);
+static void batch_free (struct BDatagram__batch *b);
+static int batch_sendmmsg (int fd, batch_msghdr *msgs, int num);
+static int batch_recvmmsg (int fd, batch_msghdr *msgs, int num);
+#ifdef BDATAGRAM_USE_URING
+static struct BDatagram__uring * uring_alloc (BDatagram *o, BReactorIO_handler handler);
+static void uring_free (BDatagram *o, struct BDatagram__uring *u);
+static struct BDatagram__uring_send_batch * uring_send_batch_alloc (BDatagram *o, int num_ops);
+static void uring_send_batch_free (BDatagram *o, struct BDatagram__uring_send_batch *ub);
+static struct BDatagram__uring_recv_batch * uring_recv_batch_alloc (BDatagram *o, int batch_size, int payload_size);
+static void uring_recv_batch_free (BDatagram *o, struct BDatagram__uring_recv_batch *ub);
+#endif
+static int send_uses_uring (BDatagram *o);
+static int recv_uses_uring (BDatagram *o);
 static void report_error (BDatagram *o);
+static void start_recv (BDatagram *o);
+static int build_send_msg (BDatagram *o, struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union cmsg_data *cdata);
+static void send_done (BDatagram *o, int bytes, int total_len);
 static void do_send (BDatagram *o);
+static void send_batch_queue (BDatagram *o);
+static int send_batch_can_segment (BDatagram *o, struct batch_entry *first, struct batch_entry *prev, struct batch_entry *e, int num_segments, size_t total_len);
+static int send_batch_build (BDatagram *o);
+static void send_batch_remove (BDatagram *o, int num_msgs);
+static int send_batch_flush (BDatagram *o);
+static void do_send_batch (BDatagram *o);
+static void recv_done (BDatagram *o, struct sys_addr *sysaddr, struct msghdr *msg, int bytes);
+static void build_recv_msg (BDatagram *o, struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union cmsg_data *cdata);
 static void do_recv (BDatagram *o);
+static void recv_batch_deliver (BDatagram *o);
+static void do_recv_batch (BDatagram *o);
+#ifdef BDATAGRAM_USE_URING
+static void send_batch_submit (BDatagram *o);
+static void recv_uring_batch_arm (BDatagram *o);
+static void recv_uring_batch_deliver (BDatagram *o);
+static void do_recv_uring_batch (BDatagram *o);
+#endif
 static void fd_handler (BDatagram *o, int events);
 static void send_job_handler (BDatagram *o);
 static void recv_job_handler (BDatagram *o);
+#ifdef BDATAGRAM_USE_URING
+static void send_uring_handler (BDatagram *o, int res, int buf, int more);
+static void send_uring_batch_handler (struct BDatagram__uring_send_op *op, int res, int buf, int more);
+static void recv_uring_handler (BDatagram *o, int res, int buf, int more);
+static void recv_uring_batch_handler (BDatagram *o, int res, int buf, int more);
+#endif
 static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len);
+static void send_if_handler_send_batch (BDatagram *o, struct PacketPassInterface_packet *packets, int num_packets);
+static void send_vec_if_handler_send (BDatagram *o, PacketVecSeg *segs, int num_segs);
 static void recv_if_handler_recv (BDatagram *o, uint8_t *data);
+static int init_with_fd (BDatagram *o, int family, int recv_started);
 
 static int family_socket_to_sys (int family)
 {
@@ -231,61 +364,11 @@ static void set_pktinfo (int fd, int family)
     }
 }
 
-static void report_error (BDatagram *o)
-{
-    DebugError_AssertNoError(&o->d_err);
-    
-    // report error
-    DEBUGERROR(&o->d_err, o->handler(o->user, BDATAGRAM_EVENT_ERROR));
-    return;
-}
-
-static void do_send (BDatagram *o)
+static size_t build_send_control (union cmsg_data *cdata, BIPAddr local_addr)
 {
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
-    ASSERT(o->send.have_addrs)
-    
-    // limit
-    if (!BReactorLimit_Increment(&o->send.limit)) {
-        // wait for fd
-        o->wait_events |= BREACTOR_WRITE;
-        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-        return;
-    }
-    
-    // convert destination address
-    struct sys_addr sysaddr;
-    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
-    
-    struct iovec iov;
-    iov.iov_base = (uint8_t *)o->send.busy_data;
-    iov.iov_len = o->send.busy_data_len;
-    
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
-    
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sysaddr.addr.generic;
-    msg.msg_namelen = sysaddr.len;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
-    
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    struct cmsghdr *cmsg = &cdata->align;
     
-    size_t controllen = 0;
-    
-    switch (o->send.local_addr.type) {
+    switch (local_addr.type) {
         case BADDR_TYPE_IPV4: {
 #ifdef BADVPN_FREEBSD
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
@@ -293,16 +376,16 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IP_SENDSRCADDR;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
             struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            addrinfo->s_addr = o->send.local_addr.ipv4;
-            controllen += CMSG_SPACE(sizeof(struct in_addr));
+            addrinfo->s_addr = local_addr.ipv4;
+            return CMSG_SPACE(sizeof(struct in_addr));
 #else
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
             cmsg->cmsg_level = IPPROTO_IP;
             cmsg->cmsg_type = IP_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
             struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            pktinfo->ipi_spec_dst.s_addr = o->send.local_addr.ipv4;
-            controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
+            pktinfo->ipi_spec_dst.s_addr = local_addr.ipv4;
+            return CMSG_SPACE(sizeof(struct in_pktinfo));
 #endif
         } break;
         
@@ -312,230 +395,1315 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IPV6_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
             struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
-            controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
+            memcpy(pktinfo->ipi6_addr.s6_addr, local_addr.ipv6, 16);
+            return CMSG_SPACE(sizeof(struct in6_pktinfo));
         } break;
     }
     
-    msg.msg_controllen = controllen;
-    
-    if (msg.msg_controllen == 0) {
-        msg.msg_control = NULL;
-    }
-    
-    // send
-    int bytes = sendmsg(o->fd, &msg, 0);
-    if (bytes < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // wait for fd
-            o->wait_events |= BREACTOR_WRITE;
-            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-            return;
-        }
-        
-        report_error(o);
-        return;
-    }
-    
-    ASSERT(bytes >= 0)
-    ASSERT(bytes <= o->send.busy_data_len)
-    
-    if (bytes < o->send.busy_data_len) {
-        BLog(BLOG_ERROR, "send sent too little");
-    }
-    
-    // if recv wasn't started yet, start it
-    if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
-    }
-    
-    // set not busy
-    o->send.busy = 0;
-    
-    // done
-    PacketPassInterface_Done(&o->send.iface);
+    return 0;
 }
 
-static void do_recv (BDatagram *o)
+static void parse_recv_control (struct msghdr *msg, BIPAddr *local_addr)
 {
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->recv.inited)
-    ASSERT(o->recv.busy)
-    ASSERT(o->recv.started)
-    
-    // limit
-    if (!BReactorLimit_Increment(&o->recv.limit)) {
-        // wait for fd
-        o->wait_events |= BREACTOR_READ;
-        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-        return;
-    }
-    
-    struct sys_addr sysaddr;
-    
-    struct iovec iov;
-    iov.iov_base = o->recv.busy_data;
-    iov.iov_len = o->recv.mtu;
-    
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
-    
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sysaddr.addr.generic;
-    msg.msg_namelen = sizeof(sysaddr.addr);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
-    
-    // recv
-    int bytes = recvmsg(o->fd, &msg, 0);
-    if (bytes < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // wait for fd
-            o->wait_events |= BREACTOR_READ;
-            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-            return;
-        }
-        
-        BLog(BLOG_ERROR, "recv failed");
-        report_error(o);
-        return;
-    }
-    
-    ASSERT(bytes >= 0)
-    ASSERT(bytes <= o->recv.mtu)
-    
-    // read returned address
-    sysaddr.len = msg.msg_namelen;
-    addr_sys_to_socket(&o->recv.remote_addr, sysaddr);
+    BIPAddr_InitInvalid(local_addr);
     
-    // read returned local address
-    BIPAddr_InitInvalid(&o->recv.local_addr);
-    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
 #ifdef BADVPN_FREEBSD
         if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
             struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, addrinfo->s_addr);
+            BIPAddr_InitIPv4(local_addr, addrinfo->s_addr);
         }
 #else
         if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
             struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, pktinfo->ipi_addr.s_addr);
+            BIPAddr_InitIPv4(local_addr, pktinfo->ipi_addr.s_addr);
         }
 #endif
         else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
             struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv6(&o->recv.local_addr, pktinfo->ipi6_addr.s6_addr);
+            BIPAddr_InitIPv6(local_addr, pktinfo->ipi6_addr.s6_addr);
         }
     }
-    
-    // set have addresses
-    o->recv.have_addrs = 1;
-    
-    // set not busy
-    o->recv.busy = 0;
-    
-    // done
-    PacketRecvInterface_Done(&o->recv.iface, bytes);
 }
 
-static void fd_handler (BDatagram *o, int events)
+static size_t build_segment_control (union cmsg_data *cdata, size_t offset, int segment_size)
 {
-    DebugObject_Access(&o->d_obj);
-    DebugError_AssertNoError(&o->d_err);
+    ASSERT(offset + CMSG_SPACE(sizeof(uint16_t)) <= sizeof(*cdata))
+    ASSERT(segment_size > 0)
+    ASSERT(segment_size <= UINT16_MAX)
+    
+#ifdef UDP_SEGMENT
+    struct cmsghdr *cmsg = (struct cmsghdr *)((char *)cdata + offset);
+    memset(cmsg, 0, CMSG_SPACE(sizeof(uint16_t)));
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t size = segment_size;
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+    return CMSG_SPACE(sizeof(uint16_t));
+#else
+    ASSERT(0);
+    return 0;
+#endif
+}
+
+static int parse_segment_control (struct msghdr *msg)
+{
+#ifdef UDP_GRO
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return (size > 0 ? size : 0);
+        }
+    }
+#endif
     
-    // clear handled events
-    o->wait_events &= ~events;
-    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+    return 0;
+}
+
+static struct BDatagram__batch * batch_alloc (int batch_size, int num_bufs, int mtu)
+{
+    ASSERT(batch_size > 0)
+    ASSERT(num_bufs >= 0)
+    ASSERT(mtu >= 0)
     
-    int have_send = 0;
-    int have_recv = 0;
+    struct BDatagram__batch *b = (struct BDatagram__batch *)BAlloc(sizeof(*b));
+    if (!b) {
+        goto fail0;
+    }
     
-    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && o->send.busy && o->send.have_addrs)) {
-        ASSERT(o->send.inited)
-        ASSERT(o->send.busy)
-        ASSERT(o->send.have_addrs)
-        
-        have_send = 1;
+    if (!(b->entries = (struct batch_entry *)BAllocArray(batch_size, sizeof(b->entries[0])))) {
+        goto fail1;
     }
     
-    if ((events & BREACTOR_READ) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->recv.inited && o->recv.busy && o->recv.started)) {
-        ASSERT(o->recv.inited)
-        ASSERT(o->recv.busy)
-        ASSERT(o->recv.started)
-        
-        have_recv = 1;
+    if (!(b->msgs = (batch_msghdr *)BAllocArray(batch_size, sizeof(b->msgs[0])))) {
+        goto fail2;
     }
     
-    if (have_send) {
-        if (have_recv) {
-            BPending_Set(&o->recv.job);
-        }
-        
-        do_send(o);
-        return;
+    if (!(b->iovs = (struct iovec *)BAllocArray(batch_size, sizeof(b->iovs[0])))) {
+        goto fail3;
     }
     
-    if (have_recv) {
-        do_recv(o);
-        return;
+    b->data = NULL;
+    if (num_bufs > 0 && mtu > 0 && !(b->data = (uint8_t *)BAllocArray2(num_bufs, mtu, 1))) {
+        goto fail4;
     }
     
-    BLog(BLOG_ERROR, "fd error event");
-    report_error(o);
-    return;
+    return b;
+    
+fail4:
+    BFree(b->iovs);
+fail3:
+    BFree(b->msgs);
+fail2:
+    BFree(b->entries);
+fail1:
+    BFree(b);
+fail0:
+    return NULL;
 }
 
-static void send_job_handler (BDatagram *o)
+static void batch_free (struct BDatagram__batch *b)
 {
-    DebugObject_Access(&o->d_obj);
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
-    ASSERT(o->send.have_addrs)
+    BFree(b->data);
+    BFree(b->iovs);
+    BFree(b->msgs);
+    BFree(b->entries);
+    BFree(b);
+}
+
+static int batch_sendmmsg (int fd, batch_msghdr *msgs, int num)
+{
+    ASSERT(num > 0)
     
-    do_send(o);
-    return;
+#ifdef BADVPN_LINUX
+    return sendmmsg(fd, msgs, num, 0);
+#else
+    int i;
+    for (i = 0; i < num; i++) {
+        int bytes = sendmsg(fd, &msgs[i].msg_hdr, 0);
+        if (bytes < 0) {
+            return (i > 0 ? i : -1);
+        }
+        msgs[i].msg_len = bytes;
+    }
+    return i;
+#endif
 }
 
-static void recv_job_handler (BDatagram *o)
+static int batch_recvmmsg (int fd, batch_msghdr *msgs, int num)
 {
-    DebugObject_Access(&o->d_obj);
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->recv.inited)
-    ASSERT(o->recv.busy)
-    ASSERT(o->recv.started)
+    ASSERT(num > 0)
     
-    do_recv(o);
-    return;
+#ifdef BADVPN_LINUX
+    return recvmmsg(fd, msgs, num, 0, NULL);
+#else
+    int i;
+    for (i = 0; i < num; i++) {
+        int bytes = recvmsg(fd, &msgs[i].msg_hdr, 0);
+        if (bytes < 0) {
+            return (i > 0 ? i : -1);
+        }
+        msgs[i].msg_len = bytes;
+    }
+    return i;
+#endif
 }
 
-static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len)
+#ifdef BDATAGRAM_USE_URING
+
+static struct BDatagram__uring * uring_alloc (BDatagram *o, BReactorIO_handler handler)
 {
-    DebugObject_Access(&o->d_obj);
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(!o->send.busy)
-    ASSERT(data_len >= 0)
-    ASSERT(data_len <= o->send.mtu)
+    struct BDatagram__uring *u = BAlloc(sizeof(*u));
+    if (!u) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return NULL;
+    }
     
-    // remember data
-    o->send.busy_data = data;
-    o->send.busy_data_len = data_len;
+    BReactorIO_Init(&u->io, handler, o);
+    if (!BReactor_AddIO(o->reactor, &u->io)) {
+        BLog(BLOG_ERROR, "BReactor_AddIO failed");
+        BFree(u);
+        return NULL;
+    }
+    
+    return u;
+}
+
+static void uring_free (BDatagram *o, struct BDatagram__uring *u)
+{
+    BReactor_RemoveIO(o->reactor, &u->io);
+    BFree(u);
+}
+
+static struct BDatagram__uring_send_batch * uring_send_batch_alloc (BDatagram *o, int num_ops)
+{
+    ASSERT(num_ops > 0)
+    
+    struct BDatagram__uring_send_batch *ub = BAlloc(sizeof(*ub));
+    if (!ub) {
+        goto fail0;
+    }
+    
+    if (!(ub->ops = BAllocArray(num_ops, sizeof(ub->ops[0])))) {
+        goto fail1;
+    }
+    
+    int i;
+    for (i = 0; i < num_ops; i++) {
+        ub->ops[i].o = o;
+        BReactorIO_Init(&ub->ops[i].io, (BReactorIO_handler)send_uring_batch_handler, &ub->ops[i]);
+        if (!BReactor_AddIO(o->reactor, &ub->ops[i].io)) {
+            goto fail2;
+        }
+    }
+    
+    ub->num_msgs = 0;
+    
+    return ub;
+    
+fail2:
+    while (i-- > 0) {
+        BReactor_RemoveIO(o->reactor, &ub->ops[i].io);
+    }
+    BFree(ub->ops);
+fail1:
+    BFree(ub);
+fail0:
+    return NULL;
+}
+
+static void uring_send_batch_free (BDatagram *o, struct BDatagram__uring_send_batch *ub)
+{
+    for (int i = 0; i < o->send.batch_size; i++) {
+        BReactor_RemoveIO(o->reactor, &ub->ops[i].io);
+    }
+    BFree(ub->ops);
+    BFree(ub);
+}
+
+static struct BDatagram__uring_recv_batch * uring_recv_batch_alloc (BDatagram *o, int batch_size, int payload_size)
+{
+    ASSERT(batch_size > 0)
+    ASSERT(payload_size >= 0)
+    
+    // the ring needs a power of two of buffers
+    int num_bufs = 1;
+    while (num_bufs < batch_size && num_bufs < 32768) {
+        num_bufs *= 2;
+    }
+    
+    struct BDatagram__uring_recv_batch *ub = BAlloc(sizeof(*ub));
+    if (!ub) {
+        goto fail0;
+    }
+    
+    if (!(ub->queue = BAllocArray(num_bufs, sizeof(ub->queue[0])))) {
+        goto fail1;
+    }
+    
+    int buf_size = URING_RECV_HEADER + (payload_size + 7) / 8 * 8;
+    if (!BReactorBufferRing_Init(&ub->ring, o->reactor, num_bufs, buf_size)) {
+        goto fail2;
+    }
+    
+    // reserve space for the address and control messages in each buffer
+    memset(&ub->msg, 0, sizeof(ub->msg));
+    ub->msg.msg_namelen = URING_RECV_NAMELEN;
+    ub->msg.msg_controllen = sizeof(union cmsg_data);
+    
+    ub->queue_start = 0;
+    ub->queue_count = 0;
+    ub->offset = 0;
+    ub->armed = 0;
+    
+    return ub;
+    
+fail2:
+    BFree(ub->queue);
+fail1:
+    BFree(ub);
+fail0:
+    return NULL;
+}
+
+static void uring_recv_batch_free (BDatagram *o, struct BDatagram__uring_recv_batch *ub)
+{
+    // stop receiving into the ring
+    BReactor_CancelIO(o->reactor, &o->recv.uring->io);
+    
+    BReactorBufferRing_Free(&ub->ring);
+    BFree(ub->queue);
+    BFree(ub);
+}
+
+#endif
+
+static int send_uses_uring (BDatagram *o)
+{
+#ifdef BDATAGRAM_USE_URING
+    return (o->send.uring && (!o->send.batch || o->send.uring_batch));
+#else
+    return 0;
+#endif
+}
+
+static int recv_uses_uring (BDatagram *o)
+{
+#ifdef BDATAGRAM_USE_URING
+    return (o->recv.uring && !o->recv.batch);
+#else
+    return 0;
+#endif
+}
+
+static void report_error (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    
+    // report error
+    DEBUGERROR(&o->d_err, o->handler(o->user, BDATAGRAM_EVENT_ERROR));
+    return;
+}
+
+static void start_recv (BDatagram *o)
+{
+    // if recv wasn't started yet, start it
+    if (!o->recv.started) {
+        // set recv started
+        o->recv.started = 1;
+        
+        // continue receiving
+        if (o->recv.inited && o->recv.busy) {
+            BPending_Set(&o->recv.job);
+        }
+    }
+}
+
+static int build_send_msg (BDatagram *o, struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union cmsg_data *cdata)
+{
+    ASSERT(o->send.busy)
+    ASSERT(o->send.have_addrs)
+    
+    // convert destination address
+    addr_socket_to_sys(sysaddr, o->send.remote_addr);
+    
+    int iovlen;
+    int total_len;
+    
+    if (o->send.vec) {
+        // one iovec per segment
+        iovlen = 0;
+        for (int i = 0; i < o->send.busy_num_segs; i++) {
+            iov[iovlen].iov_base = o->send.busy_segs[i].data;
+            iov[iovlen].iov_len = o->send.busy_segs[i].len;
+            iovlen++;
+        }
+        total_len = PacketVecSeg_TotalLen(o->send.busy_segs, o->send.busy_num_segs);
+    } else {
+        iov[0].iov_base = (uint8_t *)o->send.busy_data;
+        iov[0].iov_len = o->send.busy_data_len;
+        iovlen = 1;
+        total_len = o->send.busy_data_len;
+    }
+    
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &sysaddr->addr.generic;
+    msg->msg_namelen = sysaddr->len;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = iovlen;
+    msg->msg_control = cdata;
+    msg->msg_controllen = build_send_control(cdata, o->send.local_addr);
+    
+    if (msg->msg_controllen == 0) {
+        msg->msg_control = NULL;
+    }
+    
+    return total_len;
+}
+
+static void send_done (BDatagram *o, int bytes, int total_len)
+{
+    ASSERT(o->send.busy)
+    ASSERT(bytes >= 0)
+    ASSERT(bytes <= total_len)
+    
+    if (bytes < total_len) {
+        BLog(BLOG_ERROR, "send sent too little");
+    }
+    
+    // start receiving if not yet
+    start_recv(o);
+    
+    // set not busy
+    o->send.busy = 0;
+    
+    // done
+    if (o->send.vec) {
+        PacketPassVecInterface_Done(&o->send.vec_iface);
+    } else {
+        PacketPassInterface_Done(&o->send.iface);
+    }
+}
+
+static void do_send (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.busy)
+    ASSERT(o->send.have_addrs)
+    
+#ifdef BDATAGRAM_USE_URING
+    // let the reactor send; send_uring_handler is called when done
+    if (o->send.uring) {
+        struct BDatagram__uring *u = o->send.uring;
+        u->total_len = build_send_msg(o, &u->msg, u->iov, &u->sysaddr, &u->cdata);
+        BReactor_SubmitSendmsg(o->reactor, &u->io, o->fd, &u->msg, 0);
+        return;
+    }
+#endif
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->send.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    struct sys_addr sysaddr;
+    struct iovec iov[PACKETVEC_MAX_SEGS];
+    union cmsg_data cdata;
+    struct msghdr msg;
+    int total_len = build_send_msg(o, &msg, iov, &sysaddr, &cdata);
+    
+    // send
+    int bytes = sendmsg(o->fd, &msg, 0);
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_WRITE;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        report_error(o);
+        return;
+    }
+    
+    send_done(o, bytes, total_len);
+}
+
+static void send_batch_queue (BDatagram *o)
+{
+    ASSERT(o->send.batch)
+    ASSERT(o->send.busy)
+    ASSERT(o->send.have_addrs)
+    ASSERT(o->send.batch_count < o->send.batch_size)
+    ASSERT(o->send.busy_num_packets > 0)
+    
+    // queue as many of the datagrams as there is space for
+    int num = 0;
+    do {
+        struct PacketPassInterface_packet *p = &o->send.busy_packets[num];
+        
+        // get queue entry
+        int i = (o->send.batch_start + o->send.batch_count) % o->send.batch_size;
+        struct batch_entry *e = &o->send.batch->entries[i];
+        
+        // copy data
+        e->iov.iov_base = o->send.batch->data + (size_t)i * o->send.mtu;
+        e->iov.iov_len = p->len;
+        memcpy(e->iov.iov_base, p->data, p->len);
+        
+        // remember addresses
+        addr_socket_to_sys(&e->sysaddr, o->send.remote_addr);
+        e->local_addr = o->send.local_addr;
+        
+        // increment count
+        o->send.batch_count++;
+        num++;
+    } while (num < o->send.busy_num_packets && o->send.batch_count < o->send.batch_size);
+    
+    // set not busy
+    o->send.busy = 0;
+    
+    // done
+    PacketPassInterface_DoneBatch(&o->send.iface, num);
+}
+
+static int send_batch_can_segment (BDatagram *o, struct batch_entry *first, struct batch_entry *prev, struct batch_entry *e, int num_segments, size_t total_len)
+{
+    ASSERT(o->send.gso)
+    
+    // all segments but the last must have the size of the first one
+    size_t segment_size = first->iov.iov_len;
+    
+    return (
+        segment_size > 0 &&
+        prev->iov.iov_len == segment_size &&
+        e->iov.iov_len <= segment_size &&
+        num_segments < BDATAGRAM_GSO_MAX_SEGMENTS &&
+        total_len + e->iov.iov_len <= BDATAGRAM_GSO_MAX_SIZE &&
+        e->sysaddr.len == first->sysaddr.len &&
+        !memcmp(&e->sysaddr.addr, &first->sysaddr.addr, first->sysaddr.len) &&
+        e->local_addr.type == first->local_addr.type &&
+        (e->local_addr.type == BADDR_TYPE_NONE || BIPAddr_Compare(&e->local_addr, &first->local_addr))
+    );
+}
+
+static int send_batch_build (BDatagram *o)
+{
+    ASSERT(o->send.batch)
+    ASSERT(o->send.batch_count > 0)
+    
+    struct BDatagram__batch *b = o->send.batch;
+    
+    // build messages for queued datagrams
+    int num_msgs = 0;
+    int j = 0;
+    while (j < o->send.batch_count) {
+        struct batch_entry *first = &b->entries[(o->send.batch_start + j) % o->send.batch_size];
+        struct msghdr *msg = &b->msgs[num_msgs].msg_hdr;
+        
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &first->sysaddr.addr.generic;
+        msg->msg_namelen = first->sysaddr.len;
+        msg->msg_iov = &b->iovs[j];
+        msg->msg_iovlen = 0;
+        
+        // with GSO, send a train of datagrams as segments of a single one
+        struct batch_entry *prev = first;
+        size_t total_len = 0;
+        do {
+            struct batch_entry *e = &b->entries[(o->send.batch_start + j) % o->send.batch_size];
+            if (msg->msg_iovlen > 0 && !(o->send.gso && send_batch_can_segment(o, first, prev, e, msg->msg_iovlen, total_len))) {
+                break;
+            }
+            b->iovs[j] = e->iov;
+            msg->msg_iovlen++;
+            total_len += e->iov.iov_len;
+            prev = e;
+            j++;
+        } while (j < o->send.batch_count);
+        
+        size_t controllen = build_send_control(&first->cdata, first->local_addr);
+        if (msg->msg_iovlen > 1) {
+            controllen += build_segment_control(&first->cdata, controllen, first->iov.iov_len);
+        }
+        msg->msg_control = (controllen > 0 ? &first->cdata : NULL);
+        msg->msg_controllen = controllen;
+        
+        num_msgs++;
+    }
+    
+    return num_msgs;
+}
+
+static void send_batch_remove (BDatagram *o, int num_msgs)
+{
+    ASSERT(o->send.batch)
+    ASSERT(num_msgs >= 0)
+    
+    // count datagrams in the messages
+    int num_sent = 0;
+    for (int k = 0; k < num_msgs; k++) {
+        num_sent += o->send.batch->msgs[k].msg_hdr.msg_iovlen;
+    }
+    ASSERT(num_sent <= o->send.batch_count)
+    
+    // remove them from queue
+    o->send.batch_start = (o->send.batch_start + num_sent) % o->send.batch_size;
+    o->send.batch_count -= num_sent;
+}
+
+static int send_batch_flush (BDatagram *o)
+{
+    ASSERT(o->send.batch)
+    ASSERT(o->send.batch_count > 0)
+    
+    // build messages for queued datagrams
+    int num_msgs = send_batch_build(o);
+    
+    // send
+    int res = batch_sendmmsg(o->fd, o->send.batch->msgs, num_msgs);
+    if (res <= 0) {
+        return res;
+    }
+    
+    ASSERT(res <= num_msgs)
+    
+    // remove sent datagrams from queue
+    send_batch_remove(o, res);
+    
+    return res;
+}
+
+#ifdef BDATAGRAM_USE_URING
+
+static void send_batch_submit (BDatagram *o)
+{
+    ASSERT(o->send.uring_batch)
+    ASSERT(o->send.uring_batch->num_msgs == 0)
+    ASSERT(o->send.batch_count > 0)
+    
+    struct BDatagram__uring_send_batch *ub = o->send.uring_batch;
+    
+    // build messages for queued datagrams
+    int num_msgs = send_batch_build(o);
+    ASSERT(num_msgs <= o->send.batch_size)
+    
+    // let the reactor send them in order; send_uring_batch_handler is called
+    // for each, and datagrams queued in the meantime go in after them
+    for (int k = 0; k < num_msgs; k++) {
+        BReactor_SubmitSendmsg(o->reactor, &ub->ops[k].io, o->fd, &o->send.batch->msgs[k].msg_hdr, 0);
+        if (k + 1 < num_msgs) {
+            BReactor_LinkIO(o->reactor, &ub->ops[k].io);
+        }
+    }
+    
+    ub->num_msgs = num_msgs;
+    ub->num_done = 0;
+    ub->num_sent = 0;
+    ub->error = 0;
+}
+
+#endif
+
+static void do_send_batch (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.batch)
+    ASSERT(o->send.busy || o->send.batch_count > 0)
+    ASSERT(o->send.have_addrs)
+    
+    // queue datagram which was waiting for space
+    if (o->send.busy && o->send.batch_count < o->send.batch_size) {
+        send_batch_queue(o);
+    }
+    
+#ifdef BDATAGRAM_USE_URING
+    // let the reactor send, unless it is still sending; send_uring_batch_handler
+    // continues when done
+    if (o->send.uring_batch) {
+        if (o->send.uring_batch->num_msgs == 0 && o->send.batch_count > 0) {
+            send_batch_submit(o);
+        }
+        return;
+    }
+#endif
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->send.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    // send queued datagrams
+    if (send_batch_flush(o) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_WRITE;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        // the route may not support segmentation offload
+        if (errno == EIO && o->send.gso) {
+            BLog(BLOG_WARNING, "send with GSO failed, disabling GSO");
+            o->send.gso = 0;
+            BPending_Set(&o->send.job);
+            return;
+        }
+        
+        report_error(o);
+        return;
+    }
+    
+    // start receiving if not yet
+    start_recv(o);
+    
+    // queue datagram which was waiting for space
+    if (o->send.busy && o->send.batch_count < o->send.batch_size) {
+        send_batch_queue(o);
+    }
+    
+    // continue sending if not everything was sent
+    if (o->send.batch_count > 0) {
+        BPending_Set(&o->send.job);
+    }
+}
+
+static void recv_done (BDatagram *o, struct sys_addr *sysaddr, struct msghdr *msg, int bytes)
+{
+    ASSERT(bytes >= 0)
+    ASSERT(bytes <= o->recv.mtu)
+    
+    // read returned address
+    sysaddr->len = msg->msg_namelen;
+    addr_sys_to_socket(&o->recv.remote_addr, *sysaddr);
+    
+    // read returned local address
+    parse_recv_control(msg, &o->recv.local_addr);
+    
+    // set have addresses
+    o->recv.have_addrs = 1;
+    
+    // set not busy
+    o->recv.busy = 0;
+    
+    // done
+    PacketRecvInterface_Done(&o->recv.iface, bytes);
+}
+
+static void build_recv_msg (BDatagram *o, struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union cmsg_data *cdata)
+{
+    ASSERT(o->recv.busy)
+    
+    iov->iov_base = o->recv.busy_data;
+    iov->iov_len = o->recv.mtu;
+    
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &sysaddr->addr.generic;
+    msg->msg_namelen = sizeof(sysaddr->addr);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = cdata;
+    msg->msg_controllen = sizeof(*cdata);
+}
+
+static void do_recv (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.started)
+    
+#ifdef BDATAGRAM_USE_URING
+    // let the reactor receive; recv_uring_handler is called when done
+    if (o->recv.uring) {
+        struct BDatagram__uring *u = o->recv.uring;
+        build_recv_msg(o, &u->msg, u->iov, &u->sysaddr, &u->cdata);
+        BReactor_SubmitRecvmsg(o->reactor, &u->io, o->fd, &u->msg, 0);
+        return;
+    }
+#endif
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->recv.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    struct sys_addr sysaddr;
+    struct iovec iov;
+    union cmsg_data cdata;
+    struct msghdr msg;
+    build_recv_msg(o, &msg, &iov, &sysaddr, &cdata);
+    
+    // recv
+    int bytes = recvmsg(o->fd, &msg, 0);
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "recv failed");
+        report_error(o);
+        return;
+    }
+    
+    ASSERT(bytes >= 0)
+    ASSERT(bytes <= o->recv.mtu)
+    
+    recv_done(o, &sysaddr, &msg, bytes);
+}
+    
+static void recv_batch_deliver (BDatagram *o)
+{
+    ASSERT(o->recv.batch)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.batch_pos < o->recv.batch_count)
+    
+    struct batch_entry *e = &o->recv.batch->entries[o->recv.batch_pos];
+    batch_msghdr *m = &o->recv.batch->msgs[o->recv.batch_pos];
+    
+    // with GRO, the datagram may consist of multiple segments
+    if (o->recv.batch_offset == 0) {
+        e->segment_size = (o->recv.gro ? parse_segment_control(&m->msg_hdr) : 0);
+    }
+    
+    // get next segment
+    int len = m->msg_len - o->recv.batch_offset;
+    if (e->segment_size > 0 && len > e->segment_size) {
+        len = e->segment_size;
+    }
+    
+    // copy to receive buffer, truncating like recvmsg() would
+    int copy_len = (len < o->recv.mtu ? len : o->recv.mtu);
+    memcpy(o->recv.busy_data, (uint8_t *)e->iov.iov_base + o->recv.batch_offset, copy_len);
+    
+    // move to next segment
+    o->recv.batch_offset += len;
+    if (o->recv.batch_offset >= (int)m->msg_len) {
+        o->recv.batch_pos++;
+        o->recv.batch_offset = 0;
+    }
+    
+    recv_done(o, &e->sysaddr, &m->msg_hdr, copy_len);
+}
+
+static void do_recv_batch (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.batch)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.started)
+    
+    // complete with a stored datagram if there is one
+    if (o->recv.batch_pos < o->recv.batch_count) {
+        recv_batch_deliver(o);
+        return;
+    }
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->recv.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    // build messages; without GRO, the first datagram goes directly into the receive buffer
+    for (int i = 0; i < o->recv.batch_size; i++) {
+        struct batch_entry *e = &o->recv.batch->entries[i];
+        struct msghdr *msg = &o->recv.batch->msgs[i].msg_hdr;
+        
+        if (o->recv.gro) {
+            e->iov.iov_base = o->recv.batch->data + (size_t)i * BDATAGRAM_GRO_BUFFER_SIZE;
+            e->iov.iov_len = BDATAGRAM_GRO_BUFFER_SIZE;
+        } else {
+            e->iov.iov_base = (i == 0 ? o->recv.busy_data : o->recv.batch->data + (size_t)(i - 1) * o->recv.mtu);
+            e->iov.iov_len = o->recv.mtu;
+        }
+        
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &e->sysaddr.addr.generic;
+        msg->msg_namelen = sizeof(e->sysaddr.addr);
+        msg->msg_iov = &e->iov;
+        msg->msg_iovlen = 1;
+        msg->msg_control = &e->cdata;
+        msg->msg_controllen = sizeof(e->cdata);
+    }
+    
+    // recv
+    int res = batch_recvmmsg(o->fd, o->recv.batch->msgs, o->recv.batch_size);
+    if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "recv failed");
+        report_error(o);
+        return;
+    }
+    
+    ASSERT(res > 0)
+    ASSERT(res <= o->recv.batch_size)
+    
+    // remember received datagrams
+    o->recv.batch_pos = 0;
+    o->recv.batch_offset = 0;
+    o->recv.batch_count = res;
+    
+    // with GRO, deliver the first segment from our buffer
+    if (o->recv.gro) {
+        recv_batch_deliver(o);
+        return;
+    }
+    
+    // the first datagram is already in the receive buffer
+    o->recv.batch_pos = 1;
+    
+    recv_done(o, &o->recv.batch->entries[0].sysaddr, &o->recv.batch->msgs[0].msg_hdr, o->recv.batch->msgs[0].msg_len);
+}
+
+#ifdef BDATAGRAM_USE_URING
+
+static void recv_uring_batch_arm (BDatagram *o)
+{
+    ASSERT(o->recv.uring_batch)
+    
+    struct BDatagram__uring_recv_batch *ub = o->recv.uring_batch;
+    
+    // start receiving into the ring if not already
+    if (!ub->armed) {
+        BReactor_SubmitRecvmsgMultishot(o->reactor, &o->recv.uring->io, o->fd, &ub->msg, &ub->ring, 0);
+        ub->armed = 1;
+    }
+}
+
+static void recv_uring_batch_deliver (BDatagram *o)
+{
+    ASSERT(o->recv.uring_batch)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.uring_batch->queue_count > 0)
+    
+    struct BDatagram__uring_recv_batch *ub = o->recv.uring_batch;
+    int buf = ub->queue[ub->queue_start];
+    uint8_t *data = BReactorBufferRing_Buffer(&ub->ring, buf);
+    
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, data, sizeof(out));
+    
+    // copy the address and control messages, as the buffer may be given back
+    struct sys_addr sysaddr;
+    union cmsg_data cdata;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_namelen = (out.namelen < sizeof(sysaddr.addr) ? out.namelen : sizeof(sysaddr.addr));
+    memcpy(&sysaddr.addr, data + sizeof(out), msg.msg_namelen);
+    msg.msg_control = &cdata;
+    msg.msg_controllen = (out.controllen < sizeof(cdata) ? out.controllen : sizeof(cdata));
+    memcpy(&cdata, data + sizeof(out) + URING_RECV_NAMELEN, msg.msg_controllen);
+    
+    // a datagram larger than the buffer was truncated
+    uint8_t *payload = data + URING_RECV_HEADER;
+    int payload_len = ub->ring.buf_size - URING_RECV_HEADER;
+    if (out.payloadlen < payload_len) {
+        payload_len = out.payloadlen;
+    }
+    
+    // with GRO, the datagram may consist of multiple segments
+    if (ub->offset == 0) {
+        ub->segment_size = (o->recv.gro ? parse_segment_control(&msg) : 0);
+    }
+    
+    // get next segment
+    int len = payload_len - ub->offset;
+    if (ub->segment_size > 0 && len > ub->segment_size) {
+        len = ub->segment_size;
+    }
+    
+    // copy to receive buffer, truncating like recvmsg() would
+    int copy_len = (len < o->recv.mtu ? len : o->recv.mtu);
+    memcpy(o->recv.busy_data, payload + ub->offset, copy_len);
+    
+    // move to next segment, or give the buffer back when done with it
+    ub->offset += len;
+    if (ub->offset >= payload_len) {
+        ub->queue_start = (ub->queue_start + 1) & (ub->ring.num_bufs - 1);
+        ub->queue_count--;
+        ub->offset = 0;
+        BReactorBufferRing_Recycle(&ub->ring, buf);
+        
+        // continue receiving if we ran out of buffers
+        recv_uring_batch_arm(o);
+    }
+    
+    recv_done(o, &sysaddr, &msg, copy_len);
+}
+
+static void do_recv_uring_batch (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.uring_batch)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.started)
+    
+    // complete with a received datagram if there is one
+    if (o->recv.uring_batch->queue_count > 0) {
+        recv_uring_batch_deliver(o);
+        return;
+    }
+    
+    // wait for recv_uring_batch_handler
+    recv_uring_batch_arm(o);
+}
+
+#endif
+
+static void fd_handler (BDatagram *o, int events)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    
+    // clear handled events
+    o->wait_events &= ~events;
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+    
+    int have_send = 0;
+    int have_recv = 0;
+    
+    // sends and receives performed by the reactor report their own errors
+    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && (o->send.busy || o->send.batch_count > 0) && o->send.have_addrs && !send_uses_uring(o))) {
+        ASSERT(o->send.inited)
+        ASSERT(o->send.busy || o->send.batch_count > 0)
+        ASSERT(o->send.have_addrs)
+        
+        have_send = 1;
+    }
+    
+    if ((events & BREACTOR_READ) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->recv.inited && o->recv.busy && o->recv.started && !recv_uses_uring(o))) {
+        ASSERT(o->recv.inited)
+        ASSERT(o->recv.busy)
+        ASSERT(o->recv.started)
+        
+        have_recv = 1;
+    }
+    
+    if (have_send) {
+        if (have_recv) {
+            BPending_Set(&o->recv.job);
+        }
+        
+        if (o->send.batch) {
+            do_send_batch(o);
+        } else {
+            do_send(o);
+        }
+        return;
+    }
+    
+    if (have_recv) {
+        if (o->recv.batch) {
+            do_recv_batch(o);
+        } else {
+            do_recv(o);
+        }
+        return;
+    }
+    
+    BLog(BLOG_ERROR, "fd error event");
+    report_error(o);
+    return;
+}
+
+static void send_job_handler (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.busy || o->send.batch_count > 0)
+    ASSERT(o->send.have_addrs)
+    
+    if (o->send.batch) {
+        do_send_batch(o);
+        return;
+    }
+    
+    do_send(o);
+    return;
+}
+
+static void recv_job_handler (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.started)
+    
+#ifdef BDATAGRAM_USE_URING
+    if (o->recv.uring_batch) {
+        do_recv_uring_batch(o);
+        return;
+    }
+#endif
+    
+    if (o->recv.batch) {
+        do_recv_batch(o);
+        return;
+    }
+    
+    do_recv(o);
+    return;
+}
+
+#ifdef BDATAGRAM_USE_URING
+
+static void send_uring_handler (BDatagram *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(send_uses_uring(o))
+    ASSERT(o->send.inited)
+    ASSERT(o->send.busy)
+    ASSERT(!more)
+    
+    if (res < 0) {
+        report_error(o);
+        return;
+    }
+    
+    send_done(o, res, o->send.uring->total_len);
+}
+
+static void send_uring_batch_handler (struct BDatagram__uring_send_op *op, int res, int buf, int more)
+{
+    BDatagram *o = op->o;
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.uring_batch)
+    ASSERT(o->send.uring_batch->num_done < o->send.uring_batch->num_msgs)
+    ASSERT(!more)
+    
+    struct BDatagram__uring_send_batch *ub = o->send.uring_batch;
+    
+    // Messages after one which failed are cancelled, so those which were
+    // sent are the first ones.
+    if (res >= 0) {
+        ub->num_sent++;
+    } else if (res != -ECANCELED && !ub->error) {
+        ub->error = -res;
+    }
+    
+    // wait for the rest
+    ub->num_done++;
+    if (ub->num_done < ub->num_msgs) {
+        return;
+    }
+    
+    // remove sent datagrams from queue
+    send_batch_remove(o, ub->num_sent);
+    ub->num_msgs = 0;
+    
+    if (ub->error) {
+        // the route may not support segmentation offload
+        if (ub->error == EIO && o->send.gso) {
+            BLog(BLOG_WARNING, "send with GSO failed, disabling GSO");
+            o->send.gso = 0;
+            BPending_Set(&o->send.job);
+            return;
+        }
+        
+        report_error(o);
+        return;
+    }
+    
+    // start receiving if not yet
+    start_recv(o);
+    
+    // queue datagram which was waiting for space
+    if (o->send.busy && o->send.batch_count < o->send.batch_size) {
+        send_batch_queue(o);
+    }
+    
+    // send what was queued in the meantime
+    if (o->send.batch_count > 0) {
+        BPending_Set(&o->send.job);
+    }
+}
+
+static void recv_uring_handler (BDatagram *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    
+    if (o->recv.uring_batch) {
+        recv_uring_batch_handler(o, res, buf, more);
+        return;
+    }
+    
+    ASSERT(recv_uses_uring(o))
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.started)
+    ASSERT(!more)
+    
+    if (res < 0) {
+        BLog(BLOG_ERROR, "recv failed");
+        report_error(o);
+        return;
+    }
+    
+    ASSERT(res <= o->recv.mtu)
+    
+    recv_done(o, &o->recv.uring->sysaddr, &o->recv.uring->msg, res);
+}
+
+static void recv_uring_batch_handler (BDatagram *o, int res, int buf, int more)
+{
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.uring_batch)
+    ASSERT(o->recv.uring_batch->armed)
+    
+    struct BDatagram__uring_recv_batch *ub = o->recv.uring_batch;
+    
+    // the multishot receive may have stopped
+    if (!more) {
+        ub->armed = 0;
+    }
+    
+    if (res < 0) {
+        // The kernel ran out of buffers. Those given back since are not used
+        // until receiving is started again.
+        if (res == -ENOBUFS) {
+            if (ub->queue_count < ub->ring.num_bufs) {
+                recv_uring_batch_arm(o);
+            }
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "recv failed");
+        report_error(o);
+        return;
+    }
+    
+    ASSERT(buf >= 0)
+    ASSERT(ub->queue_count < ub->ring.num_bufs)
+    
+    // queue buffer
+    ub->queue[(ub->queue_start + ub->queue_count) & (ub->ring.num_bufs - 1)] = buf;
+    ub->queue_count++;
+    
+    // continue receiving if the kernel stopped for another reason
+    if (!ub->armed && ub->queue_count < ub->ring.num_bufs) {
+        recv_uring_batch_arm(o);
+    }
+    
+    // deliver right away if a datagram is wanted
+    if (o->recv.busy && !BPending_IsSet(&o->recv.job)) {
+        recv_uring_batch_deliver(o);
+        return;
+    }
+}
+
+#endif
+
+static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(!o->send.busy)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->send.mtu)
+    
+    // remember data
+    o->send.busy_data = data;
+    o->send.busy_data_len = data_len;
+    o->send.busy_single.data = data;
+    o->send.busy_single.len = data_len;
+    o->send.busy_packets = &o->send.busy_single;
+    o->send.busy_num_packets = 1;
+    
+    // set busy
+    o->send.busy = 1;
+    
+    // if have no addresses, wait
+    if (!o->send.have_addrs) {
+        return;
+    }
+    
+    // set job
+    BPending_Set(&o->send.job);
+    
+    // in batch mode, queue the datagram if there's space, so that the sender
+    // can submit more before the job flushes the queue
+    if (o->send.batch && o->send.batch_count < o->send.batch_size) {
+        send_batch_queue(o);
+    }
+}
+
+static void send_if_handler_send_batch (BDatagram *o, struct PacketPassInterface_packet *packets, int num_packets)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.batch)
+    ASSERT(!o->send.busy)
+    ASSERT(num_packets > 0)
+    
+    // remember datagrams
+    o->send.busy_packets = packets;
+    o->send.busy_num_packets = num_packets;
+    
+    // set busy
+    o->send.busy = 1;
+    
+    // if have no addresses, wait
+    if (!o->send.have_addrs) {
+        return;
+    }
+    
+    // set job
+    BPending_Set(&o->send.job);
+    
+    // queue what fits now, the rest waits for the job to make space
+    if (o->send.batch_count < o->send.batch_size) {
+        send_batch_queue(o);
+    }
+}
+
+static void send_vec_if_handler_send (BDatagram *o, PacketVecSeg *segs, int num_segs)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.vec)
+    ASSERT(!o->send.busy)
+    ASSERT(num_segs >= 0)
+    ASSERT(num_segs <= PACKETVEC_MAX_SEGS)
+    
+    // remember segments
+    o->send.busy_segs = segs;
+    o->send.busy_num_segs = num_segs;
     
     // set busy
     o->send.busy = 1;
@@ -571,38 +1739,8 @@ static void recv_if_handler_recv (BDatagram *o, uint8_t *data)
     BPending_Set(&o->recv.job);
 }
 
-int BDatagram_AddressFamilySupported (int family)
-{
-    switch (family) {
-        case BADDR_TYPE_IPV4:
-        case BADDR_TYPE_IPV6:
-#ifdef BADVPN_LINUX
-        case BADDR_TYPE_PACKET:
-#endif
-            return 1;
-    }
-    
-    return 0;
-}
-
-int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
-                    BDatagram_handler handler)
+static int init_with_fd (BDatagram *o, int family, int recv_started)
 {
-    ASSERT(BDatagram_AddressFamilySupported(family))
-    ASSERT(handler)
-    BNetwork_Assert();
-    
-    // init arguments
-    o->reactor = reactor;
-    o->user = user;
-    o->handler = handler;
-    
-    // init fd
-    if ((o->fd = socket(family_socket_to_sys(family), SOCK_DGRAM, 0)) < 0) {
-        BLog(BLOG_ERROR, "socket failed");
-        goto fail0;
-    }
-    
     // set fd non-blocking
     if (!badvpn_set_nonblocking(o->fd)) {
         BLog(BLOG_ERROR, "badvpn_set_nonblocking failed");
@@ -619,6 +1757,21 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
         goto fail1;
     }
     
+#ifdef BDATAGRAM_USE_URING
+    // let the reactor perform sends and receives if it can
+    o->send.uring = NULL;
+    o->recv.uring = NULL;
+    if (BReactor_IOSupported(o->reactor)) {
+        if (!(o->send.uring = uring_alloc(o, (BReactorIO_handler)send_uring_handler))) {
+            goto fail2;
+        }
+        if (!(o->recv.uring = uring_alloc(o, (BReactorIO_handler)recv_uring_handler))) {
+            uring_free(o, o->send.uring);
+            goto fail2;
+        }
+    }
+#endif
+    
     // set no wait events
     o->wait_events = 0;
     
@@ -630,8 +1783,8 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
     o->send.have_addrs = 0;
     o->recv.have_addrs = 0;
     
-    // set recv not started
-    o->recv.started = 0;
+    // set recv started
+    o->recv.started = recv_started;
     
     // set send and recv not inited
     o->send.inited = 0;
@@ -641,14 +1794,73 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
     DebugObject_Init(&o->d_obj);
     return 1;
     
+#ifdef BDATAGRAM_USE_URING
+fail2:
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+#endif
 fail1:
     if (close(o->fd) < 0) {
         BLog(BLOG_ERROR, "close failed");
     }
-fail0:
     return 0;
 }
 
+int BDatagram_AddressFamilySupported (int family)
+{
+    switch (family) {
+        case BADDR_TYPE_IPV4:
+        case BADDR_TYPE_IPV6:
+#ifdef BADVPN_LINUX
+        case BADDR_TYPE_PACKET:
+#endif
+            return 1;
+    }
+    
+    return 0;
+}
+
+int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
+                    BDatagram_handler handler)
+{
+    ASSERT(BDatagram_AddressFamilySupported(family))
+    ASSERT(handler)
+    BNetwork_Assert();
+    
+    // init arguments
+    o->reactor = reactor;
+    o->user = user;
+    o->handler = handler;
+    
+    // init fd
+    if ((o->fd = socket(family_socket_to_sys(family), SOCK_DGRAM, 0)) < 0) {
+        BLog(BLOG_ERROR, "socket failed");
+        return 0;
+    }
+    
+    // recv will start when we bind or send
+    return init_with_fd(o, family, 0);
+}
+
+int BDatagram_InitFromFd (BDatagram *o, int fd, int family, BReactor *reactor, void *user,
+                          BDatagram_handler handler)
+{
+    ASSERT(fd >= 0)
+    ASSERT(BDatagram_AddressFamilySupported(family))
+    ASSERT(handler)
+    BNetwork_Assert();
+    
+    // init arguments
+    o->reactor = reactor;
+    o->user = user;
+    o->handler = handler;
+    
+    // use provided fd
+    o->fd = fd;
+    
+    // the socket was already in use, so receive right away
+    return init_with_fd(o, family, 1);
+}
+
 void BDatagram_Free (BDatagram *o)
 {
     DebugObject_Free(&o->d_obj);
@@ -660,6 +1872,14 @@ void BDatagram_Free (BDatagram *o)
     BReactorLimit_Free(&o->recv.limit);
     BReactorLimit_Free(&o->send.limit);
     
+#ifdef BDATAGRAM_USE_URING
+    // free reactor operations
+    if (o->send.uring) {
+        uring_free(o, o->recv.uring);
+        uring_free(o, o->send.uring);
+    }
+#endif
+    
     // free BFileDescriptor
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
     
@@ -669,6 +1889,31 @@ void BDatagram_Free (BDatagram *o)
     }
 }
 
+int BDatagram_Release (BDatagram *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugError_Free(&o->d_err);
+    ASSERT(!o->recv.inited)
+    ASSERT(!o->send.inited)
+    
+    // free limits
+    BReactorLimit_Free(&o->recv.limit);
+    BReactorLimit_Free(&o->send.limit);
+    
+#ifdef BDATAGRAM_USE_URING
+    // free reactor operations
+    if (o->send.uring) {
+        uring_free(o, o->recv.uring);
+        uring_free(o, o->send.uring);
+    }
+#endif
+    
+    // free BFileDescriptor
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+    
+    return o->fd;
+}
+
 int BDatagram_Bind (BDatagram *o, BAddr addr)
 {
     DebugObject_Access(&o->d_obj);
@@ -685,16 +1930,8 @@ int BDatagram_Bind (BDatagram *o, BAddr addr)
         return 0;
     }
     
-    // if recv wasn't started yet, start it
-    if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
-    }
+    // start receiving if not yet
+    start_recv(o);
     
     return 1;
 }
@@ -790,16 +2027,113 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     // init interface
     PacketPassInterface_Init(&o->send.iface, o->send.mtu, (PacketPassInterface_handler_send)send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
     
+    // set not vectored
+    o->send.vec = 0;
+    
+    // init job
+    BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)send_job_handler, o);
+    
+    // set not busy
+    o->send.busy = 0;
+    
+    // set not batching
+    o->send.batch = NULL;
+    o->send.batch_count = 0;
+    o->send.gso = 0;
+#ifdef BDATAGRAM_USE_URING
+    o->send.uring_batch = NULL;
+#endif
+    
+    // set inited
+    o->send.inited = 1;
+}
+
+void BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size)
+{
+    ASSERT(batch_size > 0)
+    
+    BDatagram_SendAsync_Init(o, mtu);
+    
+    // allocate queue
+    if (!(o->send.batch = batch_alloc(batch_size, batch_size, mtu))) {
+        BLog(BLOG_ERROR, "batch_alloc failed, not batching sends");
+        return;
+    }
+    
+    // init queue
+    o->send.batch_size = batch_size;
+    o->send.batch_start = 0;
+    
+#ifdef BDATAGRAM_USE_URING
+    // let the reactor send the queued datagrams
+    if (o->send.uring && !(o->send.uring_batch = uring_send_batch_alloc(o, batch_size))) {
+        BLog(BLOG_ERROR, "uring_send_batch_alloc failed, sending batches directly");
+    }
+#endif
+    
+    // accept batches of datagrams into the queue
+    PacketPassInterface_EnableBatch(&o->send.iface, (PacketPassInterface_handler_send_batch)send_if_handler_send_batch);
+}
+
+void BDatagram_SendAsync_InitVec (BDatagram *o, int mtu, int max_segs)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->send.inited)
+    ASSERT(mtu >= 0)
+    ASSERT(max_segs > 0)
+    ASSERT(max_segs <= PACKETVEC_MAX_SEGS)
+    
+    // init arguments
+    o->send.mtu = mtu;
+    
+    // init interface
+    PacketPassVecInterface_Init(&o->send.vec_iface, o->send.mtu, max_segs, (PacketPassVecInterface_handler_send)send_vec_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    
+    // set vectored
+    o->send.vec = 1;
+    
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)send_job_handler, o);
     
     // set not busy
     o->send.busy = 0;
     
+    // set not batching
+    o->send.batch = NULL;
+    o->send.batch_count = 0;
+    o->send.gso = 0;
+#ifdef BDATAGRAM_USE_URING
+    o->send.uring_batch = NULL;
+#endif
+    
     // set inited
     o->send.inited = 1;
 }
 
+int BDatagram_SendAsync_EnableGSO (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->send.inited)
+    
+    if (!o->send.batch) {
+        return 0;
+    }
+    
+#ifdef UDP_SEGMENT
+    // check kernel support; a segment size of zero is the default of no segmentation
+    int size = 0;
+    if (setsockopt(o->fd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) < 0) {
+        return 0;
+    }
+    
+    o->send.gso = 1;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 void BDatagram_SendAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -809,11 +2143,45 @@ void BDatagram_SendAsync_Free (BDatagram *o)
     o->wait_events &= ~BREACTOR_WRITE;
     BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
     
+#ifdef BDATAGRAM_USE_URING
+    // cancel send in progress, so the kernel no longer reads the packet
+    if (o->send.uring) {
+        BReactor_CancelIO(o->reactor, &o->send.uring->io);
+    }
+    
+    if (o->send.uring_batch) {
+        struct BDatagram__uring_send_batch *ub = o->send.uring_batch;
+        
+        // cancel batch sends in progress; they may have been performed
+        // already, so the datagrams are not sent again
+        for (int k = 0; k < ub->num_msgs; k++) {
+            BReactor_CancelIO(o->reactor, &ub->ops[k].io);
+        }
+        send_batch_remove(o, ub->num_msgs);
+        
+        uring_send_batch_free(o, ub);
+    }
+#endif
+    
+    if (o->send.batch) {
+        // try to send what's left in the queue
+        if (o->send.batch_count > 0) {
+            send_batch_flush(o);
+        }
+        
+        // free queue
+        batch_free(o->send.batch);
+    }
+    
     // free job
     BPending_Free(&o->send.job);
     
     // free interface
-    PacketPassInterface_Free(&o->send.iface);
+    if (o->send.vec) {
+        PacketPassVecInterface_Free(&o->send.vec_iface);
+    } else {
+        PacketPassInterface_Free(&o->send.iface);
+    }
     
     // set not inited
     o->send.inited = 0;
@@ -823,10 +2191,20 @@ PacketPassInterface * BDatagram_SendAsync_GetIf (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
     ASSERT(o->send.inited)
+    ASSERT(!o->send.vec)
     
     return &o->send.iface;
 }
 
+PacketPassVecInterface * BDatagram_SendAsync_GetVecIf (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.vec)
+    
+    return &o->send.vec_iface;
+}
+
 void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
 {
     DebugObject_Access(&o->d_obj);
@@ -846,10 +2224,123 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     // set not busy
     o->recv.busy = 0;
     
+    // set not batching
+    o->recv.batch = NULL;
+    o->recv.batch_pos = 0;
+    o->recv.batch_offset = 0;
+    o->recv.batch_count = 0;
+    o->recv.gro = 0;
+#ifdef BDATAGRAM_USE_URING
+    o->recv.uring_batch = NULL;
+#endif
+    
     // set inited
     o->recv.inited = 1;
 }
 
+void BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size)
+{
+    ASSERT(batch_size > 0)
+    
+    BDatagram_RecvAsync_Init(o, mtu);
+    
+#ifdef BDATAGRAM_USE_URING
+    // let the reactor receive into a ring of buffers
+    if (o->recv.uring) {
+        if (!(o->recv.uring_batch = uring_recv_batch_alloc(o, batch_size, mtu))) {
+            BLog(BLOG_ERROR, "uring_recv_batch_alloc failed, not batching receives");
+            return;
+        }
+        
+        o->recv.batch_size = batch_size;
+        return;
+    }
+#endif
+    
+    // allocate buffers for all but the first datagram
+    if (!(o->recv.batch = batch_alloc(batch_size, batch_size - 1, mtu))) {
+        BLog(BLOG_ERROR, "batch_alloc failed, not batching receives");
+        return;
+    }
+    
+    o->recv.batch_size = batch_size;
+}
+
+int BDatagram_RecvAsync_EnableGRO (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.batch_pos >= o->recv.batch_count)
+    
+#ifdef BDATAGRAM_USE_URING
+    if (o->recv.uring_batch) {
+        ASSERT(o->recv.uring_batch->queue_count == 0)
+        
+        if (o->recv.gro) {
+            return 1;
+        }
+        
+#ifdef UDP_GRO
+        // datagrams may be coalesced, so each needs a large buffer
+        struct BDatagram__uring_recv_batch *ub = uring_recv_batch_alloc(o, o->recv.batch_size, BDATAGRAM_GRO_BUFFER_SIZE);
+        if (!ub) {
+            BLog(BLOG_ERROR, "uring_recv_batch_alloc failed");
+            return 0;
+        }
+        
+        // enable GRO
+        int opt = 1;
+        if (setsockopt(o->fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) < 0) {
+            uring_recv_batch_free(o, ub);
+            return 0;
+        }
+        
+        // replace buffers
+        uring_recv_batch_free(o, o->recv.uring_batch);
+        o->recv.uring_batch = ub;
+        o->recv.gro = 1;
+        
+        return 1;
+#else
+        return 0;
+#endif
+    }
+#endif
+    
+    if (!o->recv.batch) {
+        return 0;
+    }
+    
+    if (o->recv.gro) {
+        return 1;
+    }
+    
+#ifdef UDP_GRO
+    // datagrams may be coalesced, so each needs a large buffer
+    struct BDatagram__batch *batch = batch_alloc(o->recv.batch_size, o->recv.batch_size, BDATAGRAM_GRO_BUFFER_SIZE);
+    if (!batch) {
+        BLog(BLOG_ERROR, "batch_alloc failed");
+        return 0;
+    }
+    
+    // enable GRO
+    int opt = 1;
+    if (setsockopt(o->fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) < 0) {
+        batch_free(batch);
+        return 0;
+    }
+    
+    // replace buffers
+    batch_free(o->recv.batch);
+    o->recv.batch = batch;
+    o->recv.gro = 1;
+    
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 void BDatagram_RecvAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -859,6 +2350,23 @@ void BDatagram_RecvAsync_Free (BDatagram *o)
     o->wait_events &= ~BREACTOR_READ;
     BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
     
+#ifdef BDATAGRAM_USE_URING
+    // cancel receive in progress, so the kernel no longer writes to the buffer
+    if (o->recv.uring) {
+        BReactor_CancelIO(o->reactor, &o->recv.uring->io);
+    }
+    
+    // free ring of buffers
+    if (o->recv.uring_batch) {
+        uring_recv_batch_free(o, o->recv.uring_batch);
+    }
+#endif
+    
+    // free buffers
+    if (o->recv.batch) {
+        batch_free(o->recv.batch);
+    }
+    
     // free job
     BPending_Free(&o->recv.job);
     
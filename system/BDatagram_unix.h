@@ -33,6 +33,23 @@
 #define BDATAGRAM_SEND_LIMIT 2
 #define BDATAGRAM_RECV_LIMIT 2
 
+// limits for UDP segmentation offload
+#define BDATAGRAM_GSO_MAX_SEGMENTS 64
+#define BDATAGRAM_GSO_MAX_SIZE 65507
+
+// receive buffer size with UDP receive offload
+#define BDATAGRAM_GRO_BUFFER_SIZE 65535
+
+// with the io_uring backend, the reactor performs sends and receives
+#if defined(BADVPN_BREACTOR_BADVPN) && defined(BADVPN_USE_IO_URING)
+#define BDATAGRAM_USE_URING
+#endif
+
+struct BDatagram__batch;
+struct BDatagram__uring;
+struct BDatagram__uring_send_batch;
+struct BDatagram__uring_recv_batch;
+
 struct BDatagram_s {
     BReactor *reactor;
     void *user;
@@ -48,10 +65,26 @@ struct BDatagram_s {
         int inited;
         int mtu;
         PacketPassInterface iface;
+        int vec;
+        PacketPassVecInterface vec_iface;
         BPending job;
         int busy;
         const uint8_t *busy_data;
         int busy_data_len;
+        struct PacketPassInterface_packet busy_single;
+        struct PacketPassInterface_packet *busy_packets;
+        int busy_num_packets;
+        PacketVecSeg *busy_segs;
+        int busy_num_segs;
+        int batch_size;
+        struct BDatagram__batch *batch;
+        int batch_start;
+        int batch_count;
+        int gso;
+#ifdef BDATAGRAM_USE_URING
+        struct BDatagram__uring *uring;
+        struct BDatagram__uring_send_batch *uring_batch;
+#endif
     } send;
     struct {
         BReactorLimit limit;
@@ -65,6 +98,16 @@ struct BDatagram_s {
         BPending job;
         int busy;
         uint8_t *busy_data;
+        int batch_size;
+        struct BDatagram__batch *batch;
+        int batch_pos;
+        int batch_offset;
+        int batch_count;
+        int gro;
+#ifdef BDATAGRAM_USE_URING
+        struct BDatagram__uring *uring;
+        struct BDatagram__uring_recv_batch *uring_batch;
+#endif
     } recv;
     DebugError d_err;
     DebugObject d_obj;
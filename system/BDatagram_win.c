@@ -696,6 +696,22 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     o->send.inited = 1;
 }
 
+void BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size)
+{
+    ASSERT(batch_size > 0)
+    
+    // batching is not supported
+    BDatagram_SendAsync_Init(o, mtu);
+}
+
+int BDatagram_SendAsync_EnableGSO (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->send.inited)
+    
+    return 0;
+}
+
 void BDatagram_SendAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -748,6 +764,22 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     o->recv.inited = 1;
 }
 
+void BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size)
+{
+    ASSERT(batch_size > 0)
+    
+    // batching is not supported
+    BDatagram_RecvAsync_Init(o, mtu);
+}
+
+int BDatagram_RecvAsync_EnableGRO (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->recv.inited)
+    
+    return 0;
+}
+
 void BDatagram_RecvAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -0,0 +1,289 @@
+/**
+ * @file BPacketPipe.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/offset.h>
+
+#include "BPacketPipe.h"
+
+#define END_STATE_NEW 0
+#define END_STATE_INIT 1
+#define END_STATE_FREED 2
+
+static void release (BPacketPipe *o, int count)
+{
+    if (__atomic_sub_fetch(&o->refs, count, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    
+    BFree(o->buffer);
+    BFree(o->slots);
+    BFree(o);
+}
+
+static void output_send_next (BPacketPipe *o)
+{
+    ASSERT(o->out_state == END_STATE_INIT)
+    ASSERT(!o->out_sending)
+    
+    LinkedList1Node *node = LinkedList1_GetFirst(&o->out_ready_list);
+    if (!node) {
+        return;
+    }
+    
+    struct BPacketPipe_slot *slot = UPPER_OBJECT(node, struct BPacketPipe_slot, list_node);
+    LinkedList1_Remove(&o->out_ready_list, &slot->list_node);
+    
+    o->out_sending = slot;
+    PacketPassInterface_Sender_Send(o->out_output, slot->data, slot->data_len);
+}
+
+static void output_slot_handler (BReactorMailboxMsg *msg)
+{
+    struct BPacketPipe_slot *slot = UPPER_OBJECT(msg, struct BPacketPipe_slot, msg);
+    BPacketPipe *o = slot->p;
+    
+    // the output end is gone, drop the slot
+    if (o->out_state == END_STATE_FREED) {
+        release(o, 1);
+        return;
+    }
+    
+    LinkedList1_Append(&o->out_ready_list, &slot->list_node);
+    
+    if (o->out_state == END_STATE_INIT && !o->out_sending) {
+        DebugObject_Access(&o->out_d_obj);
+        output_send_next(o);
+    }
+}
+
+static void input_slot_handler (BReactorMailboxMsg *msg)
+{
+    struct BPacketPipe_slot *slot = UPPER_OBJECT(msg, struct BPacketPipe_slot, msg);
+    BPacketPipe *o = slot->p;
+    
+    // the input end is gone, drop the slot
+    if (o->in_state == END_STATE_FREED) {
+        release(o, 1);
+        return;
+    }
+    
+    // no packet waiting, keep the slot
+    if (o->in_state != END_STATE_INIT || !o->in_data) {
+        LinkedList1_Append(&o->in_free_list, &slot->list_node);
+        return;
+    }
+    
+    DebugObject_Access(&o->in_d_obj);
+    
+    // pass the waiting packet
+    memcpy(slot->data, o->in_data, o->in_data_len);
+    slot->data_len = o->in_data_len;
+    o->in_data = NULL;
+    BReactorMailbox_Thread_Send(o->output_mailbox, &slot->msg, output_slot_handler);
+    
+    PacketPassInterface_Done(&o->in_iface);
+}
+
+static void input_handler_send (BPacketPipe *o, uint8_t *data, int data_len)
+{
+    ASSERT(o->in_state == END_STATE_INIT)
+    ASSERT(!o->in_data)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->mtu)
+    DebugObject_Access(&o->in_d_obj);
+    
+    LinkedList1Node *node = LinkedList1_GetFirst(&o->in_free_list);
+    
+    // no free slot, wait for one to come back
+    if (!node) {
+        o->in_data = data;
+        o->in_data_len = data_len;
+        return;
+    }
+    
+    struct BPacketPipe_slot *slot = UPPER_OBJECT(node, struct BPacketPipe_slot, list_node);
+    LinkedList1_Remove(&o->in_free_list, &slot->list_node);
+    
+    memcpy(slot->data, data, data_len);
+    slot->data_len = data_len;
+    BReactorMailbox_Thread_Send(o->output_mailbox, &slot->msg, output_slot_handler);
+    
+    PacketPassInterface_Done(&o->in_iface);
+}
+
+static void output_handler_done (BPacketPipe *o)
+{
+    ASSERT(o->out_state == END_STATE_INIT)
+    ASSERT(o->out_sending)
+    DebugObject_Access(&o->out_d_obj);
+    
+    // return the slot
+    struct BPacketPipe_slot *slot = o->out_sending;
+    o->out_sending = NULL;
+    BReactorMailbox_Thread_Send(o->input_mailbox, &slot->msg, input_slot_handler);
+    
+    output_send_next(o);
+}
+
+BPacketPipe * BPacketPipe_New (int mtu, int num_slots, BReactorMailbox *input_mailbox, BReactorMailbox *output_mailbox)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(num_slots > 0)
+    
+    BPacketPipe *o = (BPacketPipe *)BAlloc(sizeof(*o));
+    if (!o) {
+        goto fail0;
+    }
+    
+    o->mtu = mtu;
+    o->num_slots = num_slots;
+    o->input_mailbox = input_mailbox;
+    o->output_mailbox = output_mailbox;
+    
+    // each end and each slot holds a reference
+    o->refs = 2 + num_slots;
+    
+    if (!(o->slots = (struct BPacketPipe_slot *)BAllocArray(num_slots, sizeof(o->slots[0])))) {
+        goto fail1;
+    }
+    
+    if (!(o->buffer = (uint8_t *)BAllocArray2(num_slots, (mtu > 0 ? mtu : 1), 1))) {
+        goto fail2;
+    }
+    
+    // all slots start at the input end
+    LinkedList1_Init(&o->in_free_list);
+    for (int i = 0; i < num_slots; i++) {
+        struct BPacketPipe_slot *slot = &o->slots[i];
+        slot->p = o;
+        slot->data = o->buffer + (size_t)i * mtu;
+        LinkedList1_Append(&o->in_free_list, &slot->list_node);
+    }
+    
+    o->in_state = END_STATE_NEW;
+    o->in_data = NULL;
+    
+    o->out_state = END_STATE_NEW;
+    LinkedList1_Init(&o->out_ready_list);
+    o->out_sending = NULL;
+    
+    return o;
+    
+fail2:
+    BFree(o->slots);
+fail1:
+    BFree(o);
+fail0:
+    return NULL;
+}
+
+void BPacketPipe_InitInput (BPacketPipe *o, BPendingGroup *pg)
+{
+    ASSERT(o->in_state == END_STATE_NEW)
+    
+    PacketPassInterface_Init(&o->in_iface, o->mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    
+    o->in_state = END_STATE_INIT;
+    
+    DebugObject_Init(&o->in_d_obj);
+}
+
+void BPacketPipe_FreeInput (BPacketPipe *o)
+{
+    ASSERT(o->in_state == END_STATE_NEW || o->in_state == END_STATE_INIT)
+    
+    if (o->in_state == END_STATE_INIT) {
+        DebugObject_Free(&o->in_d_obj);
+        PacketPassInterface_Free(&o->in_iface);
+    }
+    
+    o->in_state = END_STATE_FREED;
+    
+    // drop slots which are here; the others are dropped when they come back
+    int count = 1;
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->in_free_list)) {
+        LinkedList1_Remove(&o->in_free_list, node);
+        count++;
+    }
+    
+    release(o, count);
+}
+
+PacketPassInterface * BPacketPipe_GetInput (BPacketPipe *o)
+{
+    ASSERT(o->in_state == END_STATE_INIT)
+    DebugObject_Access(&o->in_d_obj);
+    
+    return &o->in_iface;
+}
+
+void BPacketPipe_InitOutput (BPacketPipe *o, PacketPassInterface *output)
+{
+    ASSERT(o->out_state == END_STATE_NEW)
+    ASSERT(PacketPassInterface_GetMTU(output) >= o->mtu)
+    
+    o->out_output = output;
+    PacketPassInterface_Sender_Init(o->out_output, (PacketPassInterface_handler_done)output_handler_done, o);
+    
+    o->out_state = END_STATE_INIT;
+    
+    DebugObject_Init(&o->out_d_obj);
+    
+    // send packets which arrived before
+    output_send_next(o);
+}
+
+void BPacketPipe_FreeOutput (BPacketPipe *o)
+{
+    ASSERT(o->out_state == END_STATE_NEW || o->out_state == END_STATE_INIT)
+    
+    if (o->out_state == END_STATE_INIT) {
+        DebugObject_Free(&o->out_d_obj);
+    }
+    
+    o->out_state = END_STATE_FREED;
+    
+    // drop slots which are here; the others are dropped when they arrive
+    int count = 1;
+    if (o->out_sending) {
+        count++;
+    }
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->out_ready_list)) {
+        LinkedList1_Remove(&o->out_ready_list, node);
+        count++;
+    }
+    
+    release(o, count);
+}
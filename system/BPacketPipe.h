@@ -0,0 +1,147 @@
+/**
+ * @file BPacketPipe.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * Passes packets from one reactor to another, which may be running in another
+ * thread. Packets are sent to the input end, a {@link PacketPassInterface} in the
+ * sending reactor, and the output end sends them to a {@link PacketPassInterface}
+ * in the receiving reactor. Packets are copied into a fixed number of slots which
+ * travel between the two reactors as {@link BReactorMailboxMsg} messages, so the
+ * input end accepts up to that many packets ahead of the output.
+ * 
+ * The two ends are initialized and freed independently, each from the thread of
+ * its own reactor. Packets may be sent before the output end is initialized; they
+ * wait for it. The pipe is released once both ends have been freed and no slot is
+ * in a mailbox.
+ */
+
+#ifndef BADVPN_B_PACKET_PIPE_H
+#define BADVPN_B_PACKET_PIPE_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <system/BReactorMailbox.h>
+#include <flow/PacketPassInterface.h>
+
+struct BPacketPipe_s;
+
+struct BPacketPipe_slot {
+    BReactorMailboxMsg msg;
+    struct BPacketPipe_s *p;
+    LinkedList1Node list_node;
+    uint8_t *data;
+    int data_len;
+};
+
+typedef struct BPacketPipe_s {
+    int mtu;
+    int num_slots;
+    BReactorMailbox *input_mailbox;
+    BReactorMailbox *output_mailbox;
+    int refs;
+    struct BPacketPipe_slot *slots;
+    uint8_t *buffer;
+    
+    // input end, accessed from the sending thread
+    int in_state;
+    PacketPassInterface in_iface;
+    LinkedList1 in_free_list;
+    uint8_t *in_data;
+    int in_data_len;
+    DebugObject in_d_obj;
+    
+    // output end, accessed from the receiving thread
+    int out_state;
+    PacketPassInterface *out_output;
+    LinkedList1 out_ready_list;
+    struct BPacketPipe_slot *out_sending;
+    DebugObject out_d_obj;
+} BPacketPipe;
+
+/**
+ * Allocates a pipe. Its ends are not initialized.
+ * 
+ * @param mtu maximum packet size. Must be >=0.
+ * @param num_slots number of packets which may be in the pipe at once. Must be >0.
+ * @param input_mailbox mailbox of the sending reactor
+ * @param output_mailbox mailbox of the receiving reactor
+ * @return the pipe, or NULL on failure
+ */
+BPacketPipe * BPacketPipe_New (int mtu, int num_slots, BReactorMailbox *input_mailbox, BReactorMailbox *output_mailbox);
+
+/**
+ * Initializes the input end.
+ * Must be called from the thread of the sending reactor, and at most once.
+ * 
+ * @param o the pipe
+ * @param pg pending group of the sending reactor
+ */
+void BPacketPipe_InitInput (BPacketPipe *o, BPendingGroup *pg);
+
+/**
+ * Frees the input end, which may or may not have been initialized.
+ * Must be called from the thread of the sending reactor, exactly once.
+ * The pipe must not be accessed from the sending thread after this.
+ * 
+ * @param o the pipe
+ */
+void BPacketPipe_FreeInput (BPacketPipe *o);
+
+/**
+ * Returns the input interface.
+ * The MTU of the interface is as in {@link BPacketPipe_New}.
+ * 
+ * @param o the pipe, with the input end initialized
+ * @return input interface
+ */
+PacketPassInterface * BPacketPipe_GetInput (BPacketPipe *o);
+
+/**
+ * Initializes the output end.
+ * Must be called from the thread of the receiving reactor, and at most once.
+ * 
+ * @param o the pipe
+ * @param output output interface, in the receiving reactor. Its MTU must be >= the MTU
+ *               of the pipe.
+ */
+void BPacketPipe_InitOutput (BPacketPipe *o, PacketPassInterface *output);
+
+/**
+ * Frees the output end, which may or may not have been initialized.
+ * Must be called from the thread of the receiving reactor, exactly once.
+ * The pipe must not be accessed from the receiving thread after this.
+ * If a packet is being sent to the output, the output must not report it done.
+ * 
+ * @param o the pipe
+ */
+void BPacketPipe_FreeOutput (BPacketPipe *o);
+
+#endif
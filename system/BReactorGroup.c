@@ -0,0 +1,300 @@
+/**
+ * @file BReactorGroup.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#ifdef BADVPN_LINUX
+#include <sched.h>
+#endif
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+
+#include "BReactorGroup.h"
+
+#include <generated/blog_channel_BReactorGroup.h>
+
+static int default_num_threads (void)
+{
+#ifdef BADVPN_LINUX
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+        return CPU_COUNT(&allowed);
+    }
+#endif
+    
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num > 0 ? num : 1);
+}
+
+static void assign_cpus (BReactorGroup *o, int pin_cpus)
+{
+    for (int i = 0; i < o->num_threads; i++) {
+        o->threads[i].cpu = -1;
+    }
+    
+    if (!pin_cpus) {
+        return;
+    }
+    
+#ifdef BADVPN_LINUX
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        BLog(BLOG_ERROR, "sched_getaffinity failed, not binding threads to CPUs");
+        return;
+    }
+    
+    int num_cpus = CPU_COUNT(&allowed);
+    if (num_cpus <= 0) {
+        return;
+    }
+    
+    // give the n-th thread the n-th allowed CPU, going around if there are more threads
+    int i = 0;
+    while (i < o->num_threads) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && i < o->num_threads; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                o->threads[i++].cpu = cpu;
+            }
+        }
+    }
+#else
+    BLog(BLOG_WARNING, "binding threads to CPUs is not supported on this system");
+#endif
+}
+
+static void quit_msg_handler (BReactorMailboxMsg *msg)
+{
+    struct BReactorGroup_thread *t = UPPER_OBJECT(msg, struct BReactorGroup_thread, quit_msg);
+    
+    BReactor_Quit(&t->reactor, 0);
+}
+
+static void * thread_func (struct BReactorGroup_thread *t)
+{
+    BReactorGroup *o = t->g;
+    
+#ifdef BADVPN_LINUX
+    if (t->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            BLog(BLOG_ERROR, "thread %d: sched_setaffinity failed", t->index);
+        } else {
+            BLog(BLOG_INFO, "thread %d bound to CPU %d", t->index, t->cpu);
+        }
+    }
+#endif
+    
+    if (!BReactor_Init(&t->reactor)) {
+        BLog(BLOG_ERROR, "thread %d: BReactor_Init failed", t->index);
+        goto fail0;
+    }
+    
+    if (!BReactorMailbox_Init(&t->mailbox, &t->reactor)) {
+        BLog(BLOG_ERROR, "thread %d: BReactorMailbox_Init failed", t->index);
+        goto fail1;
+    }
+    
+    if (o->handler_init && !o->handler_init(o->user, t->index, &t->reactor)) {
+        BLog(BLOG_ERROR, "thread %d: init handler failed", t->index);
+        goto fail2;
+    }
+    
+    // report success
+    t->started_ok = 1;
+    ASSERT_FORCE(sem_post(&t->started_sem) == 0)
+    
+    BReactor_Exec(&t->reactor);
+    
+    if (o->handler_deinit) {
+        o->handler_deinit(o->user, t->index, &t->reactor);
+    }
+    
+    BReactorMailbox_Free(&t->mailbox);
+    BReactor_Free(&t->reactor);
+    return NULL;
+    
+fail2:
+    BReactorMailbox_Free(&t->mailbox);
+fail1:
+    BReactor_Free(&t->reactor);
+fail0:
+    t->started_ok = 0;
+    ASSERT_FORCE(sem_post(&t->started_sem) == 0)
+    return NULL;
+}
+
+static void stop_threads (BReactorGroup *o, int num_started)
+{
+    // ask all threads to quit first so they shut down in parallel
+    for (int i = 0; i < num_started; i++) {
+        struct BReactorGroup_thread *t = &o->threads[i];
+        BReactorMailbox_Thread_Send(&t->mailbox, &t->quit_msg, quit_msg_handler);
+    }
+    
+    for (int i = num_started - 1; i >= 0; i--) {
+        struct BReactorGroup_thread *t = &o->threads[i];
+        
+        ASSERT_FORCE(pthread_join(t->thread, NULL) == 0)
+        ASSERT_FORCE(sem_destroy(&t->started_sem) == 0)
+    }
+}
+
+int BReactorGroup_Init (BReactorGroup *o, int num_threads, int pin_cpus, void *user,
+                        BReactorGroup_handler_init handler_init, BReactorGroup_handler_deinit handler_deinit)
+{
+    // init arguments
+    o->user = user;
+    o->handler_init = handler_init;
+    o->handler_deinit = handler_deinit;
+    
+    if (num_threads <= 0) {
+        num_threads = default_num_threads();
+    }
+    if (num_threads > BREACTORGROUP_MAX_THREADS) {
+        num_threads = BREACTORGROUP_MAX_THREADS;
+    }
+    o->num_threads = num_threads;
+    
+    // allocate threads
+    if (!(o->threads = BAllocArray(o->num_threads, sizeof(o->threads[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    
+    assign_cpus(o, pin_cpus);
+    
+    // start threads one by one
+    int num_started = 0;
+    while (num_started < o->num_threads) {
+        struct BReactorGroup_thread *t = &o->threads[num_started];
+        t->g = o;
+        t->index = num_started;
+        
+        if (sem_init(&t->started_sem, 0, 0) < 0) {
+            BLog(BLOG_ERROR, "sem_init failed");
+            goto fail1;
+        }
+        
+        // block signals in the thread, so that they are handled in the thread which
+        // expects them
+        sigset_t sset_all;
+        sigfillset(&sset_all);
+        sigset_t sset_old;
+        if (pthread_sigmask(SIG_SETMASK, &sset_all, &sset_old) != 0) {
+            BLog(BLOG_ERROR, "pthread_sigmask failed");
+            ASSERT_FORCE(sem_destroy(&t->started_sem) == 0)
+            goto fail1;
+        }
+        
+        int res = pthread_create(&t->thread, NULL, (void * (*) (void *))thread_func, t);
+        ASSERT_FORCE(pthread_sigmask(SIG_SETMASK, &sset_old, NULL) == 0)
+        
+        if (res != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
+            ASSERT_FORCE(sem_destroy(&t->started_sem) == 0)
+            goto fail1;
+        }
+        
+        // wait for the thread to initialize
+        while (sem_wait(&t->started_sem) < 0) {
+            ASSERT_FORCE(errno == EINTR)
+        }
+        
+        if (!t->started_ok) {
+            ASSERT_FORCE(pthread_join(t->thread, NULL) == 0)
+            ASSERT_FORCE(sem_destroy(&t->started_sem) == 0)
+            goto fail1;
+        }
+        
+        num_started++;
+    }
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    stop_threads(o, num_started);
+    BFree(o->threads);
+fail0:
+    return 0;
+}
+
+void BReactorGroup_Free (BReactorGroup *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    stop_threads(o, o->num_threads);
+    
+    BFree(o->threads);
+}
+
+int BReactorGroup_NumThreads (BReactorGroup *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->num_threads;
+}
+
+BReactor * BReactorGroup_Reactor (BReactorGroup *o, int index)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(index >= 0)
+    ASSERT(index < o->num_threads)
+    
+    return &o->threads[index].reactor;
+}
+
+BReactorMailbox * BReactorGroup_Mailbox (BReactorGroup *o, int index)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(index >= 0)
+    ASSERT(index < o->num_threads)
+    
+    return &o->threads[index].mailbox;
+}
+
+void BReactorGroup_Thread_Send (BReactorGroup *o, int index, BReactorMailboxMsg *msg, BReactorMailboxMsg_handler handler)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(index >= 0)
+    ASSERT(index < o->num_threads)
+    
+    BReactorMailbox_Thread_Send(&o->threads[index].mailbox, msg, handler);
+}
@@ -0,0 +1,165 @@
+/**
+ * @file BReactorGroup.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * A group of threads, each running its own {@link BReactor}, optionally with
+ * each thread bound to its own CPU. Every thread has a {@link BReactorMailbox}
+ * through which other threads pass it work. Sockets can be moved between
+ * threads by releasing a {@link BConnection} or {@link BDatagram} in one thread
+ * (BConnection_Release, BDatagram_Release), sending the file descriptor in a
+ * message, and creating a new object from it in the receiving thread.
+ * 
+ * Signals are blocked in the threads of the group, so they are delivered to
+ * other threads of the program.
+ */
+
+#ifndef BADVPN_B_REACTOR_GROUP_H
+#define BADVPN_B_REACTOR_GROUP_H
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BReactorMailbox.h>
+
+#define BREACTORGROUP_MAX_THREADS 64
+
+/**
+ * Handler called in a new thread of the group after its reactor and mailbox
+ * have been initialized, before the reactor starts running.
+ * 
+ * @param user as in {@link BReactorGroup_Init}
+ * @param index index of the thread in the group
+ * @param reactor reactor of the thread
+ * @return 1 on success, 0 on failure, which makes {@link BReactorGroup_Init} fail
+ */
+typedef int (*BReactorGroup_handler_init) (void *user, int index, BReactor *reactor);
+
+/**
+ * Handler called in a thread of the group after its reactor has stopped,
+ * before the reactor and mailbox are freed.
+ * 
+ * @param user as in {@link BReactorGroup_Init}
+ * @param index index of the thread in the group
+ * @param reactor reactor of the thread
+ */
+typedef void (*BReactorGroup_handler_deinit) (void *user, int index, BReactor *reactor);
+
+struct BReactorGroup_thread {
+    struct BReactorGroup_s *g;
+    int index;
+    int cpu;
+    BReactor reactor;
+    BReactorMailbox mailbox;
+    BReactorMailboxMsg quit_msg;
+    sem_t started_sem;
+    int started_ok;
+    pthread_t thread;
+};
+
+typedef struct BReactorGroup_s {
+    void *user;
+    BReactorGroup_handler_init handler_init;
+    BReactorGroup_handler_deinit handler_deinit;
+    int num_threads;
+    struct BReactorGroup_thread *threads;
+    DebugObject d_obj;
+} BReactorGroup;
+
+/**
+ * Initializes the group, starting its threads.
+ * Returns after all threads have been started and their init handlers have
+ * returned.
+ * 
+ * @param o the object
+ * @param num_threads number of threads. If <=0, the number of CPUs available to the
+ *                    process is used. At most {@link BREACTORGROUP_MAX_THREADS}
+ *                    threads are started.
+ * @param pin_cpus whether to bind each thread to a different CPU, going around if there
+ *                 are more threads than CPUs. Only supported on Linux.
+ * @param user argument to handlers
+ * @param handler_init handler called in each thread at startup, or NULL
+ * @param handler_deinit handler called in each thread at shutdown, or NULL
+ * @return 1 on success, 0 on failure
+ */
+int BReactorGroup_Init (BReactorGroup *o, int num_threads, int pin_cpus, void *user,
+                        BReactorGroup_handler_init handler_init, BReactorGroup_handler_deinit handler_deinit) WARN_UNUSED;
+
+/**
+ * Stops all threads and frees the group.
+ * Each thread stops after handling the messages sent to it before this call,
+ * then calls its deinit handler. The caller must make sure that no messages are
+ * sent to the group's mailboxes after this is called.
+ * 
+ * @param o the object
+ */
+void BReactorGroup_Free (BReactorGroup *o);
+
+/**
+ * Returns the number of threads in the group.
+ * 
+ * @param o the object
+ * @return number of threads
+ */
+int BReactorGroup_NumThreads (BReactorGroup *o);
+
+/**
+ * Returns the reactor of a thread in the group.
+ * The reactor may only be used from its own thread; other threads need to
+ * send a message to its mailbox.
+ * 
+ * @param o the object
+ * @param index index of the thread. Must be >=0 and < number of threads.
+ * @return reactor
+ */
+BReactor * BReactorGroup_Reactor (BReactorGroup *o, int index);
+
+/**
+ * Returns the mailbox of a thread in the group.
+ * 
+ * @param o the object
+ * @param index index of the thread. Must be >=0 and < number of threads.
+ * @return mailbox
+ */
+BReactorMailbox * BReactorGroup_Mailbox (BReactorGroup *o, int index);
+
+/**
+ * Sends a message to a thread in the group.
+ * May be called from any thread. See {@link BReactorMailbox_Thread_Send}.
+ * 
+ * @param o the object
+ * @param index index of the thread. Must be >=0 and < number of threads.
+ * @param msg the message
+ * @param handler handler to call for the message in the receiving thread
+ */
+void BReactorGroup_Thread_Send (BReactorGroup *o, int index, BReactorMailboxMsg *msg, BReactorMailboxMsg_handler handler);
+
+#endif
@@ -0,0 +1,232 @@
+/**
+ * @file BReactorMailbox.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef BADVPN_LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include <misc/debug.h>
+#include <misc/nonblocking.h>
+#include <base/BLog.h>
+
+#include "BReactorMailbox.h"
+
+#include <generated/blog_channel_BReactorMailbox.h>
+
+// The queue is the intrusive MPSC queue by Dmitry Vyukov. Senders append
+// at head with a single atomic exchange; the receiver takes messages from tail.
+// A stub message keeps the queue non-empty so that senders never need to
+// touch tail.
+
+static void push (BReactorMailbox *o, BReactorMailboxMsg *msg)
+{
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    BReactorMailboxMsg *prev = __atomic_exchange_n(&o->head, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+static BReactorMailboxMsg * pop (BReactorMailbox *o)
+{
+    BReactorMailboxMsg *tail = o->tail;
+    BReactorMailboxMsg *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    
+    // skip the stub
+    if (tail == &o->stub) {
+        if (!next) {
+            return NULL;
+        }
+        o->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    
+    if (next) {
+        o->tail = next;
+        return tail;
+    }
+    
+    // a sender is between exchanging head and linking its message;
+    // it will wake us up once it is done
+    if (tail != __atomic_load_n(&o->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    
+    // tail is the last message; put the stub behind it so we can take it
+    push(o, &o->stub);
+    
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        o->tail = next;
+        return tail;
+    }
+    
+    return NULL;
+}
+
+static void wake_fd_handler (BReactorMailbox *o, int events)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // consume wakeup
+#ifdef BADVPN_LINUX
+    uint64_t value;
+#else
+    uint8_t value[64];
+#endif
+    ssize_t res = read(o->wake_fd[0], &value, sizeof(value));
+    if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        BLog(BLOG_ERROR, "read failed");
+    }
+    
+    // Allow senders to wake us again. This has to happen before we look at the
+    // queue, so that a message which we miss is followed by another wakeup.
+    __atomic_store_n(&o->signalled, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    BPending_Set(&o->job);
+}
+
+static void job_handler (BReactorMailbox *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    BReactorMailboxMsg *msg = pop(o);
+    if (!msg) {
+        return;
+    }
+    
+    // schedule next message
+    BPending_Set(&o->job);
+    
+    // call handler
+    msg->handler(msg);
+    return;
+}
+
+int BReactorMailbox_Init (BReactorMailbox *o, BReactor *reactor)
+{
+    o->reactor = reactor;
+    
+    // init queue
+    o->stub.next = NULL;
+    o->head = &o->stub;
+    o->tail = &o->stub;
+    
+    // set not signalled
+    o->signalled = 0;
+    
+#ifdef BADVPN_LINUX
+    if ((o->wake_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+        BLog(BLOG_ERROR, "eventfd failed");
+        goto fail0;
+    }
+    o->wake_fd[1] = o->wake_fd[0];
+#else
+    if (pipe(o->wake_fd) < 0) {
+        BLog(BLOG_ERROR, "pipe failed");
+        goto fail0;
+    }
+    
+    if (!badvpn_set_nonblocking(o->wake_fd[0]) || !badvpn_set_nonblocking(o->wake_fd[1])) {
+        BLog(BLOG_ERROR, "badvpn_set_nonblocking failed");
+        goto fail1;
+    }
+#endif
+    
+    BFileDescriptor_Init(&o->bfd, o->wake_fd[0], (BFileDescriptor_handler)wake_fd_handler, o);
+    
+    if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
+        BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
+        goto fail1;
+    }
+    
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
+    
+    BPending_Init(&o->job, BReactor_PendingGroup(o->reactor), (BPending_handler)job_handler, o);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    if (o->wake_fd[1] != o->wake_fd[0] && close(o->wake_fd[1]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+    if (close(o->wake_fd[0]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+fail0:
+    return 0;
+}
+
+void BReactorMailbox_Free (BReactorMailbox *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    BPending_Free(&o->job);
+    
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+    
+    if (o->wake_fd[1] != o->wake_fd[0] && close(o->wake_fd[1]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+    if (close(o->wake_fd[0]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+}
+
+void BReactorMailbox_Thread_Send (BReactorMailbox *o, BReactorMailboxMsg *msg, BReactorMailboxMsg_handler handler)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(msg)
+    ASSERT(handler)
+    
+    msg->handler = handler;
+    
+    // enqueue message
+    push(o, msg);
+    
+    // wake up the receiver unless a wakeup is already on its way
+    if (__atomic_exchange_n(&o->signalled, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+#ifdef BADVPN_LINUX
+    uint64_t value = 1;
+#else
+    uint8_t value = 0;
+#endif
+    ssize_t res = write(o->wake_fd[1], &value, sizeof(value));
+    if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        BLog(BLOG_ERROR, "write failed");
+    }
+}
@@ -0,0 +1,115 @@
+/**
+ * @file BReactorMailbox.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Lock-free queue of messages to be processed in the thread of a {@link BReactor}.
+ * Any number of threads may send messages, and they are handled by the reactor that
+ * owns the mailbox, in the order they were sent by each sender. Messages are provided
+ * by the sender and linked into the queue without copying or allocation. The owning
+ * reactor is woken up only when a message arrives to an idle mailbox, so a burst of
+ * messages costs a single wakeup.
+ */
+
+#ifndef BADVPN_B_REACTOR_MAILBOX_H
+#define BADVPN_B_REACTOR_MAILBOX_H
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+
+typedef struct BReactorMailboxMsg_s BReactorMailboxMsg;
+
+/**
+ * Handler called in the thread of the receiving reactor to process a message.
+ * The mailbox no longer references the message, so the handler may free or reuse it.
+ * It is called from a job closure of the receiving reactor.
+ * 
+ * @param msg the message, as passed to {@link BReactorMailbox_Thread_Send}
+ */
+typedef void (*BReactorMailboxMsg_handler) (BReactorMailboxMsg *msg);
+
+/**
+ * Message header. Embed it in a structure with the message contents, and
+ * use UPPER_OBJECT in the handler to get to the contents.
+ */
+struct BReactorMailboxMsg_s {
+    BReactorMailboxMsg *next;
+    BReactorMailboxMsg_handler handler;
+};
+
+typedef struct BReactorMailbox_s BReactorMailbox;
+
+struct BReactorMailbox_s {
+    // written by senders
+    BReactorMailboxMsg *head;
+    int signalled;
+    // keep sender and receiver state on separate cache lines
+    char pad[64];
+    // owned by the receiving reactor
+    BReactorMailboxMsg *tail;
+    BReactorMailboxMsg stub;
+    BReactor *reactor;
+    int wake_fd[2];
+    BFileDescriptor bfd;
+    BPending job;
+    DebugObject d_obj;
+};
+
+/**
+ * Initializes the mailbox.
+ * Messages will be handled in the thread of the given reactor.
+ * 
+ * @param o the object
+ * @param reactor receiving reactor
+ * @return 1 on success, 0 on failure
+ */
+int BReactorMailbox_Init (BReactorMailbox *o, BReactor *reactor) WARN_UNUSED;
+
+/**
+ * Frees the mailbox.
+ * Must be called from the thread of the receiving reactor, and no other thread may be
+ * sending messages at this time. Messages which have not been handled yet are discarded
+ * without calling their handlers.
+ * 
+ * @param o the object
+ */
+void BReactorMailbox_Free (BReactorMailbox *o);
+
+/**
+ * Sends a message to the mailbox.
+ * May be called from any thread, including that of the receiving reactor.
+ * The message must not be sent again until its handler has been called.
+ * 
+ * @param o the object
+ * @param msg the message. Its memory must remain valid until the handler is called.
+ * @param handler handler to call for the message in the thread of the receiving reactor
+ */
+void BReactorMailbox_Thread_Send (BReactorMailbox *o, BReactorMailboxMsg *msg, BReactorMailboxMsg_handler handler);
+
+#endif
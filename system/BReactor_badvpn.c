@@ -41,6 +41,18 @@
 #include <unistd.h>
 #endif
 
+#ifdef BADVPN_USE_EPOLL
+#include <time.h>
+#endif
+
+#ifdef BADVPN_USE_IO_URING
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #include <misc/debug.h>
 #include <misc/offset.h>
 #include <misc/balloc.h>
@@ -54,10 +66,17 @@
 #define KEVENT_TAG_FD 1
 #define KEVENT_TAG_KEVENT 2
 
+#define URING_USER_DATA_IGNORE UINT64_MAX
+#define URING_USER_DATA_FD ((uint64_t)1 << 31)
+#define URING_INITIAL_SLOTS 64
+#define URING_REGISTER_SYNC_CANCEL 24
+
 #define TIMER_STATE_INACTIVE 1
 #define TIMER_STATE_RUNNING 2
 #define TIMER_STATE_EXPIRED 3
 
+#ifndef BADVPN_BREACTOR_TIMER_WHEEL
+
 static int compare_timers (BSmallTimer *t1, BSmallTimer *t2)
 {
     int cmp = B_COMPARE(t1->absTime, t2->absTime);
@@ -71,12 +90,251 @@ static int compare_timers (BSmallTimer *t1, BSmallTimer *t2)
 #include "BReactor_badvpn_timerstree.h"
 #include <structure/CAvl_impl.h>
 
+#endif
+
 static void assert_timer (BSmallTimer *bt)
 {
     ASSERT(bt->state == TIMER_STATE_INACTIVE || bt->state == TIMER_STATE_RUNNING ||
            bt->state == TIMER_STATE_EXPIRED)
 }
 
+#ifdef BADVPN_BREACTOR_TIMER_WHEEL
+
+static void wheel_insert (BReactor *bsys, BSmallTimer *bt)
+{
+    ASSERT(bt->state == TIMER_STATE_RUNNING)
+    
+    // start the clock with the first timer
+    if (bsys->timers_wheel_clk < 0) {
+        bsys->timers_wheel_clk = btime_gettime();
+    }
+    
+    btime_t clk = bsys->timers_wheel_clk;
+    
+    // timers for ticks already processed go to the due list
+    if (bt->absTime < clk) {
+        LinkedList1_Append(&bsys->timers_wheel_due, &bt->u.list_node);
+        bsys->timers_wheel_count++;
+        bt->wheel_level = BSYSTEM_TIMER_WHEEL_LEVELS;
+        return;
+    }
+    
+    btime_t expires = bt->absTime;
+    
+    // choose the level by how far away the timer is; the last level
+    // takes everything further, and such timers are cascaded back into it
+    uint64_t delta = expires - clk;
+    int level = 0;
+    while (level < BSYSTEM_TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (BSYSTEM_TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= ((uint64_t)1 << (BSYSTEM_TIMER_WHEEL_BITS * BSYSTEM_TIMER_WHEEL_LEVELS))) {
+        expires = clk + ((btime_t)1 << (BSYSTEM_TIMER_WHEEL_BITS * BSYSTEM_TIMER_WHEEL_LEVELS)) - 1;
+    }
+    
+    int slot = (expires >> (BSYSTEM_TIMER_WHEEL_BITS * level)) & (BSYSTEM_TIMER_WHEEL_SLOTS - 1);
+    
+    LinkedList1_Append(&bsys->timers_wheel[level][slot], &bt->u.list_node);
+    bsys->timers_wheel_bitmap[level] |= (uint64_t)1 << slot;
+    bsys->timers_wheel_count++;
+    
+    bt->wheel_level = level;
+    bt->wheel_slot = slot;
+}
+
+static void wheel_remove (BReactor *bsys, BSmallTimer *bt)
+{
+    ASSERT(bt->state == TIMER_STATE_RUNNING)
+    ASSERT(bsys->timers_wheel_count > 0)
+    
+    if (bt->wheel_level == BSYSTEM_TIMER_WHEEL_LEVELS) {
+        LinkedList1_Remove(&bsys->timers_wheel_due, &bt->u.list_node);
+        bsys->timers_wheel_count--;
+        return;
+    }
+    
+    LinkedList1 *list = &bsys->timers_wheel[bt->wheel_level][bt->wheel_slot];
+    LinkedList1_Remove(list, &bt->u.list_node);
+    if (LinkedList1_IsEmpty(list)) {
+        bsys->timers_wheel_bitmap[bt->wheel_level] &= ~((uint64_t)1 << bt->wheel_slot);
+    }
+    bsys->timers_wheel_count--;
+}
+
+static void wheel_cascade (BReactor *bsys, int level, int slot)
+{
+    ASSERT(level > 0)
+    
+    if (!(bsys->timers_wheel_bitmap[level] & ((uint64_t)1 << slot))) {
+        return;
+    }
+    
+    // take the timers out and put them back in; they go to lower levels
+    LinkedList1 list = bsys->timers_wheel[level][slot];
+    LinkedList1_Init(&bsys->timers_wheel[level][slot]);
+    bsys->timers_wheel_bitmap[level] &= ~((uint64_t)1 << slot);
+    
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&list)) {
+        BSmallTimer *timer = UPPER_OBJECT(node, BSmallTimer, u.list_node);
+        LinkedList1_Remove(&list, node);
+        bsys->timers_wheel_count--;
+        wheel_insert(bsys, timer);
+    }
+}
+
+static void wheel_expire (BReactor *bsys, LinkedList1 *list)
+{
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(list)) {
+        BSmallTimer *timer = UPPER_OBJECT(node, BSmallTimer, u.list_node);
+        ASSERT(timer->state == TIMER_STATE_RUNNING)
+        ASSERT(timer->absTime <= bsys->timers_wheel_clk)
+        
+        // remove from wheel
+        wheel_remove(bsys, timer);
+        
+        // add to expired timers list
+        LinkedList1_Append(&bsys->timers_expired_list, &timer->u.list_node);
+        
+        // set expired
+        timer->state = TIMER_STATE_EXPIRED;
+    }
+}
+
+static btime_t wheel_next_time (BReactor *bsys)
+{
+    ASSERT(bsys->timers_wheel_count > 0)
+    
+    btime_t clk = bsys->timers_wheel_clk;
+    int slot = clk & (BSYSTEM_TIMER_WHEEL_SLOTS - 1);
+    
+    // timers set in the past are due already
+    if (!LinkedList1_IsEmpty(&bsys->timers_wheel_due)) {
+        return clk - 1;
+    }
+    
+    // a timer later in the current block is exact, the rest of the
+    // first level belongs to the next block
+    uint64_t bits = bsys->timers_wheel_bitmap[0] >> slot;
+    btime_t next_block = (clk | (BSYSTEM_TIMER_WHEEL_SLOTS - 1)) + 1;
+    btime_t res;
+    if (bits) {
+        res = clk + __builtin_ctzll(bits);
+    } else {
+        res = (bsys->timers_wheel_bitmap[0] ? next_block + __builtin_ctzll(bsys->timers_wheel_bitmap[0]) : INT64_MAX);
+    }
+    
+    // for higher levels, wake up when the first used slot is cascaded;
+    // this may not expire anything, but gets the timers to lower levels.
+    // This must be checked even if the first level has a timer in the
+    // current block: when the clock sits on a block boundary, a cascade
+    // is due at the clock itself and must not be skipped over.
+    for (int level = 1; level < BSYSTEM_TIMER_WHEEL_LEVELS; level++) {
+        uint64_t bitmap = bsys->timers_wheel_bitmap[level];
+        if (!bitmap) {
+            continue;
+        }
+        
+        int shift = BSYSTEM_TIMER_WHEEL_BITS * level;
+        btime_t block = clk >> shift;
+        int cur = block & (BSYSTEM_TIMER_WHEEL_SLOTS - 1);
+        
+        // the current slot is still to be cascaded if we're at its start
+        int first = ((clk & (((btime_t)1 << shift) - 1)) == 0 ? 0 : 1);
+        int start = (cur + first) & (BSYSTEM_TIMER_WHEEL_SLOTS - 1);
+        uint64_t rot = (start ? (bitmap >> start) | (bitmap << (BSYSTEM_TIMER_WHEEL_SLOTS - start)) : bitmap);
+        
+        btime_t time = (block + first + __builtin_ctzll(rot)) << shift;
+        if (time < res) {
+            res = time;
+        }
+    }
+    
+    ASSERT(res >= clk)
+    ASSERT(res < INT64_MAX)
+    
+    return res;
+}
+
+static int wheel_advance (BReactor *bsys, btime_t now)
+{
+    int moved = !LinkedList1_IsEmpty(&bsys->timers_wheel_due);
+    
+    // expire timers which were set in the past
+    wheel_expire(bsys, &bsys->timers_wheel_due);
+    
+    // process only the ticks where something happens
+    btime_t clk;
+    while (bsys->timers_wheel_count > 0 && (clk = wheel_next_time(bsys)) <= now) {
+        ASSERT(clk >= bsys->timers_wheel_clk)
+        bsys->timers_wheel_clk = clk;
+        int slot = clk & (BSYSTEM_TIMER_WHEEL_SLOTS - 1);
+        
+        // at a block boundary, cascade the slots of higher levels covering the new block
+        if (slot == 0) {
+            for (int level = 1; level < BSYSTEM_TIMER_WHEEL_LEVELS; level++) {
+                int lslot = (clk >> (BSYSTEM_TIMER_WHEEL_BITS * level)) & (BSYSTEM_TIMER_WHEEL_SLOTS - 1);
+                wheel_cascade(bsys, level, lslot);
+                if (lslot != 0) {
+                    break;
+                }
+            }
+        }
+        
+        // move timers of this tick to the expired list
+        if (!LinkedList1_IsEmpty(&bsys->timers_wheel[0][slot])) {
+            wheel_expire(bsys, &bsys->timers_wheel[0][slot]);
+            moved = 1;
+        }
+        
+        bsys->timers_wheel_clk = clk + 1;
+    }
+    
+    // nothing else happens up to now
+    if (bsys->timers_wheel_clk <= now) {
+        bsys->timers_wheel_clk = now + 1;
+    }
+    
+    return moved;
+}
+
+static int have_running_timers (BReactor *bsys)
+{
+    return bsys->timers_wheel_count > 0;
+}
+
+static btime_t first_timer_time (BReactor *bsys)
+{
+    return wheel_next_time(bsys);
+}
+
+static int move_expired_timers (BReactor *bsys, btime_t now)
+{
+    return wheel_advance(bsys, now);
+}
+
+static void move_first_timers (BReactor *bsys)
+{
+    wheel_advance(bsys, wheel_next_time(bsys));
+}
+
+#else
+
+static int have_running_timers (BReactor *bsys)
+{
+    return !BReactor__TimersTree_IsEmpty(&bsys->timers_tree);
+}
+
+static btime_t first_timer_time (BReactor *bsys)
+{
+    BSmallTimer *first_timer = BReactor__TimersTree_GetFirst(&bsys->timers_tree, 0).link;
+    ASSERT(first_timer)
+    ASSERT(first_timer->state == TIMER_STATE_RUNNING)
+    
+    return first_timer->absTime;
+}
+
 static int move_expired_timers (BReactor *bsys, btime_t now)
 {
     int moved = 0;
@@ -147,6 +405,8 @@ static void move_first_timers (BReactor *bsys)
     }
 }
 
+#endif
+
 #ifdef BADVPN_USE_WINAPI
 
 static void set_iocp_ready (BReactorIOCPOverlapped *olap, int succeeded, DWORD bytes)
@@ -169,6 +429,46 @@ static void set_iocp_ready (BReactorIOCPOverlapped *olap, int succeeded, DWORD b
 
 #ifdef BADVPN_USE_EPOLL
 
+static int64_t busy_poll_time (void)
+{
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void resize_epoll_results (BReactor *bsys)
+{
+    ASSERT(bsys->epoll_results_num == 0)
+    
+    // have room for all fds, so that one epoll_wait drains all of them
+    int want = bsys->epoll_num_fds;
+    if (want > BSYSTEM_MAX_EPOLL_RESULTS) {
+        want = BSYSTEM_MAX_EPOLL_RESULTS;
+    }
+    
+    if (want <= bsys->epoll_results_size) {
+        return;
+    }
+    
+    // grow at least twice, to not reallocate for every new fd
+    int new_size = 2 * bsys->epoll_results_size;
+    if (new_size < want) {
+        new_size = want;
+    }
+    if (new_size > BSYSTEM_MAX_EPOLL_RESULTS) {
+        new_size = BSYSTEM_MAX_EPOLL_RESULTS;
+    }
+    
+    struct epoll_event *new_results = BReallocArray(bsys->epoll_results, new_size, sizeof(new_results[0]));
+    if (!new_results) {
+        BLog(BLOG_WARNING, "BReallocArray failed, keeping %d results", bsys->epoll_results_size);
+        return;
+    }
+    
+    bsys->epoll_results = new_results;
+    bsys->epoll_results_size = new_size;
+}
+
 static void set_epoll_fd_pointers (BReactor *bsys)
 {
     // Write pointers to our entry pointers into file descriptors.
@@ -270,6 +570,346 @@ static void set_poll_fd_pointers (BReactor *bsys)
 
 #endif
 
+#ifdef BADVPN_USE_IO_URING
+
+struct BReactor__uring_slot {
+    BFileDescriptor *bfd;
+    BReactorIO *io;
+    uint32_t gen;
+    int fd_results; // results of the request are new file descriptors
+    int next_free;
+};
+
+// struct io_uring_sync_cancel_reg, which older headers lack
+struct uring_sync_cancel_reg {
+    uint64_t addr;
+    int32_t fd;
+    uint32_t flags;
+    int64_t timeout_sec;
+    int64_t timeout_nsec;
+    uint64_t pad[4];
+};
+
+static uint64_t uring_user_data (BReactor *bsys, int slot)
+{
+    ASSERT(slot >= 0 && slot < bsys->uring_num_slots)
+    
+    // The generation changes whenever a request is made or cancelled or the
+    // slot is released, so that completions of cancelled requests can be
+    // told apart. Slots are below 2^31, leaving a bit to mark requests which
+    // return file descriptors.
+    struct BReactor__uring_slot *s = &bsys->uring_slots[slot];
+    return ((uint64_t)s->gen << 32) | (s->fd_results ? URING_USER_DATA_FD : 0) | (uint32_t)slot;
+}
+
+static void uring_discard_result (uint64_t user_data, int res)
+{
+    // close a file descriptor which nobody will get
+    if ((user_data & URING_USER_DATA_FD) && res >= 0) {
+        if (close(res) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+    }
+}
+
+static int uring_take_slot (BReactor *bsys)
+{
+    // grow slots array if there are no free slots
+    if (bsys->uring_free_slot < 0) {
+        if (bsys->uring_num_slots > INT_MAX / 2) {
+            BLog(BLOG_ERROR, "too many slots");
+            return -1;
+        }
+        int new_num_slots = 2 * bsys->uring_num_slots;
+        struct BReactor__uring_slot *new_slots = BReallocArray(bsys->uring_slots, new_num_slots, sizeof(new_slots[0]));
+        if (!new_slots) {
+            BLog(BLOG_ERROR, "BReallocArray failed");
+            return -1;
+        }
+        for (int i = bsys->uring_num_slots; i < new_num_slots; i++) {
+            new_slots[i].bfd = NULL;
+            new_slots[i].io = NULL;
+            new_slots[i].gen = 0;
+            new_slots[i].fd_results = 0;
+            new_slots[i].next_free = (i + 1 < new_num_slots ? i + 1 : -1);
+        }
+        bsys->uring_free_slot = bsys->uring_num_slots;
+        bsys->uring_slots = new_slots;
+        bsys->uring_num_slots = new_num_slots;
+    }
+    
+    // take free slot
+    int slot_index = bsys->uring_free_slot;
+    struct BReactor__uring_slot *slot = &bsys->uring_slots[slot_index];
+    ASSERT(!slot->bfd)
+    ASSERT(!slot->io)
+    bsys->uring_free_slot = slot->next_free;
+    
+    return slot_index;
+}
+
+static void uring_release_slot (BReactor *bsys, int slot_index)
+{
+    ASSERT(slot_index >= 0 && slot_index < bsys->uring_num_slots)
+    
+    // release slot, invalidating any completions
+    struct BReactor__uring_slot *slot = &bsys->uring_slots[slot_index];
+    slot->bfd = NULL;
+    slot->io = NULL;
+    slot->gen++;
+    slot->fd_results = 0;
+    slot->next_free = bsys->uring_free_slot;
+    bsys->uring_free_slot = slot_index;
+}
+
+static int uring_enter (BReactor *bsys, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    unsigned int to_submit = *bsys->uring_sq_tail - __atomic_load_n(bsys->uring_sq_head, __ATOMIC_ACQUIRE);
+    
+    return syscall(__NR_io_uring_enter, bsys->uring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static void uring_submit (BReactor *bsys)
+{
+    while (uring_enter(bsys, 0, 0, NULL, 0) < 0) {
+        int error = errno;
+        if (error != EINTR && error != EAGAIN && error != EBUSY) {
+            perror("io_uring_enter");
+            ASSERT_FORCE(0)
+        }
+    }
+}
+
+static struct io_uring_sqe * uring_get_sqe (BReactor *bsys)
+{
+    unsigned int tail = *bsys->uring_sq_tail;
+    
+    // submit queued requests if the submission queue is full
+    if (tail - __atomic_load_n(bsys->uring_sq_head, __ATOMIC_ACQUIRE) == bsys->uring_sq_entries) {
+        uring_submit(bsys);
+    }
+    
+    struct io_uring_sqe *sqe = &bsys->uring_sqes[tail & bsys->uring_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_commit_sqe (BReactor *bsys, struct io_uring_sqe *sqe)
+{
+    unsigned int tail = *bsys->uring_sq_tail;
+    unsigned int index = sqe - bsys->uring_sqes;
+    ASSERT(index == (tail & bsys->uring_sq_mask))
+    
+    bsys->uring_sq_array[index] = index;
+    __atomic_store_n(bsys->uring_sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_cancel_poll (BReactor *bsys, BFileDescriptor *bfd)
+{
+    ASSERT(bfd->uring_armed_events)
+    
+    struct io_uring_sqe *sqe = uring_get_sqe(bsys);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(bsys, bfd->uring_slot);
+    sqe->user_data = URING_USER_DATA_IGNORE;
+    uring_commit_sqe(bsys, sqe);
+    
+    // invalidate the completion of the cancelled request
+    bsys->uring_slots[bfd->uring_slot].gen++;
+    
+    bfd->uring_armed_events = 0;
+}
+
+static int uring_sync_cancel (BReactor *bsys, uint64_t user_data)
+{
+    struct uring_sync_cancel_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = user_data;
+    reg.fd = -1;
+    reg.timeout_sec = -1;
+    reg.timeout_nsec = -1;
+    
+    return syscall(__NR_io_uring_register, bsys->uring_fd, URING_REGISTER_SYNC_CANCEL, &reg, 1);
+}
+
+static struct io_uring_sqe * uring_prepare_io (BReactor *bsys, BReactorIO *io, int opcode, int fd)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    
+    bsys->uring_slots[io->uring_slot].gen++;
+    bsys->uring_slots[io->uring_slot].fd_results = (opcode == IORING_OP_ACCEPT);
+    struct io_uring_sqe *sqe = uring_get_sqe(bsys);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = uring_user_data(bsys, io->uring_slot);
+    
+    io->busy = 1;
+    
+    return sqe;
+}
+
+static void uring_drop_results (BReactor *bsys, BReactorIO *io)
+{
+    // A multishot operation may have several results waiting to be
+    // dispatched, so look through all of them.
+    for (int i = bsys->uring_results_pos; i < bsys->uring_results_num; i++) {
+        struct BReactor__uring_result *result = &bsys->uring_results[i];
+        if (result->io == io) {
+            uring_discard_result(uring_user_data(bsys, io->uring_slot), result->res);
+            result->io = NULL;
+        }
+    }
+}
+
+static void buffer_ring_add (BReactorBufferRing *o, int buf)
+{
+    struct io_uring_buf *b = &o->ring->bufs[o->tail & (o->num_bufs - 1)];
+    b->addr = (uintptr_t)(o->bufs + (size_t)buf * o->buf_size);
+    b->len = o->buf_size;
+    b->bid = buf;
+    o->tail++;
+}
+
+static void uring_set_dirty (BReactor *bsys, BFileDescriptor *bfd)
+{
+    if (!bfd->uring_dirty) {
+        LinkedList1_Append(&bsys->uring_dirty_list, &bfd->uring_dirty_list_node);
+        bfd->uring_dirty = 1;
+    }
+}
+
+static void uring_update_polls (BReactor *bsys)
+{
+    // Poll requests are one-shot, which gives the level-triggered semantics
+    // of the other backends: a request made while the file descriptor is
+    // ready completes immediately. Changes of monitored events are collected
+    // here, so that they cost nothing until the next wait, where they are
+    // submitted together with it.
+    LinkedList1Node *list_node;
+    while (list_node = LinkedList1_GetFirst(&bsys->uring_dirty_list)) {
+        BFileDescriptor *bfd = UPPER_OBJECT(list_node, BFileDescriptor, uring_dirty_list_node);
+        ASSERT(bfd->active)
+        ASSERT(bfd->uring_dirty)
+        
+        LinkedList1_Remove(&bsys->uring_dirty_list, &bfd->uring_dirty_list_node);
+        bfd->uring_dirty = 0;
+        
+        // calculate poll events
+        int pevents = 0;
+        if ((bfd->waitEvents & BREACTOR_READ)) {
+            pevents |= POLLIN;
+        }
+        if ((bfd->waitEvents & BREACTOR_WRITE)) {
+            pevents |= POLLOUT;
+        }
+        
+        if (pevents == bfd->uring_armed_events) {
+            continue;
+        }
+        
+        // cancel existing request
+        if (bfd->uring_armed_events) {
+            uring_cancel_poll(bsys, bfd);
+        }
+        
+        if (!pevents) {
+            continue;
+        }
+        
+        // make new request
+        bsys->uring_slots[bfd->uring_slot].gen++;
+        struct io_uring_sqe *sqe = uring_get_sqe(bsys);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = bfd->fd;
+        #ifdef BADVPN_BIG_ENDIAN
+        sqe->poll32_events = ((uint32_t)pevents << 16) | ((uint32_t)pevents >> 16);
+        #else
+        sqe->poll32_events = pevents;
+        #endif
+        sqe->user_data = uring_user_data(bsys, bfd->uring_slot);
+        uring_commit_sqe(bsys, sqe);
+        
+        bfd->uring_armed_events = pevents;
+    }
+}
+
+static int uring_collect_results (BReactor *bsys)
+{
+    ASSERT(bsys->uring_results_num == 0)
+    
+    unsigned int head = *bsys->uring_cq_head;
+    unsigned int tail = __atomic_load_n(bsys->uring_cq_tail, __ATOMIC_ACQUIRE);
+    
+    while (head != tail && bsys->uring_results_num < BSYSTEM_MAX_RESULTS) {
+        struct io_uring_cqe *cqe = &bsys->uring_cqes[head & bsys->uring_cq_mask];
+        head++;
+        
+        if (cqe->user_data == URING_USER_DATA_IGNORE) {
+            continue;
+        }
+        
+        // ignore completions of cancelled requests
+        int slot = (uint32_t)cqe->user_data & ~(uint32_t)URING_USER_DATA_FD;
+        if (slot >= bsys->uring_num_slots || cqe->user_data != uring_user_data(bsys, slot)) {
+            uring_discard_result(cqe->user_data, cqe->res);
+            continue;
+        }
+        
+        struct BReactor__uring_result *result = &bsys->uring_results[bsys->uring_results_num];
+        
+        // completion of an I/O operation
+        BReactorIO *io = bsys->uring_slots[slot].io;
+        if (io) {
+            ASSERT(io->active)
+            ASSERT(io->busy)
+            
+            // a multishot operation goes on while the kernel says so,
+            // otherwise the operation is done
+            int more = !!(cqe->flags & IORING_CQE_F_MORE);
+            if (!more) {
+                io->busy = 0;
+                bsys->uring_slots[slot].gen++;
+            }
+            
+            // write result
+            result->bfd = NULL;
+            result->io = io;
+            result->res = cqe->res;
+            result->buf = ((cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1);
+            result->more = more;
+            bsys->uring_results_num++;
+            continue;
+        }
+        
+        BFileDescriptor *bfd = bsys->uring_slots[slot].bfd;
+        ASSERT(bfd)
+        ASSERT(bfd->active)
+        ASSERT(bfd->uring_armed_events)
+        ASSERT(!bfd->uring_returned_ptr)
+        
+        // the request is done; make another one before the next wait if needed
+        bfd->uring_armed_events = 0;
+        uring_set_dirty(bsys, bfd);
+        
+        // write result
+        result->bfd = bfd;
+        result->io = NULL;
+        result->revents = (cqe->res < 0 ? POLLERR : cqe->res);
+        bsys->uring_results_num++;
+        
+        // remember where the result is, so it can be invalidated
+        bfd->uring_returned_ptr = &result->bfd;
+    }
+    
+    __atomic_store_n(bsys->uring_cq_head, head, __ATOMIC_RELEASE);
+    
+    return bsys->uring_results_num;
+}
+
+#endif
+
 static void wait_for_events (BReactor *bsys)
 {
     // must have processed all pending events
@@ -287,11 +927,15 @@ static void wait_for_events (BReactor *bsys)
     #ifdef BADVPN_USE_POLL
     ASSERT(bsys->poll_results_pos == bsys->poll_results_num)
     #endif
+    #ifdef BADVPN_USE_IO_URING
+    ASSERT(bsys->uring_results_pos == bsys->uring_results_num)
+    #endif
 
     // clean up epoll results
     #ifdef BADVPN_USE_EPOLL
     bsys->epoll_results_num = 0;
     bsys->epoll_results_pos = 0;
+    resize_epoll_results(bsys);
     #endif
     
     // clean up kevent results
@@ -306,16 +950,20 @@ static void wait_for_events (BReactor *bsys)
     bsys->poll_results_pos = 0;
     #endif
     
+    // clean up io_uring results and queue poll requests
+    #ifdef BADVPN_USE_IO_URING
+    bsys->uring_results_num = 0;
+    bsys->uring_results_pos = 0;
+    uring_update_polls(bsys);
+    #endif
+    
     // timeout vars
     int have_timeout = 0;
-    btime_t timeout_abs;
+    btime_t timeout_abs = 0; // to remove warning
     btime_t now = 0; // to remove warning
     
     // compute timeout
-    BSmallTimer *first_timer = BReactor__TimersTree_GetFirst(&bsys->timers_tree, 0).link;
-    if (first_timer) {
-        ASSERT(first_timer->state == TIMER_STATE_RUNNING)
-        
+    if (have_running_timers(bsys)) {
         // get current time
         now = btime_gettime();
         
@@ -327,9 +975,14 @@ static void wait_for_events (BReactor *bsys)
         
         // timeout is first timer, remember absolute time
         have_timeout = 1;
-        timeout_abs = first_timer->absTime;
+        timeout_abs = first_timer_time(bsys);
     }
     
+    #ifdef BADVPN_USE_EPOLL
+    // poll without blocking until this time
+    int64_t busy_poll_end = (bsys->busy_poll_us > 0 ? busy_poll_time() + bsys->busy_poll_us : 0);
+    #endif
+    
     // wait until the timeout is reached or the file descriptor / handle in ready
     while (1) {
         // compute timeout
@@ -383,9 +1036,12 @@ static void wait_for_events (BReactor *bsys)
             }
         }
         
+        // while busy polling, the wait must not block
+        int busy = (busy_poll_end > 0 && busy_poll_time() < busy_poll_end);
+        
         BLog(BLOG_DEBUG, "Calling epoll_wait");
         
-        int waitres = epoll_wait(bsys->efd, bsys->epoll_results, BSYSTEM_MAX_RESULTS, (have_timeout ? timeout_rel_trunc : -1));
+        int waitres = epoll_wait(bsys->efd, bsys->epoll_results, bsys->epoll_results_size, (busy ? 0 : have_timeout ? timeout_rel_trunc : -1));
         if (waitres < 0) {
             int error = errno;
             if (error == EINTR) {
@@ -396,10 +1052,10 @@ static void wait_for_events (BReactor *bsys)
             ASSERT_FORCE(0)
         }
         
-        ASSERT_FORCE(!(waitres == 0) || have_timeout)
-        ASSERT_FORCE(waitres <= BSYSTEM_MAX_RESULTS)
+        ASSERT_FORCE(!(waitres == 0) || have_timeout || busy)
+        ASSERT_FORCE(waitres <= bsys->epoll_results_size)
         
-        if (waitres != 0 || timeout_rel_trunc == timeout_rel) {
+        if (waitres != 0 || (!busy && timeout_rel_trunc == timeout_rel)) {
             if (waitres != 0) {
                 BLog(BLOG_DEBUG, "epoll_wait returned %d file descriptors", waitres);
                 bsys->epoll_results_num = waitres;
@@ -496,31 +1152,80 @@ static void wait_for_events (BReactor *bsys)
             list_node = LinkedList1Node_Next(list_node);
         }
         
-        BLog(BLOG_DEBUG, "Calling poll");
+        BLog(BLOG_DEBUG, "Calling poll");
+        
+        int waitres = poll(bsys->poll_results_pollfds, num_fds, (have_timeout ? timeout_rel_trunc : -1));
+        if (waitres < 0) {
+            int error = errno;
+            if (error == EINTR) {
+                BLog(BLOG_DEBUG, "poll interrupted");
+                goto try_again;
+            }
+            perror("poll");
+            ASSERT_FORCE(0)
+        }
+        
+        ASSERT_FORCE(!(waitres == 0) || have_timeout)
+        
+        if (waitres != 0 || timeout_rel_trunc == timeout_rel) {
+            if (waitres != 0) {
+                BLog(BLOG_DEBUG, "poll returned %d file descriptors", waitres);
+                bsys->poll_results_num = num_fds;
+                bsys->poll_results_pos = 0;
+                set_poll_fd_pointers(bsys);
+            } else {
+                BLog(BLOG_DEBUG, "poll timed out");
+                move_first_timers(bsys);
+            }
+            break;
+        }
+        
+        #endif
+        
+        #ifdef BADVPN_USE_IO_URING
+        
+        struct __kernel_timespec ts;
+        if (have_timeout) {
+            if (timeout_rel_trunc > 86400000) {
+                timeout_rel_trunc = 86400000;
+            }
+            ts.tv_sec = timeout_rel_trunc / 1000;
+            ts.tv_nsec = (timeout_rel_trunc % 1000) * 1000000;
+        }
+        
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (have_timeout ? (uint64_t)(uintptr_t)&ts : 0);
         
-        int waitres = poll(bsys->poll_results_pollfds, num_fds, (have_timeout ? timeout_rel_trunc : -1));
+        // don't block if there are completions left from the last wait
+        unsigned int min_complete = (*bsys->uring_cq_head == __atomic_load_n(bsys->uring_cq_tail, __ATOMIC_ACQUIRE));
+        
+        BLog(BLOG_DEBUG, "Calling io_uring_enter");
+        
+        // this both submits queued requests and waits for completions
+        int waitres = uring_enter(bsys, min_complete, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
         if (waitres < 0) {
             int error = errno;
             if (error == EINTR) {
-                BLog(BLOG_DEBUG, "poll interrupted");
+                BLog(BLOG_DEBUG, "io_uring_enter interrupted");
                 goto try_again;
             }
-            perror("poll");
-            ASSERT_FORCE(0)
+            if (error != ETIME && error != EAGAIN && error != EBUSY) {
+                perror("io_uring_enter");
+                ASSERT_FORCE(0)
+            }
         }
         
-        ASSERT_FORCE(!(waitres == 0) || have_timeout)
+        // A successful return only says how many requests were submitted; the
+        // wait itself may have timed out or been interrupted.
+        if (uring_collect_results(bsys) > 0) {
+            BLog(BLOG_DEBUG, "io_uring_enter returned %d file descriptors", bsys->uring_results_num);
+            break;
+        }
         
-        if (waitres != 0 || timeout_rel_trunc == timeout_rel) {
-            if (waitres != 0) {
-                BLog(BLOG_DEBUG, "poll returned %d file descriptors", waitres);
-                bsys->poll_results_num = num_fds;
-                bsys->poll_results_pos = 0;
-                set_poll_fd_pointers(bsys);
-            } else {
-                BLog(BLOG_DEBUG, "poll timed out");
-                move_first_timers(bsys);
-            }
+        if (waitres < 0 && errno == ETIME && timeout_rel_trunc == timeout_rel) {
+            BLog(BLOG_DEBUG, "io_uring_enter timed out");
+            move_first_timers(bsys);
             break;
         }
         
@@ -561,6 +1266,17 @@ void BFileDescriptor_Init (BFileDescriptor *bs, int fd, BFileDescriptor_handler
 
 #endif
 
+#ifdef BADVPN_USE_IO_URING
+
+void BReactorIO_Init (BReactorIO *io, BReactorIO_handler handler, void *user)
+{
+    io->handler = handler;
+    io->user = user;
+    io->active = 0;
+}
+
+#endif
+
 void BSmallTimer_Init (BSmallTimer *bt, BSmallTimer_handler handler)
 {
     bt->handler.smalll = handler;
@@ -596,11 +1312,26 @@ int BReactor_Init (BReactor *bsys)
     // set not exiting
     bsys->exiting = 0;
     
+    // no busy polling
+    bsys->busy_poll_us = 0;
+    
     // init jobs
     BPendingGroup_Init(&bsys->pending_jobs);
     
     // init timers
+    #ifdef BADVPN_BREACTOR_TIMER_WHEEL
+    bsys->timers_wheel_clk = -1;
+    for (int i = 0; i < BSYSTEM_TIMER_WHEEL_LEVELS; i++) {
+        for (int j = 0; j < BSYSTEM_TIMER_WHEEL_SLOTS; j++) {
+            LinkedList1_Init(&bsys->timers_wheel[i][j]);
+        }
+        bsys->timers_wheel_bitmap[i] = 0;
+    }
+    LinkedList1_Init(&bsys->timers_wheel_due);
+    bsys->timers_wheel_count = 0;
+    #else
     BReactor__TimersTree_Init(&bsys->timers_tree);
+    #endif
     LinkedList1_Init(&bsys->timers_expired_list);
     
     // init limits
@@ -631,9 +1362,17 @@ int BReactor_Init (BReactor *bsys)
     }
     
     // init results array
+    bsys->epoll_results_size = BSYSTEM_MAX_RESULTS;
+    if (!(bsys->epoll_results = BAllocArray(bsys->epoll_results_size, sizeof(bsys->epoll_results[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
     bsys->epoll_results_num = 0;
     bsys->epoll_results_pos = 0;
     
+    // set zero fds
+    bsys->epoll_num_fds = 0;
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -674,6 +1413,87 @@ int BReactor_Init (BReactor *bsys)
     
     #endif
     
+    #ifdef BADVPN_USE_IO_URING
+    
+    // create io_uring
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = BSYSTEM_URING_CQ_ENTRIES;
+    if ((bsys->uring_fd = syscall(__NR_io_uring_setup, BSYSTEM_URING_SQ_ENTRIES, &params)) < 0) {
+        BLog(BLOG_ERROR, "io_uring_setup failed");
+        goto fail0;
+    }
+    
+    // we need timeouts for io_uring_enter (Linux 5.11)
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        BLog(BLOG_ERROR, "io_uring does not support IORING_FEAT_EXT_ARG");
+        goto fail1;
+    }
+    
+    // map submission queue ring
+    bsys->uring_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if ((bsys->uring_sq_ring = mmap(NULL, bsys->uring_sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, bsys->uring_fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed");
+        goto fail1;
+    }
+    
+    // map completion queue ring
+    bsys->uring_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((bsys->uring_cq_ring = mmap(NULL, bsys->uring_cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, bsys->uring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed");
+        goto fail2;
+    }
+    
+    // map submission queue entries
+    bsys->uring_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((bsys->uring_sqes = mmap(NULL, bsys->uring_sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, bsys->uring_fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed");
+        goto fail3;
+    }
+    
+    // get ring pointers
+    uint8_t *sq_ring = bsys->uring_sq_ring;
+    bsys->uring_sq_head = (unsigned int *)(sq_ring + params.sq_off.head);
+    bsys->uring_sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    bsys->uring_sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    bsys->uring_sq_mask = *(unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    bsys->uring_sq_entries = *(unsigned int *)(sq_ring + params.sq_off.ring_entries);
+    uint8_t *cq_ring = bsys->uring_cq_ring;
+    bsys->uring_cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+    bsys->uring_cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    bsys->uring_cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    bsys->uring_cq_mask = *(unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    
+    // I/O operations need synchronous cancellation (Linux 6.0), so that their
+    // buffers can be released right after cancelling; probe for it by
+    // cancelling a request that doesn't exist
+    bsys->uring_have_io = (uring_sync_cancel(bsys, URING_USER_DATA_IGNORE) < 0 && errno == ENOENT);
+    
+    // allocate slots
+    bsys->uring_num_slots = URING_INITIAL_SLOTS;
+    if (!(bsys->uring_slots = BAllocArray(bsys->uring_num_slots, sizeof(bsys->uring_slots[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail4;
+    }
+    for (int i = 0; i < bsys->uring_num_slots; i++) {
+        bsys->uring_slots[i].bfd = NULL;
+        bsys->uring_slots[i].io = NULL;
+        bsys->uring_slots[i].gen = 0;
+        bsys->uring_slots[i].fd_results = 0;
+        bsys->uring_slots[i].next_free = (i + 1 < bsys->uring_num_slots ? i + 1 : -1);
+    }
+    bsys->uring_free_slot = 0;
+    
+    // init dirty list
+    LinkedList1_Init(&bsys->uring_dirty_list);
+    
+    // init results array
+    bsys->uring_results_num = 0;
+    bsys->uring_results_pos = 0;
+    
+    #endif
+    
     DebugObject_Init(&bsys->d_obj);
     #ifndef BADVPN_USE_WINAPI
     DebugCounter_Init(&bsys->d_fds_counter);
@@ -685,10 +1505,24 @@ int BReactor_Init (BReactor *bsys)
     
     return 1;
     
+    #ifdef BADVPN_USE_EPOLL
+fail1:
+    ASSERT_FORCE(close(bsys->efd) == 0)
+    #endif
     #ifdef BADVPN_USE_POLL
 fail1:
     BFree(bsys->poll_results_pollfds);
     #endif
+    #ifdef BADVPN_USE_IO_URING
+fail4:
+    ASSERT_FORCE(munmap(bsys->uring_sqes, bsys->uring_sqes_size) == 0)
+fail3:
+    ASSERT_FORCE(munmap(bsys->uring_cq_ring, bsys->uring_cq_ring_size) == 0)
+fail2:
+    ASSERT_FORCE(munmap(bsys->uring_sq_ring, bsys->uring_sq_ring_size) == 0)
+fail1:
+    ASSERT_FORCE(close(bsys->uring_fd) == 0)
+    #endif
 fail0:
     BPendingGroup_Free(&bsys->pending_jobs);
     BLog(BLOG_ERROR, "Reactor failed to initialize");
@@ -709,7 +1543,7 @@ void BReactor_Free (BReactor *bsys)
     
     // {pending group has no BPending objects}
     ASSERT(!BPendingGroup_HasJobs(&bsys->pending_jobs))
-    ASSERT(BReactor__TimersTree_IsEmpty(&bsys->timers_tree))
+    ASSERT(!have_running_timers(bsys))
     ASSERT(LinkedList1_IsEmpty(&bsys->timers_expired_list))
     ASSERT(LinkedList1_IsEmpty(&bsys->active_limits_list))
     DebugObject_Free(&bsys->d_obj);
@@ -728,6 +1562,9 @@ void BReactor_Free (BReactor *bsys)
     ASSERT(bsys->poll_num_enabled_fds == 0)
     ASSERT(LinkedList1_IsEmpty(&bsys->poll_enabled_fds_list))
     #endif
+    #ifdef BADVPN_USE_IO_URING
+    ASSERT(LinkedList1_IsEmpty(&bsys->uring_dirty_list))
+    #endif
     
     BLog(BLOG_DEBUG, "Reactor freeing");
     
@@ -740,6 +1577,9 @@ void BReactor_Free (BReactor *bsys)
     
     #ifdef BADVPN_USE_EPOLL
     
+    // free results array
+    BFree(bsys->epoll_results);
+    
     // close epoll fd
     ASSERT_FORCE(close(bsys->efd) == 0)
     
@@ -760,6 +1600,30 @@ void BReactor_Free (BReactor *bsys)
     
     #endif
     
+    #ifdef BADVPN_USE_IO_URING
+    
+    // close file descriptors from completions of cancelled requests
+    unsigned int head = *bsys->uring_cq_head;
+    unsigned int tail = __atomic_load_n(bsys->uring_cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &bsys->uring_cqes[head & bsys->uring_cq_mask];
+        if (cqe->user_data != URING_USER_DATA_IGNORE) {
+            uring_discard_result(cqe->user_data, cqe->res);
+        }
+        head++;
+    }
+    
+    // free slots
+    BFree(bsys->uring_slots);
+    
+    // unmap rings and close io_uring fd; this cancels outstanding requests
+    ASSERT_FORCE(munmap(bsys->uring_sqes, bsys->uring_sqes_size) == 0)
+    ASSERT_FORCE(munmap(bsys->uring_cq_ring, bsys->uring_cq_ring_size) == 0)
+    ASSERT_FORCE(munmap(bsys->uring_sq_ring, bsys->uring_sq_ring_size) == 0)
+    ASSERT_FORCE(close(bsys->uring_fd) == 0)
+    
+    #endif
+    
     // free jobs
     BPendingGroup_Free(&bsys->pending_jobs);
 }
@@ -982,6 +1846,67 @@ int BReactor_Exec (BReactor *bsys)
         
         #endif
         
+        #ifdef BADVPN_USE_IO_URING
+        
+        // dispatch file descriptor
+        if (bsys->uring_results_pos < bsys->uring_results_num) {
+            // grab event
+            struct BReactor__uring_result *result = &bsys->uring_results[bsys->uring_results_pos];
+            bsys->uring_results_pos++;
+            
+            // dispatch I/O operation
+            if (result->io) {
+                BReactorIO *io = result->io;
+                ASSERT(io->active)
+                ASSERT(result->more || !io->busy)
+                
+                // call handler
+                BLog(BLOG_DEBUG, "Dispatching I/O operation");
+                io->handler(io->user, result->res, result->buf, result->more);
+                continue;
+            }
+            
+            // check if the BFileDescriptor or BReactorIO was removed
+            if (!result->bfd) {
+                continue;
+            }
+            
+            // get BFileDescriptor
+            BFileDescriptor *bfd = result->bfd;
+            ASSERT(bfd->active)
+            ASSERT(bfd->uring_returned_ptr == &result->bfd)
+            
+            // zero pointer to the result
+            bfd->uring_returned_ptr = NULL;
+            
+            // calculate events to report
+            int events = 0;
+            if ((bfd->waitEvents & BREACTOR_READ) && (result->revents & POLLIN)) {
+                events |= BREACTOR_READ;
+            }
+            if ((bfd->waitEvents & BREACTOR_WRITE) && (result->revents & POLLOUT)) {
+                events |= BREACTOR_WRITE;
+            }
+            if ((result->revents & POLLERR)) {
+                events |= BREACTOR_ERROR;
+            }
+            if ((result->revents & POLLHUP)) {
+                events |= BREACTOR_HUP;
+            }
+            
+            // the monitored events may have changed since the request was made
+            if (!events) {
+                continue;
+            }
+            
+            // call handler
+            BLog(BLOG_DEBUG, "Dispatching file descriptor");
+            bfd->handler(bfd->user, events);
+            continue;
+        }
+        
+        #endif
+        
         wait_for_events(bsys);
     }
 
@@ -996,6 +1921,14 @@ void BReactor_Quit (BReactor *bsys, int code)
     bsys->exit_code = code;
 }
 
+void BReactor_SetBusyPoll (BReactor *bsys, int usecs)
+{
+    DebugObject_Access(&bsys->d_obj);
+    ASSERT(usecs >= 0)
+    
+    bsys->busy_poll_us = usecs;
+}
+
 void BReactor_SetSmallTimer (BReactor *bsys, BSmallTimer *bt, int mode, btime_t time)
 {
     assert_timer(bt);
@@ -1015,10 +1948,14 @@ void BReactor_SetSmallTimer (BReactor *bsys, BSmallTimer *bt, int mode, btime_t
     // set running
     bt->state = TIMER_STATE_RUNNING;
     
-    // insert to running timers tree
+    // insert to running timers
+    #ifdef BADVPN_BREACTOR_TIMER_WHEEL
+    wheel_insert(bsys, bt);
+    #else
     BReactor__TimersTreeRef ref = {bt, bt};
     int res = BReactor__TimersTree_Insert(&bsys->timers_tree, 0, ref, NULL);
     ASSERT_EXECUTE(res)
+    #endif
 }
 
 void BReactor_RemoveSmallTimer (BReactor *bsys, BSmallTimer *bt)
@@ -1033,9 +1970,13 @@ void BReactor_RemoveSmallTimer (BReactor *bsys, BSmallTimer *bt)
         // remove from expired list
         LinkedList1_Remove(&bsys->timers_expired_list, &bt->u.list_node);
     } else {
-        // remove from running tree
+        // remove from running timers
+        #ifdef BADVPN_BREACTOR_TIMER_WHEEL
+        wheel_remove(bsys, bt);
+        #else
         BReactor__TimersTreeRef ref = {bt, bt};
         BReactor__TimersTree_Remove(&bsys->timers_tree, 0, ref);
+        #endif
     }
 
     // set inactive
@@ -1106,6 +2047,8 @@ int BReactor_AddFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
     // set epoll returned pointer
     bs->epoll_returned_ptr = NULL;
     
+    bsys->epoll_num_fds++;
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -1134,6 +2077,23 @@ int BReactor_AddFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
     
     #endif
     
+    #ifdef BADVPN_USE_IO_URING
+    
+    // take slot
+    if ((bs->uring_slot = uring_take_slot(bsys)) < 0) {
+        return 0;
+    }
+    bsys->uring_slots[bs->uring_slot].bfd = bs;
+    
+    // no poll request yet
+    bs->uring_armed_events = 0;
+    bs->uring_dirty = 0;
+    
+    // set not returned
+    bs->uring_returned_ptr = NULL;
+    
+    #endif
+    
     bs->active = 1;
     bs->waitEvents = 0;
     
@@ -1160,6 +2120,8 @@ void BReactor_RemoveFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
         *bs->epoll_returned_ptr = NULL;
     }
     
+    bsys->epoll_num_fds--;
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -1194,6 +2156,29 @@ void BReactor_RemoveFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
     bsys->poll_num_enabled_fds--;
     
     #endif
+    
+    #ifdef BADVPN_USE_IO_URING
+    
+    // cancel poll request; it is submitted with the next wait
+    if (bs->uring_armed_events) {
+        uring_cancel_poll(bsys, bs);
+    }
+    
+    // remove from dirty list
+    if (bs->uring_dirty) {
+        LinkedList1_Remove(&bsys->uring_dirty_list, &bs->uring_dirty_list_node);
+    }
+    
+    // write through returned pointer
+    if (bs->uring_returned_ptr) {
+        *bs->uring_returned_ptr = NULL;
+    }
+    
+    // release slot
+    ASSERT(bsys->uring_slots[bs->uring_slot].bfd == bs)
+    uring_release_slot(bsys, bs->uring_slot);
+    
+    #endif
 }
 
 void BReactor_SetFileDescriptorEvents (BReactor *bsys, BFileDescriptor *bs, int events)
@@ -1231,12 +2216,331 @@ void BReactor_SetFileDescriptorEvents (BReactor *bsys, BFileDescriptor *bs, int
     
     #endif
     
+    #ifdef BADVPN_USE_IO_URING
+    
+    // the poll request is updated before the next wait
+    uring_set_dirty(bsys, bs);
+    
+    #endif
+    
     // update events
     bs->waitEvents = events;
 }
 
 #endif
 
+#ifdef BADVPN_USE_IO_URING
+
+int BReactor_IOSupported (BReactor *bsys)
+{
+    DebugObject_Access(&bsys->d_obj);
+    
+    return bsys->uring_have_io;
+}
+
+int BReactor_AddIO (BReactor *bsys, BReactorIO *io)
+{
+    ASSERT(!io->active)
+    ASSERT(bsys->uring_have_io)
+    
+    // take slot
+    if ((io->uring_slot = uring_take_slot(bsys)) < 0) {
+        return 0;
+    }
+    bsys->uring_slots[io->uring_slot].io = io;
+    
+    io->active = 1;
+    io->busy = 0;
+    
+    DebugCounter_Increment(&bsys->d_fds_counter);
+    return 1;
+}
+
+void BReactor_RemoveIO (BReactor *bsys, BReactorIO *io)
+{
+    ASSERT(io->active)
+    DebugCounter_Decrement(&bsys->d_fds_counter);
+    
+    // cancel operation and forget its results
+    BReactor_CancelIO(bsys, io);
+    
+    // release slot
+    ASSERT(bsys->uring_slots[io->uring_slot].io == io)
+    uring_release_slot(bsys, io->uring_slot);
+    
+    io->active = 0;
+}
+
+void BReactor_SubmitSendmsg (BReactor *bsys, BReactorIO *io, int fd, struct msghdr *msg, int flags)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_SENDMSG, fd);
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitRecvmsg (BReactor *bsys, BReactorIO *io, int fd, struct msghdr *msg, int flags)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_RECVMSG, fd);
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitRead (BReactor *bsys, BReactorIO *io, int fd, void *buf, int len)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    ASSERT(len >= 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_READ, fd);
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitReadv (BReactor *bsys, BReactorIO *io, int fd, const struct iovec *iov, int iovcnt)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    ASSERT(iovcnt > 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_READV, fd);
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->off = (uint64_t)-1;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitWrite (BReactor *bsys, BReactorIO *io, int fd, const void *buf, int len)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    ASSERT(len >= 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_WRITE, fd);
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitWritev (BReactor *bsys, BReactorIO *io, int fd, const struct iovec *iov, int iovcnt)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    ASSERT(iovcnt > 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_WRITEV, fd);
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->off = (uint64_t)-1;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitAcceptMultishot (BReactor *bsys, BReactorIO *io, int fd)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_ACCEPT, fd);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_SubmitRecvmsgMultishot (BReactor *bsys, BReactorIO *io, int fd, struct msghdr *msg, BReactorBufferRing *ring, int flags)
+{
+    ASSERT(io->active)
+    ASSERT(!io->busy)
+    ASSERT(fd >= 0)
+    DebugObject_Access(&ring->d_obj);
+    ASSERT(ring->reactor == bsys)
+    
+    struct io_uring_sqe *sqe = uring_prepare_io(bsys, io, IORING_OP_RECVMSG, fd);
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->slot;
+    uring_commit_sqe(bsys, sqe);
+}
+
+void BReactor_LinkIO (BReactor *bsys, BReactorIO *io)
+{
+    ASSERT(io->active)
+    ASSERT(io->busy)
+    
+    // The request is the last one in the submission queue. Should the queue
+    // fill up and be submitted before the next request is added, the link is
+    // lost and the requests are merely performed concurrently.
+    unsigned int tail = *bsys->uring_sq_tail;
+    ASSERT(tail != __atomic_load_n(bsys->uring_sq_head, __ATOMIC_ACQUIRE))
+    struct io_uring_sqe *sqe = &bsys->uring_sqes[(tail - 1) & bsys->uring_sq_mask];
+    ASSERT(sqe->user_data == uring_user_data(bsys, io->uring_slot))
+    ASSERT(!(sqe->flags & IOSQE_BUFFER_SELECT))
+    
+    sqe->flags |= IOSQE_IO_LINK;
+}
+
+void BReactor_CancelIO (BReactor *bsys, BReactorIO *io)
+{
+    ASSERT(io->active)
+    
+    if (io->busy) {
+        // The request may still be in the submission queue, where it cannot be
+        // cancelled; submit it first. Then wait until the kernel is done with it.
+        // If it has already completed, the cancellation just finds nothing.
+        uring_submit(bsys);
+        while (uring_sync_cancel(bsys, uring_user_data(bsys, io->uring_slot)) < 0) {
+            int error = errno;
+            if (error == ENOENT) {
+                break;
+            }
+            if (error != EINTR) {
+                perror("io_uring_register");
+                ASSERT_FORCE(0)
+            }
+        }
+        
+        // invalidate the completion of the cancelled request
+        bsys->uring_slots[io->uring_slot].gen++;
+        
+        io->busy = 0;
+    }
+    
+    // results which were already collected are not reported either
+    uring_drop_results(bsys, io);
+}
+
+int BReactorBufferRing_Init (BReactorBufferRing *o, BReactor *reactor, int num_bufs, int buf_size)
+{
+    DebugObject_Access(&reactor->d_obj);
+    ASSERT(reactor->uring_have_io)
+    ASSERT(num_bufs > 0)
+    ASSERT(num_bufs <= 32768)
+    ASSERT(!(num_bufs & (num_bufs - 1)))
+    ASSERT(buf_size > 0)
+    ASSERT(buf_size % 8 == 0)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->num_bufs = num_bufs;
+    o->buf_size = buf_size;
+    
+    // take a slot; its index is the buffer group ID of the ring
+    if ((o->slot = uring_take_slot(reactor)) < 0) {
+        goto fail0;
+    }
+    if (o->slot > UINT16_MAX) {
+        BLog(BLOG_ERROR, "too many slots for a buffer group ID");
+        goto fail1;
+    }
+    
+    // allocate buffers
+    if (!(o->bufs = BAllocArray2(num_bufs, buf_size, 1))) {
+        BLog(BLOG_ERROR, "BAllocArray2 failed");
+        goto fail1;
+    }
+    
+    // allocate ring, which must be page-aligned
+    o->ring_size = (size_t)num_bufs * sizeof(struct io_uring_buf);
+    if ((o->ring = mmap(NULL, o->ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed");
+        goto fail2;
+    }
+    
+    // register ring
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)o->ring;
+    reg.ring_entries = num_bufs;
+    reg.bgid = o->slot;
+    if (syscall(__NR_io_uring_register, reactor->uring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        BLog(BLOG_ERROR, "io_uring_register(IORING_REGISTER_PBUF_RING) failed");
+        goto fail3;
+    }
+    
+    // put all buffers into the ring
+    o->tail = 0;
+    for (int i = 0; i < num_bufs; i++) {
+        buffer_ring_add(o, i);
+    }
+    __atomic_store_n(&o->ring->tail, (uint16_t)o->tail, __ATOMIC_RELEASE);
+    
+    DebugCounter_Increment(&reactor->d_fds_counter);
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail3:
+    ASSERT_FORCE(munmap(o->ring, o->ring_size) == 0)
+fail2:
+    BFree(o->bufs);
+fail1:
+    uring_release_slot(reactor, o->slot);
+fail0:
+    return 0;
+}
+
+void BReactorBufferRing_Free (BReactorBufferRing *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Decrement(&o->reactor->d_fds_counter);
+    
+    // unregister ring
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = o->slot;
+    ASSERT_FORCE(syscall(__NR_io_uring_register, o->reactor->uring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1) == 0)
+    
+    // free ring
+    ASSERT_FORCE(munmap(o->ring, o->ring_size) == 0)
+    
+    // free buffers
+    BFree(o->bufs);
+    
+    // release slot
+    uring_release_slot(o->reactor, o->slot);
+}
+
+uint8_t * BReactorBufferRing_Buffer (BReactorBufferRing *o, int buf)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(buf >= 0)
+    ASSERT(buf < o->num_bufs)
+    
+    return o->bufs + (size_t)buf * o->buf_size;
+}
+
+void BReactorBufferRing_Recycle (BReactorBufferRing *o, int buf)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(buf >= 0)
+    ASSERT(buf < o->num_bufs)
+    
+    // add buffer and publish it to the kernel
+    buffer_ring_add(o, buf);
+    __atomic_store_n(&o->ring->tail, (uint16_t)o->tail, __ATOMIC_RELEASE);
+}
+
+#endif
+
 void BReactorLimit_Init (BReactorLimit *o, BReactor *reactor, int limit)
 {
     DebugObject_Access(&reactor->d_obj);
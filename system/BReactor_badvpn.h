@@ -35,7 +35,7 @@
 #ifndef BADVPN_SYSTEM_BREACTOR_H
 #define BADVPN_SYSTEM_BREACTOR_H
 
-#if (defined(BADVPN_USE_WINAPI) + defined(BADVPN_USE_EPOLL) + defined(BADVPN_USE_KEVENT) + defined(BADVPN_USE_POLL)) != 1
+#if (defined(BADVPN_USE_WINAPI) + defined(BADVPN_USE_EPOLL) + defined(BADVPN_USE_KEVENT) + defined(BADVPN_USE_POLL) + defined(BADVPN_USE_IO_URING)) != 1
 #error Unknown event backend or too many event backends
 #endif
 
@@ -68,10 +68,13 @@
 #include <base/BPending.h>
 
 struct BSmallTimer_t;
+
+#ifndef BADVPN_BREACTOR_TIMER_WHEEL
 typedef struct BSmallTimer_t *BReactor_timerstree_link;
 
 #include "BReactor_badvpn_timerstree.h"
 #include <structure/CAvl_decl.h>
+#endif
 
 #define BTIMER_SET_ABSOLUTE 1
 #define BTIMER_SET_RELATIVE 2
@@ -116,6 +119,8 @@ typedef struct BSmallTimer_t {
     int8_t tree_balance;
     uint8_t state;
     uint8_t is_small;
+    uint8_t wheel_level;
+    uint8_t wheel_slot;
 } BSmallTimer;
 
 /**
@@ -210,6 +215,14 @@ typedef struct BFileDescriptor_t {
     LinkedList1Node poll_enabled_fds_list_node;
     int poll_returned_index;
     #endif
+    
+    #ifdef BADVPN_USE_IO_URING
+    int uring_slot;
+    int uring_armed_events;
+    int uring_dirty;
+    LinkedList1Node uring_dirty_list_node;
+    struct BFileDescriptor_t **uring_returned_ptr;
+    #endif
 } BFileDescriptor;
 
 /**
@@ -225,11 +238,86 @@ void BFileDescriptor_Init (BFileDescriptor *bs, int fd, BFileDescriptor_handler
 
 #endif
 
+#ifdef BADVPN_USE_IO_URING
+
+struct msghdr;
+struct iovec;
+
+/**
+ * Handler function invoked by the reactor when an I/O operation completes,
+ * or when a multishot operation produces a result.
+ * The I/O object is in active state, being called from within the
+ * associated reactor.
+ *
+ * @param user value passed to {@link BReactorIO_Init}
+ * @param res result of the operation: the return value of the corresponding
+ *            system call on success (>=0), or a negated errno value on failure
+ * @param buf for operations receiving into a {@link BReactorBufferRing}, the
+ *            index of the buffer which was filled, which now belongs to the
+ *            handler until it is given back with {@link BReactorBufferRing_Recycle};
+ *            -1 otherwise
+ * @param more 1 if this is a result of a multishot operation which continues,
+ *             0 if the operation is done. Another operation may only be
+ *             started with the object after the handler has been called
+ *             with more=0.
+ */
+typedef void (*BReactorIO_handler) (void *user, int res, int buf, int more);
+
+/**
+ * I/O operation object used with {@link BReactor}.
+ * The reactor performs the operation asynchronously and reports its
+ * completion, instead of reporting readiness of the file descriptor.
+ * An object has at most one operation in progress.
+ * Only available with the io_uring backend; see {@link BReactor_IOSupported}.
+ */
+typedef struct BReactorIO_t {
+    BReactorIO_handler handler;
+    void *user;
+    int active;
+    int busy;
+    int uring_slot;
+} BReactorIO;
+
+/**
+ * Intializes the I/O operation object.
+ * The object is initialized in not active state.
+ *
+ * @param io I/O operation object to initialize
+ * @param handler handler function invoked by the reactor when an operation completes
+ * @param user value passed to the handler functuon
+ */
+void BReactorIO_Init (BReactorIO *io, BReactorIO_handler handler, void *user);
+
+#endif
+
 // BReactor
 
 #define BSYSTEM_MAX_RESULTS 64
+#define BSYSTEM_MAX_EPOLL_RESULTS 4096
 #define BSYSTEM_MAX_HANDLES 64
 #define BSYSTEM_MAX_POLL_FDS 4096
+#define BSYSTEM_URING_SQ_ENTRIES 256
+#define BSYSTEM_URING_CQ_ENTRIES 1024
+
+// timer wheel geometry; covers 2^(BITS*LEVELS) milliseconds
+#define BSYSTEM_TIMER_WHEEL_BITS 6
+#define BSYSTEM_TIMER_WHEEL_SLOTS (1 << BSYSTEM_TIMER_WHEEL_BITS)
+#define BSYSTEM_TIMER_WHEEL_LEVELS 6
+
+#ifdef BADVPN_USE_IO_URING
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct BReactor__uring_slot;
+
+struct BReactor__uring_result {
+    struct BFileDescriptor_t *bfd;
+    int revents;
+    struct BReactorIO_t *io;
+    int res;
+    int buf;
+    int more;
+};
+#endif
 
 /**
  * Event loop that supports file desciptor (Linux) or HANDLE (Windows) events
@@ -239,11 +327,22 @@ typedef struct {
     int exiting;
     int exit_code;
     
+    // busy polling
+    int busy_poll_us;
+    
     // jobs
     BPendingGroup pending_jobs;
     
     // timers
+    #ifdef BADVPN_BREACTOR_TIMER_WHEEL
+    btime_t timers_wheel_clk; // next tick (millisecond) to be processed, -1 if not started
+    LinkedList1 timers_wheel[BSYSTEM_TIMER_WHEEL_LEVELS][BSYSTEM_TIMER_WHEEL_SLOTS];
+    uint64_t timers_wheel_bitmap[BSYSTEM_TIMER_WHEEL_LEVELS]; // which slots are non-empty
+    LinkedList1 timers_wheel_due; // timers set for ticks already processed
+    int timers_wheel_count;
+    #else
     BReactor__TimersTree timers_tree;
+    #endif
     LinkedList1 timers_expired_list;
     
     // limits
@@ -257,9 +356,11 @@ typedef struct {
     
     #ifdef BADVPN_USE_EPOLL
     int efd; // epoll fd
-    struct epoll_event epoll_results[BSYSTEM_MAX_RESULTS]; // epoll returned events buffer
+    struct epoll_event *epoll_results; // epoll returned events buffer
+    int epoll_results_size; // capacity of the buffer, grows with the number of fds
     int epoll_results_num; // number of events in the array
     int epoll_results_pos; // number of events processed so far
+    int epoll_num_fds; // number of registered fds
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -279,6 +380,33 @@ typedef struct {
     BFileDescriptor **poll_results_bfds;
     #endif
     
+    #ifdef BADVPN_USE_IO_URING
+    int uring_fd; // io_uring fd
+    void *uring_sq_ring; // mapped submission queue ring
+    size_t uring_sq_ring_size;
+    void *uring_cq_ring; // mapped completion queue ring
+    size_t uring_cq_ring_size;
+    struct io_uring_sqe *uring_sqes; // mapped submission queue entries
+    size_t uring_sqes_size;
+    unsigned int *uring_sq_head;
+    unsigned int *uring_sq_tail;
+    unsigned int *uring_sq_array;
+    unsigned int uring_sq_mask;
+    unsigned int uring_sq_entries;
+    unsigned int *uring_cq_head;
+    unsigned int *uring_cq_tail;
+    struct io_uring_cqe *uring_cqes;
+    unsigned int uring_cq_mask;
+    int uring_have_io; // whether BReactorIO can be used
+    struct BReactor__uring_slot *uring_slots; // request identities, indexed by BFileDescriptor.uring_slot and BReactorIO.uring_slot
+    int uring_num_slots;
+    int uring_free_slot; // first free slot, -1 if none
+    LinkedList1 uring_dirty_list; // file descriptors whose poll request may need to change
+    struct BReactor__uring_result uring_results[BSYSTEM_MAX_RESULTS]; // returned events buffer
+    int uring_results_num; // number of events in the array
+    int uring_results_pos; // number of events processed so far
+    #endif
+    
     DebugObject d_obj;
     #ifndef BADVPN_USE_WINAPI
     DebugCounter d_fds_counter;
@@ -333,6 +461,17 @@ int BReactor_Exec (BReactor *bsys);
  */
 void BReactor_Quit (BReactor *bsys, int code);
 
+/**
+ * Sets how long the event loop keeps polling for events without blocking
+ * before going to sleep. This trades CPU time for lower latency when events
+ * arrive in quick succession, by avoiding the cost of waking up.
+ * Busy polling is only done with the epoll backend, and is disabled by default.
+ *
+ * @param bsys the object
+ * @param usecs time to poll in microseconds, 0 to disable. Must be >=0.
+ */
+void BReactor_SetBusyPoll (BReactor *bsys, int usecs);
+
 /**
  * Starts a timer to expire at the specified time.
  * The timer must have been initialized with {@link BSmallTimer_Init}.
@@ -474,6 +613,259 @@ void BReactor_SetFileDescriptorEvents (BReactor *bsys, BFileDescriptor *bs, int
 
 #endif
 
+#ifdef BADVPN_USE_IO_URING
+
+/**
+ * Checks if I/O operations ({@link BReactorIO}) can be used with this reactor.
+ * They need the kernel to support synchronous cancellation of io_uring
+ * requests (Linux 6.0).
+ *
+ * @param bsys the object
+ * @return 1 if supported, 0 if not
+ */
+int BReactor_IOSupported (BReactor *bsys);
+
+/**
+ * Associates an I/O operation object with the reactor.
+ *
+ * @param bsys the object. {@link BReactor_IOSupported} must return 1.
+ * @param io I/O operation object. Must have been initialized with
+ *           {@link BReactorIO_Init}. Must be in not active state.
+ *           On success, the object enters active and not busy state,
+ *           associated with this reactor.
+ * @return 1 on success, 0 on failure
+ */
+int BReactor_AddIO (BReactor *bsys, BReactorIO *io) WARN_UNUSED;
+
+/**
+ * Disassociates an I/O operation object from the reactor.
+ * An operation in progress is cancelled as with {@link BReactor_CancelIO}.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active state, associated
+ *           with this reactor. The object enters not active state.
+ */
+void BReactor_RemoveIO (BReactor *bsys, BReactorIO *io);
+
+/**
+ * Starts a sendmsg() operation.
+ * The request is submitted to the kernel together with the next wait.
+ * The message header, and everything it points to, must remain valid and
+ * unchanged until the operation completes or is cancelled.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd socket to send on
+ * @param msg message to send
+ * @param flags sendmsg() flags
+ */
+void BReactor_SubmitSendmsg (BReactor *bsys, BReactorIO *io, int fd, struct msghdr *msg, int flags);
+
+/**
+ * Starts a recvmsg() operation.
+ * The request is submitted to the kernel together with the next wait.
+ * The message header, and everything it points to, must remain valid until
+ * the operation completes or is cancelled. As with recvmsg(), on completion
+ * the msg_namelen, msg_controllen and msg_flags fields of the message header
+ * are updated.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd socket to receive from
+ * @param msg message header describing the buffers to receive into
+ * @param flags recvmsg() flags
+ */
+void BReactor_SubmitRecvmsg (BReactor *bsys, BReactorIO *io, int fd, struct msghdr *msg, int flags);
+
+/**
+ * Starts a read() operation, reading from the current file position.
+ * The request is submitted to the kernel together with the next wait.
+ * The buffer must remain valid until the operation completes or is cancelled.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd file descriptor to read from
+ * @param buf buffer to read into
+ * @param len size of the buffer. Must be >=0.
+ */
+void BReactor_SubmitRead (BReactor *bsys, BReactorIO *io, int fd, void *buf, int len);
+
+/**
+ * Starts a readv() operation, reading from the current file position.
+ * The request is submitted to the kernel together with the next wait.
+ * The iovec array, and the buffers it points to, must remain valid until
+ * the operation completes or is cancelled.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd file descriptor to read from
+ * @param iov buffers to read into
+ * @param iovcnt number of buffers. Must be >0.
+ */
+void BReactor_SubmitReadv (BReactor *bsys, BReactorIO *io, int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Starts a write() operation, writing at the current file position.
+ * The request is submitted to the kernel together with the next wait.
+ * The data must remain valid and unchanged until the operation completes
+ * or is cancelled.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd file descriptor to write to
+ * @param buf data to write
+ * @param len length of the data. Must be >=0.
+ */
+void BReactor_SubmitWrite (BReactor *bsys, BReactorIO *io, int fd, const void *buf, int len);
+
+/**
+ * Starts a writev() operation, writing at the current file position.
+ * The request is submitted to the kernel together with the next wait.
+ * The iovec array, and the data it points to, must remain valid and
+ * unchanged until the operation completes or is cancelled.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd file descriptor to write to
+ * @param iov data to write
+ * @param iovcnt number of buffers. Must be >0.
+ */
+void BReactor_SubmitWritev (BReactor *bsys, BReactorIO *io, int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Starts a multishot accept() operation, which reports every connection
+ * accepted on a listening socket with the new file descriptor as the result.
+ * The handler takes ownership of the file descriptor. Connections which
+ * were accepted but not reported when the operation is cancelled are closed.
+ * The operation continues until it fails or is cancelled.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd listening socket
+ */
+void BReactor_SubmitAcceptMultishot (BReactor *bsys, BReactorIO *io, int fd);
+
+struct BReactorBufferRing_t;
+
+/**
+ * Starts a multishot recvmsg() operation, which receives messages into
+ * buffers taken from a buffer ring and reports each of them.
+ * Each buffer is filled as described for IORING_RECV_MULTISHOT with
+ * IORING_OP_RECVMSG: a struct io_uring_recvmsg_out header, followed by
+ * msg_namelen bytes for the address, msg_controllen bytes for control
+ * messages, and then the data.
+ * The operation continues until it fails or is cancelled, in particular it
+ * fails with -ENOBUFS when the ring has no buffers left.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active and not busy state,
+ *           associated with this reactor. It enters busy state.
+ * @param fd socket to receive from
+ * @param msg message header giving msg_namelen and msg_controllen, the space
+ *            to reserve in each buffer for the address and control messages.
+ *            Other fields must be zero.
+ * @param ring buffer ring to receive into, associated with this reactor.
+ *             It must not be freed before the operation completes or is
+ *             cancelled.
+ * @param flags recvmsg() flags
+ */
+void BReactor_SubmitRecvmsgMultishot (BReactor *bsys, BReactorIO *io, int fd, struct msghdr *msg, struct BReactorBufferRing_t *ring, int flags);
+
+/**
+ * Makes the next operation submitted to the reactor start only once the
+ * last submitted operation has completed successfully. If that fails, the
+ * next operation completes with -ECANCELED without being performed.
+ * This way a sequence of operations, each linked to the next, is performed
+ * in order.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object, which must have been the last one an
+ *           operation was submitted with, and not for a multishot operation.
+ */
+void BReactor_LinkIO (BReactor *bsys, BReactorIO *io);
+
+/**
+ * Cancels the operation in progress, if any.
+ * When this returns, the kernel no longer accesses the buffers of the
+ * operation, and the handler will not be called for it. The operation may
+ * however have completed in the meantime, so a send may have been performed.
+ * Buffers of a {@link BReactorBufferRing} which were filled by a cancelled
+ * multishot receive but not yet reported are not given back to the ring,
+ * so the ring should be freed afterwards rather than used again.
+ *
+ * @param bsys the object
+ * @param io {@link BReactorIO} object. Must be in active state, associated
+ *           with this reactor. It enters not busy state.
+ */
+void BReactor_CancelIO (BReactor *bsys, BReactorIO *io);
+
+/**
+ * Buffers which the kernel receives into, see {@link BReactor_SubmitRecvmsgMultishot}.
+ * The buffers are registered with the kernel as a provided buffer ring.
+ * When a buffer has been filled, it belongs to the user until it is given
+ * back to the ring.
+ * Only available with the io_uring backend; see {@link BReactor_IOSupported}.
+ */
+typedef struct BReactorBufferRing_t {
+    BReactor *reactor;
+    int slot;
+    int num_bufs;
+    int buf_size;
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    uint8_t *bufs;
+    unsigned int tail;
+    DebugObject d_obj;
+} BReactorBufferRing;
+
+/**
+ * Initializes the buffer ring, with all buffers in the ring.
+ *
+ * @param o the object
+ * @param reactor reactor the ring is used with. {@link BReactor_IOSupported}
+ *                must return 1.
+ * @param num_bufs number of buffers. Must be a power of two, >0 and <=32768.
+ * @param buf_size size of each buffer. Must be >0 and a multiple of 8.
+ * @return 1 on success, 0 on failure
+ */
+int BReactorBufferRing_Init (BReactorBufferRing *o, BReactor *reactor, int num_bufs, int buf_size) WARN_UNUSED;
+
+/**
+ * Frees the buffer ring.
+ * No operations using the ring may be in progress.
+ *
+ * @param o the object
+ */
+void BReactorBufferRing_Free (BReactorBufferRing *o);
+
+/**
+ * Returns the memory of a buffer.
+ *
+ * @param o the object
+ * @param buf index of the buffer. Must be >=0 and <num_bufs.
+ * @return pointer to buf_size bytes
+ */
+uint8_t * BReactorBufferRing_Buffer (BReactorBufferRing *o, int buf);
+
+/**
+ * Gives a buffer, which was filled by an operation and reported to its
+ * handler, back to the ring, so that it can be received into again.
+ *
+ * @param o the object
+ * @param buf index of the buffer. Must be >=0 and <num_bufs, and must not
+ *            be in the ring.
+ */
+void BReactorBufferRing_Recycle (BReactorBufferRing *o, int buf);
+
+#endif
+
 typedef struct {
     BReactor *reactor;
     int limit;
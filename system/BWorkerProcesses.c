@@ -0,0 +1,215 @@
+/**
+ * @file BWorkerProcesses.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef BADVPN_LINUX
+#include <sys/prctl.h>
+#endif
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+
+#include "BWorkerProcesses.h"
+
+#include <generated/blog_channel_BWorkerProcesses.h>
+
+static void stop_workers (BWorkerProcesses *o)
+{
+    for (int i = 0; i < o->num_pids; i++) {
+        if (o->pids[i] > 0) {
+            kill(o->pids[i], SIGTERM);
+        }
+    }
+    
+    for (int i = 0; i < o->num_pids; i++) {
+        if (o->pids[i] > 0) {
+            while (waitpid(o->pids[i], NULL, 0) < 0 && errno == EINTR);
+        }
+    }
+    
+    o->num_pids = 0;
+}
+
+static void reap_workers (BWorkerProcesses *o)
+{
+    ASSERT(o->watching)
+    
+    for (int i = 0; i < o->num_pids; i++) {
+        if (o->pids[i] <= 0) {
+            continue;
+        }
+        
+        int status;
+        pid_t res;
+        while ((res = waitpid(o->pids[i], &status, WNOHANG)) < 0 && errno == EINTR);
+        if (res <= 0) {
+            continue;
+        }
+        
+        // forget the pid, so that we won't signal it after it's reused
+        o->pids[i] = 0;
+        
+        if (WIFEXITED(status)) {
+            BLog(BLOG_ERROR, "worker %d exited with status %d", i + 1, WEXITSTATUS(status));
+        } else {
+            BLog(BLOG_ERROR, "worker %d terminated by signal %d", i + 1, WTERMSIG(status));
+        }
+        
+        o->handler(o->user, i + 1);
+    }
+}
+
+static void signal_handler (BWorkerProcesses *o, int signo)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(signo == SIGCHLD)
+    
+    reap_workers(o);
+}
+
+int BWorkerProcesses_Init (BWorkerProcesses *o, int num_workers)
+{
+    ASSERT(num_workers >= 1)
+    
+    o->index = 0;
+    o->num_pids = 0;
+    o->watching = 0;
+    
+    // allocate pids
+    if (!(o->pids = (pid_t *)BAllocArray(num_workers - 1, sizeof(o->pids[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    
+    pid_t main_pid = getpid();
+    
+    // don't let workers inherit buffered log output
+    fflush(stdout);
+    
+    for (int i = 1; i < num_workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            BLog(BLOG_ERROR, "fork failed");
+            goto fail1;
+        }
+        
+        if (pid == 0) {
+            // we're worker i; exit together with the main process
+            o->index = i;
+            o->num_pids = 0;
+            #ifdef BADVPN_LINUX
+            if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0) {
+                _exit(1);
+            }
+            #endif
+            if (getppid() != main_pid) {
+                _exit(1);
+            }
+            BLog(BLOG_NOTICE, "worker %d started", i);
+            break;
+        }
+        
+        o->pids[o->num_pids++] = pid;
+    }
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    stop_workers(o);
+    BFree(o->pids);
+fail0:
+    return 0;
+}
+
+void BWorkerProcesses_Free (BWorkerProcesses *o)
+{
+    DebugObject_Free(&o->d_obj);
+    ASSERT(!o->watching)
+    
+    stop_workers(o);
+    
+    BFree(o->pids);
+}
+
+int BWorkerProcesses_GetIndex (BWorkerProcesses *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->index;
+}
+
+int BWorkerProcesses_Watch (BWorkerProcesses *o, BReactor *reactor, BWorkerProcesses_handler handler, void *user)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(!o->watching)
+    ASSERT(handler)
+    
+    if (o->num_pids == 0) {
+        return 1;
+    }
+    
+    o->reactor = reactor;
+    o->handler = handler;
+    o->user = user;
+    
+    sigset_t sset;
+    ASSERT_FORCE(sigemptyset(&sset) == 0)
+    ASSERT_FORCE(sigaddset(&sset, SIGCHLD) == 0)
+    
+    if (!BUnixSignal_Init(&o->signal, o->reactor, sset, (BUnixSignal_handler)signal_handler, o)) {
+        BLog(BLOG_ERROR, "BUnixSignal_Init failed");
+        return 0;
+    }
+    
+    o->watching = 1;
+    
+    // catch workers which exited before SIGCHLD was being handled
+    reap_workers(o);
+    
+    return 1;
+}
+
+void BWorkerProcesses_Unwatch (BWorkerProcesses *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (!o->watching) {
+        return;
+    }
+    
+    BUnixSignal_Free(&o->signal, 1);
+    
+    o->watching = 0;
+}
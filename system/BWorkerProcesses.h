@@ -0,0 +1,123 @@
+/**
+ * @file BWorkerProcesses.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Worker processes forked from the main process of a program, each doing the
+ * same work on its own share of it. Workers exit together with the main
+ * process. The main process can watch for workers exiting, and stops the
+ * remaining workers when it is done.
+ */
+
+#ifndef BADVPN_B_WORKER_PROCESSES_H
+#define BADVPN_B_WORKER_PROCESSES_H
+
+#include <sys/types.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BUnixSignal.h>
+
+/**
+ * Handler called in the main process when a worker has exited or was
+ * killed. The exit has already been logged.
+ * The object must not be freed from this handler.
+ * 
+ * @param user as in {@link BWorkerProcesses_Watch}
+ * @param index index of the worker, >=1
+ */
+typedef void (*BWorkerProcesses_handler) (void *user, int index);
+
+typedef struct {
+    int index;
+    int num_pids;
+    pid_t *pids; // 0 for workers which have exited
+    BReactor *reactor;
+    BWorkerProcesses_handler handler;
+    void *user;
+    int watching;
+    BUnixSignal signal;
+    DebugObject d_obj;
+} BWorkerProcesses;
+
+/**
+ * Initializes the object, forking the worker processes.
+ * This returns in the main process and in each of the workers; use
+ * {@link BWorkerProcesses_GetIndex} to find out which one this is.
+ * Workers get SIGTERM when the main process exits. Workers have no workers
+ * of their own, and there is nothing to watch for in them.
+ * This must be called before a reactor is initialized, so that workers do not
+ * share it.
+ * 
+ * @param o the object
+ * @param num_workers number of processes, including the main process. Must be >=1.
+ * @return 1 on success, 0 on failure. On failure, the workers which were already
+ *         started have been stopped.
+ */
+int BWorkerProcesses_Init (BWorkerProcesses *o, int num_workers) WARN_UNUSED;
+
+/**
+ * Stops the remaining workers and frees the object.
+ * Sends SIGTERM to the workers and waits for them to exit.
+ * Must not be watching for workers exiting.
+ * 
+ * @param o the object
+ */
+void BWorkerProcesses_Free (BWorkerProcesses *o);
+
+/**
+ * Returns the index of this process.
+ * 
+ * @param o the object
+ * @return 0 in the main process, 1 to num_workers-1 in workers
+ */
+int BWorkerProcesses_GetIndex (BWorkerProcesses *o);
+
+/**
+ * Starts watching for workers exiting, reporting each exit to the handler.
+ * Workers which exited before this call are reported from this call.
+ * Does nothing if there are no workers, like in the workers themselves.
+ * 
+ * @param o the object. Must not be watching.
+ * @param reactor reactor we live in
+ * @param handler handler called when a worker exits
+ * @param user argument to handler
+ * @return 1 on success, 0 on failure
+ */
+int BWorkerProcesses_Watch (BWorkerProcesses *o, BReactor *reactor, BWorkerProcesses_handler handler, void *user) WARN_UNUSED;
+
+/**
+ * Stops watching for workers exiting.
+ * Does nothing if not watching.
+ * 
+ * @param o the object
+ */
+void BWorkerProcesses_Unwatch (BWorkerProcesses *o);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <security/BSecurity.h>
+#include <security/BAead.h>
+
+#define MAX_LEN 1500
+
+static const int lengths[] = {0, 1, 15, 16, 17, 64, 100, 1500};
+
+// AES-128-GCM test case 3 from the GCM specification
+static const uint8_t gcm_key[16] = {
+    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08
+};
+static const uint8_t gcm_nonce[12] = {
+    0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88
+};
+static const uint8_t gcm_plaintext[64] = {
+    0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+    0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda, 0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+    0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+    0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39, 0x1a, 0xaf, 0xd2, 0x55
+};
+static const uint8_t gcm_ciphertext[64] = {
+    0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24, 0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+    0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0, 0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+    0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c, 0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+    0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97, 0x3d, 0x58, 0xe0, 0x91, 0x47, 0x3f, 0x59, 0x85
+};
+static const uint8_t gcm_tag[16] = {
+    0x4d, 0x5c, 0x2a, 0xf3, 0x27, 0xcd, 0x64, 0xa6, 0x2c, 0xf3, 0x5a, 0xbd, 0x2b, 0xa6, 0xfa, 0xb4
+};
+
+static void test_known_answer (void)
+{
+    BAead enc;
+    BAead dec;
+    ASSERT_FORCE(BAead_Init(&enc, BAEAD_MODE_ENCRYPT, BAEAD_CIPHER_AES_128_GCM, (uint8_t *)gcm_key))
+    ASSERT_FORCE(BAead_Init(&dec, BAEAD_MODE_DECRYPT, BAEAD_CIPHER_AES_128_GCM, (uint8_t *)gcm_key))
+    
+    uint8_t buf[64];
+    uint8_t tag[BAEAD_TAG_SIZE];
+    BAead_Encrypt(&enc, gcm_nonce, (uint8_t *)gcm_plaintext, buf, sizeof(buf), tag);
+    ASSERT_FORCE(!memcmp(buf, gcm_ciphertext, sizeof(buf)))
+    ASSERT_FORCE(!memcmp(tag, gcm_tag, sizeof(tag)))
+    
+    ASSERT_FORCE(BAead_Decrypt(&dec, gcm_nonce, buf, buf, sizeof(buf), tag))
+    ASSERT_FORCE(!memcmp(buf, gcm_plaintext, sizeof(buf)))
+    
+    BAead_Free(&dec);
+    BAead_Free(&enc);
+    
+    printf("AES-128-GCM known answer ok\n");
+}
+
+static void make_nonce (uint8_t *nonce, int counter)
+{
+    memset(nonce, 0, BAEAD_NONCE_SIZE);
+    memcpy(nonce, &counter, sizeof(counter));
+}
+
+static void test_cipher (int cipher, const char *name)
+{
+    ASSERT_FORCE(BAead_cipher_valid(cipher))
+    int key_size = BAead_cipher_key_size(cipher);
+    ASSERT_FORCE(key_size > 0 && key_size <= BAEAD_MAX_KEY_SIZE)
+    
+    uint8_t key[BAEAD_MAX_KEY_SIZE];
+    uint8_t other_key[BAEAD_MAX_KEY_SIZE];
+    for (int i = 0; i < key_size; i++) {
+        key[i] = i * 11;
+        other_key[i] = i * 11 + 1;
+    }
+    
+    BAead enc;
+    BAead dec;
+    BAead other_dec;
+    ASSERT_FORCE(BAead_Init(&enc, BAEAD_MODE_ENCRYPT, cipher, key))
+    ASSERT_FORCE(BAead_Init(&dec, BAEAD_MODE_DECRYPT, cipher, key))
+    ASSERT_FORCE(BAead_Init(&other_dec, BAEAD_MODE_DECRYPT, cipher, other_key))
+    
+    uint8_t plaintext[MAX_LEN];
+    uint8_t ciphertext[MAX_LEN];
+    uint8_t buf[MAX_LEN];
+    uint8_t nonce[BAEAD_NONCE_SIZE];
+    uint8_t tag[BAEAD_TAG_SIZE];
+    uint8_t bad_tag[BAEAD_TAG_SIZE];
+    int counter = 0;
+    
+    for (int l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++) {
+        int len = lengths[l];
+        
+        for (int i = 0; i < len; i++) {
+            plaintext[i] = i * 7 + l;
+        }
+        
+        // encrypt out of place
+        make_nonce(nonce, counter++);
+        BAead_Encrypt(&enc, nonce, plaintext, ciphertext, len, tag);
+        ASSERT_FORCE(len < 16 || memcmp(ciphertext, plaintext, len))
+        
+        // encrypting in place gives the same result
+        memcpy(buf, plaintext, len);
+        uint8_t tag2[BAEAD_TAG_SIZE];
+        BAead_Encrypt(&enc, nonce, buf, buf, len, tag2);
+        ASSERT_FORCE(!memcmp(buf, ciphertext, len))
+        ASSERT_FORCE(!memcmp(tag2, tag, sizeof(tag)))
+        
+        // decrypt in place
+        ASSERT_FORCE(BAead_Decrypt(&dec, nonce, buf, buf, len, tag))
+        ASSERT_FORCE(!memcmp(buf, plaintext, len))
+        
+        // any changed byte of the ciphertext is rejected
+        for (int i = 0; i < len; i++) {
+            memcpy(buf, ciphertext, len);
+            buf[i] ^= 0x01;
+            ASSERT_FORCE(!BAead_Decrypt(&dec, nonce, buf, buf, len, tag))
+        }
+        
+        // any changed byte of the tag is rejected
+        for (int i = 0; i < BAEAD_TAG_SIZE; i++) {
+            memcpy(bad_tag, tag, sizeof(tag));
+            bad_tag[i] ^= 0x80;
+            memcpy(buf, ciphertext, len);
+            ASSERT_FORCE(!BAead_Decrypt(&dec, nonce, buf, buf, len, bad_tag))
+        }
+        
+        // a different nonce is rejected
+        uint8_t bad_nonce[BAEAD_NONCE_SIZE];
+        memcpy(bad_nonce, nonce, sizeof(nonce));
+        bad_nonce[BAEAD_NONCE_SIZE - 1] ^= 0x01;
+        memcpy(buf, ciphertext, len);
+        ASSERT_FORCE(!BAead_Decrypt(&dec, bad_nonce, buf, buf, len, tag))
+        
+        // a different key is rejected
+        memcpy(buf, ciphertext, len);
+        ASSERT_FORCE(!BAead_Decrypt(&other_dec, nonce, buf, buf, len, tag))
+        
+        // failures leave the object usable; decrypt out of place
+        ASSERT_FORCE(BAead_Decrypt(&dec, nonce, ciphertext, buf, len, tag))
+        ASSERT_FORCE(!memcmp(buf, plaintext, len))
+    }
+    
+    BAead_Free(&other_dec);
+    BAead_Free(&dec);
+    BAead_Free(&enc);
+    
+    printf("%s ok\n", name);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    if (!BSecurity_GlobalInitThreadSafe()) {
+        DEBUG("BSecurity_GlobalInitThreadSafe failed");
+        goto fail0;
+    }
+    
+    ASSERT_FORCE(!BAead_cipher_valid(0))
+    
+    test_known_answer();
+    test_cipher(BAEAD_CIPHER_AES_128_GCM, "AES-128-GCM");
+    test_cipher(BAEAD_CIPHER_CHACHA20_POLY1305, "ChaCha20-Poly1305");
+    
+    BSecurity_GlobalFreeThreadSafe();
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <misc/debug.h>
+#include <misc/minmax.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BConnection.h>
+
+// many times what the socket buffers and the pipe can hold
+#define TOTAL_BYTES (2 * 1024 * 1024 + 1234)
+#define CHUNK 10000
+#define SOCK_BUFFER 16384
+#define CHECK_INTERVAL 50
+#define STALL_CHECKS 3
+
+// source_peer -> source => relay => dest -> dest_peer
+BReactor reactor;
+BConnection source_peer;
+BConnection source;
+BConnection dest;
+BConnection dest_peer;
+int source_peer_inited;
+int dest_peer_inited;
+BConnectionRelay relay;
+int relay_inited;
+StreamPassInterface *send_if;
+StreamRecvInterface *recv_if;
+uint8_t send_buf[CHUNK];
+uint8_t recv_buf[CHUNK];
+BTimer check_timer;
+int expect_error;
+size_t num_sent;
+size_t num_received;
+int receiving;
+size_t last_sent;
+int stall_checks;
+int relay_closed;
+int relay_failed;
+
+static uint8_t pattern (size_t i)
+{
+    return (uint8_t)(i % 251);
+}
+
+static void connection_handler (void *user, int event)
+{
+    DEBUG("BConnection event %d", event);
+    ASSERT_FORCE(0)
+}
+
+static void init_pair (BConnection *a, BConnection *b)
+{
+    int fds[2];
+    ASSERT_FORCE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)
+    ASSERT_FORCE(BConnection_Init(a, BConnection_source_pipe(fds[0], 1), &reactor, NULL, connection_handler))
+    ASSERT_FORCE(BConnection_Init(b, BConnection_source_pipe(fds[1], 1), &reactor, NULL, connection_handler))
+    ASSERT_FORCE(BConnection_SetSendBuffer(a, SOCK_BUFFER))
+    ASSERT_FORCE(BConnection_SetSendBuffer(b, SOCK_BUFFER))
+}
+
+static void free_source_peer (void)
+{
+    if (source_peer_inited) {
+        BConnection_SendAsync_Free(&source_peer);
+        BConnection_Free(&source_peer);
+        source_peer_inited = 0;
+    }
+}
+
+static void free_dest_peer (void)
+{
+    if (dest_peer_inited) {
+        if (receiving) {
+            BConnection_RecvAsync_Free(&dest_peer);
+        }
+        BConnection_Free(&dest_peer);
+        dest_peer_inited = 0;
+    }
+}
+
+static void maybe_finish (void)
+{
+    if (relay_closed && num_received == TOTAL_BYTES) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void send_next (void)
+{
+    int len = bmin_size(CHUNK, TOTAL_BYTES - num_sent);
+    for (int j = 0; j < len; j++) {
+        send_buf[j] = pattern(num_sent + j);
+    }
+    
+    StreamPassInterface_Sender_Send(send_if, send_buf, len);
+}
+
+static void send_handler_done (void *user, int data_len)
+{
+    num_sent += data_len;
+    
+    if (expect_error) {
+        return;
+    }
+    
+    if (num_sent < TOTAL_BYTES) {
+        send_next();
+        return;
+    }
+    
+    // close the source while data is still on its way through the relay
+    free_source_peer();
+}
+
+static void recv_handler_done (void *user, int data_len)
+{
+    for (int j = 0; j < data_len; j++) {
+        ASSERT_FORCE(recv_buf[j] == pattern(num_received + j))
+    }
+    num_received += data_len;
+    ASSERT_FORCE(num_received <= num_sent)
+    
+    if (num_received == TOTAL_BYTES) {
+        maybe_finish();
+        return;
+    }
+    
+    StreamRecvInterface_Receiver_Recv(recv_if, recv_buf, sizeof(recv_buf));
+}
+
+static void start_receiving (void)
+{
+    ASSERT(!receiving)
+    
+    BConnection_RecvAsync_Init(&dest_peer);
+    recv_if = BConnection_RecvAsync_GetIf(&dest_peer);
+    StreamRecvInterface_Receiver_Init(recv_if, recv_handler_done, NULL);
+    StreamRecvInterface_Receiver_Recv(recv_if, recv_buf, sizeof(recv_buf));
+    receiving = 1;
+}
+
+static void check_timer_handler (void *user)
+{
+    ASSERT(!receiving)
+    
+    // the destination isn't drained, so sending must stop before everything
+    // has been sent, and stay stopped
+    if (num_sent == last_sent && num_sent < TOTAL_BYTES && num_received == 0) {
+        stall_checks++;
+    } else {
+        stall_checks = 0;
+    }
+    last_sent = num_sent;
+    
+    if (stall_checks < STALL_CHECKS) {
+        BReactor_SetTimer(&reactor, &check_timer);
+        return;
+    }
+    
+    printf("sending stalled after %zu of %d bytes\n", num_sent, TOTAL_BYTES);
+    
+    // drain the destination, which lets the relay continue
+    start_receiving();
+}
+
+static void relay_handler (void *user, int event)
+{
+    ASSERT_FORCE(relay_inited)
+    
+    BConnectionRelay_Free(&relay);
+    relay_inited = 0;
+    
+    if (expect_error) {
+        ASSERT_FORCE(event == BCONNECTIONRELAY_EVENT_ERROR)
+        relay_failed = 1;
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // the source was closed after everything was sent into it
+    ASSERT_FORCE(event == BCONNECTIONRELAY_EVENT_RECVCLOSED)
+    ASSERT_FORCE(!source_peer_inited)
+    ASSERT_FORCE(num_sent == TOTAL_BYTES)
+    relay_closed = 1;
+    
+    maybe_finish();
+}
+
+static void test (int with_error)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    BTimer_Init(&check_timer, CHECK_INTERVAL, check_timer_handler, NULL);
+    expect_error = with_error;
+    num_sent = 0;
+    num_received = 0;
+    receiving = 0;
+    last_sent = 0;
+    stall_checks = 0;
+    relay_closed = 0;
+    relay_failed = 0;
+    
+    init_pair(&source_peer, &source);
+    init_pair(&dest, &dest_peer);
+    source_peer_inited = 1;
+    dest_peer_inited = 1;
+    
+    ASSERT_FORCE(BConnectionRelay_Init(&relay, &source, &dest, NULL, relay_handler))
+    relay_inited = 1;
+    
+    BConnection_SendAsync_Init(&source_peer);
+    send_if = BConnection_SendAsync_GetIf(&source_peer);
+    StreamPassInterface_Sender_Init(send_if, send_handler_done, NULL);
+    
+    if (with_error) {
+        // nobody receives from the destination any more
+        free_dest_peer();
+    } else {
+        // receive only once the relay has been blocked
+        BReactor_SetTimer(&reactor, &check_timer);
+    }
+    
+    send_next();
+    
+    BReactor_Exec(&reactor);
+    
+    if (with_error) {
+        printf("relay failed after %zu bytes were sent\n", num_sent);
+        ASSERT_FORCE(relay_failed)
+    } else {
+        printf("%zu of %d bytes relayed\n", num_received, TOTAL_BYTES);
+        ASSERT_FORCE(relay_closed)
+        ASSERT_FORCE(num_received == TOTAL_BYTES)
+    }
+    
+    if (relay_inited) {
+        BConnectionRelay_Free(&relay);
+        relay_inited = 0;
+    }
+    free_dest_peer();
+    free_source_peer();
+    BConnection_Free(&dest);
+    BConnection_Free(&source);
+    BReactor_RemoveTimer(&reactor, &check_timer);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    // also ignores SIGPIPE, which splice() to a closed socket would raise
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    test(0);
+    test(1);
+    
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BDatagram.h>
+
+#define MTU 1500
+#define BATCH_SIZE 16
+#define NUM_PACKETS 3000
+
+BReactor reactor;
+BDatagram sender;
+BDatagram receiver;
+PacketPassInterface *send_if;
+PacketRecvInterface *recv_if;
+uint8_t send_buf[MTU];
+uint8_t recv_buf[MTU];
+int window;
+int num_sent;
+int sending;
+int num_received;
+
+static void dgram_handler (void *user, int event)
+{
+    DEBUG("BDatagram error");
+    ASSERT_FORCE(0)
+}
+
+// Packets of every other window have the same size, so that with offload they
+// can be sent as segments of one datagram and received coalesced.
+static int packet_len (int i)
+{
+    if ((i / window) % 2 == 0) {
+        return 1000;
+    }
+    return 4 + (i * 37) % (MTU - 3);
+}
+
+static void send_next (void)
+{
+    // send a window of packets, then wait for them to be received, so that
+    // none can be lost
+    if (num_sent == NUM_PACKETS || num_sent - num_received == window) {
+        return;
+    }
+    
+    int len = packet_len(num_sent);
+    memcpy(send_buf, &num_sent, 4);
+    for (int j = 4; j < len; j++) {
+        send_buf[j] = (uint8_t)(num_sent + j);
+    }
+    num_sent++;
+    sending = 1;
+    
+    PacketPassInterface_Sender_Send(send_if, send_buf, len);
+}
+
+static void send_handler_done (void *user)
+{
+    sending = 0;
+    
+    send_next();
+}
+
+static void recv_handler_done (void *user, int data_len)
+{
+    // check packet
+    int i;
+    ASSERT_FORCE(data_len >= 4)
+    memcpy(&i, recv_buf, 4);
+    ASSERT_FORCE(i == num_received)
+    ASSERT_FORCE(data_len == packet_len(i))
+    for (int j = 4; j < data_len; j++) {
+        ASSERT_FORCE(recv_buf[j] == (uint8_t)(i + j))
+    }
+    num_received++;
+    
+    // check addresses
+    BAddr remote_addr;
+    BIPAddr local_addr;
+    ASSERT_FORCE(BDatagram_GetLastReceiveAddrs(&receiver, &remote_addr, &local_addr))
+    ASSERT_FORCE(remote_addr.type == BADDR_TYPE_IPV4)
+    ASSERT_FORCE(remote_addr.ipv4.ip == htonl(INADDR_LOOPBACK))
+    ASSERT_FORCE(local_addr.type == BADDR_TYPE_IPV4)
+    ASSERT_FORCE(local_addr.ipv4 == htonl(INADDR_LOOPBACK))
+    
+    if (num_received == NUM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    PacketRecvInterface_Receiver_Recv(recv_if, recv_buf);
+    
+    // start the next window when this one is done
+    if (num_received == num_sent && !sending) {
+        send_next();
+    }
+}
+
+static void run (int offload, int window_arg)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    // init receiver on loopback
+    BAddr addr;
+    BAddr_InitIPv4(&addr, htonl(INADDR_LOOPBACK), 0);
+    ASSERT_FORCE(BDatagram_Init(&receiver, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler))
+    ASSERT_FORCE(BDatagram_Bind(&receiver, addr))
+    BAddr receiver_addr;
+    ASSERT_FORCE(BDatagram_GetLocalAddr(&receiver, &receiver_addr))
+    BDatagram_RecvAsync_InitBatch(&receiver, MTU, BATCH_SIZE);
+    int gro = (offload && BDatagram_RecvAsync_EnableGRO(&receiver));
+    recv_if = BDatagram_RecvAsync_GetIf(&receiver);
+    PacketRecvInterface_Receiver_Init(recv_if, recv_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(recv_if, recv_buf);
+    
+    // init sender
+    ASSERT_FORCE(BDatagram_Init(&sender, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler))
+    BIPAddr local_addr;
+    BIPAddr_InitInvalid(&local_addr);
+    BDatagram_SetSendAddrs(&sender, receiver_addr, local_addr);
+    BDatagram_SendAsync_InitBatch(&sender, MTU, BATCH_SIZE);
+    int gso = (offload && BDatagram_SendAsync_EnableGSO(&sender));
+    send_if = BDatagram_SendAsync_GetIf(&sender);
+    PacketPassInterface_Sender_Init(send_if, send_handler_done, NULL);
+    
+    window = window_arg;
+    num_sent = 0;
+    sending = 0;
+    num_received = 0;
+    send_next();
+    
+    BReactor_Exec(&reactor);
+    
+    printf("gso=%d gro=%d window=%d: %d of %d packets received\n", gso, gro, window, num_received, NUM_PACKETS);
+    ASSERT_FORCE(num_received == NUM_PACKETS)
+    
+    BDatagram_SendAsync_Free(&sender);
+    BDatagram_Free(&sender);
+    BDatagram_RecvAsync_Free(&receiver);
+    BDatagram_Free(&receiver);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    // windows larger than the batch make the receiver run out of buffers
+    run(0, 12);
+    run(0, 40);
+    run(1, 12);
+    run(1, 40);
+    
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
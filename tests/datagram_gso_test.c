@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BDatagram.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define MTU 1500
+#define SEGMENT_SIZE 1000
+#define NUM_PACKETS 8
+
+BReactor reactor;
+BDatagram dgram;
+BTimer quit_timer;
+PacketPassInterface *send_if;
+uint8_t packet[SEGMENT_SIZE];
+int num_sent;
+
+static void dgram_handler (void *user, int event)
+{
+    DEBUG("BDatagram error");
+    ASSERT_FORCE(0)
+}
+
+static void send_next (void)
+{
+    // after the last packet, give the queue time to be flushed
+    if (num_sent == NUM_PACKETS) {
+        BReactor_SetTimer(&reactor, &quit_timer);
+        return;
+    }
+    
+    memset(packet, num_sent, sizeof(packet));
+    num_sent++;
+    
+    PacketPassInterface_Sender_Send(send_if, packet, sizeof(packet));
+}
+
+static void send_handler_done (void *user)
+{
+    send_next();
+}
+
+static void quit_timer_handler (void *user)
+{
+    BReactor_Quit(&reactor, 0);
+}
+
+// Sends NUM_PACKETS equally sized packets through a BDatagram with GSO and
+// returns the size of the first datagram received by a UDP_GRO socket,
+// or -1 if GSO or GRO is not available. When the packets were sent as one GSO
+// datagram, they are delivered over loopback as a single datagram.
+static int send_and_receive (int with_local_addr)
+{
+    // init receiver
+    int rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_FORCE(rfd >= 0)
+    struct sockaddr_in raddr;
+    memset(&raddr, 0, sizeof(raddr));
+    raddr.sin_family = AF_INET;
+    raddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_FORCE(bind(rfd, (struct sockaddr *)&raddr, sizeof(raddr)) == 0)
+    socklen_t raddr_len = sizeof(raddr);
+    ASSERT_FORCE(getsockname(rfd, (struct sockaddr *)&raddr, &raddr_len) == 0)
+    int opt = 1;
+    if (setsockopt(rfd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) < 0) {
+        close(rfd);
+        return -1;
+    }
+    
+    // init reactor
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    BTimer_Init(&quit_timer, 100, quit_timer_handler, NULL);
+    
+    // init sender
+    ASSERT_FORCE(BDatagram_Init(&dgram, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler))
+    BAddr remote_addr;
+    BAddr_InitIPv4(&remote_addr, raddr.sin_addr.s_addr, raddr.sin_port);
+    BIPAddr local_addr;
+    if (with_local_addr) {
+        BIPAddr_InitIPv4(&local_addr, htonl(INADDR_LOOPBACK));
+    } else {
+        BIPAddr_InitInvalid(&local_addr);
+    }
+    BDatagram_SetSendAddrs(&dgram, remote_addr, local_addr);
+    BDatagram_SendAsync_InitBatch(&dgram, MTU, 16);
+    
+    int res = -1;
+    
+    if (!BDatagram_SendAsync_EnableGSO(&dgram)) {
+        goto out;
+    }
+    
+    // send packets
+    send_if = BDatagram_SendAsync_GetIf(&dgram);
+    PacketPassInterface_Sender_Init(send_if, send_handler_done, NULL);
+    num_sent = 0;
+    send_next();
+    BReactor_Exec(&reactor);
+    
+    // receive the first datagram
+    uint8_t buf[NUM_PACKETS * SEGMENT_SIZE];
+    res = recv(rfd, buf, sizeof(buf), MSG_DONTWAIT);
+    ASSERT_FORCE(res > 0)
+    ASSERT_FORCE(res % SEGMENT_SIZE == 0)
+    for (int i = 0; i < res; i++) {
+        ASSERT_FORCE(buf[i] == i / SEGMENT_SIZE)
+    }
+    
+out:
+    BDatagram_SendAsync_Free(&dgram);
+    BDatagram_Free(&dgram);
+    BReactor_Free(&reactor);
+    close(rfd);
+    return res;
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail1;
+    }
+    
+    // without a local address, as when the client connects to a peer
+    int len = send_and_receive(0);
+    if (len < 0) {
+        printf("GSO not available, skipping\n");
+        goto fail1;
+    }
+    printf("without local address: first datagram %d bytes\n", len);
+    ASSERT_FORCE(len > SEGMENT_SIZE)
+    
+    // with a local address
+    len = send_and_receive(1);
+    ASSERT_FORCE(len >= 0)
+    printf("with local address: first datagram %d bytes\n", len);
+    ASSERT_FORCE(len > SEGMENT_SIZE)
+    
+fail1:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
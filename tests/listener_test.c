@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <misc/debug.h>
+#include <misc/minmax.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BConnection.h>
+
+#define NUM_CLIENTS 20
+#define DISCARD_EVERY 5
+#define NUM_KEPT (NUM_CLIENTS - NUM_CLIENTS / DISCARD_EVERY)
+#define MSG_LEN 100000
+#define CHUNK 10000
+
+// Clients connect to a listener and send a message, then close. The server
+// takes most connections and checks the messages, and leaves every few of them
+// to be discarded by the listener.
+
+struct client {
+    BConnector connector;
+    BConnection con;
+    StreamPassInterface *send_if;
+    uint8_t buf[CHUNK];
+    size_t num_sent;
+    int done;
+};
+
+struct server_con {
+    BConnection con;
+    StreamRecvInterface *recv_if;
+    uint8_t buf[CHUNK];
+    size_t num_received;
+    int done;
+};
+
+BReactor reactor;
+BListener listener;
+BAddr listener_addr;
+struct client clients[NUM_CLIENTS];
+struct server_con server_cons[NUM_KEPT];
+int num_accepted;
+int num_kept;
+int num_clients_done;
+int num_client_errors;
+int num_server_done;
+
+static uint8_t pattern (size_t i)
+{
+    return (uint8_t)(i % 251);
+}
+
+static void check_done (void)
+{
+    if (num_clients_done == NUM_CLIENTS && num_server_done == NUM_KEPT) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void client_finish (struct client *c)
+{
+    ASSERT_FORCE(!c->done)
+    
+    BConnection_SendAsync_Free(&c->con);
+    BConnection_Free(&c->con);
+    c->done = 1;
+    num_clients_done++;
+    
+    check_done();
+}
+
+static void client_send (struct client *c)
+{
+    if (c->num_sent == MSG_LEN) {
+        client_finish(c);
+        return;
+    }
+    
+    size_t len = bmin_size(CHUNK, MSG_LEN - c->num_sent);
+    for (size_t i = 0; i < len; i++) {
+        c->buf[i] = pattern(c->num_sent + i);
+    }
+    
+    StreamPassInterface_Sender_Send(c->send_if, c->buf, len);
+}
+
+static void client_send_handler_done (void *user, int data_len)
+{
+    struct client *c = user;
+    
+    c->num_sent += data_len;
+    client_send(c);
+}
+
+static void client_connection_handler (void *user, int event)
+{
+    struct client *c = user;
+    
+    // connections which the listener discarded are reset
+    ASSERT_FORCE(event == BCONNECTION_EVENT_ERROR)
+    num_client_errors++;
+    client_finish(c);
+}
+
+static void client_connector_handler (void *user, int is_error)
+{
+    struct client *c = user;
+    ASSERT_FORCE(!is_error)
+    
+    ASSERT_FORCE(BConnection_Init(&c->con, BConnection_source_connector(&c->connector), &reactor, c, client_connection_handler))
+    BConnection_SendAsync_Init(&c->con);
+    c->send_if = BConnection_SendAsync_GetIf(&c->con);
+    StreamPassInterface_Sender_Init(c->send_if, client_send_handler_done, c);
+    
+    c->num_sent = 0;
+    client_send(c);
+}
+
+static void server_recv_handler_done (void *user, int data_len)
+{
+    struct server_con *s = user;
+    
+    // check data
+    for (int i = 0; i < data_len; i++) {
+        ASSERT_FORCE(s->buf[i] == pattern(s->num_received + i))
+    }
+    s->num_received += data_len;
+    ASSERT_FORCE(s->num_received <= MSG_LEN)
+    
+    StreamRecvInterface_Receiver_Recv(s->recv_if, s->buf, sizeof(s->buf));
+}
+
+static void server_connection_handler (void *user, int event)
+{
+    struct server_con *s = user;
+    
+    // the client closed the connection after sending everything
+    ASSERT_FORCE(event == BCONNECTION_EVENT_RECVCLOSED)
+    ASSERT_FORCE(s->num_received == MSG_LEN)
+    
+    BConnection_RecvAsync_Free(&s->con);
+    BConnection_Free(&s->con);
+    s->done = 1;
+    num_server_done++;
+    
+    check_done();
+}
+
+static void listener_handler (void *user)
+{
+    int discard = (num_accepted % DISCARD_EVERY == DISCARD_EVERY - 1);
+    num_accepted++;
+    
+    // leave the connection to the listener
+    if (discard) {
+        return;
+    }
+    
+    ASSERT_FORCE(num_kept < NUM_KEPT)
+    struct server_con *s = &server_cons[num_kept++];
+    
+    BAddr addr;
+    ASSERT_FORCE(BConnection_Init(&s->con, BConnection_source_listener(&listener, &addr), &reactor, s, server_connection_handler))
+    ASSERT_FORCE(addr.type == BADDR_TYPE_IPV4)
+    ASSERT_FORCE(addr.ipv4.ip == htonl(INADDR_LOOPBACK))
+    
+    BConnection_RecvAsync_Init(&s->con);
+    s->recv_if = BConnection_RecvAsync_GetIf(&s->con);
+    StreamRecvInterface_Receiver_Init(s->recv_if, server_recv_handler_done, s);
+    s->num_received = 0;
+    s->done = 0;
+    StreamRecvInterface_Receiver_Recv(s->recv_if, s->buf, sizeof(s->buf));
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    // also ignores SIGPIPE, which sending to a discarded connection may raise
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+#ifdef BADVPN_USE_IO_URING
+    printf("reactor performs accepts, sends and receives: %d\n", BReactor_IOSupported(&reactor));
+#endif
+    
+    // init listener on loopback, on the first free port
+    int port;
+    for (port = 20000; port < 30000; port++) {
+        BAddr_InitIPv4(&listener_addr, htonl(INADDR_LOOPBACK), htons(port));
+        if (BListener_Init(&listener, listener_addr, &reactor, NULL, listener_handler)) {
+            break;
+        }
+    }
+    ASSERT_FORCE(port < 30000)
+    
+    num_accepted = 0;
+    num_kept = 0;
+    num_clients_done = 0;
+    num_client_errors = 0;
+    num_server_done = 0;
+    
+    // connect clients
+    for (int i = 0; i < NUM_CLIENTS; i++) {
+        struct client *c = &clients[i];
+            c->done = 0;
+        ASSERT_FORCE(BConnector_Init(&c->connector, listener_addr, &reactor, c, client_connector_handler))
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    printf("%d connections accepted, %d kept, %d clients reset\n", num_accepted, num_kept, num_client_errors);
+    ASSERT_FORCE(num_accepted == NUM_CLIENTS)
+    ASSERT_FORCE(num_kept == NUM_KEPT)
+    ASSERT_FORCE(num_client_errors <= NUM_CLIENTS - NUM_KEPT)
+    
+    for (int i = 0; i < NUM_CLIENTS; i++) {
+        BConnector_Free(&clients[i].connector);
+    }
+    BListener_Free(&listener);
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
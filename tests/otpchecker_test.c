@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <security/BSecurity.h>
+#include <security/OTPChecker.h>
+#include <threadwork/BThreadWork.h>
+
+// several chunks of generation
+#define NUM_OTPS (20 * OTPCHECKER_GENERATE_CHUNK + 100)
+#define NUM_RANDOM 100000
+#define SEED_ID 7
+#define OTHER_SEED_ID 6
+#define UNKNOWN_SEED_ID 8
+
+BReactor reactor;
+BThreadWorkDispatcher twd;
+OTPChecker checker;
+OTPCalculator calc;
+BTimer poll_timer;
+uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+otp_t otps[NUM_OTPS];
+otp_t sorted_otps[NUM_OTPS];
+int accepted_early;
+int num_polls;
+
+static int compare_otps (const void *v1, const void *v2)
+{
+    otp_t o1 = *(const otp_t *)v1;
+    otp_t o2 = *(const otp_t *)v2;
+    return (o1 > o2) - (o1 < o2);
+}
+
+static int is_generated (otp_t otp)
+{
+    return !!bsearch(&otp, sorted_otps, NUM_OTPS, sizeof(otp_t), compare_otps);
+}
+
+static void poll_timer_handler (void *user)
+{
+    num_polls++;
+    
+    // the first OTP is recognized as soon as its chunk is generated
+    if (OTPChecker_CheckOTP(&checker, SEED_ID, otps[0])) {
+        accepted_early = 1;
+        return;
+    }
+    
+    BReactor_SetTimer(&reactor, &poll_timer);
+}
+
+static void checker_handler (void *user)
+{
+    BReactor_RemoveTimer(&reactor, &poll_timer);
+    
+    // With threads, the first OTP was accepted while the following chunks
+    // were still being generated. Without threads all chunks are generated
+    // before the event loop gets to run anything else.
+    printf("first OTP accepted before generation finished: %d (after %d polls)\n", accepted_early, num_polls);
+    ASSERT_FORCE(accepted_early == BThreadWorkDispatcher_UsingThreads(&twd))
+    
+    // all OTPs are accepted, except the first if it already was
+    for (int i = accepted_early; i < NUM_OTPS; i++) {
+        ASSERT_FORCE(OTPChecker_CheckOTP(&checker, SEED_ID, otps[i]))
+    }
+    
+    // OTPs are accepted only once, except for values generated more than once
+    int num_distinct = 1;
+    for (int i = 1; i < NUM_OTPS; i++) {
+        num_distinct += (sorted_otps[i] != sorted_otps[i - 1]);
+    }
+    int num_again = 0;
+    for (int i = 0; i < NUM_OTPS; i++) {
+        num_again += OTPChecker_CheckOTP(&checker, SEED_ID, otps[i]);
+    }
+    ASSERT_FORCE(num_again == NUM_OTPS - num_distinct)
+    for (int i = 0; i < NUM_OTPS; i++) {
+        ASSERT_FORCE(!OTPChecker_CheckOTP(&checker, SEED_ID, otps[i]))
+    }
+    
+    // values which were not generated are rejected
+    for (int i = 0; i < NUM_RANDOM; i++) {
+        otp_t otp = (otp_t)rand() * 7919 + i;
+        if (!is_generated(otp)) {
+            ASSERT_FORCE(!OTPChecker_CheckOTP(&checker, SEED_ID, otp))
+        }
+    }
+    
+    // OTPs of another seed are rejected
+    ASSERT_FORCE(!OTPChecker_CheckOTP(&checker, UNKNOWN_SEED_ID, otps[5]))
+    
+    printf("%d OTPs accepted once, %d generated twice\n", NUM_OTPS, num_again);
+    
+    BReactor_Quit(&reactor, 0);
+}
+
+static void test (int num_threads, int cipher)
+{
+    srand(num_threads);
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    ASSERT_FORCE(BThreadWorkDispatcher_Init(&twd, &reactor, num_threads, 0))
+    ASSERT_FORCE(OTPChecker_Init(&checker, NUM_OTPS, cipher, 3, &twd))
+    OTPChecker_SetHandlers(&checker, checker_handler, NULL);
+    
+    // compute the expected OTPs
+    ASSERT_FORCE(OTPCalculator_Init(&calc, NUM_OTPS, cipher))
+    for (int i = 0; i < (int)sizeof(key); i++) {
+        key[i] = i * 3 + cipher;
+    }
+    for (int i = 0; i < (int)sizeof(iv); i++) {
+        iv[i] = i;
+    }
+    memcpy(otps, OTPCalculator_Generate(&calc, key, iv, 0), sizeof(otps));
+    memcpy(sorted_otps, otps, sizeof(otps));
+    qsort(sorted_otps, NUM_OTPS, sizeof(otp_t), compare_otps);
+    
+    // start generating for a seed, then replace it while it is being generated
+    uint8_t other_key[BENCRYPTION_MAX_KEY_SIZE] = {1};
+    uint8_t other_iv[BENCRYPTION_MAX_BLOCK_SIZE] = {2};
+    OTPChecker_AddSeed(&checker, OTHER_SEED_ID, other_key, other_iv);
+    OTPChecker_AddSeed(&checker, SEED_ID, key, iv);
+    
+    // check for the first OTP between chunks
+    accepted_early = 0;
+    num_polls = 0;
+    BTimer_Init(&poll_timer, 1, poll_timer_handler, NULL);
+    BReactor_SetTimer(&reactor, &poll_timer);
+    
+    BReactor_Exec(&reactor);
+    
+    printf("threads=%d cipher=%d ok\n", num_threads, cipher);
+    
+    BReactor_RemoveTimer(&reactor, &poll_timer);
+    OTPCalculator_Free(&calc);
+    OTPChecker_Free(&checker);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BSecurity_GlobalInitThreadSafe()) {
+        DEBUG("BSecurity_GlobalInitThreadSafe failed");
+        goto fail0;
+    }
+    
+    test(0, BENCRYPTION_CIPHER_AES);
+    test(2, BENCRYPTION_CIPHER_AES);
+    test(2, BENCRYPTION_CIPHER_BLOWFISH);
+    
+    BSecurity_GlobalFreeThreadSafe();
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,252 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BReactorMailbox.h>
+#include <system/BReactorGroup.h>
+#include <system/BPacketPipe.h>
+#include <flow/PacketPassInterface.h>
+
+#define MTU 1000
+#define NUM_PACKETS 20000
+#define NUM_FLOOD 3
+#define DELAY_EVERY 500
+
+BReactor reactor;
+BReactorMailbox mailbox;
+BReactorGroup group;
+pthread_t main_thread;
+pthread_t echo_thread;
+
+// packets go from the main thread to the echo thread through one pipe, and
+// come back through the other
+BPacketPipe *to_echo;
+BPacketPipe *from_echo;
+BReactorMailboxMsg start_msg;
+BReactorMailboxMsg stop_msg;
+BReactorMailboxMsg stopped_msg;
+
+// main thread
+PacketPassInterface *send_if;
+PacketPassInterface sink;
+BTimer delay_timer;
+uint8_t send_buf[MTU];
+int num_sent;
+int sending;
+int num_received;
+int flooding;
+
+// echo thread
+PacketPassInterface echo;
+int num_echoed;
+
+static int packet_len (int i)
+{
+    return 4 + (i * 37) % (MTU - 3);
+}
+
+static void send_next (void)
+{
+    int len = packet_len(num_sent);
+    memcpy(send_buf, &num_sent, 4);
+    for (int j = 4; j < len; j++) {
+        send_buf[j] = (uint8_t)(num_sent + j);
+    }
+    num_sent++;
+    sending = 1;
+    
+    PacketPassInterface_Sender_Send(send_if, send_buf, len);
+}
+
+static void stopped_handler (BReactorMailboxMsg *msg)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), main_thread))
+    
+    printf("echo thread echoed %d packets\n", num_echoed);
+    ASSERT_FORCE(num_echoed >= NUM_PACKETS)
+    
+    BReactor_Quit(&reactor, 0);
+}
+
+static void stop_handler (BReactorMailboxMsg *msg)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), echo_thread))
+    
+    // free the ends in this thread, possibly with packets in them
+    BPacketPipe_FreeOutput(to_echo);
+    BPacketPipe_FreeInput(from_echo);
+    PacketPassInterface_Free(&echo);
+    
+    BReactorMailbox_Thread_Send(&mailbox, &stopped_msg, stopped_handler);
+}
+
+static void send_handler_done (void *user)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), main_thread))
+    
+    sending = 0;
+    
+    if (num_sent < NUM_PACKETS) {
+        send_next();
+        return;
+    }
+    
+    if (!flooding) {
+        return;
+    }
+    
+    if (num_sent < NUM_PACKETS + NUM_FLOOD) {
+        send_next();
+        return;
+    }
+    
+    // free the ends in this thread while packets are still in the pipes
+    BPacketPipe_FreeInput(to_echo);
+    BPacketPipe_FreeOutput(from_echo);
+    PacketPassInterface_Free(&sink);
+    
+    BReactorGroup_Thread_Send(&group, 0, &stop_msg, stop_handler);
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), main_thread))
+    
+    // packets arrive in order and unchanged
+    int i;
+    ASSERT_FORCE(data_len >= 4)
+    memcpy(&i, data, 4);
+    ASSERT_FORCE(i == num_received)
+    ASSERT_FORCE(data_len == packet_len(i))
+    for (int j = 4; j < data_len; j++) {
+        ASSERT_FORCE(data[j] == (uint8_t)(i + j))
+    }
+    num_received++;
+    
+    if (num_received == NUM_PACKETS) {
+        printf("received %d packets\n", num_received);
+        
+        // send a few more packets and free the pipes before they arrive
+        flooding = 1;
+        PacketPassInterface_Done(&sink);
+        if (!sending) {
+            send_next();
+        }
+        return;
+    }
+    
+    // sometimes hold the packet, so that both pipes fill up
+    if (!flooding && num_received % DELAY_EVERY == 0) {
+        BReactor_SetTimer(&reactor, &delay_timer);
+        return;
+    }
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void delay_timer_handler (void *user)
+{
+    PacketPassInterface_Done(&sink);
+}
+
+static void echo_handler_send (void *user, uint8_t *data, int data_len)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), echo_thread))
+    
+    num_echoed++;
+    
+    // pass the packet on; the pipe copies it
+    PacketPassInterface_Sender_Send(BPacketPipe_GetInput(from_echo), data, data_len);
+}
+
+static void echo_handler_done (void *user)
+{
+    PacketPassInterface_Done(&echo);
+}
+
+static void start_handler (BReactorMailboxMsg *msg)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), echo_thread))
+    
+    BReactor *echo_reactor = BReactorGroup_Reactor(&group, 0);
+    
+    // the output end of the first pipe is initialized after packets were sent
+    PacketPassInterface_Init(&echo, MTU, echo_handler_send, NULL, BReactor_PendingGroup(echo_reactor));
+    BPacketPipe_InitInput(from_echo, BReactor_PendingGroup(echo_reactor));
+    PacketPassInterface_Sender_Init(BPacketPipe_GetInput(from_echo), echo_handler_done, NULL);
+    BPacketPipe_InitOutput(to_echo, &echo);
+}
+
+static int group_handler_init (void *user, int index, BReactor *thread_reactor)
+{
+    echo_thread = pthread_self();
+    return 1;
+}
+
+static void test (int num_slots)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    ASSERT_FORCE(BReactorMailbox_Init(&mailbox, &reactor))
+    ASSERT_FORCE(BReactorGroup_Init(&group, 1, 0, NULL, group_handler_init, NULL))
+    
+    ASSERT_FORCE(to_echo = BPacketPipe_New(MTU, num_slots, &mailbox, BReactorGroup_Mailbox(&group, 0)))
+    ASSERT_FORCE(from_echo = BPacketPipe_New(MTU, num_slots, BReactorGroup_Mailbox(&group, 0), &mailbox))
+    
+    num_sent = 0;
+    sending = 0;
+    num_received = 0;
+    flooding = 0;
+    num_echoed = 0;
+    
+    // init ends in this thread
+    BTimer_Init(&delay_timer, 1, delay_timer_handler, NULL);
+    PacketPassInterface_Init(&sink, MTU, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    BPacketPipe_InitOutput(from_echo, &sink);
+    BPacketPipe_InitInput(to_echo, BReactor_PendingGroup(&reactor));
+    send_if = BPacketPipe_GetInput(to_echo);
+    PacketPassInterface_Sender_Init(send_if, send_handler_done, NULL);
+    
+    // start sending, then init the ends in the echo thread
+    send_next();
+    BReactorGroup_Thread_Send(&group, 0, &start_msg, start_handler);
+    
+    BReactor_Exec(&reactor);
+    
+    printf("slots=%d: %d packets sent, %d received\n", num_slots, num_sent, num_received);
+    ASSERT_FORCE(num_received >= NUM_PACKETS)
+    ASSERT_FORCE(num_received <= num_sent)
+    
+    BReactor_RemoveTimer(&reactor, &delay_timer);
+    BReactorGroup_Free(&group);
+    BReactorMailbox_Free(&mailbox);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    main_thread = pthread_self();
+    
+    // ends which were never initialized can be freed
+    BPacketPipe *p = BPacketPipe_New(MTU, 2, NULL, NULL);
+    ASSERT_FORCE(p)
+    BPacketPipe_FreeOutput(p);
+    BPacketPipe_FreeInput(p);
+    
+    test(1);
+    test(4);
+    
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <string.h>
+
+#ifdef BADVPN_THREADWORK_USE_PTHREAD
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <misc/debug.h>
+#include <structure/PacketRing.h>
+
+#define SPSC_PACKETS 1000000
+
+#ifdef BADVPN_THREADWORK_USE_PTHREAD
+
+static void * spsc_producer (void *arg)
+{
+    PacketRing *ring = (PacketRing *)arg;
+    
+    uint32_t i = 0;
+    while (i < SPSC_PACKETS) {
+        // write a few packets, then submit them together
+        int num = 0;
+        uint8_t *dest;
+        while (num < 8 && i < SPSC_PACKETS && (dest = PacketRing_WriteDest(ring))) {
+            memcpy(dest, &i, sizeof(i));
+            PacketRing_Write(ring, sizeof(i) + (i % 150));
+            num++;
+            i++;
+        }
+        PacketRing_Submit(ring);
+        
+        // let the consumer run if there's only one CPU
+        if (num == 0) {
+            sched_yield();
+        }
+    }
+    
+    return NULL;
+}
+
+static void test_spsc (void)
+{
+    PacketRing ring;
+    ASSERT_FORCE(PacketRing_Init(&ring, 200, 16, 1))
+    
+    pthread_t thread;
+    ASSERT_FORCE(pthread_create(&thread, NULL, spsc_producer, &ring) == 0)
+    
+    uint32_t next = 0;
+    while (next < SPSC_PACKETS) {
+        uint8_t *data[8];
+        int len[8];
+        int num = PacketRing_PeekPackets(&ring, 8, data, len);
+        for (int i = 0; i < num; i++) {
+            uint32_t val;
+            memcpy(&val, data[i], sizeof(val));
+            ASSERT_FORCE(val == next)
+            ASSERT_FORCE(len[i] == sizeof(val) + (next % 150))
+            next++;
+        }
+        PacketRing_ConsumePackets(&ring, num);
+        
+        if (num == 0) {
+            sched_yield();
+        }
+    }
+    
+    ASSERT_FORCE(pthread_join(thread, NULL) == 0)
+    ASSERT_FORCE(PacketRing_ReadAvail(&ring) == 0)
+    
+    PacketRing_Free(&ring);
+}
+
+#endif
+
+int main ()
+{
+    // two lines per MTU, eight lines
+    PacketRing ring;
+    ASSERT_FORCE(PacketRing_Init(&ring, 100, 3, 0))
+    
+    uint8_t *line0 = PacketRing_WriteDest(&ring);
+    ASSERT_FORCE(line0)
+    ASSERT_FORCE((uintptr_t)line0 % PACKETRING_CACHE_LINE == 0)
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0)
+    ASSERT_FORCE(PacketRing_ReadAvail(&ring) == 0)
+    
+    PacketRing_SubmitPacket(&ring, 100);
+    
+    ASSERT_FORCE(PacketRing_ReadAvail(&ring) == 1)
+    
+    // packets take whole lines, and are not visible until submitted
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0 + 2 * PACKETRING_CACHE_LINE)
+    PacketRing_Write(&ring, 1);
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0 + 3 * PACKETRING_CACHE_LINE)
+    PacketRing_Write(&ring, 64);
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0 + 4 * PACKETRING_CACHE_LINE)
+    PacketRing_Write(&ring, 65);
+    
+    ASSERT_FORCE(PacketRing_ReadAvail(&ring) == 1)
+    PacketRing_Submit(&ring);
+    ASSERT_FORCE(PacketRing_ReadAvail(&ring) == 4)
+    
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0 + 6 * PACKETRING_CACHE_LINE)
+    PacketRing_SubmitPacket(&ring, 0);
+    
+    // one line left at the end, and the first packet is at the beginning
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == NULL)
+    
+    uint8_t *data[8];
+    int len[8];
+    ASSERT_FORCE(PacketRing_PeekPackets(&ring, 2, data, len) == 2)
+    ASSERT_FORCE(data[0] == line0)
+    ASSERT_FORCE(len[0] == 100)
+    ASSERT_FORCE(data[1] == line0 + 2 * PACKETRING_CACHE_LINE)
+    ASSERT_FORCE(len[1] == 1)
+    
+    PacketRing_ConsumePackets(&ring, 2);
+    
+    // wrap around
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0)
+    PacketRing_SubmitPacket(&ring, 100);
+    
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == NULL)
+    
+    ASSERT_FORCE(PacketRing_PeekPackets(&ring, 8, data, len) == 4)
+    ASSERT_FORCE(data[0] == line0 + 3 * PACKETRING_CACHE_LINE)
+    ASSERT_FORCE(len[0] == 64)
+    ASSERT_FORCE(len[1] == 65)
+    ASSERT_FORCE(data[2] == line0 + 6 * PACKETRING_CACHE_LINE)
+    ASSERT_FORCE(len[2] == 0)
+    ASSERT_FORCE(data[3] == line0)
+    ASSERT_FORCE(len[3] == 100)
+    
+    PacketRing_ConsumePackets(&ring, 4);
+    
+    // empty, start over
+    ASSERT_FORCE(PacketRing_ReadAvail(&ring) == 0)
+    ASSERT_FORCE(PacketRing_PeekPackets(&ring, 8, data, len) == 0)
+    ASSERT_FORCE(PacketRing_WriteDest(&ring) == line0)
+    
+    PacketRing_Free(&ring);
+    
+#ifdef BADVPN_THREADWORK_USE_PTHREAD
+    test_spsc();
+#endif
+    
+    return 0;
+}
@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <protocol/packetproto.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BConnection.h>
+#include <system/BDatagram.h>
+#include <flow/PacketPassVecInterface.h>
+#include <flow/PacketPassVecWrapper.h>
+#include <flow/PacketPassVecGatherer.h>
+#include <flow/PacketProtoVecEncoder.h>
+#include <flow/PacketProtoDecoder.h>
+
+#define MTU 30000
+#define MAX_SEGS 4
+#define NUM_STREAM_PACKETS 5000
+#define NUM_DGRAM_PACKETS 1000
+#define DELAY_EVERY 50
+
+BReactor reactor;
+BTimer delay_timer;
+int num_sent;
+int num_received;
+int sending;
+
+// stream: segments are sent through the encoder to a connection in packet
+// mode, and decoded on the other end
+BConnection stream_sender;
+BConnection stream_receiver;
+PacketProtoVecEncoder stream_encoder;
+PacketProtoDecoder stream_decoder;
+PacketPassVecInterface *stream_send_if;
+PacketPassInterface stream_sink;
+uint8_t stream_buf[MTU];
+PacketVecSeg stream_segs[MAX_SEGS - 1];
+
+// datagram: plain packets are wrapped, encoded and sent as datagrams
+BDatagram dgram_sender;
+BDatagram dgram_receiver;
+PacketPassVecWrapper dgram_wrapper;
+PacketProtoVecEncoder dgram_encoder;
+PacketPassInterface *dgram_send_if;
+PacketRecvInterface *dgram_recv_if;
+uint8_t dgram_send_buf[MTU];
+uint8_t dgram_recv_buf[PACKETPROTO_ENCLEN(MTU)];
+
+// gatherer: segments are joined for a plain packet interface
+PacketPassVecGatherer gatherer;
+PacketPassInterface gatherer_sink;
+PacketVecSeg gatherer_segs[MAX_SEGS];
+uint8_t gatherer_single[10];
+int gatherer_step;
+uint8_t *gatherer_data;
+int gatherer_len;
+
+static int packet_len (int i)
+{
+    return (i * 37) % (MTU + 1);
+}
+
+static void fill_packet (uint8_t *data, int i)
+{
+    int len = packet_len(i);
+    for (int j = 0; j < len; j++) {
+        data[j] = (uint8_t)(i + j);
+    }
+}
+
+static void check_packet (uint8_t *data, int data_len, int i)
+{
+    ASSERT_FORCE(data_len == packet_len(i))
+    for (int j = 0; j < data_len; j++) {
+        ASSERT_FORCE(data[j] == (uint8_t)(i + j))
+    }
+}
+
+static void connection_handler (void *user, int event)
+{
+    DEBUG("BConnection error");
+    ASSERT_FORCE(0)
+}
+
+static void dgram_handler (void *user, int event)
+{
+    DEBUG("BDatagram error");
+    ASSERT_FORCE(0)
+}
+
+static void decoder_handler_error (void *user)
+{
+    DEBUG("PacketProtoDecoder error");
+    ASSERT_FORCE(0)
+}
+
+static void stream_send_next (void)
+{
+    if (num_sent == NUM_STREAM_PACKETS) {
+        return;
+    }
+    
+    // split the packet into a varying number of segments, some of them empty
+    int len = packet_len(num_sent);
+    fill_packet(stream_buf, num_sent);
+    int num_segs = 1 + num_sent % (MAX_SEGS - 1);
+    int pos = 0;
+    for (int j = 0; j < num_segs; j++) {
+        int seg_len = (j == num_segs - 1 ? len - pos : (len - pos) / 2);
+        stream_segs[j].data = stream_buf + pos;
+        stream_segs[j].len = seg_len;
+        pos += seg_len;
+    }
+    num_sent++;
+    
+    PacketPassVecInterface_Sender_Send(stream_send_if, stream_segs, num_segs);
+}
+
+static void stream_send_handler_done (void *user)
+{
+    stream_send_next();
+}
+
+static void stream_sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    check_packet(data, data_len, num_received);
+    num_received++;
+    
+    if (num_received == NUM_STREAM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // sometimes stop reading, so that the sender's socket buffer fills up and
+    // packets are written in parts
+    if (num_received % DELAY_EVERY == 0) {
+        BReactor_SetTimer(&reactor, &delay_timer);
+        return;
+    }
+    
+    PacketPassInterface_Done(&stream_sink);
+}
+
+static void delay_timer_handler (void *user)
+{
+    PacketPassInterface_Done(&stream_sink);
+}
+
+static void test_stream (void)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    BTimer_Init(&delay_timer, 1, delay_timer_handler, NULL);
+    num_sent = 0;
+    num_received = 0;
+    
+    int fds[2];
+    ASSERT_FORCE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)
+    ASSERT_FORCE(BConnection_Init(&stream_sender, BConnection_source_pipe(fds[0], 1), &reactor, NULL, connection_handler))
+    ASSERT_FORCE(BConnection_Init(&stream_receiver, BConnection_source_pipe(fds[1], 1), &reactor, NULL, connection_handler))
+    ASSERT_FORCE(BConnection_SetSendBuffer(&stream_sender, 4096))
+    
+    // init sending
+    BConnection_SendAsync_InitVec(&stream_sender, PACKETPROTO_ENCLEN(MTU), MAX_SEGS);
+    PacketProtoVecEncoder_Init(&stream_encoder, BConnection_SendAsync_GetVecIf(&stream_sender), BReactor_PendingGroup(&reactor));
+    stream_send_if = PacketProtoVecEncoder_GetInput(&stream_encoder);
+    ASSERT_FORCE(PacketPassVecInterface_GetMTU(stream_send_if) == MTU)
+    ASSERT_FORCE(PacketPassVecInterface_GetMaxSegs(stream_send_if) == MAX_SEGS - 1)
+    PacketPassVecInterface_Sender_Init(stream_send_if, stream_send_handler_done, NULL);
+    
+    // init receiving
+    BConnection_RecvAsync_Init(&stream_receiver);
+    PacketPassInterface_Init(&stream_sink, MTU, stream_sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    ASSERT_FORCE(PacketProtoDecoder_Init(&stream_decoder, BConnection_RecvAsync_GetIf(&stream_receiver), &stream_sink, BReactor_PendingGroup(&reactor), NULL, decoder_handler_error))
+    
+    stream_send_next();
+    
+    BReactor_Exec(&reactor);
+    
+    printf("stream: %d of %d packets received\n", num_received, NUM_STREAM_PACKETS);
+    
+    PacketProtoDecoder_Free(&stream_decoder);
+    PacketPassInterface_Free(&stream_sink);
+    BConnection_RecvAsync_Free(&stream_receiver);
+    PacketProtoVecEncoder_Free(&stream_encoder);
+    BConnection_SendAsync_Free(&stream_sender);
+    BConnection_Free(&stream_receiver);
+    BConnection_Free(&stream_sender);
+    BReactor_RemoveTimer(&reactor, &delay_timer);
+    BReactor_Free(&reactor);
+}
+
+static void dgram_send_next (void)
+{
+    if (num_sent == NUM_DGRAM_PACKETS) {
+        return;
+    }
+    
+    fill_packet(dgram_send_buf, num_sent);
+    int len = packet_len(num_sent);
+    num_sent++;
+    sending = 1;
+    
+    PacketPassInterface_Sender_Send(dgram_send_if, dgram_send_buf, len);
+}
+
+static void dgram_send_handler_done (void *user)
+{
+    sending = 0;
+    
+    // send the next packet once the previous one has been received, so that
+    // none can be lost
+    if (num_received == num_sent) {
+        dgram_send_next();
+    }
+}
+
+static void dgram_recv_handler_done (void *user, int data_len)
+{
+    // the datagram is the header followed by the packet
+    ASSERT_FORCE(data_len >= sizeof(struct packetproto_header))
+    struct packetproto_header header;
+    memcpy(&header, dgram_recv_buf, sizeof(header));
+    int len = ltoh16(header.len);
+    ASSERT_FORCE(len == data_len - sizeof(struct packetproto_header))
+    check_packet(dgram_recv_buf + sizeof(struct packetproto_header), len, num_received);
+    num_received++;
+    
+    if (num_received == NUM_DGRAM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    PacketRecvInterface_Receiver_Recv(dgram_recv_if, dgram_recv_buf);
+    
+    if (!sending) {
+        dgram_send_next();
+    }
+}
+
+static void test_dgram (void)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    num_sent = 0;
+    num_received = 0;
+    sending = 0;
+    
+    // init receiver on loopback
+    BAddr addr;
+    BAddr_InitIPv4(&addr, htonl(INADDR_LOOPBACK), 0);
+    ASSERT_FORCE(BDatagram_Init(&dgram_receiver, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler))
+    ASSERT_FORCE(BDatagram_Bind(&dgram_receiver, addr))
+    BAddr receiver_addr;
+    ASSERT_FORCE(BDatagram_GetLocalAddr(&dgram_receiver, &receiver_addr))
+    BDatagram_RecvAsync_Init(&dgram_receiver, sizeof(dgram_recv_buf));
+    dgram_recv_if = BDatagram_RecvAsync_GetIf(&dgram_receiver);
+    PacketRecvInterface_Receiver_Init(dgram_recv_if, dgram_recv_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(dgram_recv_if, dgram_recv_buf);
+    
+    // init sender
+    ASSERT_FORCE(BDatagram_Init(&dgram_sender, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler))
+    BIPAddr local_addr;
+    BIPAddr_InitInvalid(&local_addr);
+    BDatagram_SetSendAddrs(&dgram_sender, receiver_addr, local_addr);
+    BDatagram_SendAsync_InitVec(&dgram_sender, PACKETPROTO_ENCLEN(MTU), 2);
+    PacketProtoVecEncoder_Init(&dgram_encoder, BDatagram_SendAsync_GetVecIf(&dgram_sender), BReactor_PendingGroup(&reactor));
+    PacketPassVecWrapper_Init(&dgram_wrapper, PacketProtoVecEncoder_GetInput(&dgram_encoder), BReactor_PendingGroup(&reactor));
+    dgram_send_if = PacketPassVecWrapper_GetInput(&dgram_wrapper);
+    ASSERT_FORCE(PacketPassInterface_GetMTU(dgram_send_if) == MTU)
+    PacketPassInterface_Sender_Init(dgram_send_if, dgram_send_handler_done, NULL);
+    
+    dgram_send_next();
+    
+    BReactor_Exec(&reactor);
+    
+    printf("datagram: %d of %d packets received\n", num_received, NUM_DGRAM_PACKETS);
+    
+    PacketPassVecWrapper_Free(&dgram_wrapper);
+    PacketProtoVecEncoder_Free(&dgram_encoder);
+    BDatagram_SendAsync_Free(&dgram_sender);
+    BDatagram_Free(&dgram_sender);
+    BDatagram_RecvAsync_Free(&dgram_receiver);
+    BDatagram_Free(&dgram_receiver);
+    BReactor_Free(&reactor);
+}
+
+static void gatherer_sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    gatherer_data = data;
+    gatherer_len = data_len;
+    
+    PacketPassInterface_Done(&gatherer_sink);
+}
+
+static void gatherer_send_next (void)
+{
+    PacketPassVecInterface *send_if = PacketPassVecGatherer_GetInput(&gatherer);
+    
+    switch (gatherer_step) {
+        case 0: {
+            gatherer_segs[0].data = (uint8_t *)"first";
+            gatherer_segs[0].len = 5;
+            gatherer_segs[1].data = NULL;
+            gatherer_segs[1].len = 0;
+            gatherer_segs[2].data = (uint8_t *)"second";
+            gatherer_segs[2].len = 6;
+            gatherer_segs[3].data = (uint8_t *)"third";
+            gatherer_segs[3].len = 5;
+            PacketPassVecInterface_Sender_Send(send_if, gatherer_segs, 4);
+        } break;
+        
+        case 1: {
+            gatherer_segs[0].data = gatherer_single;
+            gatherer_segs[0].len = sizeof(gatherer_single);
+            PacketPassVecInterface_Sender_Send(send_if, gatherer_segs, 1);
+        } break;
+        
+        case 2: {
+            PacketPassVecInterface_Sender_Send(send_if, gatherer_segs, 0);
+        } break;
+        
+        default: {
+            BReactor_Quit(&reactor, 0);
+        } break;
+    }
+}
+
+static void gatherer_handler_done (void *user)
+{
+    switch (gatherer_step) {
+        case 0: {
+            // segments are joined
+            ASSERT_FORCE(gatherer_len == 16)
+            ASSERT_FORCE(!memcmp(gatherer_data, "firstsecondthird", 16))
+        } break;
+        
+        case 1: {
+            // a single segment is passed without copying
+            ASSERT_FORCE(gatherer_data == gatherer_single)
+            ASSERT_FORCE(gatherer_len == sizeof(gatherer_single))
+        } break;
+        
+        case 2: {
+            // no segments make an empty packet
+            ASSERT_FORCE(gatherer_len == 0)
+        } break;
+    }
+    
+    gatherer_step++;
+    gatherer_send_next();
+}
+
+static void test_gatherer (void)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    PacketPassInterface_Init(&gatherer_sink, MTU, gatherer_sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    ASSERT_FORCE(PacketPassVecGatherer_Init(&gatherer, MAX_SEGS, &gatherer_sink, BReactor_PendingGroup(&reactor)))
+    PacketPassVecInterface_Sender_Init(PacketPassVecGatherer_GetInput(&gatherer), gatherer_handler_done, NULL);
+    
+    gatherer_step = 0;
+    gatherer_send_next();
+    
+    BReactor_Exec(&reactor);
+    
+    printf("gatherer: %d of 3 packets checked\n", gatherer_step);
+    ASSERT_FORCE(gatherer_step == 3)
+    
+    PacketPassVecGatherer_Free(&gatherer);
+    PacketPassInterface_Free(&gatherer_sink);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    test_stream();
+    test_dgram();
+    test_gatherer();
+    
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,266 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BDatagram.h>
+#include <system/BReactorMailbox.h>
+#include <system/BReactorGroup.h>
+
+#define NUM_SENDERS 4
+#define NUM_MESSAGES 20000
+#define NUM_THREADS 3
+#define HANDOFF_THREAD 1
+#define HANDOFF_DATA "queued before handoff"
+
+struct seq_msg {
+    BReactorMailboxMsg msg;
+    int sender;
+    int seq;
+};
+
+struct thread_msg {
+    BReactorMailboxMsg msg;
+    int index;
+    int fd;
+};
+
+BReactor reactor;
+BReactorMailbox mailbox;
+BReactorGroup group;
+pthread_t main_thread;
+
+// many senders to one mailbox
+struct seq_msg seq_msgs[NUM_SENDERS][NUM_MESSAGES];
+pthread_t sender_threads[NUM_SENDERS];
+int next_seq[NUM_SENDERS];
+int num_seq_received;
+
+// messages to and from the threads of the group
+pthread_t group_threads[NUM_THREADS];
+struct thread_msg ping_msgs[NUM_THREADS];
+struct thread_msg pong_msgs[NUM_THREADS];
+int num_pongs;
+
+// a datagram socket moved to a thread of the group
+struct thread_msg handoff_msg;
+struct thread_msg handoff_done_msg;
+BDatagram handoff_dgram;
+int handoff_dgram_inited;
+uint8_t handoff_buf[100];
+int handoff_len;
+
+static void seq_msg_handler (BReactorMailboxMsg *msg);
+static void start_group (void);
+static void start_handoff (void);
+
+static void *sender_thread_func (void *arg)
+{
+    int sender = (intptr_t)arg;
+    
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        struct seq_msg *m = &seq_msgs[sender][i];
+        m->sender = sender;
+        m->seq = i;
+        BReactorMailbox_Thread_Send(&mailbox, &m->msg, seq_msg_handler);
+    }
+    
+    return NULL;
+}
+
+static void seq_msg_handler (BReactorMailboxMsg *msg)
+{
+    struct seq_msg *m = UPPER_OBJECT(msg, struct seq_msg, msg);
+    ASSERT_FORCE(pthread_equal(pthread_self(), main_thread))
+    
+    // messages from one sender arrive in order
+    ASSERT_FORCE(m->seq == next_seq[m->sender])
+    next_seq[m->sender]++;
+    num_seq_received++;
+    
+    if (num_seq_received == NUM_SENDERS * NUM_MESSAGES) {
+        printf("received %d messages from %d threads\n", num_seq_received, NUM_SENDERS);
+        start_group();
+    }
+}
+
+static int group_handler_init (void *user, int index, BReactor *thread_reactor)
+{
+    ASSERT_FORCE(index >= 0 && index < NUM_THREADS)
+    
+    group_threads[index] = pthread_self();
+    return 1;
+}
+
+static void group_handler_deinit (void *user, int index, BReactor *thread_reactor)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), group_threads[index]))
+    
+    if (index == HANDOFF_THREAD && handoff_dgram_inited) {
+        BDatagram_RecvAsync_Free(&handoff_dgram);
+        BDatagram_Free(&handoff_dgram);
+    }
+}
+
+static void pong_handler (BReactorMailboxMsg *msg)
+{
+    struct thread_msg *m = UPPER_OBJECT(msg, struct thread_msg, msg);
+    ASSERT_FORCE(pthread_equal(pthread_self(), main_thread))
+    ASSERT_FORCE(m == &pong_msgs[m->index])
+    
+    num_pongs++;
+    
+    if (num_pongs == NUM_THREADS) {
+        printf("all %d threads replied\n", NUM_THREADS);
+        start_handoff();
+    }
+}
+
+static void ping_handler (BReactorMailboxMsg *msg)
+{
+    struct thread_msg *m = UPPER_OBJECT(msg, struct thread_msg, msg);
+    
+    // handled in the thread it was sent to
+    ASSERT_FORCE(pthread_equal(pthread_self(), group_threads[m->index]))
+    
+    pong_msgs[m->index].index = m->index;
+    BReactorMailbox_Thread_Send(&mailbox, &pong_msgs[m->index].msg, pong_handler);
+}
+
+static void start_group (void)
+{
+    if (!BReactorGroup_Init(&group, NUM_THREADS, 0, NULL, group_handler_init, group_handler_deinit)) {
+        DEBUG("BReactorGroup_Init failed");
+        ASSERT_FORCE(0)
+    }
+    ASSERT_FORCE(BReactorGroup_NumThreads(&group) == NUM_THREADS)
+    
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ping_msgs[i].index = i;
+        BReactorGroup_Thread_Send(&group, i, &ping_msgs[i].msg, ping_handler);
+    }
+}
+
+static void dgram_handler (void *user, int event)
+{
+    DEBUG("BDatagram error");
+    ASSERT_FORCE(0)
+}
+
+static void handoff_done_handler (BReactorMailboxMsg *msg)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), main_thread))
+    
+    // the packet queued before the socket was moved was received by the thread
+    printf("thread received %d bytes on the moved socket\n", handoff_len);
+    ASSERT_FORCE(handoff_len == strlen(HANDOFF_DATA))
+    ASSERT_FORCE(!memcmp(handoff_buf, HANDOFF_DATA, handoff_len))
+    
+    BReactor_Quit(&reactor, 0);
+}
+
+static void handoff_recv_handler_done (void *user, int data_len)
+{
+    ASSERT_FORCE(pthread_equal(pthread_self(), group_threads[HANDOFF_THREAD]))
+    
+    handoff_len = data_len;
+    BReactorMailbox_Thread_Send(&mailbox, &handoff_done_msg.msg, handoff_done_handler);
+}
+
+static void handoff_handler (BReactorMailboxMsg *msg)
+{
+    struct thread_msg *m = UPPER_OBJECT(msg, struct thread_msg, msg);
+    ASSERT_FORCE(pthread_equal(pthread_self(), group_threads[HANDOFF_THREAD]))
+    
+    // adopt the socket in this thread's reactor
+    ASSERT_FORCE(BDatagram_InitFromFd(&handoff_dgram, m->fd, BADDR_TYPE_IPV4, BReactorGroup_Reactor(&group, HANDOFF_THREAD), NULL, dgram_handler))
+    handoff_dgram_inited = 1;
+    
+    BDatagram_RecvAsync_Init(&handoff_dgram, sizeof(handoff_buf));
+    PacketRecvInterface *recv_if = BDatagram_RecvAsync_GetIf(&handoff_dgram);
+    PacketRecvInterface_Receiver_Init(recv_if, handoff_recv_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(recv_if, handoff_buf);
+}
+
+static void start_handoff (void)
+{
+    // bind a datagram socket in this thread
+    BDatagram dgram;
+    ASSERT_FORCE(BDatagram_Init(&dgram, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler))
+    BAddr addr;
+    BAddr_InitIPv4(&addr, htonl(INADDR_LOOPBACK), 0);
+    ASSERT_FORCE(BDatagram_Bind(&dgram, addr))
+    ASSERT_FORCE(BDatagram_GetLocalAddr(&dgram, &addr))
+    
+    // queue a packet in the socket
+    int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_FORCE(sfd >= 0)
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = addr.ipv4.ip;
+    sin.sin_port = addr.ipv4.port;
+    ASSERT_FORCE(sendto(sfd, HANDOFF_DATA, strlen(HANDOFF_DATA), 0, (struct sockaddr *)&sin, sizeof(sin)) == strlen(HANDOFF_DATA))
+    close(sfd);
+    
+    // release the socket and send it to a thread of the group
+    handoff_msg.fd = BDatagram_Release(&dgram);
+    ASSERT_FORCE(handoff_msg.fd >= 0)
+    BReactorGroup_Thread_Send(&group, HANDOFF_THREAD, &handoff_msg.msg, handoff_handler);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    if (!BReactorMailbox_Init(&mailbox, &reactor)) {
+        DEBUG("BReactorMailbox_Init failed");
+        goto fail1;
+    }
+    
+    main_thread = pthread_self();
+    
+    // start senders
+    for (int i = 0; i < NUM_SENDERS; i++) {
+        ASSERT_FORCE(pthread_create(&sender_threads[i], NULL, sender_thread_func, (void *)(intptr_t)i) == 0)
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    for (int i = 0; i < NUM_SENDERS; i++) {
+        ASSERT_FORCE(pthread_join(sender_threads[i], NULL) == 0)
+    }
+    
+    BReactorGroup_Free(&group);
+    BReactorMailbox_Free(&mailbox);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassDRRQueue.h>
+#include <flowextra/PacketPassShaper.h>
+
+#define MTU 1500
+#define NUM_PACKETS 100000
+#define RUN_TIME 500
+
+struct source {
+    PacketPassInterface *input;
+    int len;
+    uint64_t num_sent;
+};
+
+BReactor reactor;
+PacketPassInterface sink;
+BTimer sink_timer;
+BTimer end_timer;
+int sink_slow;
+int num_received;
+uint8_t buf[MTU];
+struct source sources[3];
+
+static uint64_t bytes_sent (int i)
+{
+    return sources[i].num_sent * sources[i].len;
+}
+
+static void source_handler_done (void *user)
+{
+    struct source *s = user;
+    
+    s->num_sent++;
+    PacketPassInterface_Sender_Send(s->input, buf, s->len);
+}
+
+static void start_source (int i, PacketPassInterface *input, int len)
+{
+    struct source *s = &sources[i];
+    s->input = input;
+    s->len = len;
+    s->num_sent = 0;
+    
+    PacketPassInterface_Sender_Init(s->input, source_handler_done, s);
+    PacketPassInterface_Sender_Send(s->input, buf, s->len);
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    num_received++;
+    
+    // Finish packets from the event loop, so that timers get to run. The first
+    // packet is always held like this, so that all sources queue a packet
+    // before the sink takes more.
+    if (sink_slow || num_received == 1) {
+        BReactor_SetTimer(&reactor, &sink_timer);
+        return;
+    }
+    
+    if (num_received == NUM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void sink_timer_handler (void *user)
+{
+    PacketPassInterface_Done(&sink);
+}
+
+static void end_timer_handler (void *user)
+{
+    BReactor_Quit(&reactor, 0);
+}
+
+static void init_sink (int slow)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    PacketPassInterface_Init(&sink, MTU, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    BTimer_Init(&sink_timer, 0, sink_timer_handler, NULL);
+    BTimer_Init(&end_timer, RUN_TIME, end_timer_handler, NULL);
+    sink_slow = slow;
+    num_received = 0;
+}
+
+static void free_sink (void)
+{
+    BReactor_RemoveTimer(&reactor, &end_timer);
+    BReactor_RemoveTimer(&reactor, &sink_timer);
+    PacketPassInterface_Free(&sink);
+    BReactor_Free(&reactor);
+}
+
+static void check_ratio (const char *name, uint64_t a, uint64_t b, double expected)
+{
+    double ratio = (double)a / b;
+    printf("%s: %.3f, expected %.3f\n", name, ratio, expected);
+    ASSERT_FORCE(ratio > expected * 0.95 && ratio < expected * 1.05)
+}
+
+static void test_weights (void)
+{
+    init_sink(0);
+    
+    PacketPassDRRQueue queue;
+    PacketPassDRRQueueFlow flows[2];
+    ASSERT_FORCE(PacketPassDRRQueue_Init(&queue, &sink, BReactor_PendingGroup(&reactor), 0, 1))
+    PacketPassDRRQueueFlow_Init(&flows[0], &queue);
+    PacketPassDRRQueueFlow_Init(&flows[1], &queue);
+    PacketPassDRRQueueFlow_SetWeight(&flows[1], 3);
+    
+    // the share is in bytes, not packets
+    start_source(0, PacketPassDRRQueueFlow_GetInput(&flows[0]), 100);
+    start_source(1, PacketPassDRRQueueFlow_GetInput(&flows[1]), 1000);
+    
+    BReactor_Exec(&reactor);
+    
+    check_ratio("weights 1:3", bytes_sent(1), bytes_sent(0), 3.0);
+    
+    PacketPassDRRQueue_PrepareFree(&queue);
+    PacketPassDRRQueueFlow_Free(&flows[1]);
+    PacketPassDRRQueueFlow_Free(&flows[0]);
+    PacketPassDRRQueue_Free(&queue);
+    free_sink();
+}
+
+static void test_hierarchy (void)
+{
+    init_sink(0);
+    
+    // peer A with weight 2 has two classes, peer B has weight 1
+    PacketPassDRRQueue queue;
+    PacketPassDRRQueueFlow flow_a;
+    PacketPassDRRQueueFlow flow_b;
+    ASSERT_FORCE(PacketPassDRRQueue_Init(&queue, &sink, BReactor_PendingGroup(&reactor), 0, 1))
+    PacketPassDRRQueueFlow_Init(&flow_a, &queue);
+    PacketPassDRRQueueFlow_Init(&flow_b, &queue);
+    PacketPassDRRQueueFlow_SetWeight(&flow_a, 2);
+    
+    PacketPassDRRQueue queue_a;
+    PacketPassDRRQueueFlow flows_a[2];
+    ASSERT_FORCE(PacketPassDRRQueue_Init(&queue_a, PacketPassDRRQueueFlow_GetInput(&flow_a), BReactor_PendingGroup(&reactor), 0, 1))
+    PacketPassDRRQueueFlow_Init(&flows_a[0], &queue_a);
+    PacketPassDRRQueueFlow_Init(&flows_a[1], &queue_a);
+    
+    start_source(0, PacketPassDRRQueueFlow_GetInput(&flows_a[0]), 64);
+    start_source(1, PacketPassDRRQueueFlow_GetInput(&flows_a[1]), 1400);
+    start_source(2, PacketPassDRRQueueFlow_GetInput(&flow_b), 700);
+    
+    BReactor_Exec(&reactor);
+    
+    check_ratio("peer A to peer B", bytes_sent(0) + bytes_sent(1), bytes_sent(2), 2.0);
+    check_ratio("classes of peer A", bytes_sent(1), bytes_sent(0), 1.0);
+    
+    PacketPassDRRQueue_PrepareFree(&queue);
+    PacketPassDRRQueue_PrepareFree(&queue_a);
+    PacketPassDRRQueueFlow_Free(&flows_a[1]);
+    PacketPassDRRQueueFlow_Free(&flows_a[0]);
+    PacketPassDRRQueue_Free(&queue_a);
+    PacketPassDRRQueueFlow_Free(&flow_b);
+    PacketPassDRRQueueFlow_Free(&flow_a);
+    PacketPassDRRQueue_Free(&queue);
+    free_sink();
+}
+
+static void test_shaper (uint64_t rate, int burst, uint64_t new_rate, int new_burst)
+{
+    init_sink(1);
+    
+    // a shaped flow and an unshaped flow of small packets
+    PacketPassDRRQueue queue;
+    PacketPassDRRQueueFlow flows[2];
+    PacketPassShaper shaper;
+    ASSERT_FORCE(PacketPassDRRQueue_Init(&queue, &sink, BReactor_PendingGroup(&reactor), 0, 1))
+    PacketPassDRRQueueFlow_Init(&flows[0], &queue);
+    PacketPassDRRQueueFlow_Init(&flows[1], &queue);
+    PacketPassShaper_Init(&shaper, PacketPassDRRQueueFlow_GetInput(&flows[0]), &reactor, rate, burst);
+    
+    start_source(0, PacketPassShaper_GetInput(&shaper), 1000);
+    start_source(1, PacketPassDRRQueueFlow_GetInput(&flows[1]), 10);
+    
+    // change the rate once the burst was taken
+    if (new_rate > 0) {
+        PacketPassShaper_SetRate(&shaper, new_rate, new_burst);
+        rate = new_rate;
+        burst = new_burst;
+    }
+    
+    btime_t start = btime_gettime();
+    BReactor_SetTimer(&reactor, &end_timer);
+    BReactor_Exec(&reactor);
+    btime_t elapsed = btime_gettime() - start;
+    
+    // the bucket starts with a burst, and the packet which started the
+    // source was passed before the timer was started
+    uint64_t allowed = burst + rate * elapsed / 1000 + sources[0].len;
+    printf("rate %d burst %d: %d bytes in %d ms, at most %d allowed, other flow passed %d packets\n",
+           (int)rate, burst, (int)bytes_sent(0), (int)elapsed, (int)allowed, (int)sources[1].num_sent);
+    ASSERT_FORCE(bytes_sent(0) <= allowed)
+    ASSERT_FORCE(bytes_sent(0) >= (allowed - sources[0].len) * 8 / 10)
+    
+    // the held packets of the shaped flow did not block the other flow
+    ASSERT_FORCE(sources[1].num_sent > 10 * sources[0].num_sent)
+    
+    PacketPassDRRQueue_PrepareFree(&queue);
+    PacketPassShaper_Free(&shaper);
+    PacketPassDRRQueueFlow_Free(&flows[1]);
+    PacketPassDRRQueueFlow_Free(&flows[0]);
+    PacketPassDRRQueue_Free(&queue);
+    free_sink();
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    test_weights();
+    test_hierarchy();
+    test_shaper(200000, 10000, 0, 0);
+    test_shaper(200000, 10000, 50000, 1500);
+    
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <security/BSecurity.h>
+#include <threadwork/BThreadWork.h>
+#include <flow/PacketRecvInterface.h>
+#include <flow/PacketPassInterface.h>
+#include <client/SPProtoEncoder.h>
+#include <client/SPProtoDecoder.h>
+
+#define MTU 1000
+#define NUM_PACKETS 3000
+#define OTP_NUM 4096
+#define TAMPER_EVERY 7
+
+BReactor reactor;
+BThreadWorkDispatcher twd;
+struct spproto_security_params params;
+SPProtoEncoder encoder;
+SPProtoDecoder decoder;
+int pipelined;
+int ready;
+
+// source, the encoder's input
+PacketRecvInterface source;
+uint8_t *source_pending;
+int num_produced;
+
+// relay from the encoder to the decoder
+PacketRecvInterface *relay_input;
+PacketPassInterface *relay_output;
+uint8_t relay_buf[MTU + 200];
+int num_relayed;
+int tamper;
+
+// sink, the decoder's output
+PacketPassInterface sink;
+int num_expected;
+int num_received;
+
+static void log_func (void *user)
+{
+    BLog_Append("spproto_test: ");
+}
+
+static int packet_len (int i)
+{
+    return 4 + i % (MTU - 3);
+}
+
+static int is_tampered (int i)
+{
+    return (tamper && i % TAMPER_EVERY == 3);
+}
+
+static void source_produce (uint8_t *data)
+{
+    int len = packet_len(num_produced);
+    memcpy(data, &num_produced, 4);
+    for (int j = 4; j < len; j++) {
+        data[j] = (uint8_t)(num_produced + j);
+    }
+    num_produced++;
+    
+    PacketRecvInterface_Done(&source, len);
+}
+
+static void source_handler_recv (void *user, uint8_t *data)
+{
+    if (num_produced == NUM_PACKETS) {
+        return;
+    }
+    
+    // Without pipelining and with no separate plaintext buffer, the packet
+    // must be encoded in the encoder's output packet.
+    if (!pipelined && !SPPROTO_HAVE_ENCRYPTION_KEY(params)) {
+        ASSERT_FORCE(data == relay_buf + SPPROTO_HEADER_LEN(params))
+    }
+    
+    // wait until OTPs can be checked
+    if (!ready) {
+        source_pending = data;
+        return;
+    }
+    
+    source_produce(data);
+}
+
+static void relay_input_handler_done (void *user, int data_len)
+{
+    // corrupt a byte after the IV or nonce
+    if (is_tampered(num_relayed)) {
+        relay_buf[data_len - 1] ^= 0x40;
+    }
+    num_relayed++;
+    
+    PacketPassInterface_Sender_Send(relay_output, relay_buf, data_len);
+}
+
+static void relay_output_handler_done (void *user)
+{
+    PacketRecvInterface_Receiver_Recv(relay_input, relay_buf);
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    // Without pipelining and with no separate plaintext buffer, the packet
+    // must be decoded in the decoder's input packet.
+    if (!pipelined && !SPPROTO_HAVE_ENCRYPTION(params)) {
+        ASSERT_FORCE(data >= relay_buf && data < relay_buf + sizeof(relay_buf))
+    }
+    
+    // skip packets which were tampered with
+    while (is_tampered(num_expected)) {
+        num_expected++;
+    }
+    
+    int i;
+    ASSERT_FORCE(data_len >= 4)
+    memcpy(&i, data, 4);
+    ASSERT_FORCE(i == num_expected)
+    ASSERT_FORCE(data_len == packet_len(i))
+    for (int j = 4; j < data_len; j++) {
+        ASSERT_FORCE(data[j] == (uint8_t)(i + j))
+    }
+    num_expected++;
+    num_received++;
+    
+    PacketPassInterface_Done(&sink);
+    
+    // skip trailing packets which were tampered with
+    while (num_expected < NUM_PACKETS && is_tampered(num_expected)) {
+        num_expected++;
+    }
+    
+    if (num_expected == NUM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void decoder_otp_handler (void *user)
+{
+    if (ready) {
+        return;
+    }
+    ready = 1;
+    
+    if (source_pending) {
+        source_produce(source_pending);
+    }
+}
+
+static void test (int num_threads, struct spproto_security_params p, int with_tamper)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    ASSERT_FORCE(BThreadWorkDispatcher_Init(&twd, &reactor, num_threads, 0))
+    pipelined = BThreadWorkDispatcher_UsingThreads(&twd);
+    params = p;
+    tamper = with_tamper;
+    ready = !SPPROTO_HAVE_OTP(params);
+    source_pending = NULL;
+    num_produced = 0;
+    num_relayed = 0;
+    num_expected = 0;
+    num_received = 0;
+    
+    int carrier_mtu = spproto_carrier_mtu_for_payload_mtu(params, MTU);
+    ASSERT_FORCE(carrier_mtu >= 0)
+    ASSERT_FORCE(carrier_mtu <= (int)sizeof(relay_buf))
+    
+    // init source and sink
+    PacketRecvInterface_Init(&source, MTU, source_handler_recv, NULL, BReactor_PendingGroup(&reactor));
+    PacketPassInterface_Init(&sink, MTU, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    
+    // init encoder and decoder
+    ASSERT_FORCE(SPProtoEncoder_Init(&encoder, &source, params, (SPPROTO_HAVE_OTP(params) ? OTP_NUM / 2 : 0), BReactor_PendingGroup(&reactor), &twd))
+    ASSERT_FORCE(SPProtoDecoder_Init(&decoder, &sink, params, 2, BReactor_PendingGroup(&reactor), &twd, NULL, log_func))
+    SPProtoDecoder_SetHandlers(&decoder, decoder_otp_handler, NULL);
+    
+    // set keys and seeds
+    if (SPPROTO_HAVE_ENCRYPTION_KEY(params)) {
+        uint8_t key[SPPROTO_ENCRYPTION_KEY_SIZE(params)];
+        for (int i = 0; i < (int)sizeof(key); i++) {
+            key[i] = i * 7;
+        }
+        SPProtoEncoder_SetEncryptionKey(&encoder, key);
+        SPProtoDecoder_SetEncryptionKey(&decoder, key);
+    }
+    if (SPPROTO_HAVE_OTP(params)) {
+        uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+        uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+        for (int i = 0; i < (int)sizeof(key); i++) {
+            key[i] = i * 3;
+        }
+        for (int i = 0; i < (int)sizeof(iv); i++) {
+            iv[i] = i;
+        }
+        SPProtoEncoder_SetOTPSeed(&encoder, 1, key, iv);
+        SPProtoDecoder_AddOTPSeed(&decoder, 1, key, iv);
+    }
+    
+    // start relaying
+    relay_input = SPProtoEncoder_GetOutput(&encoder);
+    relay_output = SPProtoDecoder_GetInput(&decoder);
+    PacketRecvInterface_Receiver_Init(relay_input, relay_input_handler_done, NULL);
+    PacketPassInterface_Sender_Init(relay_output, relay_output_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(relay_input, relay_buf);
+    
+    BReactor_Exec(&reactor);
+    
+    printf("pipelined=%d hash=%d encryption=%d otp=%d aead=%d tamper=%d: %d of %d packets received\n",
+           pipelined, params.hash_mode, params.encryption_mode, params.otp_mode, params.aead_mode, tamper, num_received, NUM_PACKETS);
+    
+    SPProtoDecoder_Free(&decoder);
+    SPProtoEncoder_Free(&encoder);
+    PacketPassInterface_Free(&sink);
+    PacketRecvInterface_Free(&source);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_SPProtoDecoder, BLOG_ERROR);
+    
+    BTime_Init();
+    
+    if (!BSecurity_GlobalInitThreadSafe()) {
+        DEBUG("BSecurity_GlobalInitThreadSafe failed");
+        goto fail0;
+    }
+    
+    struct spproto_security_params configs[] = {
+        {SPPROTO_HASH_MODE_NONE, SPPROTO_ENCRYPTION_MODE_NONE, SPPROTO_OTP_MODE_NONE, 0, SPPROTO_AEAD_MODE_NONE},
+        {BHASH_TYPE_SHA1, SPPROTO_ENCRYPTION_MODE_NONE, SPPROTO_OTP_MODE_NONE, 0, SPPROTO_AEAD_MODE_NONE},
+        {BHASH_TYPE_SHA1, BENCRYPTION_CIPHER_AES, SPPROTO_OTP_MODE_NONE, 0, SPPROTO_AEAD_MODE_NONE},
+        {BHASH_TYPE_MD5, BENCRYPTION_CIPHER_BLOWFISH, BENCRYPTION_CIPHER_AES, OTP_NUM, SPPROTO_AEAD_MODE_NONE},
+        {SPPROTO_HASH_MODE_NONE, SPPROTO_ENCRYPTION_MODE_NONE, SPPROTO_OTP_MODE_NONE, 0, BAEAD_CIPHER_AES_128_GCM},
+        {SPPROTO_HASH_MODE_NONE, SPPROTO_ENCRYPTION_MODE_NONE, BENCRYPTION_CIPHER_AES, OTP_NUM, BAEAD_CIPHER_CHACHA20_POLY1305},
+    };
+    
+    for (int t = 0; t <= 2; t += 2) {
+        for (int i = 0; i < (int)(sizeof(configs) / sizeof(configs[0])); i++) {
+            // packets can be tampered with undetected only without authentication
+            int can_tamper = (SPPROTO_HAVE_HASH(configs[i]) || SPPROTO_HAVE_AEAD(configs[i]));
+            test(t, configs[i], 0);
+            if (can_tamper) {
+                test(t, configs[i], 1);
+            }
+        }
+    }
+    
+    BSecurity_GlobalFreeThreadSafe();
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
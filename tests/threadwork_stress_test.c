@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <threadwork/BThreadWork.h>
+
+// more than fit in the queue of the dispatcher at once
+#define NUM_WORKS (4 * BTHREADWORK_QUEUE_SIZE + 100)
+#define NUM_ROUNDS 50000
+
+struct work {
+    BThreadWork tw;
+    int index;
+    int inited;
+    int ran;
+};
+
+BReactor reactor;
+BThreadWorkDispatcher twd;
+struct work works[NUM_WORKS];
+int num_live;
+int num_started;
+int num_done;
+int num_cancelled;
+
+static void handler_done (void *user);
+
+static void work_func (void *user)
+{
+    struct work *w = user;
+    
+    volatile unsigned int x = 0;
+    for (int i = 0; i < (w->index % 7) * 200; i++) {
+        x++;
+    }
+    
+    __atomic_add_fetch(&w->ran, 1, __ATOMIC_RELAXED);
+}
+
+static void start_work (struct work *w)
+{
+    ASSERT_FORCE(!w->inited)
+    
+    w->inited = 1;
+    w->ran = 0;
+    BThreadWork_Init(&w->tw, &twd, handler_done, w, work_func, w);
+    num_live++;
+    num_started++;
+}
+
+static void free_work (struct work *w)
+{
+    ASSERT_FORCE(w->inited)
+    
+    BThreadWork_Free(&w->tw);
+    w->inited = 0;
+    num_live--;
+    
+    // the work function ran fully or not at all, and won't run any more
+    int ran = __atomic_load_n(&w->ran, __ATOMIC_RELAXED);
+    ASSERT_FORCE(ran == 0 || ran == 1)
+}
+
+static void handler_done (void *user)
+{
+    struct work *w = user;
+    ASSERT_FORCE(w->inited)
+    ASSERT_FORCE(w->ran == 1)
+    
+    num_done++;
+    free_work(w);
+    
+    // cancel a random work, which may be queued, running or finished
+    struct work *c = &works[rand() % NUM_WORKS];
+    if (c->inited) {
+        free_work(c);
+        num_cancelled++;
+    }
+    
+    // start a random work
+    if (num_started < NUM_ROUNDS) {
+        struct work *s = &works[rand() % NUM_WORKS];
+        if (!s->inited) {
+            start_work(s);
+        }
+    }
+    
+    if (num_live == 0) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void test (int num_threads)
+{
+    srand(num_threads);
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    ASSERT_FORCE(BThreadWorkDispatcher_Init(&twd, &reactor, num_threads, 0))
+    
+    num_live = 0;
+    num_started = 0;
+    num_done = 0;
+    num_cancelled = 0;
+    
+    for (int i = 0; i < NUM_WORKS; i++) {
+        works[i].index = i;
+        works[i].inited = 0;
+        start_work(&works[i]);
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    printf("threads=%d: %d works started, %d done, %d cancelled\n", num_threads, num_started, num_done, num_cancelled);
+    ASSERT_FORCE(num_live == 0)
+    ASSERT_FORCE(num_done + num_cancelled == num_started)
+    
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    test(0);
+    test(1);
+    test(4);
+    
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
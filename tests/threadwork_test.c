@@ -55,7 +55,7 @@ int main ()
         goto fail1;
     }
     
-    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 1)) {
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 1, 0)) {
         DEBUG("BThreadWorkDispatcher_Init failed");
         goto fail2;
     }
@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+
+#define NUM_TICKERS 4
+#define NUM_TIMERS 200
+#define MAX_DELAY 2000
+#define MAX_LATENESS 100
+
+struct ticker {
+    BTimer timer;
+    int period;
+};
+
+struct long_timer {
+    BTimer timer;
+    btime_t expected;
+    int fired;
+};
+
+BReactor reactor;
+struct ticker tickers[NUM_TICKERS];
+struct long_timer timers[NUM_TIMERS];
+int num_fired;
+btime_t max_lateness;
+
+static void ticker_handler (void *user)
+{
+    struct ticker *t = user;
+    
+    BReactor_SetTimerAfter(&reactor, &t->timer, t->period);
+}
+
+static void long_timer_handler (void *user)
+{
+    struct long_timer *t = user;
+    ASSERT_FORCE(!t->fired)
+    
+    btime_t now = btime_gettime();
+    ASSERT_FORCE(now >= t->expected)
+    
+    btime_t lateness = now - t->expected;
+    if (lateness > max_lateness) {
+        max_lateness = lateness;
+    }
+    
+    t->fired = 1;
+    num_fired++;
+    
+    if (num_fired == NUM_TIMERS) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    // Timers firing every few milliseconds keep the clock moving, so that it
+    // regularly ends up on block boundaries with first-level timers pending
+    // later in the block.
+    static const int periods[NUM_TICKERS] = {3, 5, 7, 11};
+    for (int i = 0; i < NUM_TICKERS; i++) {
+        tickers[i].period = periods[i];
+        BTimer_Init(&tickers[i].timer, 0, ticker_handler, &tickers[i]);
+        BReactor_SetTimerAfter(&reactor, &tickers[i].timer, periods[i]);
+    }
+    
+    // timers far enough out to start in the higher levels
+    btime_t start = btime_gettime();
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        struct long_timer *t = &timers[i];
+        t->expected = start + 65 + (btime_t)i * (MAX_DELAY - 65) / NUM_TIMERS;
+        t->fired = 0;
+        BTimer_Init(&t->timer, 0, long_timer_handler, t);
+        BReactor_SetTimerAbsolute(&reactor, &t->timer, t->expected);
+    }
+    
+    num_fired = 0;
+    max_lateness = 0;
+    
+    BReactor_Exec(&reactor);
+    
+    printf("%d timers fired, at most %d ms late\n", num_fired, (int)max_lateness);
+    ASSERT_FORCE(num_fired == NUM_TIMERS)
+    ASSERT_FORCE(max_lateness <= MAX_LATENESS)
+    
+    for (int i = 0; i < NUM_TICKERS; i++) {
+        BReactor_RemoveTimer(&reactor, &tickers[i].timer);
+    }
+    
+    BReactor_Free(&reactor);
+    
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
@@ -27,6 +27,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stddef.h>
 
@@ -34,64 +38,179 @@
     #include <unistd.h>
     #include <errno.h>
     #include <fcntl.h>
+    #ifdef BADVPN_LINUX
+        #include <sched.h>
+        #include <sys/eventfd.h>
+    #endif
 #endif
 
 #include <misc/offset.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
-#include <generated/blog_channel_BThreadWork.h>
-
 #include <threadwork/BThreadWork.h>
 
+#include <generated/blog_channel_BThreadWork.h>
+
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 
+// Works are handed to threads through a bounded array queue (Dmitry Vyukov's
+// MPMC queue). Only the event loop enqueues, so the enqueue side needs no
+// atomic read-modify-write; threads compete for works with a CAS on
+// dequeue_pos, and sleep on queue_sem while the queue is empty.
+// Each thread returns finished works through its own ring, which the event
+// loop drains in bulk when woken through wake_fd. A wakeup is only sent if
+// the event loop is not already about to drain.
+//
+// num_queued counts works which have been enqueued but not yet drained from
+// a done ring; keeping it below BTHREADWORK_QUEUE_SIZE means the done rings
+// can never overflow. Works which don't fit wait in waiting_list.
+
+#define QUEUE_MASK (BTHREADWORK_QUEUE_SIZE - 1)
+
+static int enqueue_work (BThreadWorkDispatcher *o, BThreadWork *w)
+{
+    if (o->num_queued == BTHREADWORK_QUEUE_SIZE) {
+        return 0;
+    }
+    
+    size_t pos = o->enqueue_pos;
+    struct BThreadWorkDispatcher_cell *cell = &o->queue[pos & QUEUE_MASK];
+    
+    // the cell may still hold a cancelled work which no thread has picked up yet
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos) {
+        return 0;
+    }
+    
+    w->state = BTHREADWORK_STATE_PENDING;
+    w->queue_index = pos & QUEUE_MASK;
+    
+    __atomic_store_n(&cell->work, w, __ATOMIC_RELAXED);
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    o->enqueue_pos = pos + 1;
+    o->num_queued++;
+    
+    // wake up a thread
+    ASSERT_FORCE(sem_post(&o->queue_sem) == 0)
+    
+    return 1;
+}
+
+static void enqueue_waiting (BThreadWorkDispatcher *o)
+{
+    while (!LinkedList1_IsEmpty(&o->waiting_list)) {
+        BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->waiting_list), BThreadWork, list_node);
+        ASSERT(w->state == BTHREADWORK_STATE_WAITING)
+        
+        if (!enqueue_work(o, w)) {
+            break;
+        }
+        
+        LinkedList1_Remove(&o->waiting_list, &w->list_node);
+    }
+}
+
+static BThreadWork * dequeue_work (BThreadWorkDispatcher *o)
+{
+    size_t pos = __atomic_load_n(&o->dequeue_pos, __ATOMIC_RELAXED);
+    struct BThreadWorkDispatcher_cell *cell;
+    
+    // we got through queue_sem, so there is a cell for us
+    while (1) {
+        cell = &o->queue[pos & QUEUE_MASK];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&o->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else {
+            pos = __atomic_load_n(&o->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    // take the work, unless BThreadWork_Free took it back
+    BThreadWork *w = __atomic_exchange_n(&cell->work, NULL, __ATOMIC_ACQ_REL);
+    
+    // release the cell for enqueuing
+    __atomic_store_n(&cell->seq, pos + BTHREADWORK_QUEUE_SIZE, __ATOMIC_RELEASE);
+    
+    return w;
+}
+
+static void wake_event_loop (BThreadWorkDispatcher *o)
+{
+    if (__atomic_exchange_n(&o->signalled, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+#ifdef BADVPN_LINUX
+    uint64_t b = 1;
+#else
+    uint8_t b = 0;
+#endif
+    int res = write(o->wake_fd[1], &b, sizeof(b));
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+}
+
 static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
 {
     BThreadWorkDispatcher *o = t->d;
     
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
+#ifdef BADVPN_LINUX
+    if (t->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            BLog(BLOG_ERROR, "thread %d: sched_setaffinity failed", t->index);
+        } else {
+            BLog(BLOG_INFO, "thread %d bound to CPU %d", t->index, t->cpu);
+        }
+    }
+#endif
     
     while (1) {
+        // wait for work
+        while (sem_wait(&o->queue_sem) < 0) {
+            ASSERT_FORCE(errno == EINTR)
+        }
+        
         // exit if requested
-        if (o->cancel) {
+        if (__atomic_load_n(&o->cancel, __ATOMIC_ACQUIRE)) {
             break;
         }
         
-        if (LinkedList1_IsEmpty(&o->pending_list)) {
-            // wait for event
-            ASSERT_FORCE(pthread_cond_wait(&t->new_cond, &o->mutex) == 0)
+        // grab the work
+        BThreadWork *w = dequeue_work(o);
+        if (!w) {
+            // it was cancelled; the event loop may have works waiting for its cell
+            wake_event_loop(o);
             continue;
         }
-        
-        // grab the work
-        BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->pending_list), BThreadWork, list_node);
-        ASSERT(w->state == BTHREADWORK_STATE_PENDING)
-        LinkedList1_Remove(&o->pending_list, &w->list_node);
-        t->running_work = w;
-        w->state = BTHREADWORK_STATE_RUNNING;
+        __atomic_store_n(&w->state, BTHREADWORK_STATE_RUNNING, __ATOMIC_RELAXED);
         
         // do the work
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         w->work_func(w->work_func_user);
-        ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
         
-        // release the work
-        t->running_work = NULL;
-        LinkedList1_Append(&o->finished_list, &w->list_node);
-        w->state = BTHREADWORK_STATE_FINISHED;
+        // put the work to our done ring
+        size_t tail = t->done_tail;
+        t->done_ring[tail & QUEUE_MASK] = w;
+        w->done_thread = t->index;
+        w->done_index = tail & QUEUE_MASK;
+        __atomic_store_n(&w->state, BTHREADWORK_STATE_FINISHED, __ATOMIC_RELEASE);
         ASSERT_FORCE(sem_post(&w->finished_sem) == 0)
         
-        // write to pipe
-        uint8_t b = 0;
-        int res = write(o->pipe[1], &b, sizeof(b));
-        if (res < 0) {
-            int error = errno;
-            ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
-        }
+        // publish it; after this, the work may be freed at any time
+        __atomic_store_n(&t->done_tail, tail + 1, __ATOMIC_RELEASE);
+        
+        wake_event_loop(o);
     }
     
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
-    
     return NULL;
 }
 
@@ -99,18 +218,14 @@ static void dispatch_job (BThreadWorkDispatcher *o)
 {
     ASSERT(o->num_threads > 0)
     
-    // lock
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-    
     // check for finished job
     if (LinkedList1_IsEmpty(&o->finished_list)) {
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         return;
     }
     
     // grab finished job
     BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->finished_list), BThreadWork, list_node);
-    ASSERT(w->state == BTHREADWORK_STATE_FINISHED)
+    ASSERT(w->state == BTHREADWORK_STATE_COLLECTED)
     LinkedList1_Remove(&o->finished_list, &w->list_node);
     
     // schedule more
@@ -121,22 +236,19 @@ static void dispatch_job (BThreadWorkDispatcher *o)
     // set state forgotten
     w->state = BTHREADWORK_STATE_FORGOTTEN;
     
-    // unlock
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
-    
     // call handler
     w->handler_done(w->user);
     return;
 }
 
-static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
+static void wake_fd_handler (BThreadWorkDispatcher *o, int events)
 {
     ASSERT(o->num_threads > 0)
     DebugObject_Access(&o->d_obj);
     
-    // read data from pipe
+    // consume wakeup
     uint8_t b[64];
-    int res = read(o->pipe[0], b, sizeof(b));
+    int res = read(o->wake_fd[0], b, sizeof(b));
     if (res < 0) {
         int error = errno;
         ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
@@ -144,6 +256,33 @@ static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
         ASSERT(res > 0)
     }
     
+    // allow threads to wake us again before we look at the done rings,
+    // so that no finished work is missed
+    __atomic_store_n(&o->signalled, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    // collect finished works from all threads
+    for (int i = 0; i < o->num_threads; i++) {
+        struct BThreadWorkDispatcher_thread *t = &o->threads[i];
+        size_t tail = __atomic_load_n(&t->done_tail, __ATOMIC_ACQUIRE);
+        
+        while (t->done_head != tail) {
+            BThreadWork *w = t->done_ring[t->done_head & QUEUE_MASK];
+            t->done_head++;
+            o->num_queued--;
+            
+            // entry is cleared if the work was freed before we got to it
+            if (w) {
+                ASSERT(w->state == BTHREADWORK_STATE_FINISHED)
+                w->state = BTHREADWORK_STATE_COLLECTED;
+                LinkedList1_Append(&o->finished_list, &w->list_node);
+            }
+        }
+    }
+    
+    // queue works which didn't fit before
+    enqueue_waiting(o);
+    
     dispatch_job(o);
     return;
 }
@@ -157,24 +296,67 @@ static void more_job_handler (BThreadWorkDispatcher *o)
     return;
 }
 
+static void assign_cpus (BThreadWorkDispatcher *o, int num_threads, int pin_cpus)
+{
+    for (int i = 0; i < num_threads; i++) {
+        o->threads[i].cpu = -1;
+    }
+    
+    if (!pin_cpus) {
+        return;
+    }
+    
+#ifdef BADVPN_LINUX
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        BLog(BLOG_ERROR, "sched_getaffinity failed");
+        return;
+    }
+    
+    int num_cpus = CPU_COUNT(&allowed);
+    if (num_cpus <= 0) {
+        return;
+    }
+    
+    // leave the first CPU to the event loop if there are enough
+    int skip = (num_cpus > num_threads);
+    
+    int i = 0;
+    while (i < num_threads) {
+        int n = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && i < num_threads; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed)) {
+                continue;
+            }
+            if (n++ < skip) {
+                continue;
+            }
+            o->threads[i++].cpu = cpu;
+        }
+    }
+#else
+    BLog(BLOG_WARNING, "binding threads to CPUs is not supported on this system");
+#endif
+}
+
 static void stop_threads (BThreadWorkDispatcher *o)
 {
     // set cancelling
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-    o->cancel = 1;
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    __atomic_store_n(&o->cancel, 1, __ATOMIC_RELEASE);
+    
+    // wake up all threads
+    for (int i = 0; i < o->num_threads; i++) {
+        ASSERT_FORCE(sem_post(&o->queue_sem) == 0)
+    }
     
     while (o->num_threads > 0) {
         struct BThreadWorkDispatcher_thread *t = &o->threads[o->num_threads - 1];
         
-        // wake up thread
-        ASSERT_FORCE(pthread_cond_signal(&t->new_cond) == 0)
-        
         // wait for thread to exit
         ASSERT_FORCE(pthread_join(t->thread, NULL) == 0)
         
-        // free condition variable
-        ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
+        // free done ring
+        BFree(t->done_ring);
         
         o->num_threads--;
     }
@@ -197,7 +379,7 @@ static void work_job_handler (BThreadWork *o)
     return;
 }
 
-int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint)
+int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint, int pin_cpus)
 {
     // init arguments
     o->reactor = reactor;
@@ -212,41 +394,63 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     
     if (num_threads_hint > 0) {
-        // init pending list
-        LinkedList1_Init(&o->pending_list);
+        // init queue
+        if (!(o->queue = BAllocArray(BTHREADWORK_QUEUE_SIZE, sizeof(o->queue[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail0;
+        }
+        for (size_t i = 0; i < BTHREADWORK_QUEUE_SIZE; i++) {
+            o->queue[i].seq = i;
+            o->queue[i].work = NULL;
+        }
+        o->enqueue_pos = 0;
+        o->dequeue_pos = 0;
+        o->num_queued = 0;
+        
+        // init queue semaphore
+        if (sem_init(&o->queue_sem, 0, 0) < 0) {
+            BLog(BLOG_ERROR, "sem_init failed");
+            goto fail1;
+        }
+        
+        // init waiting list
+        LinkedList1_Init(&o->waiting_list);
         
         // init finished list
         LinkedList1_Init(&o->finished_list);
         
-        // init mutex
-        if (pthread_mutex_init(&o->mutex, NULL) != 0) {
-            BLog(BLOG_ERROR, "pthread_mutex_init failed");
-            goto fail0;
+        // init wakeup fd
+#ifdef BADVPN_LINUX
+        if ((o->wake_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+            BLog(BLOG_ERROR, "eventfd failed");
+            goto fail2;
         }
-        
-        // init pipe
-        if (pipe(o->pipe) < 0) {
+        o->wake_fd[1] = o->wake_fd[0];
+#else
+        if (pipe(o->wake_fd) < 0) {
             BLog(BLOG_ERROR, "pipe failed");
-            goto fail1;
+            goto fail2;
         }
         
         // set read end non-blocking
-        if (fcntl(o->pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+        if (fcntl(o->wake_fd[0], F_SETFL, O_NONBLOCK) < 0) {
             BLog(BLOG_ERROR, "fcntl failed");
-            goto fail2;
+            goto fail3;
         }
         
         // set write end non-blocking
-        if (fcntl(o->pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+        if (fcntl(o->wake_fd[1], F_SETFL, O_NONBLOCK) < 0) {
             BLog(BLOG_ERROR, "fcntl failed");
-            goto fail2;
+            goto fail3;
         }
+#endif
+        o->signalled = 0;
         
         // init BFileDescriptor
-        BFileDescriptor_Init(&o->bfd, o->pipe[0], (BFileDescriptor_handler)pipe_fd_handler, o);
+        BFileDescriptor_Init(&o->bfd, o->wake_fd[0], (BFileDescriptor_handler)wake_fd_handler, o);
         if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
             BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
-            goto fail2;
+            goto fail3;
         }
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
         
@@ -256,30 +460,33 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
         // set not cancelling
         o->cancel = 0;
         
+        // choose CPUs for threads
+        assign_cpus(o, num_threads_hint, pin_cpus);
+        
         // init threads
         o->num_threads = 0;
         for (int i = 0; i < num_threads_hint; i++) {
             struct BThreadWorkDispatcher_thread *t = &o->threads[i];
             
-            // set parent pointer
+            // set parent pointer and index
             t->d = o;
+            t->index = i;
             
-            // set no running work
-            t->running_work = NULL;
-            
-            // init condition variable
-            if (pthread_cond_init(&t->new_cond, NULL) != 0) {
-                BLog(BLOG_ERROR, "pthread_cond_init failed");
-                goto fail3;
+            // init done ring
+            if (!(t->done_ring = BAllocArray(BTHREADWORK_QUEUE_SIZE, sizeof(t->done_ring[0])))) {
+                BLog(BLOG_ERROR, "BAllocArray failed");
+                goto fail4;
             }
+            t->done_tail = 0;
+            t->done_head = 0;
             
             // init thread
             if (pthread_create(&t->thread, NULL, (void * (*) (void *))dispatcher_thread, t) != 0) {
                 BLog(BLOG_ERROR, "pthread_create failed");
-                ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
-                goto fail3;
+                BFree(t->done_ring);
+                goto fail4;
             }
-        
+            
             o->num_threads++;
         }
     }
@@ -291,15 +498,19 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     return 1;
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-fail3:
+fail4:
     stop_threads(o);
     BPending_Free(&o->more_job);
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+fail3:
+    ASSERT_FORCE(close(o->wake_fd[0]) == 0)
+    if (o->wake_fd[1] != o->wake_fd[0]) {
+        ASSERT_FORCE(close(o->wake_fd[1]) == 0)
+    }
 fail2:
-    ASSERT_FORCE(close(o->pipe[0]) == 0)
-    ASSERT_FORCE(close(o->pipe[1]) == 0)
+    ASSERT_FORCE(sem_destroy(&o->queue_sem) == 0)
 fail1:
-    ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+    BFree(o->queue);
 fail0:
     return 0;
     #endif
@@ -309,8 +520,7 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
 {
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (o->num_threads > 0) {
-        ASSERT(LinkedList1_IsEmpty(&o->pending_list))
-        for (int i = 0; i < o->num_threads; i++) { ASSERT(!o->threads[i].running_work) }
+        ASSERT(LinkedList1_IsEmpty(&o->waiting_list))
         ASSERT(LinkedList1_IsEmpty(&o->finished_list))
     }
     #endif
@@ -329,12 +539,17 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
         // free BFileDescriptor
         BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
         
-        // free pipe
-        ASSERT_FORCE(close(o->pipe[0]) == 0)
-        ASSERT_FORCE(close(o->pipe[1]) == 0)
+        // free wakeup fd
+        ASSERT_FORCE(close(o->wake_fd[0]) == 0)
+        if (o->wake_fd[1] != o->wake_fd[0]) {
+            ASSERT_FORCE(close(o->wake_fd[1]) == 0)
+        }
+        
+        // free queue semaphore
+        ASSERT_FORCE(sem_destroy(&o->queue_sem) == 0)
         
-        // free mutex
-        ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+        // free queue
+        BFree(o->queue);
     }
     
     #endif
@@ -362,22 +577,14 @@ void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_han
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (d->num_threads > 0) {
-        // set state
-        o->state = BTHREADWORK_STATE_PENDING;
-        
         // init finished semaphore
         ASSERT_FORCE(sem_init(&o->finished_sem, 0, 0) == 0)
         
-        // post work
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        LinkedList1_Append(&d->pending_list, &o->list_node);
-        for (int i = 0; i < d->num_threads; i++) {
-            if (!d->threads[i].running_work) {
-                ASSERT_FORCE(pthread_cond_signal(&d->threads[i].new_cond) == 0)
-                break;
-            }
+        // hand the work to threads, or wait if the queue is full
+        if (!LinkedList1_IsEmpty(&d->waiting_list) || !enqueue_work(d, o)) {
+            o->state = BTHREADWORK_STATE_WAITING;
+            LinkedList1_Append(&d->waiting_list, &o->list_node);
         }
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
     } else {
     #endif
         // schedule job
@@ -399,31 +606,15 @@ void BThreadWork_Free (BThreadWork *o)
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (d->num_threads > 0) {
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        
-        switch (o->state) {
-            case BTHREADWORK_STATE_PENDING: {
-                BLog(BLOG_DEBUG, "remove pending work");
+        switch (__atomic_load_n(&o->state, __ATOMIC_ACQUIRE)) {
+            case BTHREADWORK_STATE_WAITING: {
+                BLog(BLOG_DEBUG, "remove waiting work");
                 
-                // remove from pending list
-                LinkedList1_Remove(&d->pending_list, &o->list_node);
+                // remove from waiting list
+                LinkedList1_Remove(&d->waiting_list, &o->list_node);
             } break;
             
-            case BTHREADWORK_STATE_RUNNING: {
-                BLog(BLOG_DEBUG, "remove running work");
-                
-                // wait for the work to finish running
-                ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-                ASSERT_FORCE(sem_wait(&o->finished_sem) == 0)
-                ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-                
-                ASSERT(o->state == BTHREADWORK_STATE_FINISHED)
-                
-                // remove from finished list
-                LinkedList1_Remove(&d->finished_list, &o->list_node);
-            } break;
-            
-            case BTHREADWORK_STATE_FINISHED: {
+            case BTHREADWORK_STATE_COLLECTED: {
                 BLog(BLOG_DEBUG, "remove finished work");
                 
                 // remove from finished list
@@ -434,12 +625,28 @@ void BThreadWork_Free (BThreadWork *o)
                 BLog(BLOG_DEBUG, "remove forgotten work");
             } break;
             
-            default:
-                ASSERT(0);
+            default: {
+                // the work is queued to threads; try to take it back from the queue
+                BThreadWork *expected = o;
+                if (__atomic_compare_exchange_n(&d->queue[o->queue_index].work, &expected, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    BLog(BLOG_DEBUG, "remove pending work");
+                    d->num_queued--;
+                    break;
+                }
+                
+                BLog(BLOG_DEBUG, "remove running or finished work");
+                
+                // a thread has it; wait for it to finish running
+                while (sem_wait(&o->finished_sem) < 0) {
+                    ASSERT_FORCE(errno == EINTR)
+                }
+                ASSERT(__atomic_load_n(&o->state, __ATOMIC_ACQUIRE) == BTHREADWORK_STATE_FINISHED)
+                
+                // remove from done ring
+                d->threads[o->done_thread].done_ring[o->done_index] = NULL;
+            } break;
         }
         
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-        
         // free finished semaphore
         ASSERT_FORCE(sem_destroy(&o->finished_sem) == 0)
     } else {
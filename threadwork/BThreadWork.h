@@ -49,9 +49,15 @@
 #define BTHREADWORK_STATE_RUNNING 2
 #define BTHREADWORK_STATE_FINISHED 3
 #define BTHREADWORK_STATE_FORGOTTEN 4
+#define BTHREADWORK_STATE_COLLECTED 5
+#define BTHREADWORK_STATE_WAITING 6
 
 #define BTHREADWORK_MAX_THREADS 8
 
+// maximum number of works handed to threads at once, power of two;
+// further works wait in the event loop until some complete
+#define BTHREADWORK_QUEUE_SIZE 1024
+
 struct BThreadWork_s;
 struct BThreadWorkDispatcher_s;
 
@@ -71,21 +77,34 @@ typedef void (*BThreadWork_work_func) (void *user);
 typedef void (*BThreadWork_handler_done) (void *user);
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
+struct BThreadWorkDispatcher_cell {
+    size_t seq;
+    struct BThreadWork_s *work;
+};
+
 struct BThreadWorkDispatcher_thread {
     struct BThreadWorkDispatcher_s *d;
-    struct BThreadWork_s *running_work;
-    pthread_cond_t new_cond;
+    int index;
+    int cpu;
     pthread_t thread;
+    struct BThreadWork_s **done_ring;
+    size_t done_tail;
+    size_t done_head;
 };
 #endif
 
 typedef struct BThreadWorkDispatcher_s {
     BReactor *reactor;
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    LinkedList1 pending_list;
+    struct BThreadWorkDispatcher_cell *queue;
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+    sem_t queue_sem;
+    int num_queued;
+    LinkedList1 waiting_list;
     LinkedList1 finished_list;
-    pthread_mutex_t mutex;
-    int pipe[2];
+    int wake_fd[2];
+    int signalled;
     BFileDescriptor bfd;
     BPending more_job;
     int cancel;
@@ -107,6 +126,9 @@ typedef struct BThreadWork_s {
         struct {
             LinkedList1Node list_node;
             int state;
+            size_t queue_index;
+            size_t done_index;
+            int done_thread;
             sem_t finished_sem;
         };
         #endif
@@ -127,9 +149,12 @@ typedef struct BThreadWork_s {
  *                         <0 - A choice will be made automatically, probably based on the number of CPUs.
  *                         0 - No additional threads will be used, and computations will be performed directly
  *                             in the event loop in job handlers.
+ * @param pin_cpus whether to bind each thread to its own CPU. The first CPU available to the
+ *                 process is left to the event loop, unless there are fewer CPUs than threads.
+ *                 Only supported on Linux; ignored elsewhere.
  * @return 1 on success, 0 on failure
  */
-int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint) WARN_UNUSED;
+int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint, int pin_cpus) WARN_UNUSED;
 
 /**
  * Frees the work dispatcher.
@@ -48,12 +48,13 @@
 #include <misc/ipaddr6.h>
 #include <misc/concat_strings.h>
 #include <structure/LinkedList1.h>
+#include <structure/BlockPool.h>
 #include <base/BLog.h>
 #include <system/BReactor.h>
 #include <system/BSignal.h>
 #include <system/BAddr.h>
 #include <system/BNetwork.h>
-#include <flow/SinglePacketBuffer.h>
+#include <flow/PacketRecvInterface.h>
 #include <socksclient/BSocksClient.h>
 #include <tuntap/BTap.h>
 #include <lwip/init.h>
@@ -63,6 +64,7 @@
 #include <lwip/tcp.h>
 #include <lwip/ip4_frag.h>
 #include <lwip/nd6.h>
+#include <lwip/pbuf.h>
 #include <lwip/ip6_frag.h>
 #include <tun2socks/SocksUdpGwClient.h>
 #include <socks_udp_client/SocksUdpClient.h>
@@ -71,6 +73,10 @@
 #include <base/BLog_syslog.h>
 #endif
 
+#ifdef BADVPN_LINUX
+#include <system/BWorkerProcesses.h>
+#endif
+
 #include <tun2socks/tun2socks.h>
 
 #include <generated/blog_channel_tun2socks.h>
@@ -104,6 +110,9 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     char *tundev;
+    int tundev_multi_queue;
+    int tundev_gso;
+    int workers;
     char *netif_ipaddr;
     char *netif_netmask;
     char *netif_ip6addr;
@@ -128,7 +137,7 @@ struct tcp_client {
     BAddr remote_addr;
     struct tcp_pcb *pcb;
     int client_closed;
-    uint8_t buf[TCP_WND];
+    uint8_t *buf;
     int buf_used;
     char *socks_username;
     BSocksClient socks_client;
@@ -136,11 +145,17 @@ struct tcp_client {
     int socks_closed;
     StreamPassInterface *socks_send_if;
     StreamRecvInterface *socks_recv_if;
-    uint8_t socks_recv_buf[CLIENT_SOCKS_RECV_BUF_SIZE];
+    uint8_t *socks_recv_buf;
+    uint8_t socks_recv_idle_buf[CLIENT_SOCKS_RECV_IDLE_BUF_SIZE];
+    int socks_recv_buf_start;
     int socks_recv_buf_used;
-    int socks_recv_buf_sent;
-    int socks_recv_waiting;
+    int socks_recv_receiving;
+    int socks_recv_into_idle;
+    int socks_recv_len;
+    int socks_recv_short;
     int socks_recv_tcp_pending;
+    int lingering;
+    int dealloced;
 };
 
 // IP address of netif
@@ -165,6 +180,14 @@ size_t socks_num_auth_info;
 // remote udpgw server addr, if provided
 BAddr udpgw_remote_server_addr;
 
+// index of this worker process, 0 in the main process
+int worker_index;
+
+#ifdef BADVPN_LINUX
+// worker processes
+BWorkerProcesses workers;
+#endif
+
 // reactor
 BReactor ss;
 
@@ -177,9 +200,15 @@ BTap device;
 // device write buffer
 uint8_t *device_write_buf;
 
+// device reading buffer, which is lent to lwIP as a custom pbuf
+// after a packet is received into it
+struct device_read_buf {
+    struct pbuf_custom pc;
+};
+
 // device reading
-SinglePacketBuffer device_read_buffer;
-PacketPassInterface device_read_interface;
+BlockPool device_read_buf_pool;
+struct device_read_buf *device_read_buf;
 
 // UDP support mode
 enum UdpMode {UdpModeNone, UdpModeUdpgw, UdpModeSocks};
@@ -215,17 +244,29 @@ LinkedList1 tcp_clients;
 // number of clients
 int num_clients;
 
+// pools for client entries and their buffers; buffers are only
+// held while there is data in them
+BlockPool client_pool;
+BlockPool client_buf_pool;
+BlockPool client_socks_recv_buf_pool;
+
 static void terminate (void);
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
+#ifdef BADVPN_LINUX
+static void workers_handler (void *unused, int index);
+#endif
 static void signal_handler (void *unused);
 static BAddr baddr_from_lwip (const ip_addr_t *ip_addr, uint16_t port_hostorder);
 static void lwip_init_job_hadler (void *unused);
 static void tcp_timer_handler (void *unused);
 static void device_error_handler (void *unused);
-static void device_read_handler_send (void *unused, uint8_t *data, int data_len);
+static void device_read_buf_pbuf_free (struct pbuf *p);
+static uint8_t * device_read_buf_data (struct device_read_buf *b);
+static void device_read_handler_done (void *unused, int data_len);
+static void device_read_input (struct device_read_buf *b, int data_len);
 static int process_device_udp_packet (uint8_t *data, int data_len);
 static err_t netif_init_func (struct netif *netif);
 static err_t netif_output_func (struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr);
@@ -247,10 +288,14 @@ static err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
 static void client_socks_handler (struct tcp_client *client, int event);
 static void client_send_to_socks (struct tcp_client *client);
 static void client_socks_send_handler_done (struct tcp_client *client, int data_len);
+static void client_socks_recv_release_buf (struct tcp_client *client);
 static void client_socks_recv_initiate (struct tcp_client *client);
 static void client_socks_recv_handler_done (struct tcp_client *client, int data_len);
 static int client_socks_recv_send_out (struct tcp_client *client);
 static err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len);
+static void client_linger_done (struct tcp_client *client);
+static void client_linger_err_func (void *arg, err_t err);
+static err_t client_linger_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len);
 static void udp_send_packet_to_device (void *unused, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
 int main (int argc, char **argv)
@@ -324,13 +369,22 @@ int main (int argc, char **argv)
         goto fail1;
     }
     
+    #ifdef BADVPN_LINUX
+    // fork worker processes; everything from here on is done in each of them
+    if (!BWorkerProcesses_Init(&workers, options.workers)) {
+        BLog(BLOG_ERROR, "BWorkerProcesses_Init failed");
+        goto fail1;
+    }
+    worker_index = BWorkerProcesses_GetIndex(&workers);
+    #endif
+    
     // init time
     BTime_Init();
     
     // init reactor
     if (!BReactor_Init(&ss)) {
         BLog(BLOG_ERROR, "BReactor_Init failed");
-        goto fail1;
+        goto fail2;
     }
     
     // set not quitting
@@ -339,13 +393,27 @@ int main (int argc, char **argv)
     // setup signal handler
     if (!BSignal_Init(&ss, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
-        goto fail2;
+        goto fail3;
     }
     
+    #ifdef BADVPN_LINUX
+    // watch for workers exiting
+    if (!BWorkerProcesses_Watch(&workers, &ss, workers_handler, NULL)) {
+        BLog(BLOG_ERROR, "BWorkerProcesses_Watch failed");
+        goto fail4;
+    }
+    #endif
+    
     // init TUN device
-    if (!BTap_Init(&device, &ss, options.tundev, device_error_handler, NULL, 1)) {
-        BLog(BLOG_ERROR, "BTap_Init failed");
-        goto fail3;
+    struct BTap_init_data init_data;
+    init_data.dev_type = BTAP_DEV_TUN;
+    init_data.init_type = BTAP_INIT_STRING;
+    init_data.init.string = options.tundev;
+    init_data.flags = (options.tundev_multi_queue ? BTAP_FLAG_MULTI_QUEUE : 0) |
+                      (options.tundev_gso ? BTAP_FLAG_VNET_HDR : 0);
+    if (!BTap_Init2(&device, &ss, init_data, device_error_handler, NULL)) {
+        BLog(BLOG_ERROR, "BTap_Init2 failed");
+        goto fail4;
     }
     
     // NOTE: the order of the following is important:
@@ -354,11 +422,13 @@ int main (int argc, char **argv)
     // then device reading (so it can pass received packets to lwip).
     
     // init device reading
-    PacketPassInterface_Init(&device_read_interface, BTap_GetMTU(&device), device_read_handler_send, NULL, BReactor_PendingGroup(&ss));
-    if (!SinglePacketBuffer_Init(&device_read_buffer, BTap_GetOutput(&device), &device_read_interface, BReactor_PendingGroup(&ss))) {
-        BLog(BLOG_ERROR, "SinglePacketBuffer_Init failed");
-        goto fail4;
+    BlockPool_Init(&device_read_buf_pool, sizeof(struct device_read_buf) + BTap_GetMTU(&device), DEVICE_READ_MAX_FREE_BUFS);
+    if (!(device_read_buf = (struct device_read_buf *)BlockPool_Get(&device_read_buf_pool))) {
+        BLog(BLOG_ERROR, "BlockPool_Get failed");
+        goto fail5;
     }
+    PacketRecvInterface_Receiver_Init(BTap_GetOutput(&device), device_read_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(BTap_GetOutput(&device), device_read_buf_data(device_read_buf));
     
     // Compute the largest possible UDP payload that we can receive from or send to the
     // TUN device.
@@ -372,15 +442,15 @@ int main (int argc, char **argv)
     if (udp_mtu < 0) {
         udp_mtu = 0;
     }
-
+    
     if (options.udpgw_remote_server_addr) {
         udp_mode = UdpModeUdpgw;
-
+        
         // make sure our UDP payloads aren't too large for udpgw
         int udpgw_mtu = udpgw_compute_mtu(udp_mtu);
         if (udpgw_mtu < 0 || udpgw_mtu > PACKETPROTO_MAXPAYLOAD) {
             BLog(BLOG_ERROR, "device MTU is too large for UDP");
-            goto fail4a;
+            goto fail5;
         }
         
         // init udpgw client
@@ -390,11 +460,11 @@ int main (int argc, char **argv)
             UDPGW_RECONNECT_TIME, &ss, NULL, udp_send_packet_to_device))
         {
             BLog(BLOG_ERROR, "SocksUdpGwClient_Init failed");
-            goto fail4a;
+            goto fail5;
         }
     } else if (options.socks5_udp) {
         udp_mode = UdpModeSocks;
-
+        
         // init SOCKS UDP client
         SocksUdpClient_Init(&socks_udp_client, udp_mtu, DEFAULT_UDPGW_MAX_CONNECTIONS,
             SOCKS_UDP_SEND_BUFFER_PACKETS, UDPGW_KEEPALIVE_TIME, socks_server_addr,
@@ -410,7 +480,7 @@ int main (int argc, char **argv)
     // init device write buffer
     if (!(device_write_buf = (uint8_t *)BAlloc(BTap_GetMTU(&device)))) {
         BLog(BLOG_ERROR, "BAlloc failed");
-        goto fail5;
+        goto fail6;
     }
     
     // init TCP timer
@@ -432,6 +502,11 @@ int main (int argc, char **argv)
     // init number of clients
     num_clients = 0;
     
+    // init client pools
+    BlockPool_Init(&client_pool, sizeof(struct tcp_client), CLIENT_POOL_MAX_FREE);
+    BlockPool_Init(&client_buf_pool, TCP_WND, CLIENT_POOL_MAX_FREE);
+    BlockPool_Init(&client_socks_recv_buf_pool, CLIENT_SOCKS_RECV_BUF_SIZE, CLIENT_POOL_MAX_FREE);
+    
     // enter event loop
     BLog(BLOG_NOTICE, "entering event loop");
     BReactor_Exec(&ss);
@@ -443,6 +518,11 @@ int main (int argc, char **argv)
         client_murder(client);
     }
     
+    // free client pools
+    BlockPool_Free(&client_socks_recv_buf_pool);
+    BlockPool_Free(&client_buf_pool);
+    BlockPool_Free(&client_pool);
+    
     // free listener
     if (listener_ip6) {
         tcp_close(listener_ip6);
@@ -458,22 +538,30 @@ int main (int argc, char **argv)
     
     BReactor_RemoveTimer(&ss, &tcp_timer);
     BFree(device_write_buf);
-fail5:
+fail6:
     BPending_Free(&lwip_init_job);
     if (udp_mode == UdpModeUdpgw) {
         SocksUdpGwClient_Free(&udpgw_client);
     } else if (udp_mode == UdpModeSocks) {
         SocksUdpClient_Free(&socks_udp_client);
     }
-fail4a:
-    SinglePacketBuffer_Free(&device_read_buffer);
-fail4:
-    PacketPassInterface_Free(&device_read_interface);
+fail5:
     BTap_Free(&device);
-fail3:
+    if (device_read_buf) {
+        BlockPool_Put(&device_read_buf_pool, device_read_buf);
+    }
+    BlockPool_Free(&device_read_buf_pool);
+fail4:
+    #ifdef BADVPN_LINUX
+    BWorkerProcesses_Unwatch(&workers);
+    #endif
     BSignal_Finish();
-fail2:
+fail3:
     BReactor_Free(&ss);
+fail2:
+    #ifdef BADVPN_LINUX
+    BWorkerProcesses_Free(&workers);
+    #endif
 fail1:
     BFree(password_file_contents);
     BLog(BLOG_NOTICE, "exiting");
@@ -514,6 +602,11 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--tundev <name>]\n"
+        #ifdef BADVPN_LINUX
+        "        [--tundev-multi-queue]\n"
+        "        [--tundev-gso]\n"
+        "        [--workers <number>]\n"
+        #endif
         "        --netif-ipaddr <ipaddr>\n"
         "        --netif-netmask <ipnetmask>\n"
         "        --socks-server-addr <addr>\n"
@@ -555,6 +648,9 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.tundev = NULL;
+    options.tundev_multi_queue = 0;
+    options.tundev_gso = 0;
+    options.workers = 1;
     options.netif_ipaddr = NULL;
     options.netif_netmask = NULL;
     options.netif_ip6addr = NULL;
@@ -653,6 +749,25 @@ int parse_arguments (int argc, char *argv[])
             options.tundev = argv[i + 1];
             i++;
         }
+        #ifdef BADVPN_LINUX
+        else if (!strcmp(arg, "--tundev-multi-queue")) {
+            options.tundev_multi_queue = 1;
+        }
+        else if (!strcmp(arg, "--tundev-gso")) {
+            options.tundev_gso = 1;
+        }
+        else if (!strcmp(arg, "--workers")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.workers = atoi(argv[i + 1])) <= 0 || options.workers > TUN2SOCKS_MAX_WORKERS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else if (!strcmp(arg, "--netif-ipaddr")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -773,6 +888,16 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (options.workers > 1) {
+        if (!options.tundev) {
+            fprintf(stderr, "--workers requires --tundev\n");
+            return 0;
+        }
+        
+        // each worker attaches its own queue of the device
+        options.tundev_multi_queue = 1;
+    }
+    
     if (options.username) {
         if (!options.password && !options.password_file) {
             fprintf(stderr, "username given but password not given\n");
@@ -862,6 +987,19 @@ int process_arguments (void)
     return 1;
 }
 
+#ifdef BADVPN_LINUX
+
+void workers_handler (void *unused, int index)
+{
+    // Its share of the flows is no longer served, so rather than keep
+    // running partially, exit and stop the other workers.
+    if (!quitting) {
+        terminate();
+    }
+}
+
+#endif
+
 void signal_handler (void *unused)
 {
     ASSERT(!quitting)
@@ -1038,34 +1176,65 @@ void device_error_handler (void *unused)
     return;
 }
 
-void device_read_handler_send (void *unused, uint8_t *data, int data_len)
+void device_read_buf_pbuf_free (struct pbuf *p)
+{
+    struct device_read_buf *b = UPPER_OBJECT((struct pbuf_custom *)p, struct device_read_buf, pc);
+    
+    // lwIP is done with the packet
+    BlockPool_Put(&device_read_buf_pool, b);
+}
+
+uint8_t * device_read_buf_data (struct device_read_buf *b)
+{
+    return (uint8_t *)(b + 1);
+}
+
+void device_read_handler_done (void *unused, int data_len)
 {
     ASSERT(!quitting)
     ASSERT(data_len >= 0)
     
     BLog(BLOG_DEBUG, "device: received packet");
     
-    // accept packet
-    PacketPassInterface_Done(&device_read_interface);
-    
-    // process UDP directly
-    if (process_device_udp_packet(data, data_len)) {
-        return;
+    // process UDP directly, else pass to lwIP
+    if (!process_device_udp_packet(device_read_buf_data(device_read_buf), data_len)) {
+        device_read_input(device_read_buf, data_len);
     }
     
-    // obtain pbuf
+    // receive next packet
+    PacketRecvInterface_Receiver_Recv(BTap_GetOutput(&device), device_read_buf_data(device_read_buf));
+}
+
+void device_read_input (struct device_read_buf *b, int data_len)
+{
+    ASSERT(b == device_read_buf)
+    ASSERT(data_len >= 0)
+    
     if (data_len > UINT16_MAX) {
         BLog(BLOG_WARNING, "device read: packet too large");
         return;
     }
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
-    if (!p) {
-        BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
-        return;
-    }
     
-    // write packet to pbuf
-    ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
+    struct pbuf *p;
+    
+    // Hand the buffer itself to lwIP if we can get another one to receive
+    // into; it will come back via device_read_buf_pbuf_free when lwIP
+    // frees the pbuf, which may be much later if lwIP queues the segment.
+    struct device_read_buf *next = (struct device_read_buf *)BlockPool_Get(&device_read_buf_pool);
+    if (next) {
+        b->pc.custom_free_function = device_read_buf_pbuf_free;
+        p = pbuf_alloced_custom(PBUF_RAW, data_len, PBUF_REF, &b->pc, device_read_buf_data(b), data_len);
+        ASSERT(p)
+        device_read_buf = next;
+    } else {
+        // out of memory for buffers, copy the packet
+        p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
+        if (!p) {
+            BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
+            return;
+        }
+        ASSERT_FORCE(pbuf_take(p, device_read_buf_data(b), data_len) == ERR_OK)
+    }
     
     // pass pbuf to input
     if (the_netif.input(p, &the_netif) != ERR_OK) {
@@ -1222,8 +1391,6 @@ err_t netif_output_ip6_func (struct netif *netif, struct pbuf *p, const ip6_addr
 
 err_t common_netif_output (struct netif *netif, struct pbuf *p)
 {
-    SYNC_DECL
-    
     BLog(BLOG_DEBUG, "device write: send packet");
     
     if (quitting) {
@@ -1237,9 +1404,9 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
             goto out;
         }
         
-        SYNC_FROMHERE
+        // BTap_Send doesn't dispatch any jobs, and in VNET_HDR mode the device
+        // must be allowed to defer writing until we return
         BTap_Send(&device, (uint8_t *)p->payload, p->len);
-        SYNC_COMMIT
     } else {
         int len = 0;
         do {
@@ -1251,9 +1418,7 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
             len += p->len;
         } while (p = p->next);
         
-        SYNC_FROMHERE
         BTap_Send(&device, device_write_buf, len);
-        SYNC_COMMIT
     }
     
 out:
@@ -1305,9 +1470,9 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     ASSERT(err == ERR_OK)
     
     // allocate client structure
-    struct tcp_client *client = (struct tcp_client *)malloc(sizeof(*client));
+    struct tcp_client *client = (struct tcp_client *)BlockPool_Get(&client_pool);
     if (!client) {
-        BLog(BLOG_ERROR, "listener accept: malloc failed");
+        BLog(BLOG_ERROR, "listener accept: BlockPool_Get failed");
         goto fail0;
     }
     client->socks_username = NULL;
@@ -1371,11 +1536,17 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     tcp_recv(client->pcb, client_recv_func);
     
     // setup buffer
+    client->buf = NULL;
     client->buf_used = 0;
     
     // set SOCKS not up, not closed
     client->socks_up = 0;
     client->socks_closed = 0;
+    client->socks_recv_buf = NULL;
+    
+    // set not lingering
+    client->lingering = 0;
+    client->dealloced = 0;
     
     client_log(client, BLOG_INFO, "accepted");
     
@@ -1389,7 +1560,7 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
 fail1:
     SYNC_BREAK
     free(client->socks_username);
-    free(client);
+    BlockPool_Put(&client_pool, client);
 fail0:
     return ERR_MEM;
 }
@@ -1424,11 +1595,28 @@ void client_free_client (struct tcp_client *client)
     tcp_recv(client->pcb, NULL);
     tcp_sent(client->pcb, NULL);
     
+    // Data queued with tcp_write refers to socks_recv_buf, and lwIP will keep
+    // (re)transmitting it after tcp_close, so we have to keep the client memory
+    // until it is acknowledged. That is, unless tcp_close resets the connection
+    // because not all received data was consumed, dropping everything queued
+    // (see tcp_close_shutdown).
+    int linger = 0;
+    if (client->socks_up && client->socks_recv_tcp_pending > 0) {
+        struct tcp_pcb *pcb = client->pcb;
+        linger = !((pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT) &&
+                   (pcb->refused_data || pcb->rcv_wnd != TCP_WND_MAX(pcb)));
+    }
+    
     // free pcb
     err_t err = tcp_close(client->pcb);
     if (err != ERR_OK) {
         client_log(client, BLOG_ERROR, "tcp_close failed (%d)", err);
         client_abort_pcb(client);
+    } else if (linger) {
+        // wait for the data to be acknowledged
+        client->lingering = 1;
+        tcp_err(client->pcb, client_linger_err_func);
+        tcp_sent(client->pcb, client_linger_sent_func);
     }
     
     client_handle_freed_client(client);
@@ -1484,7 +1672,7 @@ void client_free_socks (struct tcp_client *client)
     client->socks_closed = 1;
     
     // if we have data to be sent to the client and we can send it, keep sending
-    if (client->socks_up && (client->socks_recv_buf_used >= 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
+    if (client->socks_up && (client->socks_recv_buf_used > 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
         client_log(client, BLOG_INFO, "waiting until buffered data is sent to client");
     } else {
         if (!client->client_closed) {
@@ -1541,9 +1729,19 @@ void client_dealloc (struct tcp_client *client)
         DEAD_KILL_WITH(client->dead_aborted, -1);
     }
     
-    // free memory
+    // free buffer
+    if (client->buf) {
+        BlockPool_Put(&client_buf_pool, client->buf);
+    }
+    
+    // free memory, unless lwIP still refers to socks_recv_buf
     free(client->socks_username);
-    free(client);
+    if (client->lingering) {
+        client->dealloced = 1;
+    } else {
+        client_socks_recv_release_buf(client);
+        BlockPool_Put(&client_pool, client);
+    }
 }
 
 void client_err_func (void *arg, err_t err)
@@ -1573,12 +1771,20 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
         ASSERT(p->tot_len > 0)
         
         // check if we have enough buffer
-        if (p->tot_len > sizeof(client->buf) - client->buf_used) {
+        if (p->tot_len > TCP_WND - client->buf_used) {
             client_log(client, BLOG_ERROR, "no buffer for data !?!");
             DEAD_LEAVE2(client->dead_aborted)
             return ERR_MEM;
         }
         
+        // get buffer if we don't have one; if this fails, lwIP
+        // will keep the data and give it to us again later
+        if (!client->buf && !(client->buf = (uint8_t *)BlockPool_Get(&client_buf_pool))) {
+            client_log(client, BLOG_ERROR, "no memory for buffer");
+            DEAD_LEAVE2(client->dead_aborted)
+            return ERR_MEM;
+        }
+        
         // copy data to buffer
         ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + client->buf_used, p->tot_len, 0) == p->tot_len)
         client->buf_used += p->tot_len;
@@ -1627,7 +1833,11 @@ void client_socks_handler (struct tcp_client *client, int event)
             // init receiving
             client->socks_recv_if = BSocksClient_GetRecvInterface(&client->socks_client);
             StreamRecvInterface_Receiver_Init(client->socks_recv_if, (StreamRecvInterface_handler_done)client_socks_recv_handler_done, client);
-            client->socks_recv_buf_used = -1;
+            client->socks_recv_buf = NULL;
+            client->socks_recv_buf_start = 0;
+            client->socks_recv_buf_used = 0;
+            client->socks_recv_receiving = 0;
+            client->socks_recv_short = 1;
             client->socks_recv_tcp_pending = 0;
             if (!client->client_closed) {
                 tcp_sent(client->pcb, client_sent_func);
@@ -1687,8 +1897,14 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     if (client->buf_used > 0) {
         // send any further data
         StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+        return;
     }
-    else if (client->client_closed) {
+    
+    // release buffer until there is more data
+    BlockPool_Put(&client_buf_pool, client->buf);
+    client->buf = NULL;
+    
+    if (client->client_closed) {
         // client was closed we've sent everything we had buffered; we're done with it
         client_log(client, BLOG_INFO, "removing after client went down");
         
@@ -1696,43 +1912,109 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     }
 }
 
+void client_socks_recv_release_buf (struct tcp_client *client)
+{
+    if (client->socks_recv_buf) {
+        BlockPool_Put(&client_socks_recv_buf_pool, client->socks_recv_buf);
+        client->socks_recv_buf = NULL;
+    }
+}
+
 void client_socks_recv_initiate (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(!client->socks_recv_receiving)
+    
+    int queued = client->socks_recv_tcp_pending + client->socks_recv_buf_used;
+    ASSERT(queued >= 0)
+    ASSERT(queued <= CLIENT_SOCKS_RECV_BUF_SIZE)
+    
+    // release buffer if it's empty
+    if (queued == 0) {
+        client_socks_recv_release_buf(client);
+    }
+    
+    if (client->socks_recv_buf && !client->socks_recv_short) {
+        // More data is likely coming, receive into the free space after
+        // the queued data, up to the end of the buffer.
+        int pos = (client->socks_recv_buf_start + queued) % CLIENT_SOCKS_RECV_BUF_SIZE;
+        int avail = bmin_int(CLIENT_SOCKS_RECV_BUF_SIZE - queued, CLIENT_SOCKS_RECV_BUF_SIZE - pos);
+        if (avail == 0) {
+            // buffer is full, continue in client_sent_func
+            return;
+        }
+        
+        client->socks_recv_into_idle = 0;
+        client->socks_recv_len = avail;
+        StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf + pos, avail);
+    } else {
+        // The connection may be idle for a long time, receive into the
+        // small buffer in the client entry so that we don't hold on to
+        // a buffer from the pool in the meantime.
+        int avail = bmin_int(CLIENT_SOCKS_RECV_BUF_SIZE - queued, CLIENT_SOCKS_RECV_IDLE_BUF_SIZE);
+        if (avail == 0) {
+            // buffer is full, continue in client_sent_func
+            return;
+        }
+        
+        client->socks_recv_into_idle = 1;
+        client->socks_recv_len = avail;
+        StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_idle_buf, avail);
+    }
     
-    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf, sizeof(client->socks_recv_buf));
+    client->socks_recv_receiving = 1;
 }
 
 void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 {
     ASSERT(data_len > 0)
-    ASSERT(data_len <= sizeof(client->socks_recv_buf))
+    ASSERT(data_len <= client->socks_recv_len)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(client->socks_recv_receiving)
+    
+    // set not receiving
+    client->socks_recv_receiving = 0;
     
     // if client was closed, stop receiving
     if (client->client_closed) {
         return;
     }
     
-    // set amount of data in buffer
-    client->socks_recv_buf_used = data_len;
-    client->socks_recv_buf_sent = 0;
-    client->socks_recv_waiting = 0;
+    // if we didn't get as much as we asked for, the connection may be going idle
+    client->socks_recv_short = (data_len < client->socks_recv_len);
+    
+    if (client->socks_recv_into_idle) {
+        // get buffer if we don't have one
+        if (!client->socks_recv_buf) {
+            if (!(client->socks_recv_buf = (uint8_t *)BlockPool_Get(&client_socks_recv_buf_pool))) {
+                client_log(client, BLOG_ERROR, "no memory for buffer");
+                
+                client_abort_client(client);
+                return;
+            }
+            client->socks_recv_buf_start = 0;
+        }
+        
+        // copy data to buffer after the queued data, wrapping around
+        int pos = (client->socks_recv_buf_start + client->socks_recv_tcp_pending + client->socks_recv_buf_used) % CLIENT_SOCKS_RECV_BUF_SIZE;
+        int first = bmin_int(data_len, CLIENT_SOCKS_RECV_BUF_SIZE - pos);
+        memcpy(client->socks_recv_buf + pos, client->socks_recv_idle_buf, first);
+        memcpy(client->socks_recv_buf, client->socks_recv_idle_buf + first, data_len - first);
+    }
+    
+    // add data to buffer
+    client->socks_recv_buf_used += data_len;
     
     // send to client
     if (client_socks_recv_send_out(client) < 0) {
         return;
     }
     
-    // continue receiving if needed
-    if (client->socks_recv_buf_used == -1) {
-        client_socks_recv_initiate(client);
-    }
+    // continue receiving
+    client_socks_recv_initiate(client);
 }
 
 int client_socks_recv_send_out (struct tcp_client *client)
@@ -1740,19 +2022,22 @@ int client_socks_recv_send_out (struct tcp_client *client)
     ASSERT(!client->client_closed)
     ASSERT(client->socks_up)
     ASSERT(client->socks_recv_buf_used > 0)
-    ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
-    ASSERT(!client->socks_recv_waiting)
     
     // return value -1 means tcp_abort() was done,
     // 0 means it wasn't and the client (pcb) is still up
     
+    int buf_size = CLIENT_SOCKS_RECV_BUF_SIZE;
+    
+    // The data is queued by reference, without copying. It has to stay in
+    // the buffer until client_sent_func reports it acknowledged.
     do {
-        int to_write = bmin_int(client->socks_recv_buf_used - client->socks_recv_buf_sent, tcp_sndbuf(client->pcb));
+        int pos = (client->socks_recv_buf_start + client->socks_recv_tcp_pending) % buf_size;
+        int to_write = bmin_int(bmin_int(client->socks_recv_buf_used, buf_size - pos), tcp_sndbuf(client->pcb));
         if (to_write == 0) {
             break;
         }
         
-        err_t err = tcp_write(client->pcb, client->socks_recv_buf + client->socks_recv_buf_sent, to_write, TCP_WRITE_FLAG_COPY);
+        err_t err = tcp_write(client->pcb, client->socks_recv_buf + pos, to_write, 0);
         if (err != ERR_OK) {
             if (err == ERR_MEM) {
                 break;
@@ -1764,9 +2049,9 @@ int client_socks_recv_send_out (struct tcp_client *client)
             return -1;
         }
         
-        client->socks_recv_buf_sent += to_write;
+        client->socks_recv_buf_used -= to_write;
         client->socks_recv_tcp_pending += to_write;
-    } while (client->socks_recv_buf_sent < client->socks_recv_buf_used);
+    } while (client->socks_recv_buf_used > 0);
     
     // start sending now
     err_t err = tcp_output(client->pcb);
@@ -1777,23 +2062,14 @@ int client_socks_recv_send_out (struct tcp_client *client)
         return -1;
     }
     
-    // more data to queue?
-    if (client->socks_recv_buf_sent < client->socks_recv_buf_used) {
-        if (client->socks_recv_tcp_pending == 0) {
-            client_log(client, BLOG_ERROR, "can't queue data, but all data was confirmed !?!");
-            
-            client_abort_client(client);
-            return -1;
-        }
+    // more data to queue? continue in client_sent_func
+    if (client->socks_recv_buf_used > 0 && client->socks_recv_tcp_pending == 0) {
+        client_log(client, BLOG_ERROR, "can't queue data, but all data was confirmed !?!");
         
-        // set waiting, continue in client_sent_func
-        client->socks_recv_waiting = 1;
-        return 0;
+        client_abort_client(client);
+        return -1;
     }
     
-    // everything was queued
-    client->socks_recv_buf_used = -1;
-    
     return 0;
 }
 
@@ -1808,35 +2084,35 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
     
     DEAD_ENTER(client->dead_aborted)
     
-    // decrement pending
+    // release confirmed data from buffer
     client->socks_recv_tcp_pending -= len;
+    client->socks_recv_buf_start = (client->socks_recv_buf_start + len) % CLIENT_SOCKS_RECV_BUF_SIZE;
     
     // continue queuing
     if (client->socks_recv_buf_used > 0) {
-        ASSERT(client->socks_recv_waiting)
-        ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
-        
-        // set not waiting
-        client->socks_recv_waiting = 0;
-        
         // possibly send more data
         if (client_socks_recv_send_out(client) < 0) {
             goto out;
         }
-        
-        // we just queued some data, so it can't have been confirmed yet
-        ASSERT(client->socks_recv_tcp_pending > 0)
-        
-        // continue receiving if needed
-        if (client->socks_recv_buf_used == -1 && !client->socks_closed) {
+    }
+    
+    // release buffer if it's empty, unless we're receiving into it
+    if (client->socks_recv_buf_used == 0 && client->socks_recv_tcp_pending == 0 &&
+        !(client->socks_recv_receiving && !client->socks_recv_into_idle)) {
+        client_socks_recv_release_buf(client);
+    }
+    
+    if (!client->socks_closed) {
+        // continue receiving if we stopped because the buffer was full
+        if (!client->socks_recv_receiving) {
             SYNC_DECL
             SYNC_FROMHERE
             client_socks_recv_initiate(client);
             SYNC_COMMIT
         }
-    } else {    
+    } else {
         // have we sent everything after SOCKS was closed?
-        if (client->socks_closed && client->socks_recv_tcp_pending == 0) {
+        if (client->socks_recv_buf_used == 0 && client->socks_recv_tcp_pending == 0) {
             client_log(client, BLOG_INFO, "removing after SOCKS went down");
             client_free_client(client);
         }
@@ -1849,13 +2125,56 @@ out:
     return (DEAD_KILLED > 0) ? ERR_ABRT : ERR_OK;
 }
 
+void client_linger_done (struct tcp_client *client)
+{
+    ASSERT(client->client_closed)
+    ASSERT(client->lingering)
+    
+    // set not lingering
+    client->lingering = 0;
+    
+    // free memory if the client was already deallocated
+    if (client->dealloced) {
+        client_socks_recv_release_buf(client);
+        BlockPool_Put(&client_pool, client);
+    }
+}
+
+void client_linger_err_func (void *arg, err_t err)
+{
+    struct tcp_client *client = (struct tcp_client *)arg;
+    
+    // the pcb is gone, and the data with it
+    client_linger_done(client);
+}
+
+err_t client_linger_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+    struct tcp_client *client = (struct tcp_client *)arg;
+    ASSERT(client->lingering)
+    ASSERT(len > 0)
+    ASSERT(len <= client->socks_recv_tcp_pending)
+    
+    // decrement pending
+    client->socks_recv_tcp_pending -= len;
+    
+    // done when all data has been confirmed
+    if (client->socks_recv_tcp_pending == 0) {
+        tcp_err(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        client_linger_done(client);
+    }
+    
+    return ERR_OK;
+}
+
 void udp_send_packet_to_device (void *unused, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
 {
     ASSERT(udp_mode != UdpModeNone)
     ASSERT(local_addr.type == BADDR_TYPE_IPV4 || local_addr.type == BADDR_TYPE_IPV6)
     ASSERT(local_addr.type == remote_addr.type)
     ASSERT(data_len >= 0)
-
+    
     char const *source_name = (udp_mode == UdpModeUdpgw) ? "udpgw" : "SOCKS UDP";
     
     int packet_length = 0;
@@ -27,8 +27,24 @@
 // name of the program
 #define PROGRAM_NAME "tun2socks"
 
-// size of temporary buffer for passing data from the SOCKS server to TCP for sending
-#define CLIENT_SOCKS_RECV_BUF_SIZE 8192
+// size of buffer for passing data from the SOCKS server to TCP for sending;
+// data is sent from here by reference, so this should be somewhat larger
+// than TCP_SND_BUF to allow receiving while the send buffer is full
+#define CLIENT_SOCKS_RECV_BUF_SIZE 24576
+
+// size of buffer in each client for receiving from the SOCKS server while
+// the connection is idle, so that it doesn't need to hold a full buffer
+#define CLIENT_SOCKS_RECV_IDLE_BUF_SIZE 512
+
+// maximum number of unused client entries and client buffers of each
+// kind to keep for reuse
+#define CLIENT_POOL_MAX_FREE 64
+
+// maximum number of unused device read buffers to keep for reuse
+#define DEVICE_READ_MAX_FREE_BUFS 256
+
+// maximum number of worker processes (--workers)
+#define TUN2SOCKS_MAX_WORKERS 64
 
 // maximum number of udpgw connections
 #define DEFAULT_UDPGW_MAX_CONNECTIONS 256
@@ -48,7 +48,9 @@
     #include <net/if.h>
     #include <net/if_arp.h>
     #ifdef BADVPN_LINUX
+        #include <sys/uio.h>
         #include <linux/if_tun.h>
+        #include <linux/virtio_net.h>
     #endif
     #ifdef BADVPN_FREEBSD
         #include <net/if_tun.h>
@@ -56,14 +58,51 @@
     #endif
 #endif
 
+#include <misc/balloc.h>
+#include <misc/minmax.h>
+#include <misc/read_write_int.h>
+#include <misc/ipv4_proto.h>
+#include <misc/ipv6_proto.h>
+#include <misc/tcp_proto.h>
 #include <base/BLog.h>
 
 #include <tuntap/BTap.h>
 
 #include <generated/blog_channel_BTap.h>
 
+#ifdef BADVPN_LINUX
+#define VNET_HDR_SIZE sizeof(struct virtio_net_hdr)
+#else
+#define VNET_HDR_SIZE 0
+#endif
+
+#ifdef BTAP_USE_URING
+// reads, and writes in VNET_HDR mode, performed by the reactor; the kernel may
+// access the buffers until the operations complete or are cancelled
+struct BTap__uring {
+    BReactorIO recv_io;
+    BReactorIO send_io;
+    int recv_busy;
+    int send_busy;
+    struct virtio_net_hdr recv_vh;
+    struct iovec recv_iov[3];
+    struct virtio_net_hdr send_vh;
+    struct iovec send_iov[BTAP_VNET_MAX_SEGMENTS + 2];
+    int send_packets;
+    int send_expected;
+};
+#endif
+
 static void report_error (BTap *o);
 static void output_handler_recv (BTap *o, uint8_t *data);
+#ifdef BTAP_USE_URING
+static struct BTap__uring * uring_alloc (BTap *o);
+static void uring_free (BTap *o);
+static void uring_recv (BTap *o, uint8_t *data);
+static void uring_recv_handler (BTap *o, int res, int buf, int more);
+static void uring_vnet_write (BTap *o);
+static void uring_send_handler (BTap *o, int res, int buf, int more);
+#endif
 
 #ifdef BADVPN_USE_WINAPI
 
@@ -91,6 +130,697 @@ static void recv_olap_handler (BTap *o, int event, DWORD bytes)
 
 #else
 
+#ifdef BADVPN_LINUX
+
+static uint32_t csum_add (uint32_t t, const uint8_t *data, int len)
+{
+    for (int i = 0; i + 1 < len; i += 2) {
+        t += badvpn_read_be16((const char *)data + i);
+    }
+    if (len % 2) {
+        t += (uint32_t)data[len - 1] << 8;
+    }
+    return t;
+}
+
+static uint16_t csum_fold (uint32_t t)
+{
+    while (t >> 16) {
+        t = (t & 0xFFFF) + (t >> 16);
+    }
+    return t;
+}
+
+static uint32_t tcp_pseudo_sum (const uint8_t *ip, int tcp_len)
+{
+    uint32_t t = 0;
+    
+    if ((ip[0] >> 4) == 4) {
+        t = csum_add(t, ip + offsetof(struct ipv4_header, source_address), 8);
+        t += IPV4_PROTOCOL_TCP;
+    } else {
+        t = csum_add(t, ip + offsetof(struct ipv6_header, source_address), 32);
+        t += IPV6_NEXT_TCP;
+    }
+    
+    return t + (uint32_t)tcp_len;
+}
+
+// Checks that a packet is IPv4 (without options) or IPv6 (without extension headers)
+// carrying TCP, and returns the lengths of the IP and IP+TCP headers.
+static int parse_tcp (const uint8_t *data, int len, int *out_ip_hl, int *out_hdr_len)
+{
+    int ip_hl;
+    
+    if (len < 1) {
+        return 0;
+    }
+    
+    switch (data[0] >> 4) {
+        case 4: {
+            ip_hl = sizeof(struct ipv4_header);
+            if (len < ip_hl || IPV4_GET_IHL(*(const struct ipv4_header *)data) * 4 != ip_hl ||
+                data[offsetof(struct ipv4_header, protocol)] != IPV4_PROTOCOL_TCP
+            ) {
+                return 0;
+            }
+        } break;
+        
+        case 6: {
+            ip_hl = sizeof(struct ipv6_header);
+            if (len < ip_hl || data[offsetof(struct ipv6_header, next_header)] != IPV6_NEXT_TCP) {
+                return 0;
+            }
+        } break;
+        
+        default:
+            return 0;
+    }
+    
+    if (len - ip_hl < sizeof(struct tcp_header)) {
+        return 0;
+    }
+    
+    int tcp_hl = TCP_GET_HEADER_LENGTH(*(const struct tcp_header *)(data + ip_hl));
+    if (tcp_hl < sizeof(struct tcp_header) || tcp_hl > len - ip_hl) {
+        return 0;
+    }
+    
+    *out_ip_hl = ip_hl;
+    *out_hdr_len = ip_hl + tcp_hl;
+    return 1;
+}
+
+// Stores the next segment of the super-segment in gso_buf into data, and returns
+// its length.
+static int vnet_pop (BTap *o, uint8_t *data)
+{
+    ASSERT(o->vnet_hdr)
+    ASSERT(o->gso_len > 0)
+    
+    uint8_t *pkt = o->gso_buf;
+    
+    // cut the next segment out of the super-segment
+    int payload_len = o->gso_len - o->gso_hdr_len;
+    int chunk = bmin_int(o->gso_size, payload_len - o->gso_offset);
+    int last = (o->gso_offset + chunk == payload_len);
+    int len = o->gso_hdr_len + chunk;
+    int tcp_len = len - o->gso_ip_hl;
+    
+    memcpy(data, pkt, o->gso_hdr_len);
+    memcpy(data + o->gso_hdr_len, pkt + o->gso_hdr_len + o->gso_offset, chunk);
+    
+    // fix IP header
+    if ((data[0] >> 4) == 4) {
+        struct ipv4_header iph;
+        memcpy(&iph, data, sizeof(iph));
+        iph.total_length = hton16(len);
+        iph.identification = hton16(ntoh16(iph.identification) + o->gso_index);
+        iph.checksum = hton16(0);
+        iph.checksum = ipv4_checksum(&iph, NULL, 0);
+        memcpy(data, &iph, sizeof(iph));
+    } else {
+        badvpn_write_be16(tcp_len, (char *)data + offsetof(struct ipv6_header, payload_length));
+    }
+    
+    // fix TCP header
+    uint8_t *tcp = data + o->gso_ip_hl;
+    uint32_t seq = badvpn_read_be32((char *)tcp + offsetof(struct tcp_header, seq_num));
+    badvpn_write_be32(seq + o->gso_offset, (char *)tcp + offsetof(struct tcp_header, seq_num));
+    if (!last) {
+        tcp[offsetof(struct tcp_header, flags)] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    }
+    if (o->gso_index > 0) {
+        tcp[offsetof(struct tcp_header, flags)] &= ~TCP_FLAG_CWR;
+    }
+    badvpn_write_be16(0, (char *)tcp + offsetof(struct tcp_header, checksum));
+    uint16_t sum = ~csum_fold(csum_add(tcp_pseudo_sum(data, tcp_len), tcp, tcp_len));
+    badvpn_write_be16(sum, (char *)tcp + offsetof(struct tcp_header, checksum));
+    
+    o->gso_offset += chunk;
+    o->gso_index++;
+    if (last) {
+        o->gso_len = 0;
+    }
+    
+    return len;
+}
+
+// Handles a packet which was read from the device, with its virtio header in vh,
+// and the packet starting in data, which has space for the MTU, and continuing in
+// gso_buf. Only the first segment of a super-segment is stored into data, the rest
+// stays in gso_buf for vnet_pop. Returns the length of the packet in data, or 0 if
+// the packet was dropped.
+static int vnet_parse (BTap *o, const struct virtio_net_hdr *vh, uint8_t *data, int bytes)
+{
+    ASSERT(o->vnet_hdr)
+    ASSERT(o->gso_len == 0)
+    
+    if (bytes <= sizeof(*vh)) {
+        BLog(BLOG_WARNING, "packet without virtio header");
+        return 0;
+    }
+    
+    int len = bytes - sizeof(*vh);
+    
+    switch (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+        case VIRTIO_NET_HDR_GSO_NONE: {
+            if (len > o->frame_mtu) {
+                BLog(BLOG_WARNING, "packet too large");
+                return 0;
+            }
+            
+            // complete a partial checksum
+            if ((vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+                if (vh->csum_start > len || vh->csum_offset + 2 > len - vh->csum_start) {
+                    BLog(BLOG_WARNING, "bad checksum offsets");
+                    return 0;
+                }
+                uint16_t sum = ~csum_fold(csum_add(0, data + vh->csum_start, len - vh->csum_start));
+                badvpn_write_be16(sum, (char *)data + vh->csum_start + vh->csum_offset);
+            }
+            
+            return len;
+        } break;
+        
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+        case VIRTIO_NET_HDR_GSO_TCPV6: {
+            // join the start of the super-segment with the rest
+            memcpy(o->gso_buf, data, bmin_int(len, o->frame_mtu));
+            
+            int ip_hl;
+            int hdr_len;
+            if (!parse_tcp(o->gso_buf, len, &ip_hl, &hdr_len) || hdr_len == len ||
+                vh->gso_size == 0 || vh->gso_size > o->frame_mtu - hdr_len
+            ) {
+                BLog(BLOG_WARNING, "bad TCP super-segment");
+                return 0;
+            }
+            
+            o->gso_len = len;
+            o->gso_ip_hl = ip_hl;
+            o->gso_hdr_len = hdr_len;
+            o->gso_size = vh->gso_size;
+            o->gso_offset = 0;
+            o->gso_index = 0;
+            
+            return vnet_pop(o, data);
+        } break;
+        
+        default:
+            BLog(BLOG_WARNING, "unsupported GSO type %d", (int)vh->gso_type);
+            return 0;
+    }
+}
+
+// Builds the iovec for reading a packet from the device, see vnet_parse.
+static void vnet_read_iov (BTap *o, struct virtio_net_hdr *vh, uint8_t *data, struct iovec *iov)
+{
+    // A packet fitting the MTU goes directly into data, and only a
+    // super-segment continues into gso_buf.
+    iov[0].iov_base = vh;
+    iov[0].iov_len = sizeof(*vh);
+    iov[1].iov_base = data;
+    iov[1].iov_len = o->frame_mtu;
+    iov[2].iov_base = o->gso_buf + o->frame_mtu;
+    iov[2].iov_len = BTAP_VNET_MAX_PACKET - o->frame_mtu;
+}
+
+// Reads a packet from the device into data, see vnet_parse. Returns the length of
+// the packet, 0 if nothing was read, or -1 if an error was reported.
+static int vnet_read (BTap *o, uint8_t *data)
+{
+    ASSERT(o->vnet_hdr)
+    ASSERT(o->gso_len == 0)
+    
+    while (1) {
+        struct virtio_net_hdr vh;
+        struct iovec iov[3];
+        vnet_read_iov(o, &vh, data, iov);
+        
+        int bytes = readv(o->fd, iov, 3);
+        if (bytes <= 0) {
+            // See note about zero return in fd_handler.
+            if (bytes == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            // report fatal error
+            report_error(o);
+            return -1;
+        }
+        
+        int len = vnet_parse(o, &vh, data, bytes);
+        if (len > 0) {
+            return len;
+        }
+    }
+}
+
+// Checks whether a packet can be the first segment of a super-segment, and returns
+// the lengths of its IP and IP+TCP headers.
+static int vnet_can_start (const uint8_t *pkt, int len, int *out_ip_hl, int *out_hdr_len)
+{
+    return (parse_tcp(pkt, len, out_ip_hl, out_hdr_len) && len > *out_hdr_len &&
+            pkt[*out_ip_hl + offsetof(struct tcp_header, flags)] == TCP_FLAG_ACK);
+}
+
+// Checks whether a queued packet continues the super-segment whose first packet is
+// first, and which so far carries total payload bytes.
+static int vnet_can_append (const uint8_t *first, int ip_hl, int hdr_len, int first_payload, int total, const uint8_t *pkt, int len)
+{
+    int payload = len - hdr_len;
+    if (payload <= 0 || payload > first_payload || total + payload > BTAP_VNET_MAX_PACKET - hdr_len) {
+        return 0;
+    }
+    
+    // IP headers must match except for length, identification and checksum
+    if ((first[0] >> 4) == 4) {
+        if (memcmp(first, pkt, 2) || memcmp(first + 6, pkt + 6, 4) || memcmp(first + 12, pkt + 12, 8)) {
+            return 0;
+        }
+    } else {
+        if (memcmp(first, pkt, 4) || memcmp(first + 6, pkt + 6, ip_hl - 6)) {
+            return 0;
+        }
+    }
+    
+    // TCP headers must match except for sequence number, flags and checksum,
+    // and the sequence number must continue where the previous segment ended
+    const uint8_t *t1 = first + ip_hl;
+    const uint8_t *t2 = pkt + ip_hl;
+    uint32_t seq1 = badvpn_read_be32((const char *)t1 + offsetof(struct tcp_header, seq_num));
+    uint32_t seq2 = badvpn_read_be32((const char *)t2 + offsetof(struct tcp_header, seq_num));
+    if (memcmp(t1, t2, 4) || seq2 != seq1 + (uint32_t)total ||
+        memcmp(t1 + 8, t2 + 8, 5) || memcmp(t1 + 14, t2 + 14, 2) ||
+        memcmp(t1 + 18, t2 + 18, hdr_len - ip_hl - 18)
+    ) {
+        return 0;
+    }
+    
+    uint8_t flags = t2[offsetof(struct tcp_header, flags)];
+    return (flags == TCP_FLAG_ACK || flags == (TCP_FLAG_ACK | TCP_FLAG_PSH));
+}
+
+// Builds the iovec for writing out packets from the front of the send buffer.
+// Returns the number of packets used.
+static int vnet_build (BTap *o, struct virtio_net_hdr *vh, struct iovec *iov, int *out_iovcnt)
+{
+    ASSERT(o->tx_count > 0)
+    
+    uint8_t *first = o->tx_buf + (size_t)o->tx_start * o->frame_mtu;
+    int first_len = o->tx_lens[o->tx_start];
+    
+    memset(vh, 0, sizeof(*vh));
+    vh->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    
+    iov[0].iov_base = vh;
+    iov[0].iov_len = sizeof(*vh);
+    iov[1].iov_base = first;
+    iov[1].iov_len = first_len;
+    *out_iovcnt = 2;
+    
+    int ip_hl;
+    int hdr_len;
+    if (!vnet_can_start(first, first_len, &ip_hl, &hdr_len)) {
+        return 1;
+    }
+    
+    int first_payload = first_len - hdr_len;
+    int total = first_payload;
+    uint8_t last_flags = TCP_FLAG_ACK;
+    int n = 1;
+    
+    while (n < o->tx_count && n < BTAP_VNET_MAX_SEGMENTS) {
+        int slot = (o->tx_start + n) % BTAP_VNET_TX_PACKETS;
+        uint8_t *pkt = o->tx_buf + (size_t)slot * o->frame_mtu;
+        int len = o->tx_lens[slot];
+        
+        if (len < hdr_len || !vnet_can_append(first, ip_hl, hdr_len, first_payload, total, pkt, len)) {
+            break;
+        }
+        
+        iov[n + 2].iov_base = pkt + hdr_len;
+        iov[n + 2].iov_len = len - hdr_len;
+        total += len - hdr_len;
+        last_flags = pkt[ip_hl + offsetof(struct tcp_header, flags)];
+        n++;
+        
+        // a shorter or pushed segment must be the last one
+        if (len - hdr_len < first_payload || last_flags != TCP_FLAG_ACK) {
+            break;
+        }
+    }
+    
+    if (n == 1) {
+        return 1;
+    }
+    
+    // build headers for the super-segment
+    uint8_t *hdr = o->gso_tx_hdr;
+    memcpy(hdr, first, hdr_len);
+    int tcp_len = hdr_len - ip_hl + total;
+    
+    if ((hdr[0] >> 4) == 4) {
+        struct ipv4_header iph;
+        memcpy(&iph, hdr, sizeof(iph));
+        iph.total_length = hton16(hdr_len + total);
+        iph.checksum = hton16(0);
+        iph.checksum = ipv4_checksum(&iph, NULL, 0);
+        memcpy(hdr, &iph, sizeof(iph));
+        vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    } else {
+        badvpn_write_be16(tcp_len, (char *)hdr + offsetof(struct ipv6_header, payload_length));
+        vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    }
+    
+    // the kernel completes the checksum starting from the pseudo-header sum
+    uint8_t *tcp = hdr + ip_hl;
+    tcp[offsetof(struct tcp_header, flags)] = last_flags;
+    badvpn_write_be16(csum_fold(tcp_pseudo_sum(hdr, tcp_len)), (char *)tcp + offsetof(struct tcp_header, checksum));
+    
+    vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vh->hdr_len = hdr_len;
+    vh->gso_size = first_payload;
+    vh->csum_start = ip_hl;
+    vh->csum_offset = offsetof(struct tcp_header, checksum);
+    
+    iov[1].iov_base = hdr;
+    iov[1].iov_len = hdr_len;
+    iov[2].iov_base = first + hdr_len;
+    iov[2].iov_len = first_payload;
+    *out_iovcnt = n + 2;
+    
+    return n;
+}
+
+// Checks whether the reactor is writing out packets from the send buffer.
+static int vnet_write_busy (BTap *o)
+{
+#ifdef BTAP_USE_URING
+    return (o->uring && o->uring->send_busy);
+#else
+    return 0;
+#endif
+}
+
+static int vnet_iov_len (const struct iovec *iov, int iovcnt)
+{
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Removes n packets which were written from the front of the send buffer.
+static void vnet_written (BTap *o, int n, int bytes, int expected)
+{
+    ASSERT(n > 0)
+    ASSERT(n <= o->tx_count)
+    
+    // errors are ignored like in BTap_Send
+    if (bytes >= 0 && bytes != expected) {
+        BLog(BLOG_WARNING, "written %d expected %d", bytes, expected);
+    }
+    
+    o->tx_start = (o->tx_start + n) % BTAP_VNET_TX_PACKETS;
+    o->tx_count -= n;
+}
+
+static void vnet_write (BTap *o)
+{
+    ASSERT(o->vnet_hdr)
+    ASSERT(!vnet_write_busy(o))
+    
+    while (o->tx_count > 0) {
+        struct virtio_net_hdr vh;
+        struct iovec iov[BTAP_VNET_MAX_SEGMENTS + 2];
+        int iovcnt;
+        int n = vnet_build(o, &vh, iov, &iovcnt);
+        
+        int bytes = writev(o->fd, iov, iovcnt);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // continue when the device becomes writable
+            if (!(o->poll_events & BREACTOR_WRITE)) {
+                o->poll_events |= BREACTOR_WRITE;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+            }
+            return;
+        }
+        
+        vnet_written(o, n, bytes, vnet_iov_len(iov, iovcnt));
+    }
+    
+    if ((o->poll_events & BREACTOR_WRITE)) {
+        o->poll_events &= ~BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+    }
+}
+
+static void vnet_readable (BTap *o)
+{
+    ASSERT(o->vnet_hdr)
+    ASSERT(o->output_packet)
+    ASSERT(o->gso_len == 0)
+    
+    int bytes = vnet_read(o, o->output_packet);
+    if (bytes < 0) {
+        return;
+    }
+    
+    if (bytes == 0) {
+        // retry later
+        return;
+    }
+    
+    // set no output packet
+    o->output_packet = NULL;
+    
+    // update events
+    o->poll_events &= ~BREACTOR_READ;
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+    
+    // inform receiver we finished the packet
+    PacketRecvInterface_Done(&o->output, bytes);
+}
+
+static void tx_job_handler (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->vnet_hdr)
+    
+    // if we're waiting for the device to become writable, let fd_handler continue
+    if ((o->poll_events & BREACTOR_WRITE)) {
+        return;
+    }
+    
+#ifdef BTAP_USE_URING
+    // let the reactor write; uring_send_handler continues when done
+    if (o->uring) {
+        if (!o->uring->send_busy && o->tx_count > 0) {
+            uring_vnet_write(o);
+        }
+        return;
+    }
+#endif
+    
+    vnet_write(o);
+}
+
+static int init_vnet (BTap *o)
+{
+    ASSERT(o->vnet_hdr)
+    
+    if (o->frame_mtu > BTAP_VNET_MAX_PACKET) {
+        BLog(BLOG_ERROR, "MTU too large for VNET_HDR");
+        goto fail0;
+    }
+    
+    if (!(o->gso_buf = BAlloc(BTAP_VNET_MAX_PACKET))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    if (!(o->tx_buf = BAllocArray2(BTAP_VNET_TX_PACKETS, o->frame_mtu, 1))) {
+        BLog(BLOG_ERROR, "BAllocArray2 failed");
+        goto fail1;
+    }
+    
+    o->gso_len = 0;
+    o->tx_start = 0;
+    o->tx_count = 0;
+    
+    BPending_Init(&o->tx_job, BReactor_PendingGroup(o->reactor), (BPending_handler)tx_job_handler, o);
+    
+    return 1;
+    
+fail1:
+    BFree(o->gso_buf);
+fail0:
+    return 0;
+}
+
+static void free_vnet (BTap *o)
+{
+    ASSERT(o->vnet_hdr)
+    
+    if (o->tx_count > 0) {
+        BLog(BLOG_DEBUG, "dropping %d unsent packets", o->tx_count);
+    }
+    
+    BPending_Free(&o->tx_job);
+    BFree(o->tx_buf);
+    BFree(o->gso_buf);
+}
+
+#ifdef BTAP_USE_URING
+
+static struct BTap__uring * uring_alloc (BTap *o)
+{
+    struct BTap__uring *u = BAlloc(sizeof(*u));
+    if (!u) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    BReactorIO_Init(&u->recv_io, (BReactorIO_handler)uring_recv_handler, o);
+    if (!BReactor_AddIO(o->reactor, &u->recv_io)) {
+        BLog(BLOG_ERROR, "BReactor_AddIO failed");
+        goto fail1;
+    }
+    
+    BReactorIO_Init(&u->send_io, (BReactorIO_handler)uring_send_handler, o);
+    if (!BReactor_AddIO(o->reactor, &u->send_io)) {
+        BLog(BLOG_ERROR, "BReactor_AddIO failed");
+        goto fail2;
+    }
+    
+    u->recv_busy = 0;
+    u->send_busy = 0;
+    
+    return u;
+    
+fail2:
+    BReactor_RemoveIO(o->reactor, &u->recv_io);
+fail1:
+    BFree(u);
+fail0:
+    return NULL;
+}
+
+static void uring_free (BTap *o)
+{
+    BReactor_RemoveIO(o->reactor, &o->uring->send_io);
+    BReactor_RemoveIO(o->reactor, &o->uring->recv_io);
+    BFree(o->uring);
+}
+
+static void uring_recv (BTap *o, uint8_t *data)
+{
+    struct BTap__uring *u = o->uring;
+    ASSERT(!u->recv_busy)
+    
+    if (o->vnet_hdr) {
+        vnet_read_iov(o, &u->recv_vh, data, u->recv_iov);
+        BReactor_SubmitReadv(o->reactor, &u->recv_io, o->fd, u->recv_iov, 3);
+    } else {
+        BReactor_SubmitRead(o->reactor, &u->recv_io, o->fd, data, o->frame_mtu);
+    }
+    
+    u->recv_busy = 1;
+}
+
+static void uring_recv_handler (BTap *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->output_packet)
+    ASSERT(o->uring->recv_busy)
+    ASSERT(!more)
+    
+    o->uring->recv_busy = 0;
+    
+    if (res <= 0) {
+        // Older kernels do not wait with non-blocking file descriptors.
+        // See note about zero return in fd_handler.
+        if (res == 0 || res == -EAGAIN) {
+            // continue in fd_handler when the device becomes readable
+            o->poll_events |= BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "read failed");
+        report_error(o);
+        return;
+    }
+    
+    int bytes = res;
+    
+    if (o->vnet_hdr) {
+        bytes = vnet_parse(o, &o->uring->recv_vh, o->output_packet, res);
+        if (bytes == 0) {
+            // the packet was dropped, read another one
+            uring_recv(o, o->output_packet);
+            return;
+        }
+    }
+    
+    ASSERT_FORCE(bytes <= o->frame_mtu)
+    
+    // set no output packet
+    o->output_packet = NULL;
+    
+    // inform receiver we finished the packet
+    PacketRecvInterface_Done(&o->output, bytes);
+}
+
+static void uring_vnet_write (BTap *o)
+{
+    struct BTap__uring *u = o->uring;
+    ASSERT(o->vnet_hdr)
+    ASSERT(!u->send_busy)
+    ASSERT(o->tx_count > 0)
+    
+    int iovcnt;
+    u->send_packets = vnet_build(o, &u->send_vh, u->send_iov, &iovcnt);
+    u->send_expected = vnet_iov_len(u->send_iov, iovcnt);
+    
+    BReactor_SubmitWritev(o->reactor, &u->send_io, o->fd, u->send_iov, iovcnt);
+    u->send_busy = 1;
+}
+
+static void uring_send_handler (BTap *o, int res, int buf, int more)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->vnet_hdr)
+    ASSERT(o->uring->send_busy)
+    ASSERT(!more)
+    
+    o->uring->send_busy = 0;
+    
+    // older kernels do not wait with non-blocking file descriptors
+    if (res == -EAGAIN) {
+        // continue in fd_handler when the device becomes writable
+        o->poll_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+        return;
+    }
+    
+    vnet_written(o, o->uring->send_packets, res, o->uring->send_expected);
+    
+    // write out packets queued in the meantime
+    if (o->tx_count > 0) {
+        uring_vnet_write(o);
+    }
+}
+
+#endif
+
+#endif
+
 static void fd_handler (BTap *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -100,6 +830,19 @@ static void fd_handler (BTap *o, int events)
         BLog(BLOG_WARNING, "device fd reports error?");
     }
     
+#ifdef BADVPN_LINUX
+    if ((events&BREACTOR_WRITE)) {
+        ASSERT(o->vnet_hdr)
+        
+        vnet_write(o);
+    }
+    
+    if ((events&BREACTOR_READ) && o->vnet_hdr) {
+        vnet_readable(o);
+        return;
+    }
+#endif
+    
     if (events&BREACTOR_READ) do {
         ASSERT(o->output_packet)
         
@@ -161,6 +904,44 @@ void output_handler_recv (BTap *o, uint8_t *data)
     
 #else
     
+#ifdef BADVPN_LINUX
+    // serve the rest of a super-segment
+    if (o->vnet_hdr && o->gso_len > 0) {
+        PacketRecvInterface_Done(&o->output, vnet_pop(o, data));
+        return;
+    }
+#endif
+    
+#ifdef BTAP_USE_URING
+    // let the reactor read; uring_recv_handler is called when done
+    if (o->uring) {
+        o->output_packet = data;
+        uring_recv(o, data);
+        return;
+    }
+#endif
+    
+#ifdef BADVPN_LINUX
+    if (o->vnet_hdr) {
+        // attempt read
+        int bytes = vnet_read(o, data);
+        if (bytes < 0) {
+            return;
+        }
+        
+        if (bytes > 0) {
+            PacketRecvInterface_Done(&o->output, bytes);
+            return;
+        }
+        
+        // retry later in fd_handler
+        o->output_packet = data;
+        o->poll_events |= BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+        return;
+    }
+#endif
+    
     // attempt read
     int bytes = read(o->fd, data, o->frame_mtu);
     if (bytes <= 0) {
@@ -194,6 +975,7 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
     init_data.dev_type = tun ? BTAP_DEV_TUN : BTAP_DEV_TAP;
     init_data.init_type = BTAP_INIT_STRING;
     init_data.init.string = devname;
+    init_data.flags = 0;
     
     return BTap_Init2(o, reactor, init_data, handler_error, handler_error_user);
 }
@@ -201,6 +983,7 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
 int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTap_handler_error handler_error, void *handler_error_user)
 {
     ASSERT(init_data.dev_type == BTAP_DEV_TUN || init_data.dev_type == BTAP_DEV_TAP)
+    ASSERT(!(init_data.flags & ~(BTAP_FLAG_MULTI_QUEUE | BTAP_FLAG_VNET_HDR)))
     
     // init arguments
     o->reactor = reactor;
@@ -322,6 +1105,17 @@ fail0:
     #if defined(BADVPN_LINUX) || defined(BADVPN_FREEBSD)
     
     o->close_fd = (init_data.init_type != BTAP_INIT_FD);
+    o->vnet_hdr = !!(init_data.flags & BTAP_FLAG_VNET_HDR);
+    
+    if ((init_data.flags & (BTAP_FLAG_MULTI_QUEUE | BTAP_FLAG_VNET_HDR)) && init_data.init_type != BTAP_INIT_STRING) {
+        BLog(BLOG_ERROR, "multi-queue and VNET_HDR require opening the device by name");
+        goto fail0;
+    }
+    
+    if (o->vnet_hdr && init_data.dev_type != BTAP_DEV_TUN) {
+        BLog(BLOG_ERROR, "VNET_HDR requires a TUN device");
+        goto fail0;
+    }
     
     switch (init_data.init_type) {
         case BTAP_INIT_FD: {
@@ -355,6 +1149,17 @@ fail0:
             } else {
                 ifr.ifr_flags |= IFF_TAP;
             }
+            if ((init_data.flags & BTAP_FLAG_MULTI_QUEUE)) {
+                #ifdef IFF_MULTI_QUEUE
+                ifr.ifr_flags |= IFF_MULTI_QUEUE;
+                #else
+                BLog(BLOG_ERROR, "multi-queue not supported by the kernel headers");
+                goto fail1;
+                #endif
+            }
+            if (o->vnet_hdr) {
+                ifr.ifr_flags |= IFF_VNET_HDR;
+            }
             if (init_data.init.string) {
                 snprintf(ifr.ifr_name, IFNAMSIZ, "%s", init_data.init.string);
             }
@@ -366,6 +1171,20 @@ fail0:
             
             strcpy(devname_real, ifr.ifr_name);
             
+            // enable checksum and segmentation offload
+            if (o->vnet_hdr) {
+                int hdr_size = VNET_HDR_SIZE;
+                if (ioctl(o->fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+                    BLog(BLOG_ERROR, "error setting virtio header size");
+                    goto fail1;
+                }
+                
+                if (ioctl(o->fd, TUNSETOFFLOAD, (unsigned long)(TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6)) < 0) {
+                    BLog(BLOG_ERROR, "error enabling offloads");
+                    goto fail1;
+                }
+            }
+            
             #endif
             
             #ifdef BADVPN_FREEBSD
@@ -375,6 +1194,11 @@ fail0:
                 goto fail0;
             }
             
+            if ((init_data.flags & (BTAP_FLAG_MULTI_QUEUE | BTAP_FLAG_VNET_HDR))) {
+                BLog(BLOG_ERROR, "multi-queue and VNET_HDR not supported on FreeBSD");
+                goto fail0;
+            }
+            
             if (!init_data.init.string) {
                 BLog(BLOG_ERROR, "no device specified");
                 goto fail0;
@@ -439,16 +1263,37 @@ fail0:
         goto fail1;
     }
     
+    #ifdef BADVPN_LINUX
+    // init VNET_HDR buffers
+    if (o->vnet_hdr && !init_vnet(o)) {
+        goto fail1;
+    }
+    #endif
+    
     // init file descriptor object
     BFileDescriptor_Init(&o->bfd, o->fd, (BFileDescriptor_handler)fd_handler, o);
     if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
         BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
-        goto fail1;
+        goto fail2;
     }
     o->poll_events = 0;
     
+    #ifdef BTAP_USE_URING
+    // let the reactor perform reads and writes if it can
+    o->uring = NULL;
+    if (BReactor_IOSupported(o->reactor) && !(o->uring = uring_alloc(o))) {
+        BLog(BLOG_WARNING, "uring_alloc failed, waiting for readiness");
+    }
+    #endif
+    
     goto success;
     
+fail2:
+    #ifdef BADVPN_LINUX
+    if (o->vnet_hdr) {
+        free_vnet(o);
+    }
+    #endif
 fail1:
     if (o->close_fd) {
         ASSERT_FORCE(close(o->fd) == 0)
@@ -500,9 +1345,23 @@ void BTap_Free (BTap *o)
     
 #else
     
+#ifdef BTAP_USE_URING
+    // cancel reads and writes performed by the reactor
+    if (o->uring) {
+        uring_free(o);
+    }
+#endif
+    
     // free BFileDescriptor
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
     
+#ifdef BADVPN_LINUX
+    // free VNET_HDR buffers
+    if (o->vnet_hdr) {
+        free_vnet(o);
+    }
+#endif
+    
     if (o->close_fd) {
         // close file descriptor
         ASSERT_FORCE(close(o->fd) == 0)
@@ -559,6 +1418,32 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len)
     
 #else
     
+#ifdef BADVPN_LINUX
+    if (o->vnet_hdr) {
+        // make space by writing out what we have, unless the reactor
+        // is writing already
+        if (o->tx_count == BTAP_VNET_TX_PACKETS && !vnet_write_busy(o)) {
+            vnet_write(o);
+        }
+        if (o->tx_count == BTAP_VNET_TX_PACKETS) {
+            BLog(BLOG_WARNING, "send buffer full, dropping packet");
+            return;
+        }
+        
+        // queue packet
+        int slot = (o->tx_start + o->tx_count) % BTAP_VNET_TX_PACKETS;
+        memcpy(o->tx_buf + (size_t)slot * o->frame_mtu, data, data_len);
+        o->tx_lens[slot] = data_len;
+        o->tx_count++;
+        
+        // write out from a job, so that a burst of packets is written together
+        if (!BPending_IsSet(&o->tx_job)) {
+            BPending_Set(&o->tx_job);
+        }
+        return;
+    }
+#endif
+    
     int bytes = write(o->fd, data, data_len);
     if (bytes < 0) {
         // malformed packets will cause errors, ignore them and act like
@@ -48,11 +48,37 @@
 #include <misc/debug.h>
 #include <misc/debugerror.h>
 #include <base/DebugObject.h>
+#include <base/BPending.h>
 #include <system/BReactor.h>
 #include <flow/PacketRecvInterface.h>
 
 #define BTAP_ETHERNET_HEADER_LENGTH 14
 
+// request a multi-queue device (IFF_MULTI_QUEUE, Linux only)
+#define BTAP_FLAG_MULTI_QUEUE (1 << 0)
+
+// exchange TCP super-segments with the kernel (IFF_VNET_HDR with TSO, Linux TUN only)
+#define BTAP_FLAG_VNET_HDR (1 << 1)
+
+// largest packet exchanged with the kernel in VNET_HDR mode
+#define BTAP_VNET_MAX_PACKET 65535
+
+// maximum number of segments coalesced into one super-segment
+#define BTAP_VNET_MAX_SEGMENTS 64
+
+// number of packets queued for coalescing in VNET_HDR mode
+#define BTAP_VNET_TX_PACKETS 64
+
+// maximum IP plus TCP header length
+#define BTAP_VNET_MAX_HEADER 120
+
+// with the io_uring backend, the reactor performs reads, and writes in VNET_HDR mode
+#if defined(BADVPN_LINUX) && defined(BADVPN_BREACTOR_BADVPN) && defined(BADVPN_USE_IO_URING)
+#define BTAP_USE_URING
+#endif
+
+struct BTap__uring;
+
 /**
  * Handler called when an error occurs on the device.
  * The object must be destroyed from the job context of this
@@ -79,6 +105,23 @@ typedef struct {
     int fd;
     BFileDescriptor bfd;
     int poll_events;
+    uint8_t *tx_buf;
+    int tx_lens[BTAP_VNET_TX_PACKETS];
+    int tx_start;
+    int tx_count;
+    BPending tx_job;
+    int vnet_hdr;
+    uint8_t *gso_buf;
+    int gso_len;
+    int gso_ip_hl;
+    int gso_hdr_len;
+    int gso_size;
+    int gso_offset;
+    int gso_index;
+    uint8_t gso_tx_hdr[BTAP_VNET_MAX_HEADER];
+#ifdef BTAP_USE_URING
+    struct BTap__uring *uring;
+#endif
 #endif
     
     DebugError d_err;
@@ -126,6 +169,7 @@ struct BTap_init_data {
             int mtu;
         } fd;
     } init;
+    int flags;
 };
 
 /**
@@ -153,6 +197,15 @@ struct BTap_init_data {
  *                  and init_data.init.fd.mtu must be set to the largest IP packet or
  *                  Ethernet frame supported, for a TUN or TAP device, respectively.
  *                  File descriptor initialization is not supported on Windows.
+ *                  init_data.flags is a bitmask of BTAP_FLAG_* values. BTAP_FLAG_MULTI_QUEUE
+ *                  opens the device as one queue of a multi-queue device; it is only
+ *                  supported on Linux with BTAP_INIT_STRING. BTAP_FLAG_VNET_HDR enables
+ *                  TCP segmentation offload between the kernel and this object: TCP
+ *                  super-segments read from the device are split into packets no larger
+ *                  than the MTU, and consecutive TCP segments of a flow passed to
+ *                  {@link BTap_Send} are queued and coalesced into super-segments, which
+ *                  are written from a job. It is only supported on Linux with
+ *                  BTAP_INIT_STRING and BTAP_DEV_TUN.
  * @param handler_error error handler function
  * @param handler_error_user value passed to error handler
  * @return 1 on success, 0 on failure
@@ -177,6 +230,11 @@ int BTap_GetMTU (BTap *o);
 /**
  * Sends a packet to the device.
  * Any errors will be reported via a job.
+ * In VNET_HDR mode, the packet is copied into the send buffer and written
+ * out later, so that TCP segments can be coalesced; if the send buffer is
+ * full and cannot be flushed, the packet is dropped. With the io_uring
+ * backend, the send buffer is written out by the reactor, and it cannot be
+ * flushed while a write is in progress.
  * 
  * @param o the object
  * @param data packet to send
@@ -26,6 +26,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -44,8 +48,10 @@
 #include <misc/balloc.h>
 #include <misc/compare.h>
 #include <misc/print_macros.h>
+#include <misc/hashfun.h>
 #include <structure/LinkedList1.h>
 #include <structure/BAVL.h>
+#include <structure/CHash.h>
 #include <base/BLog.h>
 #include <system/BReactor.h>
 #include <system/BNetwork.h>
@@ -53,7 +59,7 @@
 #include <system/BDatagram.h>
 #include <system/BSignal.h>
 #include <flow/PacketProtoDecoder.h>
-#include <flow/PacketPassFairQueue.h>
+#include <flow/PacketPassDRRQueue.h>
 #include <flow/PacketStreamSender.h>
 #include <flow/PacketProtoFlow.h>
 #include <flow/SinglePacketBuffer.h>
@@ -64,6 +70,11 @@
 #include <resolv.h>
 #endif
 
+#ifdef BADVPN_LINUX
+#include <system/BWorkerProcesses.h>
+#include <sched.h>
+#endif
+
 #include <udpgw/udpgw.h>
 
 #include <generated/blog_channel_udpgw.h>
@@ -79,7 +90,7 @@ struct client {
     BTimer disconnect_timer;
     PacketProtoDecoder recv_decoder;
     PacketPassInterface recv_if;
-    PacketPassFairQueue send_queue;
+    PacketPassDRRQueue send_queue;
     PacketStreamSender send_sender;
     BAVL connections_tree;
     LinkedList1 connections_list;
@@ -100,11 +111,14 @@ struct connection {
     BPending first_job;
     BufferWriter *send_if;
     PacketProtoFlow send_ppflow;
-    PacketPassFairQueueFlow send_qflow;
+    PacketPassDRRQueueFlow send_qflow;
     union {
         struct {
             BDatagram udp_dgram;
             int local_port_index;
+            struct remote *remote;
+            BAVLNode remote_ports_tree_node;
+            LinkedList1Node remote_lru_list_node;
             BufferWriter udp_send_writer;
             PacketBuffer udp_send_buffer;
             SinglePacketBuffer udp_recv_buffer;
@@ -118,6 +132,20 @@ struct connection {
     };
 };
 
+// connections which may not share a local port, i.e. those with the
+// same remote address (or only the same IP with --unique-local-ports)
+struct remote {
+    BAddr key;
+    BAVL ports_tree;
+    LinkedList1 lru_list;
+    struct remote *hash_next;
+};
+
+typedef struct remote *RemotesHash_link;
+
+#include "udpgw_remotes_hash.h"
+#include <structure/CHash_decl.h>
+
 // command-line options
 struct {
     int help;
@@ -132,6 +160,7 @@ struct {
     char *listen_addrs[MAX_LISTEN_ADDRS];
     int num_listen_addrs;
     int udp_mtu;
+    int udp_batch_size;
     int max_clients;
     int max_connections_for_client;
     int client_socket_sndbuf;
@@ -140,6 +169,9 @@ struct {
     int local_udp_ip6_num_ports;
     char *local_udp_ip6_addr;
     int unique_local_ports;
+    int workers;
+    int worker_cpu_affinity;
+    int busy_poll;
 } options;
 
 // MTUs
@@ -150,11 +182,21 @@ int pp_mtu;
 BAddr listen_addrs[MAX_LISTEN_ADDRS];
 int num_listen_addrs;
 
-// local UDP port range, if options.local_udp_num_ports>=0
+// local UDP port range, if local_udp_num_ports>=0
 BAddr local_udp_addr;
+int local_udp_num_ports;
 
-// local UDP/IPv6 port range, if options.local_udp_ip6_num_ports>=0
+// local UDP/IPv6 port range, if local_udp_ip6_num_ports>=0
 BAddr local_udp_ip6_addr;
+int local_udp_ip6_num_ports;
+
+// index of this worker process, 0 in the main process
+int worker_index;
+
+#ifdef BADVPN_LINUX
+// worker processes
+BWorkerProcesses workers;
+#endif
 
 // DNS forwarding
 BAddr dns_addr;
@@ -171,10 +213,19 @@ int num_listeners;
 LinkedList1 clients_list;
 int num_clients;
 
+// remotes of connections bound to local ports
+RemotesHash remotes_hash;
+size_t num_remotes;
+
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
+static void take_worker_ports (BAddr *addr, int *num_ports);
+#ifdef BADVPN_LINUX
+static void set_worker_cpu_affinity (void);
+static void workers_handler (void *unused, int index);
+#endif
 static void signal_handler (void *unused);
 static void listener_handler (BListener *listener);
 static void client_free (struct client *client);
@@ -186,7 +237,12 @@ static void client_decoder_handler_error (struct client *client);
 static void client_recv_if_handler_send (struct client *client, uint8_t *data, int data_len);
 static int get_local_num_ports (int addr_type);
 static BAddr get_local_addr (int addr_type);
-static uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con);
+static BAddr remote_key (BAddr addr);
+static size_t remote_key_hash (BAddr key);
+static struct remote * find_remote (BAddr addr);
+static int connection_add_to_remote (struct connection *con);
+static void connection_remove_from_remote (struct connection *con);
+static struct connection * find_least_used_connection (struct remote *remote);
 static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len);
 static void connection_free (struct connection *con);
 static void connection_logfunc (struct connection *con);
@@ -201,8 +257,12 @@ static void connection_dgram_handler_event (struct connection *con, int event);
 static void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len);
 static struct connection * find_connection (struct client *client, uint16_t conid);
 static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
+static int int_comparator (void *unused, int *v1, int *v2);
 static void maybe_update_dns (void);
 
+#include "udpgw_remotes_hash.h"
+#include <structure/CHash_impl.h>
+
 int main (int argc, char **argv)
 {
     if (argc <= 0) {
@@ -271,6 +331,27 @@ int main (int argc, char **argv)
         goto fail1;
     }
     
+    #ifdef BADVPN_LINUX
+    // fork worker processes; everything from here on is done in each of them
+    if (!BWorkerProcesses_Init(&workers, options.workers)) {
+        BLog(BLOG_ERROR, "BWorkerProcesses_Init failed");
+        goto fail1;
+    }
+    worker_index = BWorkerProcesses_GetIndex(&workers);
+    
+    if (options.worker_cpu_affinity) {
+        set_worker_cpu_affinity();
+    }
+    #endif
+    
+    // give each worker its own part of the local port ranges
+    if (local_udp_num_ports >= 0) {
+        take_worker_ports(&local_udp_addr, &local_udp_num_ports);
+    }
+    if (local_udp_ip6_num_ports >= 0) {
+        take_worker_ports(&local_udp_ip6_addr, &local_udp_ip6_num_ports);
+    }
+    
     // compute MTUs
     udpgw_mtu = udpgw_compute_mtu(options.udp_mtu);
     if (udpgw_mtu < 0 || udpgw_mtu > PACKETPROTO_MAXPAYLOAD) {
@@ -289,25 +370,49 @@ int main (int argc, char **argv)
     // init reactor
     if (!BReactor_Init(&ss)) {
         BLog(BLOG_ERROR, "BReactor_Init failed");
-        goto fail1;
+        goto fail2;
+    }
+    
+    #ifdef BADVPN_BREACTOR_BADVPN
+    // poll for events before sleeping
+    if (options.busy_poll > 0) {
+        BReactor_SetBusyPoll(&ss, options.busy_poll);
     }
+    #endif
     
     // setup signal handler
     if (!BSignal_Init(&ss, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
-        goto fail2;
+        goto fail3;
     }
     
+    #ifdef BADVPN_LINUX
+    // watch for workers exiting
+    if (!BWorkerProcesses_Watch(&workers, &ss, workers_handler, NULL)) {
+        BLog(BLOG_ERROR, "BWorkerProcesses_Watch failed");
+        goto fail4;
+    }
+    #endif
+    
     // initialize listeners
     num_listeners = 0;
     while (num_listeners < num_listen_addrs) {
-        if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
+        // with multiple workers, they all listen on the same addresses
+        struct BLisCon_from from = (options.workers > 1 ? BLisCon_from_addr_reuse_port(listen_addrs[num_listeners]) : BLisCon_from_addr(listen_addrs[num_listeners]));
+        if (!BListener_InitFrom(&listeners[num_listeners], from, &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
             BLog(BLOG_ERROR, "Listener_Init failed");
-            goto fail3;
+            goto fail4;
         }
         num_listeners++;
     }
     
+    // init remotes hash
+    if (!RemotesHash_Init(&remotes_hash, REMOTES_HASH_INITIAL_BUCKETS)) {
+        BLog(BLOG_ERROR, "RemotesHash_Init failed");
+        goto fail4;
+    }
+    num_remotes = 0;
+    
     // init clients list
     LinkedList1_Init(&clients_list);
     num_clients = 0;
@@ -321,17 +426,30 @@ int main (int argc, char **argv)
         struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&clients_list), struct client, clients_list_node);
         client_free(client);
     }
-fail3:
+    
+    // free remotes hash
+    ASSERT(num_remotes == 0)
+    RemotesHash_Free(&remotes_hash);
+fail4:
     // free listeners
     while (num_listeners > 0) {
         num_listeners--;
         BListener_Free(&listeners[num_listeners]);
     }
+    #ifdef BADVPN_LINUX
+    // stop watching workers
+    BWorkerProcesses_Unwatch(&workers);
+    #endif
     // finish signal handling
     BSignal_Finish();
-fail2:
+fail3:
     // free reactor
     BReactor_Free(&ss);
+fail2:
+    #ifdef BADVPN_LINUX
+    // stop workers
+    BWorkerProcesses_Free(&workers);
+    #endif
 fail1:
     // free logger
     BLog(BLOG_NOTICE, "exiting");
@@ -361,12 +479,20 @@ void print_help (const char *name)
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--listen-addr <addr>] ...\n"
         "        [--udp-mtu <bytes>]\n"
+        "        [--udp-batch-size <number>]\n"
         "        [--max-clients <number>]\n"
         "        [--max-connections-for-client <number>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--local-udp-addrs <addr> <num_ports>]\n"
         "        [--local-udp-ip6-addrs <addr> <num_ports>]\n"
         "        [--unique-local-ports]\n"
+        #ifdef BADVPN_LINUX
+        "        [--workers <number>]\n"
+        "        [--worker-cpu-affinity]\n"
+        #endif
+        #ifdef BADVPN_BREACTOR_BADVPN
+        "        [--busy-poll <usecs>]\n"
+        #endif
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -396,12 +522,16 @@ int parse_arguments (int argc, char *argv[])
     }
     options.num_listen_addrs = 0;
     options.udp_mtu = DEFAULT_UDP_MTU;
+    options.udp_batch_size = 0;
     options.max_clients = DEFAULT_MAX_CLIENTS;
     options.max_connections_for_client = DEFAULT_MAX_CONNECTIONS_FOR_CLIENT;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SEND_BUFFER;
     options.local_udp_num_ports = -1;
     options.local_udp_ip6_num_ports = -1;
     options.unique_local_ports = 0;
+    options.workers = 1;
+    options.worker_cpu_affinity = 0;
+    options.busy_poll = 0;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -503,6 +633,17 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--udp-batch-size")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udp_batch_size = atoi(argv[i + 1])) < 0 || options.udp_batch_size > MAX_UDP_BATCH_SIZE) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else if (!strcmp(arg, "--max-clients")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -563,6 +704,35 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--unique-local-ports")) {
             options.unique_local_ports = 1;
         }
+        #ifdef BADVPN_LINUX
+        else if (!strcmp(arg, "--workers")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.workers = atoi(argv[i + 1])) <= 0 || options.workers > UDPGW_MAX_WORKERS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--worker-cpu-affinity")) {
+            options.worker_cpu_affinity = 1;
+        }
+        #endif
+        #ifdef BADVPN_BREACTOR_BADVPN
+        else if (!strcmp(arg, "--busy-poll")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.busy_poll = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -589,7 +759,8 @@ int process_arguments (void)
     }
     
     // resolve local UDP address
-    if (options.local_udp_num_ports >= 0) {
+    local_udp_num_ports = options.local_udp_num_ports;
+    if (local_udp_num_ports >= 0) {
         if (!BAddr_Parse(&local_udp_addr, options.local_udp_addr, NULL, 0)) {
             BLog(BLOG_ERROR, "local udp addr: BAddr_Parse failed");
             return 0;
@@ -601,7 +772,8 @@ int process_arguments (void)
     }
     
     // resolve local UDP/IPv6 address
-    if (options.local_udp_ip6_num_ports >= 0) {
+    local_udp_ip6_num_ports = options.local_udp_ip6_num_ports;
+    if (local_udp_ip6_num_ports >= 0) {
         if (!BAddr_Parse(&local_udp_ip6_addr, options.local_udp_ip6_addr, NULL, 0)) {
             BLog(BLOG_ERROR, "local udp ip6 addr: BAddr_Parse failed");
             return 0;
@@ -612,9 +784,83 @@ int process_arguments (void)
         }
     }
     
+    if (options.workers > 1 && options.local_udp_num_ports >= 0 && options.local_udp_num_ports < options.workers) {
+        BLog(BLOG_ERROR, "local udp addr: need at least one port per worker");
+        return 0;
+    }
+    
+    if (options.workers > 1 && options.local_udp_ip6_num_ports >= 0 && options.local_udp_ip6_num_ports < options.workers) {
+        BLog(BLOG_ERROR, "local udp ip6 addr: need at least one port per worker");
+        return 0;
+    }
+    
     return 1;
 }
 
+void take_worker_ports (BAddr *addr, int *num_ports)
+{
+    ASSERT(*num_ports >= 0)
+    ASSERT(worker_index >= 0)
+    ASSERT(worker_index < options.workers)
+    
+    // split the range into equal parts, the first ones getting the remainder
+    int part = *num_ports / options.workers;
+    int rem = *num_ports % options.workers;
+    int start = worker_index * part + (worker_index < rem ? worker_index : rem);
+    
+    BAddr_SetPort(addr, hton16(ntoh16(BAddr_GetPort(addr)) + (uint16_t)start));
+    *num_ports = part + (worker_index < rem);
+}
+
+#ifdef BADVPN_LINUX
+
+void set_worker_cpu_affinity (void)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        BLog(BLOG_ERROR, "sched_getaffinity failed");
+        return;
+    }
+    
+    int num_cpus = CPU_COUNT(&allowed);
+    if (num_cpus <= 0) {
+        return;
+    }
+    
+    // pick the n-th of the allowed CPUs, going around if there are more workers
+    int n = worker_index % num_cpus;
+    
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (n-- > 0) {
+            continue;
+        }
+        
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            BLog(BLOG_ERROR, "sched_setaffinity failed");
+            return;
+        }
+        
+        BLog(BLOG_INFO, "worker %d bound to CPU %d", worker_index, cpu);
+        return;
+    }
+}
+
+void workers_handler (void *unused, int index)
+{
+    // Its part of the local port ranges is no longer served, so rather than
+    // keep running partially, exit and stop the other workers.
+    BReactor_Quit(&ss, 1);
+}
+
+#endif
+
 void signal_handler (void *unused)
 {
     BLog(BLOG_NOTICE, "termination requested");
@@ -673,8 +919,8 @@ void listener_handler (BListener *listener)
     PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&ss));
     
     // init send queue
-    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0, 1)) {
-        BLog(BLOG_ERROR, "PacketPassFairQueue_Init failed");
+    if (!PacketPassDRRQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0, 1)) {
+        BLog(BLOG_ERROR, "PacketPassDRRQueue_Init failed");
         goto fail3;
     }
     
@@ -716,7 +962,7 @@ fail0:
 void client_free (struct client *client)
 {
     // allow freeing send queue flows
-    PacketPassFairQueue_PrepareFree(&client->send_queue);
+    PacketPassDRRQueue_PrepareFree(&client->send_queue);
     
     // free connections
     while (!LinkedList1_IsEmpty(&client->connections_list)) {
@@ -735,7 +981,7 @@ void client_free (struct client *client)
     num_clients--;
     
     // free send queue
-    PacketPassFairQueue_Free(&client->send_queue);
+    PacketPassDRRQueue_Free(&client->send_queue);
     
     // free send sender
     PacketStreamSender_Free(&client->send_sender);
@@ -906,8 +1152,8 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
 int get_local_num_ports (int addr_type)
 {
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return options.local_udp_num_ports;
-        case BADDR_TYPE_IPV6: return options.local_udp_ip6_num_ports;
+        case BADDR_TYPE_IPV4: return local_udp_num_ports;
+        case BADDR_TYPE_IPV6: return local_udp_ip6_num_ports;
         default: ASSERT(0); return 0;
     }
 }
@@ -923,64 +1169,132 @@ BAddr get_local_addr (int addr_type)
     }
 }
 
-uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con)
+BAddr remote_key (BAddr addr)
 {
-    ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
-    ASSERT(get_local_num_ports(remote_addr.type) >= 0)
+    ASSERT(addr.type == BADDR_TYPE_IPV4 || addr.type == BADDR_TYPE_IPV6)
     
-    int local_num_ports = get_local_num_ports(remote_addr.type);
+    // with unique local ports, connections only conflict by IP address
+    if (options.unique_local_ports) {
+        BAddr_SetPort(&addr, 0);
+    }
     
-    // allocate port usage array
-    uint8_t *port_usage = (uint8_t *)BAllocSize(bsize_fromint(local_num_ports));
-    if (!port_usage) {
-        return NULL;
+    return addr;
+}
+
+size_t remote_key_hash (BAddr key)
+{
+    uint8_t buf[18];
+    size_t len;
+    
+    switch (key.type) {
+        case BADDR_TYPE_IPV4:
+            memcpy(buf, &key.ipv4.ip, 4);
+            memcpy(buf + 4, &key.ipv4.port, 2);
+            len = 6;
+            break;
+        case BADDR_TYPE_IPV6:
+            memcpy(buf, key.ipv6.ip, 16);
+            memcpy(buf + 16, &key.ipv6.port, 2);
+            len = 18;
+            break;
+        default:
+            ASSERT(0);
+            return 0;
     }
     
-    // zero array
-    memset(port_usage, 0, local_num_ports);
+    return badvpn_djb2_hash_bin(buf, len);
+}
+
+struct remote * find_remote (BAddr addr)
+{
+    RemotesHashRef ref = RemotesHash_Lookup(&remotes_hash, 0, remote_key(addr));
     
-    struct connection *least_con = NULL;
+    return ref.ptr;
+}
+
+int connection_add_to_remote (struct connection *con)
+{
+    ASSERT(!con->closing)
+    ASSERT(con->local_port_index >= 0)
+    ASSERT(con->local_port_index < get_local_num_ports(con->addr.type))
     
-    // flag inappropriate ports (those with the same remote address)
-    for (LinkedList1Node *ln = LinkedList1_GetFirst(&clients_list); ln; ln = LinkedList1Node_Next(ln)) {
-        struct client *client = UPPER_OBJECT(ln, struct client, clients_list_node);
+    struct remote *remote = find_remote(con->addr);
+    
+    if (!remote) {
+        // grow hash table to keep chains short
+        if (num_remotes == remotes_hash.num_buckets && !RemotesHash_MultiplyBuckets(&remotes_hash, 0, 1)) {
+            BLog(BLOG_ERROR, "RemotesHash_MultiplyBuckets failed");
+            return 0;
+        }
         
-        for (LinkedList1Node *ln2 = LinkedList1_GetFirst(&client->connections_list); ln2; ln2 = LinkedList1Node_Next(ln2)) {
-            struct connection *con = UPPER_OBJECT(ln2, struct connection, connections_list_node);
-            ASSERT(con->client == client)
-            ASSERT(!con->closing)
-            
-            if (con->addr.type != remote_addr.type || con->local_port_index < 0) {
-                continue;
-            }
-            ASSERT(con->local_port_index < local_num_ports)
-            
-            if (options.unique_local_ports) {
-                BIPAddr ip1;
-                BIPAddr ip2;
-                BAddr_GetIPAddr(&con->addr, &ip1);
-                BAddr_GetIPAddr(&remote_addr, &ip2);
-                if (!BIPAddr_Compare(&ip1, &ip2)) {
-                    continue;
-                }
-            } else {
-                if (!BAddr_Compare(&con->addr, &remote_addr)) {
-                    continue;
-                }
-            }
-            
-            port_usage[con->local_port_index] = 1;
-            
-            if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
-                if (!least_con || con->last_use_time < least_con->last_use_time) {
-                    least_con = con;
-                }
-            }
+        // allocate structure
+        if (!(remote = (struct remote *)malloc(sizeof(*remote)))) {
+            BLog(BLOG_ERROR, "malloc failed");
+            return 0;
+        }
+        
+        // init structure
+        remote->key = remote_key(con->addr);
+        BAVL_Init(&remote->ports_tree, OFFSET_DIFF(struct connection, local_port_index, remote_ports_tree_node), (BAVL_comparator)int_comparator, NULL);
+        LinkedList1_Init(&remote->lru_list);
+        
+        // insert to remotes hash
+        RemotesHashRef ref = {remote, remote};
+        ASSERT_EXECUTE(RemotesHash_Insert(&remotes_hash, 0, ref, NULL))
+        num_remotes++;
+    }
+    
+    // insert to remote's ports tree
+    ASSERT_EXECUTE(BAVL_Insert(&remote->ports_tree, &con->remote_ports_tree_node, NULL))
+    
+    // insert to remote's LRU list
+    LinkedList1_Append(&remote->lru_list, &con->remote_lru_list_node);
+    
+    con->remote = remote;
+    
+    return 1;
+}
+
+void connection_remove_from_remote (struct connection *con)
+{
+    ASSERT(con->local_port_index >= 0)
+    
+    struct remote *remote = con->remote;
+    
+    // remove from remote's LRU list
+    LinkedList1_Remove(&remote->lru_list, &con->remote_lru_list_node);
+    
+    // remove from remote's ports tree
+    BAVL_Remove(&remote->ports_tree, &con->remote_ports_tree_node);
+    
+    if (BAVL_IsEmpty(&remote->ports_tree)) {
+        ASSERT(LinkedList1_IsEmpty(&remote->lru_list))
+        
+        // remove from remotes hash
+        RemotesHashRef ref = {remote, remote};
+        RemotesHash_Remove(&remotes_hash, 0, ref);
+        num_remotes--;
+        
+        // free structure
+        free(remote);
+    }
+}
+
+struct connection * find_least_used_connection (struct remote *remote)
+{
+    // connections in the LRU list are ordered by last use time; the first
+    // one which isn't busy sending to the client is the least used
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&remote->lru_list); ln; ln = LinkedList1Node_Next(ln)) {
+        struct connection *con = UPPER_OBJECT(ln, struct connection, remote_lru_list_node);
+        ASSERT(!con->closing)
+        ASSERT(con->remote == remote)
+        
+        if (!PacketPassDRRQueueFlow_IsBusy(&con->send_qflow)) {
+            return con;
         }
     }
     
-    *out_con = least_con;
-    return port_usage;
+    return NULL;
 }
 
 void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len)
@@ -1019,10 +1333,10 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     BPending_Set(&con->first_job);
     
     // init send queue flow
-    PacketPassFairQueueFlow_Init(&con->send_qflow, &client->send_queue);
+    PacketPassDRRQueueFlow_Init(&con->send_qflow, &client->send_queue);
     
     // init send PacketProtoFlow
-    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&ss))) {
+    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassDRRQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&ss))) {
         client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
     }
@@ -1039,13 +1353,8 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     int local_num_ports = get_local_num_ports(addr.type);
     
     if (local_num_ports >= 0) {
-        // build port usage array, find least used connection
-        struct connection *least_con;
-        uint8_t *port_usage = build_port_usage_array_and_find_least_used_connection(addr, &least_con);
-        if (!port_usage) {
-            client_log(client, BLOG_ERROR, "build_port_usage_array failed");
-            goto failed;
-        }
+        // find connections which we can't share a port with
+        struct remote *remote = find_remote(addr);
         
         // set SO_REUSEADDR
         if (!BDatagram_SetReuseAddr(&con->udp_dgram, 1)) {
@@ -1056,10 +1365,14 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         // get starting local address
         BAddr local_addr = get_local_addr(addr.type);
         
+        // first port used by a connection with the same remote address
+        BAVLNode *used_node = (remote ? BAVL_GetFirst(&remote->ports_tree) : NULL);
+        
         // try different ports
         for (int i = 0; i < local_num_ports; i++) {
             // skip inappropriate ports
-            if (port_usage[i]) {
+            if (used_node && UPPER_OBJECT(used_node, struct connection, remote_ports_tree_node)->local_port_index == i) {
+                used_node = BAVL_GetNext(&remote->ports_tree, used_node);
                 continue;
             }
             
@@ -1073,6 +1386,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         }
         
         // try closing an unused connection with the same remote addr
+        struct connection *least_con = (remote ? find_least_used_connection(remote) : NULL);
         if (!least_con) {
             goto failed;
         }
@@ -1080,7 +1394,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         ASSERT(least_con->addr.type == addr.type)
         ASSERT(least_con->local_port_index >= 0)
         ASSERT(least_con->local_port_index < local_num_ports)
-        ASSERT(!PacketPassFairQueueFlow_IsBusy(&least_con->send_qflow))
+        ASSERT(!PacketPassDRRQueueFlow_IsBusy(&least_con->send_qflow))
         
         int i = least_con->local_port_index;
         
@@ -1101,7 +1415,6 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     failed:
         client_log(client, BLOG_WARNING, "failed to bind to any local address; proceeding regardless");
     cont:;
-        BFree(port_usage);
     }
     
     // set UDP dgram send address
@@ -1109,9 +1422,14 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     BIPAddr_InitInvalid(&ipaddr);
     BDatagram_SetSendAddrs(&con->udp_dgram, addr, ipaddr);
     
-    // init UDP dgram interfaces
-    BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
-    BDatagram_RecvAsync_Init(&con->udp_dgram, options.udp_mtu);
+    // init UDP dgram interfaces, batched if requested
+    if (options.udp_batch_size > 0) {
+        BDatagram_SendAsync_InitBatch(&con->udp_dgram, options.udp_mtu, options.udp_batch_size);
+        BDatagram_RecvAsync_InitBatch(&con->udp_dgram, options.udp_mtu, options.udp_batch_size);
+    } else {
+        BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
+        BDatagram_RecvAsync_Init(&con->udp_dgram, options.udp_mtu);
+    }
     
     // init UDP writer
     BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&ss));
@@ -1131,6 +1449,12 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         goto fail5;
     }
     
+    // insert to remote, so other connections won't use our port
+    if (con->local_port_index >= 0 && !connection_add_to_remote(con)) {
+        client_log(client, BLOG_ERROR, "connection_add_to_remote failed");
+        goto fail6;
+    }
+    
     // insert to client's connections tree
     ASSERT_EXECUTE(BAVL_Insert(&client->connections_tree, &con->connections_tree_node, NULL))
     
@@ -1144,6 +1468,8 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     
     return;
     
+fail6:
+    SinglePacketBuffer_Free(&con->udp_recv_buffer);
 fail5:
     PacketPassInterface_Free(&con->udp_recv_if);
     PacketBuffer_Free(&con->udp_send_buffer);
@@ -1155,7 +1481,7 @@ fail4:
 fail2:
     PacketProtoFlow_Free(&con->send_ppflow);
 fail1:
-    PacketPassFairQueueFlow_Free(&con->send_qflow);
+    PacketPassDRRQueueFlow_Free(&con->send_qflow);
     BPending_Free(&con->first_job);
     free(con);
 fail0:
@@ -1165,7 +1491,7 @@ fail0:
 void connection_free (struct connection *con)
 {
     struct client *client = con->client;
-    PacketPassFairQueueFlow_AssertFree(&con->send_qflow);
+    PacketPassDRRQueueFlow_AssertFree(&con->send_qflow);
     
     if (con->closing) {
         // remove from client's closing connections list
@@ -1180,6 +1506,11 @@ void connection_free (struct connection *con)
         // remove from client's connections tree
         BAVL_Remove(&client->connections_tree, &con->connections_tree_node);
         
+        // remove from remote
+        if (con->local_port_index >= 0) {
+            connection_remove_from_remote(con);
+        }
+        
         // free UDP
         connection_free_udp(con);
     }
@@ -1188,7 +1519,7 @@ void connection_free (struct connection *con)
     PacketProtoFlow_Free(&con->send_ppflow);
     
     // free send queue flow
-    PacketPassFairQueueFlow_Free(&con->send_qflow);
+    PacketPassDRRQueueFlow_Free(&con->send_qflow);
     
     // free first job
     BPending_Free(&con->first_job);
@@ -1318,6 +1649,10 @@ int connection_send_to_udp (struct connection *con, const uint8_t *data, int dat
     // move connection to front
     LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
     LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    if (con->local_port_index >= 0) {
+        LinkedList1_Remove(&con->remote->lru_list, &con->remote_lru_list_node);
+        LinkedList1_Append(&con->remote->lru_list, &con->remote_lru_list_node);
+    }
     
     // get buffer location
     uint8_t *out;
@@ -1341,7 +1676,7 @@ void connection_close (struct connection *con)
     ASSERT(!con->closing)
     
     // if possible, free connection immediately
-    if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
+    if (!PacketPassDRRQueueFlow_IsBusy(&con->send_qflow)) {
         connection_free(con);
         return;
     }
@@ -1357,6 +1692,11 @@ void connection_close (struct connection *con)
     // remove from client's connections tree
     BAVL_Remove(&client->connections_tree, &con->connections_tree_node);
     
+    // remove from remote
+    if (con->local_port_index >= 0) {
+        connection_remove_from_remote(con);
+    }
+    
     // free UDP
     connection_free_udp(con);
     
@@ -1364,7 +1704,7 @@ void connection_close (struct connection *con)
     LinkedList1_Append(&client->closing_connections_list, &con->closing_connections_list_node);
     
     // set busy handler
-    PacketPassFairQueueFlow_SetBusyHandler(&con->send_qflow, (PacketPassFairQueue_handler_busy)connection_send_qflow_busy_handler, con);
+    PacketPassDRRQueueFlow_SetBusyHandler(&con->send_qflow, (PacketPassDRRQueue_handler_busy)connection_send_qflow_busy_handler, con);
     
     // unset first job
     BPending_Unset(&con->first_job);
@@ -1376,7 +1716,7 @@ void connection_close (struct connection *con)
 void connection_send_qflow_busy_handler (struct connection *con)
 {
     ASSERT(con->closing)
-    PacketPassFairQueueFlow_AssertFree(&con->send_qflow);
+    PacketPassDRRQueueFlow_AssertFree(&con->send_qflow);
     
     connection_log(con, BLOG_DEBUG, "closing finally");
     
@@ -1409,6 +1749,10 @@ void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data,
     // move connection to front
     LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
     LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    if (con->local_port_index >= 0) {
+        LinkedList1_Remove(&con->remote->lru_list, &con->remote_lru_list_node);
+        LinkedList1_Append(&con->remote->lru_list, &con->remote_lru_list_node);
+    }
     
     // accept packet
     PacketPassInterface_Done(&con->udp_recv_if);
@@ -1435,6 +1779,11 @@ int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
     return B_COMPARE(*v1, *v2);
 }
 
+int int_comparator (void *unused, int *v1, int *v2)
+{
+    return B_COMPARE(*v1, *v2);
+}
+
 void maybe_update_dns (void)
 {
 #ifndef BADVPN_USE_WINAPI
@@ -39,9 +39,19 @@
 // connection buffer size for sending to UDP, in packets
 #define CONNECTION_UDP_BUFFER_SIZE 1
 
+// maximum datagrams sent or received with one system call on a connection's
+// UDP socket (--udp-batch-size); each takes a buffer of the UDP MTU
+#define MAX_UDP_BATCH_SIZE 64
+
 // maximum number of clients
 #define DEFAULT_MAX_CLIENTS 3
 
+// maximum number of worker processes (--workers)
+#define UDPGW_MAX_WORKERS 64
+
+// initial number of buckets in the hash table of remote addresses
+#define REMOTES_HASH_INITIAL_BUCKETS 256
+
 // maximum connections for client
 #define DEFAULT_MAX_CONNECTIONS_FOR_CLIENT 256
 
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME RemotesHash
+#define CHASH_PARAM_ENTRY struct remote
+#define CHASH_PARAM_LINK struct remote *
+#define CHASH_PARAM_KEY BAddr
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct remote *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) remote_key_hash((entry).ptr->key)
+#define CHASH_PARAM_KEYHASH(arg, key) remote_key_hash((key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 0
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) BAddr_Compare(&(entry1).ptr->key, &(entry2).ptr->key)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) BAddr_Compare(&(key1), &(entry2).ptr->key)
+#define CHASH_PARAM_ENTRY_NEXT hash_next